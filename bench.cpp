@@ -0,0 +1,232 @@
+/**
+ * @brief encoder benchmark for qualifying recording settings without a camera
+ *
+ * Runs a recording session through a SyntheticCameraController, so frames
+ * are generated (or replayed from a file) and encoded with the same
+ * VideoWriter the client uses, then reports sustained frame rate, CPU time
+ * per frame, allocations and bytes written.
+ *
+ * usage: mba-bench [options]
+ *   --width N            frame width (default 800)
+ *   --height N           frame height (default 800)
+ *   --fps N              target fps (default 60)
+ *   --frames N           frames to encode (default 600)
+ *   --codec NAME         encoder, see codecs::codec_names (default libx264)
+ *   --pixel-format NAME  pixel format, see pixel_types::type_names (default YUV420P)
+ *   --container NAME     video file container, see containers::container_names (default avi)
+ *   --filter             apply the denoise filter
+ *   --filter-thread      run the denoise filter on its own thread
+ *   --replay FILE        replay frames from a .raw dump or a video file
+ *   --realtime           deliver frames at the target fps instead of as fast as possible
+ *   --output DIR         output directory (default /tmp/mba-bench)
+ */
+
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <ftw.h>
+#include <getopt.h>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <thread>
+
+#include "synthetic_camera.h"
+
+// count heap allocations made through operator new. ffmpeg allocates with
+// av_malloc, which isn't counted here; its frame buffers show up as frame
+// pool misses instead
+static std::atomic<uint64_t> g_allocations {0};
+static std::atomic<uint64_t> g_allocated_bytes {0};
+
+void* operator new(size_t size)
+{
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    g_allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    void *p = std::malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    std::free(p);
+}
+
+// total size of the files written under a directory
+static uint64_t g_bytes_written = 0;
+
+static int AddFileSize(const char *, const struct stat *sb, int type, struct FTW *)
+{
+    if (type == FTW_F) {
+        g_bytes_written += sb->st_size;
+    }
+    return 0;
+}
+
+static double CpuSeconds()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static void Usage(const char *program)
+{
+    std::cerr << "usage: " << program << " [--width N] [--height N] [--fps N] [--frames N]\n"
+              << "    [--codec NAME] [--pixel-format NAME] [--container NAME] [--filter] [--filter-thread]\n"
+              << "    [--replay FILE] [--realtime] [--output DIR]\n";
+}
+
+int main(int argc, char **argv)
+{
+    int width = 800;
+    int height = 800;
+    int fps = 60;
+    uint64_t frames = 600;
+    std::string codec = codecs::LIBX264;
+    std::string pixel_format = pixel_types::YUV420P;
+    std::string container = containers::AVI;
+    bool filter = false;
+    bool filter_thread = false;
+    std::string replay_file;
+    bool realtime = false;
+    std::string output_dir = "/tmp/mba-bench";
+
+    static struct option long_options[] = {
+            {"width",        required_argument, 0, 'w'},
+            {"height",       required_argument, 0, 'h'},
+            {"fps",          required_argument, 0, 'f'},
+            {"frames",       required_argument, 0, 'n'},
+            {"codec",        required_argument, 0, 'c'},
+            {"pixel-format", required_argument, 0, 'p'},
+            {"container",    required_argument, 0, 'C'},
+            {"filter",       no_argument,       0, 'F'},
+            {"filter-thread", no_argument,      0, 'T'},
+            {"replay",       required_argument, 0, 'r'},
+            {"realtime",     no_argument,       0, 'R'},
+            {"output",       required_argument, 0, 'o'},
+            {0, 0, 0, 0}
+    };
+    int option_index = 0;
+    int c;
+
+    try {
+        while ((c = getopt_long(argc, argv, "w:h:f:n:c:p:C:FTr:Ro:", long_options, &option_index)) != -1) {
+            switch (c) {
+                case 'w': width = std::stoi(optarg); break;
+                case 'h': height = std::stoi(optarg); break;
+                case 'f': fps = std::stoi(optarg); break;
+                case 'n': frames = std::stoull(optarg); break;
+                case 'c': codec = optarg; break;
+                case 'p': pixel_format = optarg; break;
+                case 'C': container = optarg; break;
+                case 'F': filter = true; break;
+                case 'T': filter_thread = true; break;
+                case 'r': replay_file = optarg; break;
+                case 'R': realtime = true; break;
+                case 'o': output_dir = optarg; break;
+                default:
+                    Usage(argv[0]);
+                    return 1;
+            }
+        }
+    } catch (const std::logic_error &e) {
+        Usage(argv[0]);
+        return 1;
+    }
+
+    if (mkdir(output_dir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) != 0 && errno != EEXIST) {
+        std::cerr << "unable to create " << output_dir << std::endl;
+        return 1;
+    }
+
+    CameraController::RecordingSessionConfig config;
+    try {
+        config.set_file_prefix("bench_");
+        config.set_target_fps(fps);
+        config.set_codec(codec);
+        config.set_pixel_format(pixel_format);
+        config.set_container(container);
+        config.set_apply_filter(filter);
+        config.set_filter_thread(filter_thread);
+        config.set_fragment_by_hour(false);
+        // long enough that the frame limit ends the session
+        config.set_duration(std::chrono::hours(24));
+    } catch (const std::invalid_argument &e) {
+        std::cerr << "invalid setting: " << e.what() << std::endl;
+        return 1;
+    }
+
+    // write each run to its own subdirectory so bytes written only counts this run
+    const std::string run_name = "run-" + std::to_string(
+        std::chrono::system_clock::to_time_t(std::chrono::system_clock::now()));
+    SyntheticCameraController controller(output_dir, width, height, run_name, replay_file, realtime);
+    controller.set_frame_limit(frames);
+
+    const uint64_t allocations_before = g_allocations;
+    const uint64_t allocated_bytes_before = g_allocated_bytes;
+    const double cpu_before = CpuSeconds();
+
+    controller.StartRecording(config);
+    while (controller.recording()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    controller.StopRecording();
+
+    const double cpu_seconds = CpuSeconds() - cpu_before;
+    nftw((output_dir + "/" + run_name).c_str(), AddFileSize, 16, FTW_PHYS);
+
+    if (controller.recording_error()) {
+        std::cerr << controller.error_string() << std::endl;
+        return 1;
+    }
+
+    const uint64_t encoded = controller.frames_encoded();
+    const double seconds = controller.encode_seconds();
+
+    std::cout << std::fixed << std::setprecision(3)
+              << "encoder:            " << controller.encoder_name() << "\n"
+              << "frame size:         " << width << "x" << height << " " << pixel_format << "\n"
+              << "container:          " << container << "\n"
+              << "filter:             " << (filter ? (filter_thread ? "threaded" : "inline") : "off") << "\n"
+              << "frames encoded:     " << encoded << "\n"
+              << "encode time:        " << seconds << " s\n"
+              << "sustained fps:      " << (seconds > 0 ? encoded / seconds : 0.0) << "\n"
+              << "cpu per frame:      " << (encoded ? cpu_seconds * 1000.0 / encoded : 0.0) << " ms\n"
+              << "allocations:        " << g_allocations - allocations_before
+              << " (" << g_allocated_bytes - allocated_bytes_before << " bytes)\n"
+              << "frame pool misses:  " << controller.frame_pool_misses() << "\n"
+              << "frame pool hits:    " << controller.frame_pool_hits() << "\n"
+              << "bytes written:      " << g_bytes_written << "\n"
+              << "latency (us)        p50        p99        max\n";
+
+    const PipelineStats &stats = controller.pipeline_stats();
+    for (int i = 0; i < PipelineStats::NUM_STAGES; i++) {
+        auto stage = static_cast<PipelineStats::Stage>(i);
+        const LatencyHistogram &histogram = stats.histogram(stage);
+        if (histogram.count() == 0) {
+            continue;
+        }
+        std::cout << "  " << std::left << std::setw(18) << PipelineStats::StageName(stage) << std::right
+                  << std::setw(10) << histogram.Percentile(0.50) / 1000.0
+                  << std::setw(11) << histogram.Percentile(0.99) / 1000.0
+                  << std::setw(11) << histogram.max() / 1000.0 << "\n";
+    }
+    return 0;
+}
@@ -4,9 +4,9 @@
 #include <cerrno>
 #include <chrono>
 #include <cstring>
+#include <ctime>
 #include <iomanip>
 #include <iostream>
-#include <numeric>
 #include <sstream>
 #include <stdexcept>
 #include <string>
@@ -14,12 +14,49 @@
 #include <sys/stat.h>
 
 #include "camera_controller.h"
+#include "system_info.h"
+
+// largest region of interest accepted, in sensor pixels along either side
+static const unsigned int kMaxRoiSize = 16384;
+
+// largest binning or decimation factor, Basler sensors support up to 4
+static const unsigned int kMaxSubsampling = 4;
+
+// largest proxy downscale factor
+static const unsigned int kMaxProxyScale = 8;
 
 namespace codecs {
 bool Validate(std::string name)
 {
     return std::find(codec_names.begin(), codec_names.end(), name) != codec_names.end();
 }
+
+bool IsHardware(const std::string &name)
+{
+    return name == H264_NVMPI || name == H264_V4L2M2M || name == H264_NVENC || name == HARDWARE;
+}
+
+std::vector<std::string> EncoderCandidates(const std::string &name)
+{
+    std::vector<std::string> candidates;
+
+    if (name == HARDWARE) {
+        if (SysInfo::IsTegra()) {
+            candidates.push_back(H264_NVMPI);
+            candidates.push_back(H264_V4L2M2M);
+        } else {
+            candidates.push_back(H264_NVENC);
+            candidates.push_back(H264_V4L2M2M);
+        }
+    } else {
+        candidates.push_back(name);
+    }
+
+    if (IsHardware(name)) {
+        candidates.push_back(LIBX264);
+    }
+    return candidates;
+}
 } //namespace codecs
 
 CameraController::CameraController(const std::string &directory,
@@ -82,21 +119,83 @@ int CameraController::GetCurrentHour(){
     return GetCurrentHour(std::chrono::system_clock::now());
 }
 
+std::chrono::time_point<std::chrono::system_clock> CameraController::NextHour(
+    std::chrono::time_point<std::chrono::system_clock> time)
+{
+    std::time_t t = std::chrono::system_clock::to_time_t(time);
+    std::tm tm = *std::localtime(&t);
+    tm.tm_hour += 1;
+    tm.tm_min = 0;
+    tm.tm_sec = 0;
+    // let mktime normalize the fields and work out daylight saving time
+    tm.tm_isdst = -1;
+    return std::chrono::system_clock::from_time_t(std::mktime(&tm));
+}
+
 bool CameraController::StartRecording(const RecordingSessionConfig& config)
 {
+    // an armed session keeps running, the recording thread picks up the
+    // trigger and opens the file
+    if (armed()) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            trigger_config_ = armed_config_;
+            trigger_config_.MergeSession(config);
+        }
+        session_id_ = config.session_id();
+        triggered_ = true;
+        return true;
+    }
+
     // don't do anything if there is already an active recording thread
     if (recording_) {
         std::cerr << "Recording thread already running " << std::endl;
         return false;
     }
 
+    armed_ = false;
     session_id_ = config.session_id();
+    StartThread(config);
+    return true;
+}
+
+bool CameraController::Arm(const RecordingSessionConfig& config)
+{
+    if (recording_) {
+        std::cerr << "Recording thread already running " << std::endl;
+        return false;
+    }
+    if (!can_arm() || config.pre_trigger() == 0) {
+        std::cerr << "Unable to arm: no pre-trigger support" << std::endl;
+        return false;
+    }
+
+    armed_config_ = config;
+    triggered_ = false;
+    armed_ = true;
+    // no session until the trigger
+    session_id_ = -1;
+    StartThread(config);
+    return true;
+}
+
+void CameraController::StartThread(const RecordingSessionConfig& config)
+{
     elapsed_time_ = std::chrono::seconds::zero();
 
-    // avoid resizing moving_avg_ during acquisition loop since we already
-    // know the size
-    auto window_size = config.target_fps();
-    moving_avg_.reserve(window_size);
+    // reset frame queue statistics
+    frame_queue_depth_ = 0;
+    frame_queue_high_water_ = 0;
+    frames_overflowed_ = 0;
+    frame_pool_hits_ = 0;
+    frame_pool_misses_ = 0;
+    bytes_written_ = 0;
+    disk_throttle_level_ = 0;
+    frames_throttled_ = 0;
+    pacing_level_ = 0;
+    image_width_ = 0;
+    image_height_ = 0;
+    pipeline_stats_.Reset();
 
     // if a previous recording thread terminated on its own make sure to call
     // join() so the thread is cleaned up
@@ -109,9 +208,31 @@ bool CameraController::StartRecording(const RecordingSessionConfig& config)
 
     // start recording thread
     recording_ = true;
-    recording_thread_ = std::thread(&CameraController::RecordVideo, this, config);
+    // the recording thread starts with the encode policy so the threads it
+    // creates inherit it, a grab thread switches to the grab policy itself.
+    // The name is inherited the same way, for per thread cpu in the heartbeat
+    thread_tuning::ThreadPolicy policy = encode_policy_;
+    recording_thread_ = std::thread([this, policy, config]() {
+        std::string error;
+        thread_tuning::SetName("mba-encode");
+        if (!thread_tuning::Apply(policy, error)) {
+            std::cerr << "recording thread: " << error << std::endl;
+        }
+        RecordVideo(config);
+    });
+}
 
-    return true;
+void CameraController::SetCpuAffinity(const std::vector<int> &cpus)
+{
+    grab_policy_.cpus = cpus;
+    encode_policy_.cpus = cpus;
+}
+
+void CameraController::SetThreadPolicies(const thread_tuning::ThreadPolicy &grab,
+                                         const thread_tuning::ThreadPolicy &encode)
+{
+    grab_policy_ = grab;
+    encode_policy_ = encode;
 }
 
 void CameraController::StopRecording() {
@@ -144,14 +265,10 @@ std::chrono::seconds CameraController::elapsed_time() const
     return elapsed_time_;
 }
 
-double CameraController::avg_fps()
+std::string CameraController::encoder_name()
 {
-    double avg = 0.0;
-    if (moving_avg_.size()) {
-        std::lock_guard<std::mutex> lock(mutex_);
-        avg = std::accumulate(moving_avg_.begin(), moving_avg_.end(), 0.0)/moving_avg_.size();
-    }
-    return avg;
+    std::lock_guard<std::mutex> lock(mutex_);
+    return encoder_name_;
 }
 
 const std::string CameraController::error_string() const
@@ -226,6 +343,12 @@ void CameraController::SetStreaming(bool stream)
     }
 }
 
+void CameraController::SetPreview(const std::string &name, double fps)
+{
+    preview_name_ = name;
+    preview_fps_ = fps;
+}
+
 // setters for the RecordingSessionConfig class
 // -- we should add as many validation checks as we can.
 
@@ -267,6 +390,14 @@ void CameraController::RecordingSessionConfig::set_codec(std::string codec)
     codec_ = codec;
 }
 
+void CameraController::RecordingSessionConfig::set_pixel_format(const std::string &pixel_format)
+{
+    if (!pixel_types::Validate(pixel_format)) {
+        throw std::invalid_argument("invalid pixel format");
+    }
+    pixel_format_ = pixel_format;
+}
+
 void CameraController::RecordingSessionConfig::set_compression_target(const std::string &target)
 {
     compression_target_ = target;
@@ -280,3 +411,132 @@ void CameraController::RecordingSessionConfig::set_crf(unsigned int crf)
     }
     crf_ = crf;
 }
+
+
+void CameraController::RecordingSessionConfig::set_gop_size(unsigned int gop_size)
+{
+    if (gop_size < 1) {
+        throw std::invalid_argument("gop size must be at least 1");
+    }
+    gop_size_ = gop_size;
+}
+
+void CameraController::RecordingSessionConfig::set_max_b_frames(unsigned int max_b_frames)
+{
+    // x264 supports at most 16 consecutive B-frames
+    if (max_b_frames > 16) {
+        throw std::invalid_argument("max B-frames must be in the range [0, 16]");
+    }
+    max_b_frames_ = max_b_frames;
+}
+
+void CameraController::RecordingSessionConfig::set_encoder_threads(unsigned int threads)
+{
+    if (threads > 64) {
+        throw std::invalid_argument("encoder threads must be in the range [0, 64]");
+    }
+    encoder_threads_ = threads;
+}
+
+void CameraController::RecordingSessionConfig::set_tune(const std::string &tune)
+{
+    if (!tune.empty() &&
+        std::find(codecs::x264_tunes.begin(), codecs::x264_tunes.end(), tune) == codecs::x264_tunes.end()) {
+        throw std::invalid_argument("invalid tune");
+    }
+    tune_ = tune;
+}
+
+void CameraController::RecordingSessionConfig::set_rc_lookahead(int frames)
+{
+    // x264's maximum lookahead is 250 frames
+    if (frames > 250) {
+        throw std::invalid_argument("rc lookahead must be at most 250 frames");
+    }
+    rc_lookahead_ = frames;
+}
+
+void CameraController::RecordingSessionConfig::set_timestamp_format(const std::string &format)
+{
+    if (std::find(timestamp_formats::format_names.begin(), timestamp_formats::format_names.end(), format)
+        == timestamp_formats::format_names.end()) {
+        throw std::invalid_argument("invalid timestamp format");
+    }
+    timestamp_format_ = format;
+}
+
+void CameraController::RecordingSessionConfig::set_pre_trigger_mb(unsigned int mb)
+{
+    if (mb == 0) {
+        throw std::invalid_argument("pre-trigger memory limit must be positive");
+    }
+    pre_trigger_mb_ = mb;
+}
+
+void CameraController::RecordingSessionConfig::set_roi(unsigned int width, unsigned int height,
+                                                      int offset_x, int offset_y)
+{
+    if (width > kMaxRoiSize || height > kMaxRoiSize) {
+        throw std::invalid_argument("region of interest is larger than any supported sensor");
+    }
+    roi_width_ = width;
+    roi_height_ = height;
+    roi_offset_x_ = offset_x;
+    roi_offset_y_ = offset_y;
+}
+
+void CameraController::RecordingSessionConfig::set_binning(unsigned int binning)
+{
+    if (binning < 1 || binning > kMaxSubsampling) {
+        throw std::invalid_argument("binning must be between 1 and " + std::to_string(kMaxSubsampling));
+    }
+    binning_ = binning;
+}
+
+void CameraController::RecordingSessionConfig::set_decimation(unsigned int decimation)
+{
+    if (decimation < 1 || decimation > kMaxSubsampling) {
+        throw std::invalid_argument("decimation must be between 1 and " + std::to_string(kMaxSubsampling));
+    }
+    decimation_ = decimation;
+}
+
+void CameraController::RecordingSessionConfig::set_proxy_scale(unsigned int scale)
+{
+    if (scale == 1 || scale > kMaxProxyScale) {
+        throw std::invalid_argument("proxy scale must be 0 or between 2 and " + std::to_string(kMaxProxyScale));
+    }
+    proxy_scale_ = scale;
+}
+
+void CameraController::RecordingSessionConfig::set_proxy_crf(unsigned int crf)
+{
+    if (crf > 51) {
+        throw std::invalid_argument("proxy crf must be in the range [0, 51]");
+    }
+    proxy_crf_ = crf;
+}
+
+void CameraController::RecordingSessionConfig::MergeSession(const RecordingSessionConfig &session)
+{
+    fragment_by_hour_ = session.fragment_by_hour_;
+    file_prefix_ = session.file_prefix_;
+    duration_ = session.duration_;
+    session_id_ = session.session_id_;
+    timestamp_format_ = session.timestamp_format_;
+    direct_io_ = session.direct_io_;
+    preallocate_ = session.preallocate_;
+    container_ = session.container_;
+    min_free_mb_ = session.min_free_mb_;
+    disk_throttle_ = session.disk_throttle_;
+    pre_trigger_ = 0;
+}
+
+void CameraController::RecordingSessionConfig::set_container(const std::string &container)
+{
+    if (std::find(containers::container_names.begin(), containers::container_names.end(), container)
+        == containers::container_names.end()) {
+        throw std::invalid_argument("invalid container");
+    }
+    container_ = container;
+}
\ No newline at end of file
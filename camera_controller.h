@@ -5,18 +5,34 @@
 
 #include <atomic>
 #include <chrono>
+#include <cstdint>
 #include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
 #include <vector>
 
+#include "frame_drop_stats.h"
+#include "frame_rate_stats.h"
+#include "pipeline_stats.h"
 #include "pixel_types.h"
+#include "thread_tuning.h"
+#include "timestamp_log.h"
 
 namespace codecs {
-static const std::vector<std::string> codec_names({"mpeg4", "libx264"});
+static const std::vector<std::string> codec_names({"mpeg4", "libx264", "ffv1", "h264_nvmpi",
+                                                   "h264_v4l2m2m", "h264_nvenc", "hardware"});
 static const std::string MPEG4 = "mpeg4";
 static const std::string LIBX264 = "libx264";
+static const std::string FFV1 = "ffv1";
+static const std::string H264_NVMPI = "h264_nvmpi";     ///< Jetson hardware encoder (jetson-ffmpeg)
+static const std::string H264_V4L2M2M = "h264_v4l2m2m"; ///< V4L2 mem2mem hardware encoder
+static const std::string H264_NVENC = "h264_nvenc";     ///< NVIDIA desktop GPU hardware encoder
+static const std::string HARDWARE = "hardware";         ///< best available hardware encoder
+
+/// tunings accepted by libx264
+static const std::vector<std::string> x264_tunes({"film", "animation", "grain", "stillimage",
+                                                  "psnr", "ssim", "fastdecode", "zerolatency"});
 
 /**
  * @brief function to check that a string is a valid codec name
@@ -24,8 +40,39 @@ static const std::string LIBX264 = "libx264";
  * @return true if valid false otherwise
  */
 bool Validate(std::string type_name);
+
+/**
+ * @brief check if a codec name refers to a hardware encoder
+ * @param name codec name
+ * @return true for hardware encoders (including HARDWARE), false otherwise
+ */
+bool IsHardware(const std::string &name);
+
+/**
+ * @brief get the encoders to try, in order, for a configured codec
+ *
+ * a hardware codec is followed by libx264 as a fallback. HARDWARE expands
+ * to the hardware encoders for this platform (the Jetson encoders on Tegra,
+ * nvenc elsewhere) followed by libx264.
+ *
+ * @param name configured codec name
+ * @return list of ffmpeg encoder names
+ */
+std::vector<std::string> EncoderCandidates(const std::string &name);
 } // namespace codecs
 
+namespace containers {
+/// AVI, needs the trailer written to be indexed
+static const std::string AVI = "avi";
+/// fragmented MP4, playable up to the last complete fragment without a trailer
+static const std::string MP4 = "mp4";
+/// Matroska, playable without a trailer, the cues are written at the front at close
+static const std::string MKV = "mkv";
+
+/// vector of all valid container names, also used as the file extension
+static const std::vector<std::string> container_names({AVI, MP4, MKV});
+} // namespace containers
+
 
 /**
  * @brief camera controller abstract base class
@@ -82,6 +129,78 @@ public:
         /// get filtering flag
         bool apply_filter() const {return apply_filter_;}
 
+        /// get filter thread flag
+        bool filter_thread() const {return filter_thread_;}
+
+        /// get number of frames between keyframes, defaults to one second of video
+        unsigned int gop_size() const {return gop_size_ ? gop_size_ : target_fps_;}
+
+        /// get maximum number of consecutive B-frames
+        unsigned int max_b_frames() const {return max_b_frames_;}
+
+        /// get number of encoder threads, 0 lets the encoder decide
+        unsigned int encoder_threads() const {return encoder_threads_;}
+
+        /// get sliced threads flag (x264 slice based instead of frame based threading)
+        bool sliced_threads() const {return sliced_threads_;}
+
+        /// get x264 tune name, empty for none
+        const std::string& tune() const {return tune_;}
+
+        /// get rate control lookahead in frames, negative for the encoder default
+        int rc_lookahead() const {return rc_lookahead_;}
+
+        /// get per-frame timestamp file format, one of timestamp_formats::format_names
+        const std::string& timestamp_format() const {return timestamp_format_;}
+
+        /// write full buffers of the video file with O_DIRECT
+        bool direct_io() const {return direct_io_;}
+
+        /// reserve disk space for each video file before writing it
+        bool preallocate() const {return preallocate_;}
+
+        /// video file container, see containers::container_names
+        const std::string& container() const {return container_;}
+
+        /// free space in megabytes to leave on the output filesystem, recording stops below it
+        uint64_t min_free_mb() const {return min_free_mb_;}
+
+        /// lower the quality or frame rate when the session won't fit on the disk
+        bool disk_throttle() const {return disk_throttle_;}
+
+        /// encode fewer frames while the encoder can't keep up, see EncoderGovernor
+        bool adaptive_pacing() const {return adaptive_pacing_;}
+
+        /// seconds of video kept from before an armed session is triggered, 0 if not armed
+        unsigned int pre_trigger() const {return pre_trigger_;}
+
+        /// memory limit in megabytes for the pre-trigger video
+        unsigned int pre_trigger_mb() const {return pre_trigger_mb_;}
+
+        /// width of the region of interest in sensor pixels, 0 for the configured frame width
+        unsigned int roi_width() const {return roi_width_;}
+
+        /// height of the region of interest in sensor pixels, 0 for the configured frame height
+        unsigned int roi_height() const {return roi_height_;}
+
+        /// left edge of the region of interest in sensor pixels, negative to center it
+        int roi_offset_x() const {return roi_offset_x_;}
+
+        /// top edge of the region of interest in sensor pixels, negative to center it
+        int roi_offset_y() const {return roi_offset_y_;}
+
+        /// sensor binning factor, applied horizontally and vertically
+        unsigned int binning() const {return binning_;}
+
+        /// sensor decimation factor, applied horizontally and vertically
+        unsigned int decimation() const {return decimation_;}
+
+        /// downscale factor of the proxy video, 0 if there is no proxy
+        unsigned int proxy_scale() const {return proxy_scale_;}
+
+        /// constant rate factor of the proxy video
+        unsigned int proxy_crf() const {return proxy_crf_;}
+
         /// set target fps
         void set_target_fps(unsigned int target_fps);
 
@@ -100,6 +219,9 @@ public:
         /// set codec
         void set_codec(std::string codec);
 
+        /// set pixel format
+        void set_pixel_format(const std::string &pixel_format);
+
         /// set compression preset
         void set_compression_target(const std::string &target);
 
@@ -109,6 +231,88 @@ public:
         /// set filtering flag
         void set_apply_filter(bool apply_filter) {apply_filter_ = apply_filter;}
 
+        /// run the filter on its own thread, pipelined with the encoder
+        void set_filter_thread(bool filter_thread) {filter_thread_ = filter_thread;}
+
+        /// set number of frames between keyframes, 1 for all intra
+        void set_gop_size(unsigned int gop_size);
+
+        /// set maximum number of consecutive B-frames
+        void set_max_b_frames(unsigned int max_b_frames);
+
+        /// set number of encoder threads
+        void set_encoder_threads(unsigned int threads);
+
+        /// set sliced threads flag
+        void set_sliced_threads(bool sliced_threads) {sliced_threads_ = sliced_threads;}
+
+        /// set x264 tune
+        void set_tune(const std::string &tune);
+
+        /// set rate control lookahead in frames
+        void set_rc_lookahead(int frames);
+
+        /// set per-frame timestamp file format
+        void set_timestamp_format(const std::string &format);
+
+        /// set O_DIRECT flag
+        void set_direct_io(bool direct_io) {direct_io_ = direct_io;}
+
+        /// set preallocation flag
+        void set_preallocate(bool preallocate) {preallocate_ = preallocate;}
+
+        /// set video file container
+        void set_container(const std::string &container);
+
+        /// set free space to leave on the output filesystem, in megabytes
+        void set_min_free_mb(uint64_t mb) {min_free_mb_ = mb;}
+
+        /// set disk throttling flag
+        void set_disk_throttle(bool throttle) {disk_throttle_ = throttle;}
+
+        /// set adaptive pacing flag
+        void set_adaptive_pacing(bool pacing) {adaptive_pacing_ = pacing;}
+
+        /// set seconds of pre-trigger video
+        void set_pre_trigger(unsigned int seconds) {pre_trigger_ = seconds;}
+
+        /// set pre-trigger memory limit in megabytes
+        void set_pre_trigger_mb(unsigned int mb);
+
+        /**
+         * @brief set the region of interest
+         *
+         * @param width width in sensor pixels, 0 for the configured frame width
+         * @param height height in sensor pixels, 0 for the configured frame height
+         * @param offset_x left edge in sensor pixels, negative to center the region
+         * @param offset_y top edge in sensor pixels, negative to center the region
+         */
+        void set_roi(unsigned int width, unsigned int height, int offset_x, int offset_y);
+
+        /// set sensor binning factor, 1 (off) to 4
+        void set_binning(unsigned int binning);
+
+        /// set sensor decimation factor, 1 (off) to 4
+        void set_decimation(unsigned int decimation);
+
+        /// set proxy downscale factor, 2 to 8, or 0 for no proxy
+        void set_proxy_scale(unsigned int scale);
+
+        /// set proxy constant rate factor
+        void set_proxy_crf(unsigned int crf);
+
+        /**
+         * @brief take the session settings of the command that triggered an armed session
+         *
+         * the file, disk and session settings (prefix, duration, session ID,
+         * container, ...) are copied from session. The camera and encoder
+         * are already running, so their settings are kept. The result is no
+         * longer armed
+         *
+         * @param session configuration from the START command
+         */
+        void MergeSession(const RecordingSessionConfig &session);
+
     private:
         /// target frames per second for video acquisition
         int target_fps_ = 60;
@@ -142,6 +346,75 @@ public:
         /// run frames through filtering before output
         bool apply_filter_ = false;
 
+        /// denoise each frame on a separate thread while the previous one is encoded
+        bool filter_thread_ = false;
+
+        /// frames between keyframes, 0 uses target_fps_ (one keyframe per
+        /// second). This is much cheaper in disk bandwidth than all intra
+        /// while still allowing reasonably fine grained seeking
+        unsigned int gop_size_ = 0;
+
+        /// maximum consecutive B-frames. B-frames are off by default since
+        /// the AVI container doesn't carry presentation timestamps
+        unsigned int max_b_frames_ = 0;
+
+        /// encoder thread count, 0 = automatic
+        unsigned int encoder_threads_ = 0;
+
+        /// use slice based threading (lower latency, slightly less efficient)
+        bool sliced_threads_ = false;
+
+        /// x264 tune, e.g. "zerolatency" when live streaming matters most
+        std::string tune_;
+
+        /// rate control lookahead, negative values keep the preset's default
+        int rc_lookahead_ = -1;
+
+        /// per-frame timestamp file format
+        std::string timestamp_format_ = timestamp_formats::TEXT;
+
+        /// bypass the page cache for video file writes
+        bool direct_io_ = false;
+
+        /// preallocate video files from the expected bitrate
+        bool preallocate_ = true;
+
+        /// video file container
+        std::string container_ = containers::AVI;
+
+        /// free space to leave on the output filesystem, in megabytes
+        uint64_t min_free_mb_ = 1024;
+
+        /// degrade the session when it is predicted to fill the disk
+        bool disk_throttle_ = true;
+
+        /// pace the encoder when it falls behind the camera
+        bool adaptive_pacing_ = true;
+
+        /// pre-trigger video to keep while armed, in seconds
+        unsigned int pre_trigger_ = 0;
+
+        /// memory limit for the pre-trigger video, in megabytes
+        unsigned int pre_trigger_mb_ = 64;
+
+        /// region of interest in sensor pixels. width and height of 0 use
+        /// the configured frame size, negative offsets center the region
+        unsigned int roi_width_ = 0;
+        unsigned int roi_height_ = 0;
+        int roi_offset_x_ = -1;
+        int roi_offset_y_ = -1;
+
+        /// binning and decimation reduce the region of interest on the
+        /// sensor, the recorded frames are smaller by these factors
+        unsigned int binning_ = 1;
+        unsigned int decimation_ = 1;
+
+        /// a proxy video is encoded alongside the main one when the scale is
+        /// set. It is smaller by the scale along each axis and encoded at a
+        /// higher crf, for quick review
+        unsigned int proxy_scale_ = 0;
+        unsigned int proxy_crf_ = 28;
+
         /// room string, used to generate outpput subdirectory
         std::string nv_room_string_;
 
@@ -162,7 +435,7 @@ public:
      * and wait for it to terminate
      *
      */
-    ~CameraController();
+    virtual ~CameraController();
 
     /**
      * @brief get recording status
@@ -188,10 +461,34 @@ public:
     /**
      * @brief start the recording thread
      *
-     * @returns true if thread is started, false otherwise
+     * if the controller is armed this triggers the armed session instead:
+     * the pre-trigger video starts the file, and the session settings of
+     * config are merged into the armed ones, see
+     * RecordingSessionConfig::MergeSession()
+     *
+     * @returns true if thread is started (or the armed session triggered), false otherwise
      */
     bool StartRecording(const RecordingSessionConfig &config);
 
+    /**
+     * @brief start grabbing and encoding without writing a file
+     *
+     * the last config.pre_trigger() seconds of encoded video are kept in
+     * memory until StartRecording() triggers the session. StopRecording()
+     * disarms. While armed there is no session ID, recording() is true
+     *
+     * @param config camera and encoder settings, pre_trigger() must be set
+     * @returns true if armed, false if already recording or the camera
+     * doesn't support it
+     */
+    bool Arm(const RecordingSessionConfig &config);
+
+    /**
+     * @brief check if armed and waiting for a trigger
+     * @return true from Arm() until the session is triggered or stopped
+     */
+    bool armed() const {return recording_ && armed_ && !triggered_;}
+
     /**
      * @brief stop recording thread
      *
@@ -215,11 +512,139 @@ public:
     /**
      * @brief get the average frames per second
      *
-     * uses a moving window average to calculate frames per second
+     * uses a moving window average to calculate frames per second. never
+     * blocks the recording thread
      *
      * @return average frames per second
      */
-    double avg_fps();
+    double avg_fps() const {return frame_rate_stats_.avg_fps();}
+
+    /**
+     * @brief get the shortest interval between frames during the session
+     * @return interval in seconds
+     */
+    double min_frame_interval() const {return frame_rate_stats_.min_interval();}
+
+    /**
+     * @brief get the longest interval between frames during the session
+     * @return interval in seconds
+     */
+    double max_frame_interval() const {return frame_rate_stats_.max_interval();}
+
+    /**
+     * @brief get estimated number of frames the camera didn't deliver
+     *
+     * estimated from gaps between camera timestamps, so unlike
+     * frames_overflowed() it counts frames that never reached this process
+     *
+     * @return estimated count of missing frames for the current (or last) session
+     */
+    uint64_t frames_dropped_estimate() const {return frame_rate_stats_.frames_dropped();}
+
+    /**
+     * @brief get exact counts of frames lost before reaching the grab loop
+     *
+     * missing block IDs, failed grabs and stream grabber statistics, for
+     * cameras that report them
+     *
+     * @return drop counts for the current (or last) session
+     */
+    const FrameDropStats& frame_drop_stats() const {return frame_drop_stats_;}
+
+    /**
+     * @brief get the number of grabbed frames waiting to be encoded
+     *
+     * the recording thread hands frames to the encoder through a bounded
+     * queue. A steadily growing depth means the encoder or disk can't keep
+     * up with the camera.
+     *
+     * @return current depth of the frame queue
+     */
+    size_t frame_queue_depth() const {return frame_queue_depth_;}
+
+    /**
+     * @brief get the largest frame queue depth seen during the session
+     * @return frame queue high water mark
+     */
+    size_t frame_queue_high_water() const {return frame_queue_high_water_;}
+
+    /**
+     * @brief get number of frames dropped because the frame queue was full
+     * @return count of dropped frames for the current (or last) session
+     */
+    uint64_t frames_overflowed() const {return frames_overflowed_;}
+
+    /**
+     * @brief get number of bytes of video written by the session
+     * @return encoded bytes for the current (or last) session
+     */
+    uint64_t bytes_written() const {return bytes_written_;}
+
+    /**
+     * @brief get how far the session has been throttled to fit on the disk
+     *
+     * see DiskSpaceMonitor::ThrottleSettings()
+     *
+     * @return throttle level, 0 if the session uses the configured settings
+     */
+    unsigned int disk_throttle_level() const {return disk_throttle_level_;}
+
+    /**
+     * @brief get how far the encoder has been paced to keep up with the camera
+     *
+     * see EncoderGovernor
+     *
+     * @return pacing level, 0 if every frame is encoded
+     */
+    unsigned int pacing_level() const {return pacing_level_;}
+
+    /**
+     * @brief get number of frames left out of the video by throttling or pacing
+     * @return skipped frames for the current (or last) session
+     */
+    uint64_t frames_throttled() const {return frames_throttled_;}
+
+    /**
+     * @brief get the size of the recorded frames
+     *
+     * the region of interest after binning and decimation, as delivered by
+     * the camera
+     *
+     * @return width in pixels for the current (or last) session, 0 before
+     * the camera has been configured
+     */
+    int image_width() const {return image_width_;}
+
+    /// height of the recorded frames, see image_width()
+    int image_height() const {return image_height_;}
+
+    /**
+     * @brief get the name of the encoder used by the recording session
+     *
+     * this can differ from the configured codec if a hardware encoder was
+     * requested but unavailable
+     *
+     * @return ffmpeg encoder name, empty if no session has opened an encoder
+     */
+    std::string encoder_name();
+
+    /**
+     * @brief get number of encoder frame buffers reused from the frame pool
+     * @return pool hits for the current (or last) session
+     */
+    uint64_t frame_pool_hits() const {return frame_pool_hits_;}
+
+    /**
+     * @brief get number of encoder frame buffers that had to be allocated
+     * @return pool misses for the current (or last) session
+     */
+    uint64_t frame_pool_misses() const {return frame_pool_misses_;}
+
+    /**
+     * @brief get per-stage latency histograms for the recording pipeline
+     * @return histograms for the current (or last) session
+     */
+    const PipelineStats& pipeline_stats() const {return pipeline_stats_;}
 
     /**
      * @brief get error string set by recording thread
@@ -277,6 +702,62 @@ public:
     /// enable/disable live streaming. will not set to true if rtmp_uri_ is empty
     void SetStreaming(bool stream);
 
+    /**
+     * @brief configure the shared memory preview, see PreviewRing
+     *
+     * applied when the next recording session starts
+     *
+     * @param name shared memory object name
+     * @param fps maximum rate of preview frames, 0 to disable the preview
+     */
+    void SetPreview(const std::string &name, double fps);
+
+    /**
+     * @brief keep an encoder open between sessions
+     *
+     * when enabled a controller that supports it opens an encoder with the
+     * last session's settings once the session ends, so a following session
+     * with the same settings doesn't wait for the encoder to open. The idle
+     * encoder holds on to its memory and threads.
+     *
+     * @param warm true to keep an encoder ready
+     */
+    void SetWarmEncoder(bool warm) {warm_encoder_ = warm;}
+
+    /**
+     * @brief restrict recording threads to a set of cpus
+     *
+     * sets the cpus of both the grab and encode thread policies, see
+     * SetThreadPolicies()
+     *
+     * @param cpus cpu numbers, empty to let the threads run anywhere
+     */
+    void SetCpuAffinity(const std::vector<int> &cpus);
+
+    /**
+     * @brief set scheduling for the recording threads
+     *
+     * applied when the next recording session starts. The encode policy
+     * covers everything the session starts (encoder thread, encoder worker
+     * threads, file rollover and rtmp threads); only the thread that waits on
+     * the camera uses the grab policy. A controller without a separate grab
+     * thread uses the encode policy for its recording thread.
+     *
+     * @param grab policy for the thread grabbing frames from the camera
+     * @param encode policy for all other recording threads
+     */
+    void SetThreadPolicies(const thread_tuning::ThreadPolicy &grab,
+                           const thread_tuning::ThreadPolicy &encode);
+
+    /// scheduling policy of the grab thread
+    const thread_tuning::ThreadPolicy& grab_policy() const {return grab_policy_;}
+
+    /// scheduling policy of the encode threads
+    const thread_tuning::ThreadPolicy& encode_policy() const {return encode_policy_;}
+
+    /// true if the controller implements Arm()
+    virtual bool can_arm() const {return false;}
+
 protected:
     std::string directory_;     ///< directory for storing video
     std::atomic_bool stop_recording_ {false}; ///< used to signal to the recording thread to terminate early
@@ -285,7 +766,8 @@ protected:
     std::thread recording_thread_;            ///< current recording thread
     std::chrono::seconds elapsed_time_;       ///< duration of completed recording session
     std::atomic<std::chrono::high_resolution_clock::duration> session_start_;
-    std::vector<double> moving_avg_;  ///<  buffer storing fps for last N frames captured where N is the target framerate
+    FrameRateStats frame_rate_stats_; ///< frame rate over the last N frames captured where N is the target framerate
+    FrameDropStats frame_drop_stats_; ///< frames lost between the camera and the grab loop
     int session_id_ {-1}; ///< stores session ID if current recording session (if there is one)
     std::string err_msg_; ///< error message if recording_err_
     int err_state_;       ///< error state of last completed recording session
@@ -295,6 +777,28 @@ protected:
     std::string nv_room_string_; ///< string generated from hostname and location, for use in output subdir
     std::string rtmp_uri_;       ///< URL for rtmp streaming endpoint
     std::atomic_bool live_stream_ {false}; ///< if true, stream video to rtmp endpoint
+    std::string preview_name_;   ///< shared memory object for the preview ring
+    double preview_fps_ = 0;     ///< preview frame rate, 0 if the preview is disabled
+    std::atomic_bool warm_encoder_ {false}; ///< keep an encoder open between sessions
+    std::atomic<size_t> frame_queue_depth_ {0};      ///< frames grabbed but not yet encoded
+    std::atomic<size_t> frame_queue_high_water_ {0}; ///< largest frame_queue_depth_ this session
+    std::atomic<uint64_t> frames_overflowed_ {0};    ///< frames dropped because the frame queue was full
+    PipelineStats pipeline_stats_;                   ///< per-stage latency histograms for the session
+    std::atomic<uint64_t> frame_pool_hits_ {0};      ///< encoder frame buffers reused this session
+    std::atomic<uint64_t> frame_pool_misses_ {0};    ///< encoder frame buffers allocated this session
+    std::atomic<uint64_t> bytes_written_ {0};        ///< encoded bytes written this session
+    std::atomic<unsigned int> disk_throttle_level_ {0}; ///< set by the grab loop, applied by the encoder
+    std::atomic<uint64_t> frames_throttled_ {0};     ///< frames skipped by throttling or pacing this session
+    std::atomic<unsigned int> pacing_level_ {0};     ///< set and applied by the encoder
+    std::atomic<int> image_width_ {0};   ///< width of the frames delivered by the camera this session
+    std::atomic<int> image_height_ {0};  ///< height of the frames delivered by the camera this session
+    std::string encoder_name_; ///< encoder used by the current (or last) session, protected by mutex_
+    thread_tuning::ThreadPolicy grab_policy_;   ///< scheduling for the thread grabbing frames
+    thread_tuning::ThreadPolicy encode_policy_; ///< scheduling for the other recording threads
+    std::atomic_bool armed_ {false};     ///< the session was started by Arm()
+    std::atomic_bool triggered_ {false}; ///< an armed session has been triggered
+    RecordingSessionConfig armed_config_;   ///< settings the session was armed with
+    RecordingSessionConfig trigger_config_; ///< armed_config_ merged with the trigger, protected by mutex_
 
     /**
      * @brief generates a timestamp string for use in filenames.
@@ -343,6 +847,18 @@ protected:
      */
     int GetCurrentHour();
 
+    /**
+     * @brief get the start of the hour following a given system clock time
+     *
+     * used to find the boundary where an hourly fragmented recording should
+     * roll over to the next file
+     *
+     * @param time system clock time
+     * @return system clock time of the top of the next local hour
+     */
+    std::chrono::time_point<std::chrono::system_clock> NextHour(
+        std::chrono::time_point<std::chrono::system_clock> time);
+
 private:
     /**
      * @brief function executed in a thread by StartRecording()
@@ -351,7 +867,14 @@ private:
      * inherit from this abstract base class to create a functioning
      * CameraController. This function will handle recording video from
      * the camera. It should set recording when it starts and finishes.
+     *
+     * A session started by Arm() has config.pre_trigger() set and must not
+     * write files until triggered_ is set, it then takes its settings from
+     * trigger_config_.
      */
     virtual void RecordVideo(const RecordingSessionConfig&) = 0;
+
+    /// reset the session statistics and start the recording thread
+    void StartThread(const RecordingSessionConfig &config);
 };
 #endif
\ No newline at end of file
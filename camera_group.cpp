@@ -0,0 +1,234 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#include <algorithm>
+
+#include "camera_group.h"
+#include "thread_tuning.h"
+
+void CameraGroup::Add(const std::string &name, std::unique_ptr<CameraController> camera)
+{
+    cameras_.push_back(std::move(camera));
+    names_.push_back(name);
+}
+
+bool CameraGroup::recording() const
+{
+    for (const auto &camera : cameras_) {
+        if (camera->recording()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool CameraGroup::live_streaming() const
+{
+    for (const auto &camera : cameras_) {
+        if (camera->live_streaming()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool CameraGroup::armed() const
+{
+    for (const auto &camera : cameras_) {
+        if (camera->armed()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int CameraGroup::session_id() const
+{
+    for (const auto &camera : cameras_) {
+        if (camera->session_id() != -1) {
+            return camera->session_id();
+        }
+    }
+    return -1;
+}
+
+std::chrono::seconds CameraGroup::elapsed_time() const
+{
+    std::chrono::seconds elapsed = std::chrono::seconds::zero();
+    for (const auto &camera : cameras_) {
+        elapsed = std::max(elapsed, camera->elapsed_time());
+    }
+    return elapsed;
+}
+
+int CameraGroup::recording_error() const
+{
+    for (const auto &camera : cameras_) {
+        if (camera->recording_error()) {
+            return camera->recording_error();
+        }
+    }
+    return 0;
+}
+
+std::string CameraGroup::error_string() const
+{
+    std::string errors;
+    for (size_t i = 0; i < cameras_.size(); i++) {
+        if (!cameras_[i]->recording_error()) {
+            continue;
+        }
+        if (!errors.empty()) {
+            errors += "; ";
+        }
+        if (cameras_.size() > 1) {
+            errors += names_[i] + ": ";
+        }
+        errors += cameras_[i]->error_string();
+    }
+    return errors;
+}
+
+bool CameraGroup::StartRecording(const CameraController::RecordingSessionConfig &config)
+{
+    bool started = true;
+    for (size_t i = 0; i < cameras_.size(); i++) {
+        CameraController::RecordingSessionConfig camera_config = config;
+        camera_config.set_file_prefix(FilePrefix(i, config.file_prefix()));
+        if (!cameras_[i]->StartRecording(camera_config)) {
+            started = false;
+        }
+    }
+    return started;
+}
+
+bool CameraGroup::Arm(const CameraController::RecordingSessionConfig &config)
+{
+    bool armed = true;
+    for (size_t i = 0; i < cameras_.size(); i++) {
+        CameraController::RecordingSessionConfig camera_config = config;
+        camera_config.set_file_prefix(FilePrefix(i, config.file_prefix()));
+        if (!cameras_[i]->Arm(camera_config)) {
+            armed = false;
+        }
+    }
+    return armed;
+}
+
+void CameraGroup::StopRecording()
+{
+    for (auto &camera : cameras_) {
+        camera->StopRecording();
+    }
+}
+
+void CameraGroup::ClearSession()
+{
+    for (auto &camera : cameras_) {
+        camera->ClearSession();
+    }
+}
+
+void CameraGroup::SetStreaming(bool stream)
+{
+    for (auto &camera : cameras_) {
+        camera->SetStreaming(stream);
+    }
+}
+
+void CameraGroup::SetDirectory(const std::string &dir)
+{
+    for (auto &camera : cameras_) {
+        camera->SetDirectory(dir);
+    }
+}
+
+void CameraGroup::SetFrameWidth(int width)
+{
+    for (auto &camera : cameras_) {
+        camera->SetFrameWidth(width);
+    }
+}
+
+void CameraGroup::SetFrameHeight(int height)
+{
+    for (auto &camera : cameras_) {
+        camera->SetFrameHeight(height);
+    }
+}
+
+void CameraGroup::SetNvRoomString(const std::string &s)
+{
+    for (auto &camera : cameras_) {
+        camera->SetNvRoomString(s);
+    }
+}
+
+void CameraGroup::SetRtmpUri(const std::string &uri)
+{
+    for (size_t i = 0; i < cameras_.size(); i++) {
+        cameras_[i]->SetRtmpUri(StreamUri(i, uri));
+    }
+}
+
+void CameraGroup::SetPreview(const std::string &name, double fps)
+{
+    for (size_t i = 0; i < cameras_.size(); i++) {
+        cameras_[i]->SetPreview(PreviewName(i, name), fps);
+    }
+}
+
+void CameraGroup::SetWarmEncoder(bool warm)
+{
+    for (auto &camera : cameras_) {
+        camera->SetWarmEncoder(warm);
+    }
+}
+
+void CameraGroup::PartitionCpus()
+{
+    if (cameras_.size() < 2) {
+        return;
+    }
+
+    std::vector<std::vector<int>> partitions = thread_tuning::PartitionCpus(cameras_.size());
+    for (size_t i = 0; i < cameras_.size(); i++) {
+        cameras_[i]->SetCpuAffinity(partitions[i]);
+    }
+}
+
+void CameraGroup::SetThreadPolicies(const thread_tuning::ThreadPolicy &grab,
+                                    const thread_tuning::ThreadPolicy &encode)
+{
+    for (auto &camera : cameras_) {
+        camera->SetThreadPolicies(grab, encode);
+    }
+}
+
+std::string CameraGroup::FilePrefix(size_t i, const std::string &prefix) const
+{
+    if (cameras_.size() < 2 || names_[i].empty()) {
+        return prefix;
+    }
+
+    std::string camera_prefix = prefix;
+    if (!camera_prefix.empty() && camera_prefix.back() != '_' && camera_prefix.back() != '-') {
+        camera_prefix += "_";
+    }
+    return camera_prefix + names_[i] + "_";
+}
+
+std::string CameraGroup::StreamUri(size_t i, const std::string &uri) const
+{
+    if (cameras_.size() < 2 || names_[i].empty() || uri.empty()) {
+        return uri;
+    }
+    return uri + "_" + names_[i];
+}
+
+std::string CameraGroup::PreviewName(size_t i, const std::string &name) const
+{
+    if (cameras_.size() < 2 || names_[i].empty()) {
+        return name;
+    }
+    return name + "-" + names_[i];
+}
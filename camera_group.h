@@ -0,0 +1,168 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#ifndef CAMERA_GROUP_H
+#define CAMERA_GROUP_H
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "camera_controller.h"
+
+/**
+ * @brief the cameras attached to this host, controlled as one
+ *
+ * Each camera has its own CameraController and so its own recording,
+ * encoder and writer threads, session state and statistics. Commands from
+ * the server apply to every camera. When there is more than one camera the
+ * camera name (serial number) is added to the file prefix and the rtmp
+ * stream name so the cameras don't overwrite each other's output.
+ *
+ * Like CameraController, CameraGroup is intended to be used from a single
+ * thread.
+ */
+class CameraGroup {
+public:
+    CameraGroup() = default;
+    CameraGroup(const CameraGroup&) = delete;
+    CameraGroup& operator=(const CameraGroup&) = delete;
+
+    /**
+     * @brief add a camera to the group
+     * @param name name used to tell cameras apart, normally the serial number.
+     * may be empty if this is the only camera
+     * @param camera controller for the camera
+     */
+    void Add(const std::string &name, std::unique_ptr<CameraController> camera);
+
+    /// number of cameras in the group
+    size_t size() const {return cameras_.size();}
+
+    /// controller for camera i
+    CameraController& camera(size_t i) {return *cameras_[i];}
+    const CameraController& camera(size_t i) const {return *cameras_[i];}
+
+    /// name of camera i, as passed to Add()
+    const std::string& name(size_t i) const {return names_[i];}
+
+    /// true if any camera is recording
+    bool recording() const;
+
+    /// true if any camera is live streaming
+    bool live_streaming() const;
+
+    /// true if any camera is armed and waiting for a trigger
+    bool armed() const;
+
+    /**
+     * @brief get recording session ID
+     * @return session ID shared by the cameras, -1 if there is no session
+     */
+    int session_id() const;
+
+    /// longest elapsed time of the cameras in the current (or last) session
+    std::chrono::seconds elapsed_time() const;
+
+    /// non-zero if any camera's last recording session ended with an error
+    int recording_error() const;
+
+    /**
+     * @brief error messages of the cameras whose session ended with an error
+     * @return messages separated by "; ", each prefixed with the camera name
+     * when there is more than one camera
+     */
+    std::string error_string() const;
+
+    /**
+     * @brief start recording on every camera
+     * @param config session configuration, the file prefix is extended with
+     * the camera name if there is more than one camera
+     * @return true if every camera started recording
+     */
+    bool StartRecording(const CameraController::RecordingSessionConfig &config);
+
+    /**
+     * @brief arm every camera, see CameraController::Arm()
+     *
+     * StartRecording() then triggers the armed cameras
+     *
+     * @param config camera and encoder settings
+     * @return true if every camera was armed
+     */
+    bool Arm(const CameraController::RecordingSessionConfig &config);
+
+    /// stop recording on every camera, waits for all recording threads to finish
+    void StopRecording();
+
+    /// clear session state on every camera
+    void ClearSession();
+
+    /// enable/disable live streaming on every camera
+    void SetStreaming(bool stream);
+
+    /// set output directory for every camera
+    void SetDirectory(const std::string &dir);
+
+    /// set frame width for every camera
+    void SetFrameWidth(int width);
+
+    /// set frame height for every camera
+    void SetFrameHeight(int height);
+
+    /// set nv room string for every camera
+    void SetNvRoomString(const std::string &s);
+
+    /**
+     * @brief set rtmp URI
+     * @param uri stream URI, the camera name is appended for each camera if
+     * there is more than one
+     */
+    void SetRtmpUri(const std::string &uri);
+
+    /**
+     * @brief configure the shared memory preview
+     * @param name shared memory object name, the camera name is appended for
+     * each camera if there is more than one
+     * @param fps maximum preview frame rate, 0 to disable the preview
+     */
+    void SetPreview(const std::string &name, double fps);
+
+    /**
+     * @brief keep an encoder open between sessions on every camera
+     * @see CameraController::SetWarmEncoder()
+     */
+    void SetWarmEncoder(bool warm);
+
+    /**
+     * @brief give each camera's recording threads their own cpus
+     *
+     * the online cpus are split evenly between the cameras. A single camera
+     * is left unpinned. Only the cpus of the thread policies are changed.
+     */
+    void PartitionCpus();
+
+    /**
+     * @brief set scheduling for every camera's recording threads
+     * @param grab policy for the threads grabbing frames
+     * @param encode policy for all other recording threads
+     * @see CameraController::SetThreadPolicies()
+     */
+    void SetThreadPolicies(const thread_tuning::ThreadPolicy &grab,
+                           const thread_tuning::ThreadPolicy &encode);
+
+private:
+    /// file prefix for camera i
+    std::string FilePrefix(size_t i, const std::string &prefix) const;
+
+    /// rtmp uri for camera i
+    std::string StreamUri(size_t i, const std::string &uri) const;
+
+    /// preview shared memory name for camera i
+    std::string PreviewName(size_t i, const std::string &name) const;
+
+    std::vector<std::unique_ptr<CameraController>> cameras_;
+    std::vector<std::string> names_;
+};
+
+#endif
@@ -0,0 +1,98 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#include <iostream>
+#include <systemd/sd-daemon.h>
+
+#include "command_channel.h"
+
+using namespace web::websockets::client;
+
+// channel URI with the query parameters identifying this device
+static web::uri ChannelUri(const std::string &uri, const std::string &name, const std::string &location)
+{
+    web::uri_builder builder(uri);
+    builder.append_query("name", name);
+    if (!location.empty()) {
+        builder.append_query("location", location);
+    }
+    return builder.to_uri();
+}
+
+CommandChannel::CommandChannel(const std::string &uri, const std::string &name,
+                               const std::string &location, CommandQueue &commands) :
+    uri_(uri),
+    connect_uri_(ChannelUri(uri, name, location)),
+    commands_(commands)
+{
+}
+
+CommandChannel::~CommandChannel()
+{
+    if (!client_) {
+        return;
+    }
+    // the handlers use this object, so stop calling them before closing
+    client_->set_message_handler([](const websocket_incoming_message&) {});
+    client_->set_close_handler([](websocket_close_status, const std::string&, const std::error_code&) {});
+    try {
+        connect_task_.wait();
+        if (state_ == CONNECTED) {
+            client_->close().wait();
+        }
+    } catch (const std::exception &e) {
+        // closing anyway
+    }
+}
+
+void CommandChannel::Connect()
+{
+    if (state_ != DISCONNECTED) {
+        return;
+    }
+
+    // a closed client can't be reconnected, start over with a new one
+    if (client_) {
+        connect_task_.wait();
+        client_.reset();
+    }
+    state_ = CONNECTING;
+
+    client_ = std::unique_ptr<websocket_callback_client>(new websocket_callback_client());
+    client_->set_message_handler([this](const websocket_incoming_message &message) {
+        HandleMessage(message);
+    });
+    client_->set_close_handler([this](websocket_close_status, const std::string &reason, const std::error_code&) {
+        if (state_.exchange(DISCONNECTED) == CONNECTED) {
+            std::clog << SD_WARNING << "command channel closed: " << reason << std::endl;
+        }
+    });
+
+    // the continuation takes the task so a failed connect is handled here
+    connect_task_ = client_->connect(connect_uri_).then([this](pplx::task<void> connect) {
+        try {
+            connect.get();
+        } catch (const std::exception &e) {
+            std::clog << SD_WARNING << "unable to connect command channel " << uri_ << ": "
+                      << e.what() << std::endl;
+            state_ = DISCONNECTED;
+            return;
+        }
+        // if the connection closed already it stays DISCONNECTED
+        int expected = CONNECTING;
+        if (state_.compare_exchange_strong(expected, CONNECTED)) {
+            std::clog << SD_INFO << "command channel connected to " << uri_ << std::endl;
+        }
+    });
+}
+
+void CommandChannel::HandleMessage(const websocket_incoming_message &message)
+{
+    if (message.message_type() != websocket_message_type::text_message) {
+        return;
+    }
+    try {
+        commands_.Push(makeCommand(web::json::value::parse(message.extract_string().get())));
+    } catch (const std::exception &e) {
+        std::clog << SD_ERR << "ignoring command channel message: " << e.what() << std::endl;
+    }
+}
@@ -0,0 +1,79 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#ifndef COMMAND_CHANNEL_H
+#define COMMAND_CHANNEL_H
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include <cpprest/ws_client.h>
+
+#include "command_queue.h"
+
+/**
+ * @brief receives commands pushed by the server over a WebSocket
+ *
+ * An optional companion to the status updates. The server sends a text
+ * message with the same JSON it returns from the heartbeat endpoint (e.g.
+ * {"command_name": "STOP"}) whenever a command is issued, and the command is
+ * pushed onto the CommandQueue as soon as it arrives instead of waiting for
+ * the next status update. The heartbeat is unchanged and still returns the
+ * current command, so nothing depends on the channel being up; it only
+ * makes commands take effect sooner and lets the update interval be longer.
+ *
+ * The device identifies itself with name and location query parameters on
+ * the channel URI. If the connection drops, Connect() opens a new one; the
+ * control loop calls it with every status update, so a lost channel falls
+ * back to heartbeat polling until it is reconnected.
+ *
+ * Connect() must only be called from one thread.
+ */
+class CommandChannel {
+public:
+    /**
+     * @param uri ws:// or wss:// URI of the command channel
+     * @param name device name, sent as the name query parameter
+     * @param location device location, sent as the location query parameter
+     * if it isn't empty
+     * @param commands queue for the commands received, must outlive the
+     * CommandChannel
+     */
+    CommandChannel(const std::string &uri, const std::string &name, const std::string &location,
+                   CommandQueue &commands);
+
+    /// close the connection
+    ~CommandChannel();
+
+    CommandChannel(const CommandChannel&) = delete;
+    CommandChannel& operator=(const CommandChannel&) = delete;
+
+    /**
+     * @brief start connecting to the server unless already connected or connecting
+     *
+     * returns immediately, the connection is made in the background
+     */
+    void Connect();
+
+    /// true while the channel is connected and receiving commands
+    bool connected() const {return state_ == CONNECTED;}
+
+    const std::string& uri() const {return uri_;}
+
+private:
+    enum State {DISCONNECTED, CONNECTING, CONNECTED};
+
+    /// handle a message from the server, called on a cpprestsdk thread
+    void HandleMessage(const web::websockets::client::websocket_incoming_message &message);
+
+    std::string uri_;
+    web::uri connect_uri_;      ///< uri_ with the device query parameters
+    CommandQueue &commands_;
+    std::atomic<int> state_ {DISCONNECTED};
+
+    /// current connection, replaced by Connect() after it has closed
+    std::unique_ptr<web::websockets::client::websocket_callback_client> client_;
+    pplx::task<void> connect_task_;     ///< latest connect, valid if client_ is set
+};
+
+#endif
@@ -0,0 +1,63 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#ifndef COMMAND_QUEUE_H
+#define COMMAND_QUEUE_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+
+#include "server_command.h"
+
+/**
+ * @brief hands server commands to the control loop
+ *
+ * Commands arrive on cpprestsdk threads, either in the response to a status
+ * update or pushed over the command channel, and are applied by the control
+ * loop in the order they arrived. Any thread may Push(), only the control
+ * loop calls WaitForCommand().
+ */
+class CommandQueue {
+public:
+    CommandQueue() = default;
+    CommandQueue(const CommandQueue&) = delete;
+    CommandQueue& operator=(const CommandQueue&) = delete;
+
+    /// add a command and wake the control loop
+    void Push(std::unique_ptr<ServerCommand> command)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            commands_.push_back(std::move(command));
+        }
+        cv_.notify_all();
+    }
+
+    /**
+     * @brief wait for a command
+     *
+     * @param deadline time to give up waiting
+     * @return the oldest command not yet returned, or null if none arrived
+     * before the deadline
+     */
+    std::unique_ptr<ServerCommand> WaitForCommand(std::chrono::steady_clock::time_point deadline)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait_until(lock, deadline, [this] {return !commands_.empty();});
+        if (commands_.empty()) {
+            return nullptr;
+        }
+        std::unique_ptr<ServerCommand> command = std::move(commands_.front());
+        commands_.pop_front();
+        return command;
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::unique_ptr<ServerCommand>> commands_;
+};
+
+#endif
@@ -0,0 +1,87 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#include <algorithm>
+
+#include <sys/statvfs.h>
+
+#include "disk_space_monitor.h"
+
+// time to measure the write rate of new settings (and of the session start,
+// while the encoder's rate control settles) before degrading again
+static const std::chrono::seconds kSettleTime(60);
+
+// weight of the newest measurement in the smoothed write rate
+static const double kRateSmoothing = 0.25;
+
+// crf added by each crf throttle level, and the number of those levels
+static const unsigned int kCrfStep = 6;
+static const unsigned int kCrfLevels = 2;
+static const unsigned int kMaxCrf = 51;
+
+// frame rate levels, each one halves the frame rate
+static const unsigned int kFrameRateLevels = 2;
+
+DiskSpaceMonitor::DiskSpaceMonitor(const std::string &directory, uint64_t reserve_bytes) :
+    directory_(directory),
+    reserve_bytes_(reserve_bytes),
+    last_check_(std::chrono::steady_clock::now()),
+    settled_(last_check_ + kSettleTime)
+{
+}
+
+DiskSpaceMonitor::Action DiskSpaceMonitor::Check(uint64_t bytes_written, std::chrono::seconds remaining,
+                                                 bool can_degrade)
+{
+    auto now = std::chrono::steady_clock::now();
+
+    struct statvfs buf;
+    if (statvfs(directory_.c_str(), &buf) != 0) {
+        // can't tell, the session will find out soon enough from its writes
+        return KEEP;
+    }
+    free_bytes_ = static_cast<uint64_t>(buf.f_bavail) * buf.f_frsize;
+
+    double seconds = std::chrono::duration<double>(now - last_check_).count();
+    if (seconds > 0 && bytes_written >= last_bytes_) {
+        double rate = (bytes_written - last_bytes_) / seconds;
+        write_rate_ = write_rate_ > 0 ? write_rate_ + kRateSmoothing * (rate - write_rate_) : rate;
+    }
+    last_bytes_ = bytes_written;
+    last_check_ = now;
+
+    if (free_bytes_ <= reserve_bytes_) {
+        return STOP;
+    }
+
+    if (can_degrade && now >= settled_ && write_rate_ > 0 &&
+        seconds_to_full() < remaining.count()) {
+        settled_ = now + kSettleTime;
+        return DEGRADE;
+    }
+    return KEEP;
+}
+
+double DiskSpaceMonitor::seconds_to_full() const
+{
+    if (write_rate_ <= 0) {
+        return -1;
+    }
+    return free_bytes_ > reserve_bytes_ ? (free_bytes_ - reserve_bytes_) / write_rate_ : 0;
+}
+
+DiskSpaceMonitor::Throttle DiskSpaceMonitor::ThrottleSettings(unsigned int level, unsigned int crf,
+                                                              bool adjust_crf)
+{
+    unsigned int crf_levels = adjust_crf ? std::min(level, kCrfLevels) : 0;
+    unsigned int rate_levels = std::min(level - crf_levels, kFrameRateLevels);
+
+    Throttle throttle;
+    throttle.crf = std::min(crf + crf_levels * kCrfStep, kMaxCrf);
+    throttle.frame_interval = 1u << rate_levels;
+    return throttle;
+}
+
+unsigned int DiskSpaceMonitor::MaxThrottleLevel(bool adjust_crf)
+{
+    return (adjust_crf ? kCrfLevels : 0) + kFrameRateLevels;
+}
@@ -0,0 +1,97 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#ifndef DISK_SPACE_MONITOR_H
+#define DISK_SPACE_MONITOR_H
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+/**
+ * @brief predicts when a recording session will run out of disk space
+ *
+ * Check() is called periodically from the recording loop with the number of
+ * bytes the session has written so far. The monitor smooths the write rate,
+ * compares the time until the free space on the output directory drops to
+ * the reserve with the time left in the session, and asks the session to
+ * degrade (see ThrottleSettings()) while it won't fit, or to stop once the
+ * reserve is reached. A degraded session isn't restored, a disk that filled
+ * up once is not going to empty itself during the session.
+ *
+ * Not thread safe, only the recording thread uses it.
+ */
+class DiskSpaceMonitor {
+public:
+    /// what the session should do after a Check()
+    enum Action {
+        KEEP,       ///< keep recording as is
+        DEGRADE,    ///< go to the next throttle level
+        STOP        ///< stop recording, the reserve has been reached
+    };
+
+    /// encoder settings for a throttle level
+    struct Throttle {
+        unsigned int crf;               ///< constant rate factor
+        unsigned int frame_interval;    ///< encode one of every frame_interval frames
+    };
+
+    /**
+     * @param directory directory the session writes to
+     * @param reserve_bytes free space to leave on the filesystem
+     */
+    DiskSpaceMonitor(const std::string &directory, uint64_t reserve_bytes);
+
+    /**
+     * @brief update the estimate and decide what the session should do
+     *
+     * @param bytes_written total bytes written by the session so far
+     * @param remaining time left in the session
+     * @param can_degrade false if the session is already at its lowest
+     * throttle level
+     * @return action for the session
+     */
+    Action Check(uint64_t bytes_written, std::chrono::seconds remaining, bool can_degrade);
+
+    /// free space on the filesystem at the last Check()
+    uint64_t free_bytes() const {return free_bytes_;}
+
+    /// smoothed write rate in bytes per second
+    double write_rate() const {return write_rate_;}
+
+    /// predicted seconds until the reserve is reached, negative if unknown
+    double seconds_to_full() const;
+
+    /**
+     * @brief encoder settings for a throttle level
+     *
+     * the first levels raise the crf, if the encoder can change it during a
+     * session, the following ones halve the frame rate
+     *
+     * @param level throttle level, 0 for the configured settings
+     * @param crf configured constant rate factor
+     * @param adjust_crf true if the encoder accepts a new crf during a session
+     * @return settings for the level
+     */
+    static Throttle ThrottleSettings(unsigned int level, unsigned int crf, bool adjust_crf);
+
+    /**
+     * @brief number of throttle levels above 0
+     * @param adjust_crf true if the encoder accepts a new crf during a session
+     */
+    static unsigned int MaxThrottleLevel(bool adjust_crf);
+
+private:
+    std::string directory_;
+    uint64_t reserve_bytes_;
+    uint64_t free_bytes_ = 0;
+    double write_rate_ = 0;
+
+    uint64_t last_bytes_ = 0;
+    std::chrono::steady_clock::time_point last_check_;
+
+    /// the rate at the last change of settings isn't a guide to the next
+    /// one, wait a while before degrading again
+    std::chrono::steady_clock::time_point settled_;
+};
+
+#endif
@@ -0,0 +1,316 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <stdexcept>
+#include <unistd.h>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+#include "disk_writer.h"
+
+// O_DIRECT needs the buffer address, file offset and length aligned to the
+// logical block size. 4096 covers every disk we have seen
+static const size_t kDirectIoAlignment = 4096;
+
+const size_t DiskWriter::kDefaultBufferSize;
+const uint64_t DiskWriter::kDefaultSyncInterval;
+
+DiskWriter::DiskWriter(const std::string &filename, const Options &options, PipelineStats *stats) :
+    filename_(filename),
+    buffer_size_((std::max(options.buffer_size, kDirectIoAlignment) + kDirectIoAlignment - 1) /
+                 kDirectIoAlignment * kDirectIoAlignment),
+    sync_interval_(options.sync_interval),
+    stats_(stats),
+    active_(&buffers_[0])
+{
+    fd_ = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0664);
+    if (fd_ < 0) {
+        throw std::runtime_error("unable to open " + filename + ": " + std::strerror(errno));
+    }
+
+    if (options.direct_io) {
+        // a second descriptor so unaligned writes (headers, the index, the
+        // last partial buffer) can still go through the page cache
+        direct_fd_ = open(filename.c_str(), O_WRONLY | O_DIRECT | O_CLOEXEC);
+        if (direct_fd_ < 0) {
+            std::cerr << "O_DIRECT not supported for " << filename << ", using buffered writes" << std::endl;
+        }
+    }
+
+    if (options.preallocate > 0) {
+        // reserve the space without changing the file size, so a crash doesn't
+        // leave a file padded with zeros. Not every filesystem supports this
+        if (fallocate(fd_, FALLOC_FL_KEEP_SIZE, 0, options.preallocate) == 0) {
+            preallocated_ = options.preallocate;
+        } else if (errno != EOPNOTSUPP) {
+            std::cerr << "unable to preallocate " << filename << ": " << std::strerror(errno) << std::endl;
+        }
+    }
+
+    for (Buffer &buffer : buffers_) {
+        void *p = nullptr;
+        if (posix_memalign(&p, kDirectIoAlignment, buffer_size_) != 0) {
+            for (Buffer &b : buffers_) {
+                std::free(b.data);
+            }
+            if (direct_fd_ >= 0) {
+                close(direct_fd_);
+            }
+            close(fd_);
+            throw std::runtime_error("unable to allocate write buffers for " + filename);
+        }
+        buffer.data = static_cast<uint8_t*>(p);
+    }
+
+    thread_ = std::thread(&DiskWriter::Run, this);
+}
+
+DiskWriter::~DiskWriter()
+{
+    try {
+        Close();
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+    }
+    for (Buffer &buffer : buffers_) {
+        std::free(buffer.data);
+    }
+}
+
+int DiskWriter::Write(const uint8_t *data, size_t size)
+{
+    if (error_) {
+        return error_;
+    }
+
+    while (size > 0) {
+        size_t n = std::min(size, buffer_size_ - active_->fill);
+        std::memcpy(active_->data + active_->fill, data, n);
+        active_->fill += n;
+        position_ += n;
+        data += n;
+        size -= n;
+
+        if (active_->fill == buffer_size_) {
+            Submit();
+        }
+    }
+    end_ = std::max(end_, position_);
+    return error_;
+}
+
+int DiskWriter::Seek(int64_t position)
+{
+    if (position < 0) {
+        return EINVAL;
+    }
+    if (position == position_) {
+        return 0;
+    }
+
+    // the buffers only ever hold one contiguous range, so write out what we
+    // have and start over at the new position
+    Submit();
+    WaitIdle();
+    active_->offset = position;
+    active_->fill = 0;
+    position_ = position;
+    return error_;
+}
+
+void DiskWriter::Close()
+{
+    if (fd_ < 0) {
+        return;
+    }
+
+    Submit();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+
+    int error = error_;
+
+    // give back the preallocated space we didn't use. truncating to the
+    // current size releases the blocks reserved past the end of the file
+    if (preallocated_ > static_cast<uint64_t>(end_) && ftruncate(fd_, end_) != 0 && !error) {
+        error = errno;
+    }
+
+    // drop the rest of the file from the page cache
+    if (sync_interval_ > 0 && sync_start_ < end_) {
+        sync_file_range(fd_, sync_start_, 0,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(fd_, sync_start_, 0, POSIX_FADV_DONTNEED);
+    }
+
+    if (direct_fd_ >= 0 && close(direct_fd_) != 0 && !error) {
+        error = errno;
+    }
+    if (close(fd_) != 0 && !error) {
+        error = errno;
+    }
+    direct_fd_ = -1;
+    fd_ = -1;
+
+    if (error) {
+        throw std::runtime_error("error writing " + filename_ + ": " + std::strerror(error));
+    }
+}
+
+void DiskWriter::Submit()
+{
+    if (active_->fill == 0) {
+        return;
+    }
+
+    int64_t next_offset = active_->offset + active_->fill;
+    {
+        // wait for the writer thread to finish with the other buffer
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] {return pending_ == nullptr;});
+        pending_ = active_;
+    }
+    cv_.notify_all();
+
+    active_ = active_ == &buffers_[0] ? &buffers_[1] : &buffers_[0];
+    active_->fill = 0;
+    active_->offset = next_offset;
+}
+
+void DiskWriter::WaitIdle()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] {return pending_ == nullptr;});
+}
+
+void DiskWriter::Run()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        cv_.wait(lock, [this] {return stop_ || pending_ != nullptr;});
+        if (!pending_) {
+            // stopped and nothing left to write
+            break;
+        }
+
+        Buffer *buffer = pending_;
+        lock.unlock();
+        if (!error_) {
+            int error = WriteBuffer(*buffer);
+            if (error) {
+                error_ = error;
+            }
+        }
+        lock.lock();
+
+        pending_ = nullptr;
+        cv_.notify_all();
+    }
+}
+
+int DiskWriter::WriteBuffer(const Buffer &buffer)
+{
+    StageTimer timer(stats_, PipelineStats::DISK_WRITE);
+
+    bool direct = direct_fd_ >= 0 &&
+                  buffer.offset % kDirectIoAlignment == 0 &&
+                  buffer.fill % kDirectIoAlignment == 0;
+    const uint8_t *data = buffer.data;
+    size_t remaining = buffer.fill;
+    off_t offset = buffer.offset;
+
+    while (remaining > 0) {
+        ssize_t n = pwrite(direct ? direct_fd_ : fd_, data, remaining, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (direct && errno == EINVAL) {
+                // the filesystem accepted O_DIRECT at open but not for this
+                // write. stop using it
+                std::cerr << "O_DIRECT write rejected for " << filename_ << ", using buffered writes" << std::endl;
+                close(direct_fd_);
+                direct_fd_ = -1;
+                direct = false;
+                continue;
+            }
+            return errno;
+        }
+        data += n;
+        remaining -= n;
+        offset += n;
+
+        // a short direct write leaves the rest unaligned
+        if (direct && remaining % kDirectIoAlignment) {
+            direct = false;
+        }
+    }
+    timer.Stop();
+
+    if (sync_interval_ > 0) {
+        SyncRange(buffer.offset + buffer.fill);
+    }
+    return 0;
+}
+
+void DiskWriter::SyncRange(int64_t end)
+{
+    if (end - sync_end_ < static_cast<int64_t>(sync_interval_)) {
+        return;
+    }
+
+    // the previous range has had a whole interval to reach the disk. wait for
+    // it to finish and drop it from the page cache
+    if (sync_end_ > sync_start_) {
+        sync_file_range(fd_, sync_start_, sync_end_ - sync_start_,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(fd_, sync_start_, sync_end_ - sync_start_, POSIX_FADV_DONTNEED);
+    }
+
+    // start writeback of the new range without waiting for it
+    sync_file_range(fd_, sync_end_, end - sync_end_, SYNC_FILE_RANGE_WRITE);
+    sync_start_ = sync_end_;
+    sync_end_ = end;
+}
+
+int DiskWriter::AvioWrite(void *opaque, uint8_t *buf, int buf_size)
+{
+    int error = static_cast<DiskWriter*>(opaque)->Write(buf, buf_size);
+    return error ? AVERROR(error) : buf_size;
+}
+
+int64_t DiskWriter::AvioSeek(void *opaque, int64_t offset, int whence)
+{
+    DiskWriter *writer = static_cast<DiskWriter*>(opaque);
+    int64_t position;
+
+    switch (whence & ~AVSEEK_FORCE) {
+        case AVSEEK_SIZE:
+            return writer->size();
+        case SEEK_SET:
+            position = offset;
+            break;
+        case SEEK_CUR:
+            position = writer->position() + offset;
+            break;
+        case SEEK_END:
+            position = writer->size() + offset;
+            break;
+        default:
+            return AVERROR(EINVAL);
+    }
+
+    int error = writer->Seek(position);
+    return error ? AVERROR(error) : position;
+}
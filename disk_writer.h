@@ -0,0 +1,169 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#ifndef DISK_WRITER_H
+#define DISK_WRITER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "pipeline_stats.h"
+
+/**
+ * @brief sequential file writer with a write-behind thread
+ *
+ * Used as the custom AVIO backend of the video file so the muxer's small
+ * writes turn into large sequential writes. Data is collected in one of two
+ * large buffers; when a buffer fills it is handed to the writer thread and
+ * the caller carries on filling the other one, only waiting if the disk has
+ * fallen a whole buffer behind.
+ *
+ * To keep the page cache from growing on low memory boards the writer thread
+ * starts writeback every sync interval and drops the pages of the previous
+ * interval once they are on disk. The file can optionally be preallocated,
+ * and written with O_DIRECT.
+ *
+ * All methods other than the constructor must be called from one thread.
+ */
+class DiskWriter {
+public:
+    /// options for opening a DiskWriter
+    struct Options {
+        /// size of each of the two buffers, rounded up to the direct io alignment
+        size_t buffer_size = kDefaultBufferSize;
+
+        /// bytes written between sync_file_range() calls, 0 to leave writeback to the kernel
+        uint64_t sync_interval = kDefaultSyncInterval;
+
+        /// bytes to reserve for the file, 0 for no preallocation
+        uint64_t preallocate = 0;
+
+        /// write full, aligned buffers with O_DIRECT, bypassing the page cache
+        bool direct_io = false;
+    };
+
+    /**
+     * @brief open (create or truncate) a file and start the writer thread
+     *
+     * throws std::runtime_error if the file can't be opened. Preallocation
+     * and O_DIRECT are best effort: if the filesystem doesn't support them
+     * the file is written normally.
+     *
+     * @param filename file to write
+     * @param options buffering options
+     * @param stats histograms to record disk write latency into, may be null
+     */
+    DiskWriter(const std::string &filename, const Options &options, PipelineStats *stats = nullptr);
+
+    /**
+     * @brief close the file, errors are logged
+     */
+    ~DiskWriter();
+
+    DiskWriter(const DiskWriter&) = delete;
+    DiskWriter& operator=(const DiskWriter&) = delete;
+
+    /**
+     * @brief append data at the current position
+     * @param data data to write
+     * @param size number of bytes
+     * @return 0 on success, otherwise the errno of the first failed write
+     */
+    int Write(const uint8_t *data, size_t size);
+
+    /**
+     * @brief move the write position
+     *
+     * waits for buffered data to be written so the next write can start a
+     * new buffer at the new position
+     *
+     * @param position new offset from the start of the file
+     * @return 0 on success, otherwise an errno value
+     */
+    int Seek(int64_t position);
+
+    /**
+     * @brief write buffered data, stop the writer thread and close the file
+     *
+     * releases any preallocated space past the end of the data. throws
+     * std::runtime_error if any write failed. Calling Close() again does
+     * nothing.
+     */
+    void Close();
+
+    /**
+     * @brief record disk write latency
+     * @param stats histograms to record into, or nullptr to disable
+     */
+    void set_pipeline_stats(PipelineStats *stats) {stats_ = stats;}
+
+    /// current write position
+    int64_t position() const {return position_;}
+
+    /// size of the file once everything buffered has been written
+    int64_t size() const {return end_;}
+
+    /// AVIOContext write_packet callback, opaque is a DiskWriter
+    static int AvioWrite(void *opaque, uint8_t *buf, int buf_size);
+
+    /// AVIOContext seek callback, opaque is a DiskWriter
+    static int64_t AvioSeek(void *opaque, int64_t offset, int whence);
+
+    /// default buffer size
+    static const size_t kDefaultBufferSize = 4 * 1024 * 1024;
+
+    /// default sync interval
+    static const uint64_t kDefaultSyncInterval = 16 * 1024 * 1024;
+
+private:
+    /// one of the write-behind buffers
+    struct Buffer {
+        uint8_t *data = nullptr;  ///< aligned storage
+        size_t fill = 0;          ///< bytes of data
+        int64_t offset = 0;       ///< file offset of data[0]
+    };
+
+    /// writer thread main loop
+    void Run();
+
+    /// hand the active buffer to the writer thread and switch to the other one
+    void Submit();
+
+    /// wait until the writer thread has nothing left to write
+    void WaitIdle();
+
+    /// write a buffer to disk, called on the writer thread
+    int WriteBuffer(const Buffer &buffer);
+
+    /// start writeback and drop written pages from the page cache
+    void SyncRange(int64_t end);
+
+    std::string filename_;
+    int fd_ = -1;            ///< buffered file descriptor
+    int direct_fd_ = -1;     ///< O_DIRECT descriptor, -1 if not in use
+    size_t buffer_size_;
+    uint64_t sync_interval_;
+    uint64_t preallocated_ = 0;
+    std::atomic<PipelineStats*> stats_; ///< latency histograms, not owned. may be null
+
+    Buffer buffers_[2];
+    Buffer *active_;         ///< buffer being filled by the caller
+    Buffer *pending_ = nullptr; ///< buffer handed to the writer thread, guarded by mutex_
+    int64_t position_ = 0;   ///< logical write position
+    int64_t end_ = 0;        ///< largest position written
+
+    // writer thread state
+    int64_t sync_start_ = 0; ///< start of the range whose writeback has been started
+    int64_t sync_end_ = 0;   ///< end of the range whose writeback has been started
+
+    std::atomic<int> error_ {0}; ///< errno of the first failed write
+    bool stop_ = false;          ///< guarded by mutex_
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::thread thread_;
+};
+
+#endif
@@ -0,0 +1,87 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#include <algorithm>
+
+#include "encoder_governor.h"
+
+// highest level, the video keeps at least a quarter of the camera frame rate
+static const unsigned int kMaxPacingLevel = 3;
+
+// the encoder is behind if the queue gets this full, or if encoding takes
+// more than this fraction of the frame time
+static const double kBehindQueueFraction = 0.25;
+static const double kBehindLoad = 0.9;
+
+// the encoder has headroom if the queue stays below this fraction and the
+// load at the next lower level would be below this
+static const double kIdleQueueFraction = 1.0 / 16;
+static const double kIdleLoad = 0.6;
+
+// windows (seconds) the encoder has to be behind before slowing down, or
+// have headroom before speeding up again. Speeding up is slow so a device
+// that is hot doesn't go back and forth
+static const unsigned int kBehindWindows = 2;
+static const unsigned int kIdleWindows = 30;
+
+// windows to wait after a change, the queue needs time to drain
+static const unsigned int kSettleWindows = 5;
+
+EncoderGovernor::EncoderGovernor(int target_fps, size_t queue_capacity) :
+    window_frames_(std::max(target_fps, 1)),
+    queue_capacity_(queue_capacity),
+    frame_ns_(1e9 / std::max(target_fps, 1))
+{
+}
+
+bool EncoderGovernor::AddFrame(size_t queue_depth, std::chrono::nanoseconds encode_time)
+{
+    frames_++;
+    encode_ns_ += encode_time.count();
+    max_depth_ = std::max(max_depth_, queue_depth);
+
+    if (frames_ < window_frames_) {
+        return false;
+    }
+    bool changed = Evaluate();
+    frames_ = 0;
+    encode_ns_ = 0;
+    max_depth_ = 0;
+    return changed;
+}
+
+bool EncoderGovernor::Evaluate()
+{
+    load_ = encode_ns_ / (frames_ * frame_ns_);
+
+    if (settle_windows_) {
+        settle_windows_--;
+        return false;
+    }
+
+    const bool behind = max_depth_ >= queue_capacity_ * kBehindQueueFraction || load_ > kBehindLoad;
+
+    // the next lower level encodes one of every level_ frames instead of one
+    // of every level_ + 1, scale the load to match
+    const double lower_load = level_ ? load_ * (level_ + 1) / level_ : load_;
+    const bool idle = level_ && max_depth_ <= queue_capacity_ * kIdleQueueFraction && lower_load < kIdleLoad;
+
+    behind_windows_ = behind ? behind_windows_ + 1 : 0;
+    idle_windows_ = idle ? idle_windows_ + 1 : 0;
+
+    if (behind_windows_ >= kBehindWindows && level_ < kMaxPacingLevel) {
+        level_++;
+    } else if (idle_windows_ >= kIdleWindows) {
+        level_--;
+    } else {
+        return false;
+    }
+    behind_windows_ = 0;
+    idle_windows_ = 0;
+    settle_windows_ = kSettleWindows;
+    return true;
+}
+
+unsigned int EncoderGovernor::MaxLevel()
+{
+    return kMaxPacingLevel;
+}
@@ -0,0 +1,75 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#ifndef ENCODER_GOVERNOR_H
+#define ENCODER_GOVERNOR_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief paces the encoder when it can't keep up with the camera
+ *
+ * AddFrame() is called by the encoder thread for every frame it takes off
+ * the grab queue. Once per second of frames the governor looks at how deep
+ * the queue got and what fraction of the frame time went into encoding. If
+ * the encoder stays behind (thermal throttling, a busy host) it goes up a
+ * level, and the session encodes one of every frame_interval() frames
+ * instead of losing frames in bursts when the queue overflows. The level
+ * comes back down, one step at a time, once the encoder has had headroom at
+ * the lower rate for a while.
+ *
+ * Not thread safe, only the encoder thread uses it.
+ */
+class EncoderGovernor {
+public:
+    /**
+     * @param target_fps frame rate of the camera
+     * @param queue_capacity capacity of the grab queue
+     */
+    EncoderGovernor(int target_fps, size_t queue_capacity);
+
+    /**
+     * @brief record a frame taken off the grab queue
+     *
+     * @param queue_depth frames left in the queue
+     * @param encode_time time spent encoding the frame, zero if it was
+     * left out of the video
+     * @return true if the level changed
+     */
+    bool AddFrame(size_t queue_depth, std::chrono::nanoseconds encode_time);
+
+    /// pacing level, 0 for every frame
+    unsigned int level() const {return level_;}
+
+    /// encode one of every frame_interval() frames
+    unsigned int frame_interval() const {return level_ + 1;}
+
+    /// fraction of the frame time spent encoding over the last second of frames
+    double load() const {return load_;}
+
+    /// highest pacing level
+    static unsigned int MaxLevel();
+
+private:
+    /// decide on a level change at the end of a window
+    bool Evaluate();
+
+    size_t window_frames_;          ///< frames per window, one second worth
+    size_t queue_capacity_;
+    double frame_ns_;               ///< nanoseconds between camera frames
+
+    unsigned int level_ = 0;
+    double load_ = 0;
+
+    // current window
+    size_t frames_ = 0;
+    uint64_t encode_ns_ = 0;
+    size_t max_depth_ = 0;
+
+    unsigned int behind_windows_ = 0;   ///< consecutive windows the encoder was behind
+    unsigned int idle_windows_ = 0;     ///< consecutive windows with headroom at the next lower level
+    unsigned int settle_windows_ = 0;   ///< windows to wait after a change before judging the new level
+};
+
+#endif
@@ -0,0 +1,262 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#include <algorithm>
+#include <cerrno>
+#include <iostream>
+#include <stdexcept>
+
+#include "disk_writer.h"
+#include "file_sink.h"
+
+// replace the av_err2str macro with something that works for C++
+// see libav-user mailing list: https://ffmpeg.org/pipermail/libav-user/2013-January/003458.html
+#undef av_err2str
+#define av_err2str(errnum) av_make_error_string((char*)__builtin_alloca(AV_ERROR_MAX_STRING_SIZE), AV_ERROR_MAX_STRING_SIZE, errnum)
+
+// bits per pixel per frame expected from the crf encoders, used to size
+// preallocation when the encoder has no target bitrate
+static const double kExpectedBitsPerPixel = 0.1;
+
+// lossless encoders (ffv1) need roughly this fraction of the raw sample bits
+static const double kExpectedLosslessRatio = 0.5;
+
+// upper limit on the space preallocated for one file
+static const int64_t kMaxPreallocation = 16LL * 1024 * 1024 * 1024;
+
+// space reserved at the front of Matroska files for the cues (seek index),
+// per expected keyframe. One cue point takes about 20 bytes
+static const int64_t kCueBytesPerKeyframe = 32;
+static const int64_t kMinCueSpace = 4096;
+
+// size of the AVIO buffer the muxer writes into, the DiskWriter does the
+// real buffering
+static const int kAvioBufferSize = 64 * 1024;
+
+FileSink::FileSink(const std::string &filename, const AVCodecContext *codec_context,
+                   const CameraController::RecordingSessionConfig &config, PipelineStats *stats,
+                   bool rebase) :
+    filename_(filename),
+    codec_time_base_(codec_context->time_base),
+    pts_offset_(rebase ? AV_NOPTS_VALUE : 0),
+    codec_parameters_(avcodec_parameters_alloc()),
+    packet_(av_packet_alloc()),
+    filtered_packet_(av_packet_alloc()),
+    stats_(stats)
+{
+    int r;
+
+    if (!codec_parameters_ ||
+        avcodec_parameters_from_context(codec_parameters_.get(), codec_context) < 0) {
+        throw std::runtime_error("unable to copy codec parameters for " + filename_);
+    }
+    if (!packet_ || !filtered_packet_) {
+        throw std::runtime_error("unable to allocate packet");
+    }
+
+    // setup the output stream
+    const char *format_name = config.container() == containers::MKV ? "matroska" : config.container().c_str();
+    AVFormatContext *tmp_f_context = nullptr;
+    avformat_alloc_output_context2(&tmp_f_context, NULL, format_name, filename_.c_str());
+    if (!tmp_f_context) {
+        throw std::runtime_error("unable to allocate " + config.container() + " output format context");
+    }
+    format_context_ = av_pointer::format_context(tmp_f_context);
+    stream_ = avformat_new_stream(format_context_.get(), NULL);
+    if (!stream_ || avcodec_parameters_copy(stream_->codecpar, codec_parameters_.get()) < 0) {
+        throw std::runtime_error("unable to add stream to " + filename_);
+    }
+    stream_->time_base = codec_context->time_base;
+    stream_->r_frame_rate = codec_context->framerate;
+
+    if (config.container() == containers::AVI) {
+        // setup the bitstream filter used to restore in-band headers for the
+        // avi output (see VideoWriter::OpenEncoder()). MP4 and Matroska carry
+        // the global header in the container so they don't need it.
+        // we are more or less doing what the example shows with the ffmpeg
+        // command line: https://ffmpeg.org/ffmpeg-bitstream-filters.html#dump_005fextra
+        AVBSFContext *tmp;
+        r = av_bsf_alloc(av_bsf_get_by_name("dump_extra"), &tmp);
+        if (r < 0) {
+            throw std::runtime_error("unable to allocate bitstream filter context: " + std::string(av_err2str(r)));
+        }
+        // use smart pointer to manage bitstream filter context
+        bsfc_ = av_pointer::bsf_context(tmp);
+
+        // finish setting up the bitstream filter
+        // first copy the codec parameters and time base
+        avcodec_parameters_copy(bsfc_->par_in, stream_->codecpar);
+        bsfc_->time_base_in = codec_time_base_;
+        // initialize teh bsf, abort if not
+        r = av_bsf_init(bsfc_.get());
+        if (r < 0) {
+            throw std::runtime_error("unable to initialize bitstream filter " + std::string(av_err2str(r)));
+        }
+    }
+
+    // open the output file
+    OpenOutput(config);
+
+    // container options that keep a file usable if it is never closed
+    AVDictionary *options = nullptr;
+    if (config.container() == containers::MP4) {
+        // write an empty moov up front and a fragment per keyframe, so
+        // nothing needs to be rewritten at the end
+        av_dict_set(&options, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+    } else if (config.container() == containers::MKV) {
+        // leave room for the cues after the header so they don't have to be
+        // appended after the last cluster
+        av_dict_set(&options, "reserve_index_space", std::to_string(CueSpace(config)).c_str(), 0);
+    }
+    r = avformat_write_header(format_context_.get(), &options);
+    av_dict_free(&options);
+    if (r < 0) {
+        throw std::runtime_error("unable to write header: " + std::string(av_err2str(r)));
+    }
+}
+
+FileSink::~FileSink()
+{
+    try {
+        Close();
+    } catch (const std::exception &e) {
+        std::cerr << "error closing video file: " << e.what() << std::endl;
+    }
+}
+
+void FileSink::Send(const AVPacket *pkt)
+{
+    // a rebased file starts with a keyframe
+    if (pts_offset_ == AV_NOPTS_VALUE) {
+        if (!(pkt->flags & AV_PKT_FLAG_KEY)) {
+            return;
+        }
+        pts_offset_ = pkt->pts;
+    }
+
+    // take our own reference, the payload stays shared with the other sinks
+    if (!format_context_) {
+        return;
+    }
+    if (av_packet_ref(packet_.get(), pkt) < 0) {
+        throw std::runtime_error("unable to reference packet for " + filename_);
+    }
+    if (pts_offset_) {
+        if (packet_->pts != AV_NOPTS_VALUE) {
+            packet_->pts -= pts_offset_;
+        }
+        if (packet_->dts != AV_NOPTS_VALUE) {
+            packet_->dts -= pts_offset_;
+        }
+    }
+
+    if (!bsfc_) {
+        WritePacket(packet_.get());
+        return;
+    }
+
+    // use "dump_extra" bitstream filter to add header back to keyframes
+    // this is used because we have to set global headers to allow for streaming
+    // the bsf takes ownership of the packet contents, leaving packet_ blank
+    StageTimer bsf_timer(stats_, PipelineStats::BITSTREAM_FILTER);
+    int r = av_bsf_send_packet(bsfc_.get(), packet_.get());
+    if (r < 0) {
+        av_packet_unref(packet_.get());
+        throw std::runtime_error("bitstream filter error for " + filename_ + ": " + std::string(av_err2str(r)));
+    }
+
+    // grab all available packets from the bitstream filter (a bsf can collect
+    // multiple packets before they are ready to be received)
+    while ((r = av_bsf_receive_packet(bsfc_.get(), filtered_packet_.get())) == 0) {
+        bsf_timer.Stop();
+        WritePacket(filtered_packet_.get());
+    }
+    if (r != AVERROR(EAGAIN) && r != AVERROR_EOF) {
+        throw std::runtime_error("bitstream filter error for " + filename_ + ": " + std::string(av_err2str(r)));
+    }
+}
+
+void FileSink::WritePacket(AVPacket *pkt)
+{
+    // the muxer may have picked its own stream time base (Matroska always
+    // uses milliseconds). it takes ownership of the packet contents
+    av_packet_rescale_ts(pkt, codec_time_base_, stream_->time_base);
+    StageTimer write_timer(stats_, PipelineStats::FILE_WRITE);
+    int r = av_interleaved_write_frame(format_context_.get(), pkt);
+    if (r < 0) {
+        throw std::runtime_error("error writing packet to " + filename_ + ": " + std::string(av_err2str(r)));
+    }
+}
+
+void FileSink::Close()
+{
+    // writes the trailer
+    format_context_.reset();
+
+    // wait for the write-behind thread and close the file, this throws if
+    // anything failed to reach the disk
+    if (disk_writer_) {
+        std::unique_ptr<DiskWriter> disk_writer = std::move(disk_writer_);
+        disk_writer->Close();
+    }
+}
+
+void FileSink::set_pipeline_stats(PipelineStats *stats)
+{
+    stats_ = stats;
+    if (disk_writer_) {
+        disk_writer_->set_pipeline_stats(stats);
+    }
+}
+
+void FileSink::OpenOutput(const CameraController::RecordingSessionConfig &config)
+{
+    DiskWriter::Options options;
+    options.direct_io = config.direct_io();
+    if (config.preallocate()) {
+        options.preallocate = ExpectedFileSize(config);
+    }
+    disk_writer_ = std::unique_ptr<DiskWriter>(new DiskWriter(filename_, options, stats_));
+
+    // the AVIO context takes ownership of its buffer
+    unsigned char *buffer = static_cast<unsigned char*>(av_malloc(kAvioBufferSize));
+    if (!buffer) {
+        throw std::runtime_error("unable to allocate AVIO buffer");
+    }
+    format_context_->pb = avio_alloc_context(buffer, kAvioBufferSize, 1, disk_writer_.get(), NULL,
+                                             &DiskWriter::AvioWrite, &DiskWriter::AvioSeek);
+    if (!format_context_->pb) {
+        av_free(buffer);
+        throw std::runtime_error("unable to allocate AVIO context for " + filename_);
+    }
+    format_context_->flags |= AVFMT_FLAG_CUSTOM_IO;
+}
+
+int64_t FileSink::CueSpace(const CameraController::RecordingSessionConfig &config) const
+{
+    int64_t seconds = config.duration().count();
+    if (config.fragment_by_hour()) {
+        seconds = std::min<int64_t>(seconds, 3600);
+    }
+    int64_t keyframes = seconds * config.target_fps() / std::max<int64_t>(config.gop_size(), 1) + 1;
+    return std::max(keyframes * kCueBytesPerKeyframe, kMinCueSpace);
+}
+
+int64_t FileSink::ExpectedFileSize(const CameraController::RecordingSessionConfig &config) const
+{
+    double bits_per_second = codec_parameters_->bit_rate;
+    if (bits_per_second <= 0) {
+        double bits_per_pixel = kExpectedBitsPerPixel;
+        if (codec_parameters_->codec_id == AV_CODEC_ID_FFV1) {
+            bits_per_pixel = codec_parameters_->bits_per_raw_sample * kExpectedLosslessRatio;
+        }
+        bits_per_second = bits_per_pixel * codec_parameters_->width * codec_parameters_->height *
+                          config.target_fps();
+    }
+
+    // hourly files are at most an hour long, otherwise the file lasts the session
+    int64_t seconds = config.duration().count();
+    if (config.fragment_by_hour()) {
+        seconds = std::min<int64_t>(seconds, 3600);
+    }
+    return std::min<int64_t>(bits_per_second / 8 * seconds, kMaxPreallocation);
+}
@@ -0,0 +1,139 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#ifndef FILE_SINK_H
+#define FILE_SINK_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "camera_controller.h"
+#include "packet_sink.h"
+#include "pipeline_stats.h"
+#include "video_writer.h"
+
+class DiskWriter;
+
+/**
+ * @brief PacketSink that muxes packets into a video file
+ *
+ * The container is picked from the recording session configuration. AVI
+ * output goes through the dump_extra bitstream filter to put the global
+ * header back in band; MP4 and Matroska are written in a form that stays
+ * usable if the file is never closed. The file itself is written through a
+ * DiskWriter.
+ */
+class FileSink : public PacketSink {
+public:
+    /**
+     * @brief create the file and write the container header
+     *
+     * throws std::runtime_error if the file can't be set up
+     *
+     * @param filename full path of the file, including extension
+     * @param codec_context opened encoder context producing the packets
+     * @param config recording session configuration
+     * @param stats histograms to record latency into, may be null
+     * @param rebase start the file at the first keyframe sent, whose pts
+     * becomes 0 in the file. Used when the encoder was running before the
+     * file was opened
+     */
+    FileSink(const std::string &filename, const AVCodecContext *codec_context,
+             const CameraController::RecordingSessionConfig &config, PipelineStats *stats = nullptr,
+             bool rebase = false);
+
+    /// close the file, errors are logged
+    ~FileSink();
+
+    FileSink(const FileSink&) = delete;
+    FileSink& operator=(const FileSink&) = delete;
+
+    /**
+     * @brief write a packet to the file
+     *
+     * throws std::runtime_error if the packet can't be filtered or muxed
+     *
+     * @param pkt packet, timestamps in the encoder time base
+     */
+    void Send(const AVPacket *pkt);
+
+    /**
+     * @brief write the trailer and close the file
+     *
+     * throws std::runtime_error if anything failed to reach the disk.
+     * Calling Close() again does nothing.
+     */
+    void Close();
+
+    /**
+     * @brief record file write latencies
+     * @param stats histograms to record into, or nullptr to disable
+     */
+    void set_pipeline_stats(PipelineStats *stats);
+
+    /// encoder pts of the first frame in the file, AV_NOPTS_VALUE until a rebased file has its keyframe
+    int64_t pts_offset() const {return pts_offset_;}
+
+private:
+    /**
+     * @brief open the output file through a DiskWriter
+     *
+     * sets up a custom AVIO context on format_context_ that writes into
+     * disk_writer_
+     *
+     * @param config recording session configuration
+     */
+    void OpenOutput(const CameraController::RecordingSessionConfig &config);
+
+    /**
+     * @brief estimate the size of the file
+     * @param config recording session configuration
+     * @return expected file size in bytes, used for preallocation
+     */
+    int64_t ExpectedFileSize(const CameraController::RecordingSessionConfig &config) const;
+
+    /**
+     * @brief space to reserve for the cues of a Matroska file
+     * @param config recording session configuration
+     * @return bytes, enough for one cue per expected keyframe
+     */
+    int64_t CueSpace(const CameraController::RecordingSessionConfig &config) const;
+
+    /// write a packet in the stream time base to the muxer, takes the packet contents. throws on error
+    void WritePacket(AVPacket *pkt);
+
+    std::string filename_;
+
+    /// encoder time base, the time base of packets passed to Send()
+    AVRational codec_time_base_;
+
+    /// subtracted from the timestamps of packets passed to Send()
+    int64_t pts_offset_;
+
+    /// copy of the encoder parameters
+    av_pointer::codec_parameters codec_parameters_;
+
+    /// write-behind file output used by format_context_'s AVIO context. declared
+    /// first so it is destroyed after format_context_ writes the trailer
+    std::unique_ptr<DiskWriter> disk_writer_;
+
+    /// muxer
+    av_pointer::format_context format_context_;
+
+    /// file output stream, freed with format_context_
+    AVStream *stream_ = nullptr;
+
+    /// bitstream filter, only used for AVI output
+    av_pointer::bsf_context bsfc_;
+
+    /// our reference to the packet being written, reused for every packet
+    av_pointer::packet packet_;
+
+    /// packet received from the bitstream filter, reused for every packet
+    av_pointer::packet filtered_packet_;
+
+    /// latency histograms, not owned. may be null
+    PipelineStats *stats_;
+};
+
+#endif
@@ -0,0 +1,127 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#include <stdexcept>
+
+#include "frame_drop_stats.h"
+
+void FrameDropStats::Reset(uint64_t max_block_id)
+{
+    max_block_id_ = max_block_id;
+    last_block_id_ = 0;
+
+    missing_blocks_ = 0;
+    grab_failures_ = 0;
+    buffer_underruns_ = 0;
+    failed_packets_ = 0;
+    failed_buffers_ = 0;
+}
+
+uint64_t FrameDropStats::AddBlockId(uint64_t block_id)
+{
+    if (block_id == 0 || (max_block_id_ && block_id > max_block_id_)) {
+        return 0;
+    }
+    const uint64_t last = last_block_id_;
+    last_block_id_ = block_id;
+    if (last == 0 || block_id == last) {
+        return 0;
+    }
+
+    uint64_t missing = 0;
+    if (block_id > last) {
+        missing = block_id - last - 1;
+    } else if (max_block_id_) {
+        // wrapped around, block IDs start again at 1
+        missing = (max_block_id_ - last) + (block_id - 1);
+    }
+    // otherwise the IDs went backwards without wrapping (e.g. the camera was
+    // reset), start counting from the new ID
+
+    if (missing) {
+        missing_blocks_.store(missing_blocks_.load(std::memory_order_relaxed) + missing,
+                              std::memory_order_relaxed);
+    }
+    return missing;
+}
+
+void FrameDropStats::SetStreamStatistics(uint64_t buffer_underruns, uint64_t failed_packets,
+                                         uint64_t failed_buffers)
+{
+    buffer_underruns_.store(buffer_underruns, std::memory_order_relaxed);
+    failed_packets_.store(failed_packets, std::memory_order_relaxed);
+    failed_buffers_.store(failed_buffers, std::memory_order_relaxed);
+}
+
+const std::string DropLog::MISSING_BLOCK = "missing_block";
+const std::string DropLog::GRAB_FAILED = "grab_failed";
+const std::string DropLog::TICK_GAP = "tick_gap";
+const std::string DropLog::QUEUE_OVERFLOW = "queue_overflow";
+const std::string DropLog::BUFFER_UNDERRUN = "buffer_underrun";
+const std::string DropLog::FAILED_PACKET = "failed_packet";
+const std::string DropLog::PACING = "pacing";
+
+DropLog::DropLog(const std::string &filename) :
+    file_(filename, std::ofstream::out)
+{
+    if (!file_) {
+        throw std::runtime_error("unable to open " + filename);
+    }
+    file_ << "# frame camera_timestamp block_id event count\n";
+}
+
+DropLog::~DropLog()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    WritePending();
+}
+
+void DropLog::Record(uint64_t frame, uint64_t timestamp, uint64_t block_id,
+                     const std::string &event, uint64_t count)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    const bool drop = event != PACING;
+    if (drop) {
+        events_++;
+    }
+
+    // a run of drops of the same kind on consecutive frames is one line
+    if (drop && pending_ && pending_event_ == event && frame <= pending_last_frame_ + 1) {
+        pending_last_frame_ = frame;
+        pending_count_ += count;
+        return;
+    }
+    WritePending();
+
+    pending_ = true;
+    pending_frame_ = frame;
+    pending_last_frame_ = frame;
+    pending_timestamp_ = timestamp;
+    pending_block_id_ = block_id;
+    pending_event_ = event;
+    pending_count_ = count;
+}
+
+void DropLog::Flush(uint64_t frame)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (pending_ && frame > pending_last_frame_ + 1) {
+        WritePending();
+    }
+    file_.flush();
+}
+
+uint64_t DropLog::events() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return events_;
+}
+
+void DropLog::WritePending()
+{
+    if (!pending_) {
+        return;
+    }
+    file_ << pending_frame_ << " " << pending_timestamp_ << " " << pending_block_id_ << " "
+          << pending_event_ << " " << pending_count_ << "\n";
+    pending_ = false;
+}
@@ -0,0 +1,165 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#ifndef FRAME_DROP_STATS_H
+#define FRAME_DROP_STATS_H
+
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+
+/**
+ * @brief counts frames lost between the camera and the grab loop
+ *
+ * FrameRateStats estimates drops from gaps in the camera timestamps. This
+ * adds the exact counts: block IDs that never arrived, grabs pylon reported
+ * as failed, and the stream grabber's own statistics (buffer underruns and
+ * failed packets), which show whether frames were lost on the wire or for
+ * lack of a free buffer.
+ *
+ * Like FrameRateStats only one thread may call Reset() and the Add/Set
+ * functions, the accessors may be called from any thread.
+ */
+class FrameDropStats {
+public:
+    FrameDropStats() = default;
+    FrameDropStats(const FrameDropStats&) = delete;
+    FrameDropStats& operator=(const FrameDropStats&) = delete;
+
+    /**
+     * @brief clear statistics for a new recording session
+     *
+     * @param max_block_id largest block ID before the camera wraps around to
+     * 1, 0 if block IDs don't wrap
+     */
+    void Reset(uint64_t max_block_id);
+
+    /**
+     * @brief add the block ID of a grab result, failed or not
+     * @param block_id block ID reported by the camera. 0 or an ID above
+     * max_block_id is taken to mean the ID isn't available and is ignored
+     * @return number of block IDs skipped since the previous one
+     */
+    uint64_t AddBlockId(uint64_t block_id);
+
+    /// count a grab result that didn't succeed
+    void AddGrabFailure() {grab_failures_.store(grab_failures_.load(std::memory_order_relaxed) + 1,
+                                                std::memory_order_relaxed);}
+
+    /**
+     * @brief update the stream grabber counters
+     *
+     * the counters are cumulative since the stream grabber was opened
+     */
+    void SetStreamStatistics(uint64_t buffer_underruns, uint64_t failed_packets, uint64_t failed_buffers);
+
+    /// block IDs that were never delivered this session
+    uint64_t missing_blocks() const {return missing_blocks_.load(std::memory_order_relaxed);}
+
+    /// grab results that didn't succeed this session
+    uint64_t grab_failures() const {return grab_failures_.load(std::memory_order_relaxed);}
+
+    /// times the stream grabber had no free buffer for a frame
+    uint64_t buffer_underruns() const {return buffer_underruns_.load(std::memory_order_relaxed);}
+
+    /// packets the stream grabber failed to receive, even after resends
+    uint64_t failed_packets() const {return failed_packets_.load(std::memory_order_relaxed);}
+
+    /// buffers the stream grabber returned incomplete
+    uint64_t failed_buffers() const {return failed_buffers_.load(std::memory_order_relaxed);}
+
+private:
+    // only touched by the recording thread
+    uint64_t max_block_id_ = 0;
+    uint64_t last_block_id_ = 0;    ///< previous valid block ID, 0 if none yet
+
+    // published for other threads
+    std::atomic<uint64_t> missing_blocks_ {0};
+    std::atomic<uint64_t> grab_failures_ {0};
+    std::atomic<uint64_t> buffer_underruns_ {0};
+    std::atomic<uint64_t> failed_packets_ {0};
+    std::atomic<uint64_t> failed_buffers_ {0};
+};
+
+/**
+ * @brief text log of the frame drops in a recording session
+ *
+ * Written next to the timestamp file, one line per drop event:
+ *
+ *     frame camera_timestamp block_id event count
+ *
+ * frame is the number of frames grabbed before the event and
+ * camera_timestamp is the timestamp of the frame that followed the gap (0
+ * if there wasn't one), so events can be matched up with the timestamp
+ * file and the video. Consecutive events of the same kind are merged into
+ * one line, which is written once the run ends. Drops are rare, so the
+ * file is written from the grab thread; Flush() is meant to be called
+ * about once a second.
+ *
+ * The encoder thread adds a PACING line whenever the EncoderGovernor
+ * changes how many frames go into the video. Its frame is the number of the
+ * frame in the timestamp file and count the new frame interval. Calls are
+ * serialized, so both threads can record.
+ */
+class DropLog {
+public:
+    /// event names used in the log
+    static const std::string MISSING_BLOCK;   ///< block IDs skipped by the camera stream
+    static const std::string GRAB_FAILED;     ///< pylon reported the grab as failed
+    static const std::string TICK_GAP;        ///< estimated from a gap in camera timestamps
+    static const std::string QUEUE_OVERFLOW;  ///< dropped because the encoder queue was full
+    static const std::string BUFFER_UNDERRUN; ///< stream grabber had no free buffer
+    static const std::string FAILED_PACKET;   ///< stream grabber lost packets
+    static const std::string PACING;          ///< the encoder now takes one of every count frames
+
+    /**
+     * @brief open the log, throws std::runtime_error on failure
+     * @param filename path of the log file
+     */
+    explicit DropLog(const std::string &filename);
+
+    /// write any pending event and close the file
+    ~DropLog();
+
+    DropLog(const DropLog&) = delete;
+    DropLog& operator=(const DropLog&) = delete;
+
+    /**
+     * @brief record a drop event
+     * @param frame number of frames grabbed before the event
+     * @param timestamp camera timestamp of the next frame, 0 if unknown
+     * @param block_id block ID of the next frame, 0 if unknown
+     * @param event one of the event names above
+     * @param count number of frames (or packets) affected
+     */
+    void Record(uint64_t frame, uint64_t timestamp, uint64_t block_id,
+                const std::string &event, uint64_t count);
+
+    /**
+     * @brief write out a run of events that has ended and flush the file
+     * @param frame number of frames grabbed so far
+     */
+    void Flush(uint64_t frame);
+
+    /// drop events recorded this session, counting merged ones separately
+    uint64_t events() const;
+
+private:
+    void WritePending();
+
+    mutable std::mutex mutex_;
+    std::ofstream file_;
+    uint64_t events_ = 0;
+
+    // event waiting to be merged with the next one of the same kind
+    bool pending_ = false;
+    uint64_t pending_frame_;        ///< frame of the first merged event
+    uint64_t pending_last_frame_;   ///< frame of the latest merged event
+    uint64_t pending_timestamp_;
+    uint64_t pending_block_id_;
+    std::string pending_event_;
+    uint64_t pending_count_;
+};
+
+#endif
@@ -0,0 +1,94 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#include <cstring>
+#include <stdexcept>
+
+extern "C" {
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+}
+
+#include "frame_pool.h"
+
+// row alignment used for pooled planes
+static const int kLineAlignment = 32;
+
+FramePool::FramePool(enum AVPixelFormat format, int width, int height, int chroma_fill) :
+    format_(format), width_(width), height_(height)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+    nb_planes_ = av_pix_fmt_count_planes(format);
+    if (!desc || nb_planes_ <= 0 || nb_planes_ > kMaxPlanes) {
+        throw std::invalid_argument("unsupported pixel format for frame pool");
+    }
+
+    // pad the width so every row starts on an aligned address
+    int padded_width = (width + kLineAlignment - 1) & ~(kLineAlignment - 1);
+    if (av_image_fill_linesizes(linesize_, format, padded_width) < 0) {
+        throw std::invalid_argument("unable to compute frame pool line sizes");
+    }
+
+    for (int p = 0; p < kMaxPlanes; ++p) {
+        pools_[p] = nullptr;
+    }
+
+    for (int p = 0; p < nb_planes_; ++p) {
+        // chroma planes may be subsampled vertically
+        int plane_height = height;
+        allocators_[p].pool = this;
+        allocators_[p].fill = -1;
+        if (p == 1 || p == 2) {
+            plane_height = -((-height) >> desc->log2_chroma_h);
+            if (chroma_fill >= 0 && chroma_fill <= 255) {
+                allocators_[p].fill = chroma_fill;
+            }
+        }
+
+        pools_[p] = av_buffer_pool_init2(linesize_[p] * plane_height, &allocators_[p], &FramePool::Alloc, NULL);
+        if (!pools_[p]) {
+            for (int i = 0; i < p; ++i) {
+                av_buffer_pool_uninit(&pools_[i]);
+            }
+            throw std::runtime_error("unable to allocate frame buffer pool");
+        }
+    }
+}
+
+FramePool::~FramePool()
+{
+    // av_buffer_pool_uninit() defers freeing the pool until every
+    // outstanding buffer has been returned
+    for (int p = 0; p < nb_planes_; ++p) {
+        av_buffer_pool_uninit(&pools_[p]);
+    }
+}
+
+void FramePool::Get(AVFrame *frame, bool with_luma)
+{
+    frame->format = format_;
+    frame->width = width_;
+    frame->height = height_;
+
+    for (int p = with_luma ? 0 : 1; p < nb_planes_; ++p) {
+        gets_++;
+        frame->buf[p] = av_buffer_pool_get(pools_[p]);
+        if (!frame->buf[p]) {
+            av_frame_unref(frame);
+            throw std::runtime_error("unable to get buffer from frame pool");
+        }
+        frame->data[p] = frame->buf[p]->data;
+        frame->linesize[p] = linesize_[p];
+    }
+}
+
+AVBufferRef* FramePool::Alloc(void *opaque, int size)
+{
+    PlaneAllocator *allocator = static_cast<PlaneAllocator*>(opaque);
+    allocator->pool->misses_++;
+
+    AVBufferRef *buf = av_buffer_alloc(size);
+    if (buf && allocator->fill >= 0) {
+        std::memset(buf->data, allocator->fill, size);
+    }
+    return buf;
+}
@@ -0,0 +1,97 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#ifndef FRAME_POOL_H
+#define FRAME_POOL_H
+
+#include <atomic>
+#include <cstdint>
+
+extern "C" {
+#include <libavutil/buffer.h>
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+}
+
+/**
+ * @brief pool of reusable frame buffers for a fixed frame geometry
+ *
+ * Wraps one AVBufferPool per image plane so that, once the pool has warmed
+ * up, frames can be populated without allocating new image buffers. Buffers
+ * are returned to the pool automatically when the last reference to them is
+ * released (for example when the encoder is done with a frame), so the pool
+ * can safely be destroyed while frames are still in flight.
+ *
+ * Optionally the chroma planes can be given a constant value. They are filled
+ * once when a buffer is first allocated and, since nothing writes to pooled
+ * chroma planes, never need to be touched again. This lets monochrome camera
+ * data be encoded as YUV420P without rewriting the chroma on every frame.
+ */
+class FramePool {
+public:
+    /**
+     * @brief construct a new FramePool
+     * @param format pixel format of pooled frames
+     * @param width frame width in pixels
+     * @param height frame height in pixels
+     * @param chroma_fill if in the range [0, 255], chroma planes of newly
+     * allocated buffers are filled with this value. negative values leave
+     * chroma uninitialized
+     */
+    FramePool(enum AVPixelFormat format, int width, int height, int chroma_fill = -1);
+
+    /**
+     * @brief destructor -- buffers still referenced by frames are freed
+     * when those frames release them
+     */
+    ~FramePool();
+
+    FramePool(const FramePool&) = delete;
+    FramePool& operator=(const FramePool&) = delete;
+
+    /**
+     * @brief populate a frame with pooled buffers
+     *
+     * the frame must not currently reference any buffers (e.g. it was just
+     * allocated or av_frame_unref() was called on it). Contents of the
+     * returned planes are undefined if the buffer is being recycled, except
+     * for chroma planes when a chroma fill value was given.
+     *
+     * @param frame frame to populate
+     * @param with_luma if false, plane 0 is left empty so the caller can
+     * attach its own luma buffer
+     */
+    void Get(AVFrame *frame, bool with_luma = true);
+
+    /// number of plane buffers served from the pool without allocating
+    uint64_t hits() const {return gets_ - misses_;}
+
+    /// number of plane buffers that had to be allocated
+    uint64_t misses() const {return misses_;}
+
+private:
+    /// maximum number of planes we handle (YUV420P has three)
+    static const int kMaxPlanes = 4;
+
+    enum AVPixelFormat format_; ///< pixel format of pooled frames
+    int width_;                 ///< frame width in pixels
+    int height_;                ///< frame height in pixels
+    int nb_planes_;             ///< number of planes for format_
+    int linesize_[kMaxPlanes];  ///< bytes per row for each plane
+    AVBufferPool *pools_[kMaxPlanes]; ///< one buffer pool per plane
+
+    /// passed to Alloc() so it knows which pool and plane it is allocating for
+    struct PlaneAllocator {
+        FramePool *pool;  ///< pool that owns the plane
+        int fill;         ///< value new buffers are filled with, or -1
+    };
+    PlaneAllocator allocators_[kMaxPlanes]; ///< allocator state for each plane
+
+    std::atomic<uint64_t> gets_ {0};   ///< plane buffers requested from the pool
+    std::atomic<uint64_t> misses_ {0}; ///< plane buffers allocated by the pool
+
+    /// allocation callback for AVBufferPool, only called on a pool miss.
+    /// opaque is a pointer to a PlaneAllocator
+    static AVBufferRef* Alloc(void *opaque, int size);
+};
+
+#endif
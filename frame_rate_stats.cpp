@@ -0,0 +1,78 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#include <algorithm>
+
+#include "frame_rate_stats.h"
+
+void FrameRateStats::Reset(size_t window, uint64_t tick_rate, unsigned int target_fps)
+{
+    intervals_.assign(std::max<size_t>(window, 1), 0);
+    next_ = 0;
+    count_ = 0;
+    window_ticks_ = 0;
+    last_ticks_ = 0;
+    expected_interval_ = target_fps ? tick_rate / target_fps : 0;
+
+    tick_rate_ = tick_rate;
+    avg_fps_ = 0.0;
+    min_interval_ = 0;
+    max_interval_ = 0;
+    frames_dropped_ = 0;
+    frames_ = 0;
+}
+
+uint64_t FrameRateStats::AddFrame(uint64_t ticks)
+{
+    // this is the only thread that writes the published values, so they can
+    // be read back relaxed and updated with plain stores
+    const uint64_t frames = frames_.load(std::memory_order_relaxed);
+    frames_.store(frames + 1, std::memory_order_relaxed);
+
+    const uint64_t last_ticks = last_ticks_;
+    last_ticks_ = ticks;
+    if (frames == 0 || ticks <= last_ticks) {
+        // nothing to compare the first frame against. a timestamp that
+        // didn't advance (e.g. the camera was reset) starts over as well
+        return 0;
+    }
+    const uint64_t interval = ticks - last_ticks;
+
+    // replace the oldest interval in the window, keeping the sum current
+    if (count_ == intervals_.size()) {
+        window_ticks_ -= intervals_[next_];
+    } else {
+        count_++;
+    }
+    intervals_[next_] = interval;
+    window_ticks_ += interval;
+    next_ = (next_ + 1) % intervals_.size();
+
+    // frames per second over the window is the number of intervals divided
+    // by the time they span
+    avg_fps_.store(count_ * static_cast<double>(tick_rate_.load(std::memory_order_relaxed)) / window_ticks_,
+                   std::memory_order_relaxed);
+
+    const uint64_t min_interval = min_interval_.load(std::memory_order_relaxed);
+    if (min_interval == 0 || interval < min_interval) {
+        min_interval_.store(interval, std::memory_order_relaxed);
+    }
+    if (interval > max_interval_.load(std::memory_order_relaxed)) {
+        max_interval_.store(interval, std::memory_order_relaxed);
+    }
+
+    // a gap of more than one and a half frame intervals means the camera
+    // skipped frames, round to the nearest number of missing frames
+    if (expected_interval_ && 2 * interval > 3 * expected_interval_) {
+        uint64_t missing = (interval + expected_interval_ / 2) / expected_interval_ - 1;
+        frames_dropped_.store(frames_dropped_.load(std::memory_order_relaxed) + missing,
+                              std::memory_order_relaxed);
+        return missing;
+    }
+    return 0;
+}
+
+double FrameRateStats::TicksToSeconds(uint64_t ticks) const
+{
+    const uint64_t tick_rate = tick_rate_.load(std::memory_order_relaxed);
+    return tick_rate ? ticks / static_cast<double>(tick_rate) : 0.0;
+}
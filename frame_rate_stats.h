@@ -0,0 +1,88 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#ifndef FRAME_RATE_STATS_H
+#define FRAME_RATE_STATS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief frame rate statistics computed from camera timestamps
+ *
+ * AddFrame() is called by the recording thread for every frame grabbed. It is
+ * O(1): inter-frame intervals are kept in a fixed size ring with a running
+ * sum, so nothing is shifted or re-summed per frame. Results are published
+ * through atomics so the status thread can read them at any time without
+ * ever blocking the recording thread.
+ *
+ * Only one thread may call Reset() and AddFrame(). The accessors may be
+ * called from any thread.
+ */
+class FrameRateStats {
+public:
+    FrameRateStats() = default;
+    FrameRateStats(const FrameRateStats&) = delete;
+    FrameRateStats& operator=(const FrameRateStats&) = delete;
+
+    /**
+     * @brief clear statistics for a new recording session
+     *
+     * must not be called concurrently with AddFrame()
+     *
+     * @param window number of intervals in the moving average
+     * @param tick_rate camera timestamp ticks per second
+     * @param target_fps requested frame rate, used to estimate dropped frames
+     */
+    void Reset(size_t window, uint64_t tick_rate, unsigned int target_fps);
+
+    /**
+     * @brief add a frame, recording thread only
+     * @param ticks camera timestamp of the frame
+     * @return estimated number of frames missing between the previous frame
+     * and this one, see frames_dropped()
+     */
+    uint64_t AddFrame(uint64_t ticks);
+
+    /// moving average frames per second over the last window intervals
+    double avg_fps() const {return avg_fps_.load(std::memory_order_relaxed);}
+
+    /// shortest interval between consecutive frames this session, in seconds
+    double min_interval() const {return TicksToSeconds(min_interval_.load(std::memory_order_relaxed));}
+
+    /// longest interval between consecutive frames this session, in seconds
+    double max_interval() const {return TicksToSeconds(max_interval_.load(std::memory_order_relaxed));}
+
+    /**
+     * @brief estimated number of frames the camera failed to deliver
+     *
+     * computed from gaps in the camera timestamps that are much longer than
+     * the target frame interval
+     */
+    uint64_t frames_dropped() const {return frames_dropped_.load(std::memory_order_relaxed);}
+
+    /// number of frames added this session
+    uint64_t frames() const {return frames_.load(std::memory_order_relaxed);}
+
+private:
+    double TicksToSeconds(uint64_t ticks) const;
+
+    // only touched by the recording thread
+    std::vector<uint64_t> intervals_;   ///< ring of the most recent inter-frame intervals, in ticks
+    size_t next_ = 0;                   ///< next slot in intervals_ to overwrite
+    size_t count_ = 0;                  ///< number of valid intervals in the ring
+    uint64_t window_ticks_ = 0;         ///< sum of the intervals in the ring
+    uint64_t last_ticks_ = 0;           ///< timestamp of the previous frame
+    uint64_t expected_interval_ = 0;    ///< target frame interval in ticks, 0 if unknown
+
+    // published for other threads
+    std::atomic<uint64_t> tick_rate_ {0};
+    std::atomic<double> avg_fps_ {0.0};
+    std::atomic<uint64_t> min_interval_ {0};
+    std::atomic<uint64_t> max_interval_ {0};
+    std::atomic<uint64_t> frames_dropped_ {0};
+    std::atomic<uint64_t> frames_ {0};
+};
+
+#endif
@@ -0,0 +1,104 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#ifndef FRAME_RING_H
+#define FRAME_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief bounded lock-free single producer / single consumer ring
+ *
+ * Used to hand grabbed frames from the acquisition thread to the encoding
+ * thread without either side ever blocking on the other. Exactly one thread
+ * may call TryPush() and exactly one (other) thread may call TryPop().
+ * Capacity is rounded up to a power of two so index wrapping is a mask.
+ *
+ * @tparam T element type, must be default constructible and movable
+ */
+template <typename T>
+class FrameRing {
+public:
+    /**
+     * @brief construct a new ring
+     * @param capacity minimum number of elements the ring can hold
+     */
+    explicit FrameRing(size_t capacity) : capacity_(RoundUp(capacity)),
+                                          mask_(capacity_ - 1),
+                                          slots_(capacity_) {}
+
+    FrameRing(const FrameRing&) = delete;
+    FrameRing& operator=(const FrameRing&) = delete;
+
+    /**
+     * @brief add an element to the ring (producer thread only)
+     * @param item element to move into the ring
+     * @return true if the element was added, false if the ring was full (item
+     * is left untouched in that case)
+     */
+    bool TryPush(T &&item)
+    {
+        const size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) == capacity_) {
+            return false;
+        }
+        slots_[tail & mask_] = std::move(item);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief remove the oldest element from the ring (consumer thread only)
+     * @param item destination for the element
+     * @return true if an element was removed, false if the ring was empty
+     */
+    bool TryPop(T &item)
+    {
+        const size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = std::move(slots_[head & mask_]);
+        // leave a default constructed element behind so resources held by
+        // the element (e.g. camera buffers) are returned promptly
+        slots_[head & mask_] = T();
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// number of elements currently queued. safe to call from any thread
+    size_t size() const
+    {
+        return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+    }
+
+    /// true if no elements are queued
+    bool empty() const {return size() == 0;}
+
+    /// maximum number of elements the ring can hold
+    size_t capacity() const {return capacity_;}
+
+private:
+    /// round n up to the next power of two
+    static size_t RoundUp(size_t n)
+    {
+        size_t c = 1;
+        while (c < n) {
+            c <<= 1;
+        }
+        return c;
+    }
+
+    const size_t capacity_;     ///< number of slots, always a power of two
+    const size_t mask_;         ///< capacity_ - 1, used to wrap indices
+    std::vector<T> slots_;      ///< element storage
+
+    // keep the producer and consumer indices on separate cache lines so the
+    // two threads don't false share
+    alignas(64) std::atomic<size_t> head_ {0}; ///< next slot to pop, written by consumer
+    alignas(64) std::atomic<size_t> tail_ {0}; ///< next slot to push, written by producer
+};
+
+#endif
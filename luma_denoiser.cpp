@@ -0,0 +1,276 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+// the row conversions use NEON or SSE2 where available. Defining
+// LUMA_DENOISER_NO_SIMD builds the scalar versions only, so the parity test
+// can check both
+#if !defined(LUMA_DENOISER_NO_SIMD) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#define LUMA_DENOISER_NEON
+#include <arm_neon.h>
+#elif !defined(LUMA_DENOISER_NO_SIMD) && defined(__SSE2__)
+#define LUMA_DENOISER_SSE2
+#include <emmintrin.h>
+#endif
+
+#include "luma_denoiser.h"
+
+// hqdn3d quantizes the difference between a value and its predecessor to
+// this many fractional bits before looking up the filter coefficient
+static int LutBits(int depth)
+{
+    return depth == 16 ? 8 : 4;
+}
+
+/*
+ * build a coefficient table the same way hqdn3d's precalc_coefs() does, so
+ * the output matches ffmpeg's filter exactly. The table is indexed by the
+ * quantized difference, offset by 256 << lut_bits
+ */
+static std::vector<int16_t> MakeTable(double strength, int lut_bits)
+{
+    std::vector<int16_t> table(512 << lut_bits);
+    const double gamma = std::log(0.25) / std::log(1.0 - std::min(strength, 252.0) / 255.0 - 0.00001);
+
+    for (int i = -(255 << lut_bits); i <= 255 << lut_bits; i++) {
+        // midpoint of the bin
+        double f = (i * (1 << (9 - lut_bits)) + (1 << (8 - lut_bits)) - 1) / 512.0;
+        double simil = std::max(0.0, 1.0 - std::fabs(f) / 255.0);
+        table[(256 << lut_bits) + i] = static_cast<int16_t>(std::lrint(std::pow(simil, gamma) * 256.0 * f));
+    }
+    // hqdn3d uses the first entry as an enable flag. It is also reached when
+    // a saturated 12 bit value wraps, so keep it for identical output
+    table[0] = strength != 0;
+    return table;
+}
+
+LumaDenoiser::LumaDenoiser(int width, int height, int depth, double spatial, double temporal,
+                           bool threaded) :
+    width_(width),
+    height_(height),
+    depth_(depth),
+    lut_bits_(LutBits(depth)),
+    spatial_table_(MakeTable(spatial, lut_bits_)),
+    temporal_table_(MakeTable(temporal, lut_bits_)),
+    spatial_enabled_(spatial != 0),
+    frame_ant_(static_cast<size_t>(width) * height),
+    line_ant_(width),
+    row_(width),
+    out_(width)
+{
+    if (width <= 0 || height <= 0 || depth < 8 || depth > 16) {
+        throw std::invalid_argument("unsupported denoiser frame format");
+    }
+    if (threaded) {
+        thread_ = std::thread(&LumaDenoiser::Run, this);
+    }
+}
+
+LumaDenoiser::~LumaDenoiser()
+{
+    if (thread_.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        thread_.join();
+    }
+}
+
+void LumaDenoiser::Start(const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride)
+{
+    if (!thread_.joinable()) {
+        Filter(src, src_stride, dst, dst_stride);
+        return;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        // frames depend on each other, finish the previous one first
+        cv_.wait(lock, [this] {return !job_pending_;});
+        job_ = Job {src, src_stride, dst, dst_stride};
+        job_pending_ = true;
+    }
+    cv_.notify_all();
+}
+
+void LumaDenoiser::Wait()
+{
+    if (!thread_.joinable()) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] {return !job_pending_;});
+}
+
+void LumaDenoiser::Run()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        cv_.wait(lock, [this] {return stop_ || job_pending_;});
+        if (!job_pending_) {
+            break;
+        }
+        Job job = job_;
+        lock.unlock();
+        Filter(job.src, job.src_stride, job.dst, job.dst_stride);
+        lock.lock();
+        job_pending_ = false;
+        cv_.notify_all();
+    }
+}
+
+/*
+ * hqdn3d's denoise_spatial()/denoise_temporal(), restructured to work a row
+ * at a time: the row is converted to fixed point in one pass, filtered, then
+ * converted back in another so the conversions can be vectorized. The
+ * filters themselves are recursive (each value depends on the previous one)
+ * and table driven, so they stay scalar.
+ */
+void LumaDenoiser::Filter(const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride)
+{
+    const int shift = 8 - lut_bits_;
+    const int16_t *spatial = spatial_table_.data() + (256 << lut_bits_);
+    const int16_t *temporal = temporal_table_.data() + (256 << lut_bits_);
+    auto lowpass = [shift](int prev, int cur, const int16_t *coef) -> uint32_t {
+        return cur + coef[(prev - cur) >> shift];
+    };
+
+    if (first_frame_) {
+        // the first frame is its own predecessor
+        for (int y = 0; y < height_; y++) {
+            LoadRow(src + static_cast<ptrdiff_t>(y) * src_stride, &frame_ant_[static_cast<size_t>(y) * width_]);
+        }
+        first_frame_ = false;
+    }
+
+    uint16_t *frame_ant = frame_ant_.data();
+    uint16_t *line_ant = line_ant_.data();
+    const uint16_t *row = row_.data();
+    uint32_t *out = out_.data();
+
+    for (int y = 0; y < height_; y++, src += src_stride, dst += dst_stride, frame_ant += width_) {
+        LoadRow(src, row_.data());
+
+        if (!spatial_enabled_) {
+            for (int x = 0; x < width_; x++) {
+                frame_ant[x] = out[x] = lowpass(frame_ant[x], row[x], temporal);
+            }
+        } else if (y == 0) {
+            // the first row has no row above it, only the left neighbour
+            uint32_t pixel_ant = row[0];
+            for (int x = 0; x < width_; x++) {
+                line_ant[x] = pixel_ant = lowpass(pixel_ant, row[x], spatial);
+                frame_ant[x] = out[x] = lowpass(frame_ant[x], pixel_ant, temporal);
+            }
+        } else {
+            uint32_t pixel_ant = row[0];
+            int x = 0;
+            for (; x < width_ - 1; x++) {
+                uint32_t tmp = lowpass(line_ant[x], pixel_ant, spatial);
+                line_ant[x] = tmp;
+                pixel_ant = lowpass(pixel_ant, row[x + 1], spatial);
+                frame_ant[x] = out[x] = lowpass(frame_ant[x], tmp, temporal);
+            }
+            uint32_t tmp = lowpass(line_ant[x], pixel_ant, spatial);
+            line_ant[x] = tmp;
+            frame_ant[x] = out[x] = lowpass(frame_ant[x], tmp, temporal);
+        }
+
+        StoreRow(out, dst);
+    }
+}
+
+void LumaDenoiser::LoadRow(const uint8_t *src, uint16_t *row) const
+{
+    // samples are scaled to 16 bits, with the rounding hqdn3d adds
+    const int scale = 16 - depth_;
+    const uint16_t round = ((1 << scale) - 1) >> 1;
+    int x = 0;
+
+    if (depth_ == 8) {
+#if defined(LUMA_DENOISER_NEON)
+        const uint16x8_t r = vdupq_n_u16(round);
+        for (; x + 8 <= width_; x += 8) {
+            vst1q_u16(row + x, vorrq_u16(vshll_n_u8(vld1_u8(src + x), 8), r));
+        }
+#elif defined(LUMA_DENOISER_SSE2)
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i r = _mm_set1_epi16(round);
+        for (; x + 16 <= width_; x += 16) {
+            __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(row + x), _mm_or_si128(_mm_unpacklo_epi8(zero, in), r));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(row + x + 8), _mm_or_si128(_mm_unpackhi_epi8(zero, in), r));
+        }
+#endif
+        for (; x < width_; x++) {
+            row[x] = (src[x] << 8) + round;
+        }
+        return;
+    }
+
+    const uint16_t *samples = reinterpret_cast<const uint16_t*>(src);
+#if defined(LUMA_DENOISER_NEON)
+    const uint16x8_t r = vdupq_n_u16(round);
+    const int16x8_t s = vdupq_n_s16(scale);
+    for (; x + 8 <= width_; x += 8) {
+        vst1q_u16(row + x, vaddq_u16(vshlq_u16(vld1q_u16(samples + x), s), r));
+    }
+#elif defined(LUMA_DENOISER_SSE2)
+    const __m128i r = _mm_set1_epi16(round);
+    const __m128i s = _mm_cvtsi32_si128(scale);
+    for (; x + 8 <= width_; x += 8) {
+        __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(samples + x));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(row + x), _mm_add_epi16(_mm_sll_epi16(in, s), r));
+    }
+#endif
+    for (; x < width_; x++) {
+        row[x] = (samples[x] << scale) + round;
+    }
+}
+
+void LumaDenoiser::StoreRow(const uint32_t *row, uint8_t *dst) const
+{
+    const int scale = 16 - depth_;
+    int x = 0;
+
+    if (depth_ == 8) {
+#if defined(LUMA_DENOISER_NEON)
+        for (; x + 8 <= width_; x += 8) {
+            uint16x8_t v = vcombine_u16(vshrn_n_u32(vld1q_u32(row + x), 8), vshrn_n_u32(vld1q_u32(row + x + 4), 8));
+            vst1_u8(dst + x, vmovn_u16(v));
+        }
+#elif defined(LUMA_DENOISER_SSE2)
+        // filtered 8 bit values are at most 0xFFFF, so the saturating packs
+        // never clip
+        for (; x + 16 <= width_; x += 16) {
+            const __m128i *in = reinterpret_cast<const __m128i*>(row + x);
+            __m128i lo = _mm_packs_epi32(_mm_srli_epi32(_mm_loadu_si128(in), 8),
+                                         _mm_srli_epi32(_mm_loadu_si128(in + 1), 8));
+            __m128i hi = _mm_packs_epi32(_mm_srli_epi32(_mm_loadu_si128(in + 2), 8),
+                                         _mm_srli_epi32(_mm_loadu_si128(in + 3), 8));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), _mm_packus_epi16(lo, hi));
+        }
+#endif
+        for (; x < width_; x++) {
+            dst[x] = static_cast<uint8_t>(row[x] >> 8);
+        }
+        return;
+    }
+
+    uint16_t *samples = reinterpret_cast<uint16_t*>(dst);
+#if defined(LUMA_DENOISER_NEON)
+    const int32x4_t s = vdupq_n_s32(-scale);
+    for (; x + 8 <= width_; x += 8) {
+        uint16x8_t v = vcombine_u16(vmovn_u32(vshlq_u32(vld1q_u32(row + x), s)),
+                                    vmovn_u32(vshlq_u32(vld1q_u32(row + x + 4), s)));
+        vst1q_u16(samples + x, v);
+    }
+#endif
+    for (; x < width_; x++) {
+        samples[x] = static_cast<uint16_t>(row[x] >> scale);
+    }
+}
@@ -0,0 +1,115 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#ifndef LUMA_DENOISER_H
+#define LUMA_DENOISER_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief spatial and temporal denoiser for a single luma plane
+ *
+ * Implements the same filter as ffmpeg's hqdn3d, and produces the same
+ * output, for the luma plane only. Chroma is left alone, which matches
+ * hqdn3d for our frames since monochrome cameras have neutral chroma.
+ * Running the filter directly on the frame avoids the libavfilter round
+ * trip and the extra frame allocation.
+ *
+ * Each frame is filtered against the state left by the previous one, so
+ * frames must be processed in order. Optionally the filter runs on a worker
+ * thread: Start() hands a frame to the worker and returns, Wait() blocks
+ * until that frame is done. This lets the caller encode the previous frame
+ * while the current one is being filtered.
+ */
+class LumaDenoiser {
+public:
+    /**
+     * @param width plane width in pixels
+     * @param height plane height in pixels
+     * @param depth bits per sample: 8 for one byte samples, 9 to 16 for
+     * right aligned two byte samples
+     * @param spatial spatial strength, as hqdn3d's luma_spatial
+     * @param temporal temporal strength, as hqdn3d's luma_tmp
+     * @param threaded run the filter on a worker thread
+     */
+    LumaDenoiser(int width, int height, int depth, double spatial, double temporal,
+                 bool threaded = false);
+
+    /// waits for a frame in progress and stops the worker thread
+    ~LumaDenoiser();
+
+    LumaDenoiser(const LumaDenoiser&) = delete;
+    LumaDenoiser& operator=(const LumaDenoiser&) = delete;
+
+    /**
+     * @brief filter a plane
+     *
+     * src and dst may be the same plane, in which case it is filtered in
+     * place. Both must stay valid until Wait() returns.
+     *
+     * @param src plane to filter
+     * @param src_stride bytes between rows of src
+     * @param dst filtered output
+     * @param dst_stride bytes between rows of dst
+     */
+    void Start(const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride);
+
+    /// wait for the frame passed to Start() to be filtered. returns immediately if not threaded
+    void Wait();
+
+    /// filter a plane and wait for the result
+    void Process(const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride)
+    {
+        Start(src, src_stride, dst, dst_stride);
+        Wait();
+    }
+
+private:
+    /// filter one plane on the calling thread
+    void Filter(const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride);
+
+    /// convert a row of samples to the filter's 16 bit fixed point
+    void LoadRow(const uint8_t *src, uint16_t *row) const;
+
+    /// convert a row of filtered values back to samples
+    void StoreRow(const uint32_t *row, uint8_t *dst) const;
+
+    /// worker thread main loop
+    void Run();
+
+    const int width_;
+    const int height_;
+    const int depth_;
+    const int lut_bits_;    ///< fractional bits of the quantized differences
+
+    /// lookup tables, indexed by the quantized difference to the previous value
+    std::vector<int16_t> spatial_table_;
+    std::vector<int16_t> temporal_table_;
+    bool spatial_enabled_;
+
+    std::vector<uint16_t> frame_ant_;   ///< filtered previous frame
+    std::vector<uint16_t> line_ant_;    ///< filtered previous row
+    std::vector<uint16_t> row_;         ///< current row in fixed point
+    std::vector<uint32_t> out_;         ///< current row after filtering
+    bool first_frame_ = true;
+
+    // worker thread state, guarded by mutex_
+    struct Job {
+        const uint8_t *src;
+        int src_stride;
+        uint8_t *dst;
+        int dst_stride;
+    };
+    Job job_;
+    bool job_pending_ = false;
+    bool stop_ = false;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::thread thread_;                ///< worker, only started if threaded
+};
+
+#endif
@@ -0,0 +1,261 @@
+/**
+ * @brief check LumaDenoiser's output against ffmpeg's hqdn3d filter
+ *
+ * Runs sequences of random, gradient and noisy gradient frames through both
+ * LumaDenoiser and a libavfilter graph with hqdn3d=luma_spatial=10, the
+ * filter VideoWriter used before it had LumaDenoiser, and compares the luma
+ * planes byte for byte at 8 and 12 bits. Several frames are run per
+ * sequence so the temporal filter is checked as well as the spatial one.
+ * The Makefile builds it twice, with and without LumaDenoiser's SIMD row
+ * conversions (LUMA_DENOISER_NO_SIMD).
+ *
+ * usage: luma-denoiser-test
+ *
+ * exits with 0 if every sequence matches
+ */
+
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavfilter/avfilter.h>
+#include <libavfilter/buffersink.h>
+#include <libavfilter/buffersrc.h>
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+}
+
+#include "luma_denoiser.h"
+
+// same strengths as VideoWriter. hqdn3d derives luma_tmp from luma_spatial
+// as 1.5 * luma_spatial when it isn't given
+static const char *kFilterArgs = "luma_spatial=10";
+static const double kSpatial = 10;
+static const double kTemporal = 15;
+
+// width isn't a multiple of the SIMD block size, so the scalar tail of each
+// row conversion also runs
+static const int kWidth = 650;
+static const int kHeight = 40;
+
+// frames per sequence
+static const int kFrames = 8;
+
+/// test frame contents
+enum class Pattern {RANDOM, GRADIENT, NOISY_GRADIENT};
+
+struct AVFrameDeleter {
+    void operator()(AVFrame *frame) const {av_frame_free(&frame);}
+};
+
+struct AVFilterGraphDeleter {
+    void operator()(AVFilterGraph *graph) const {avfilter_graph_free(&graph);}
+};
+
+/**
+ * @brief hqdn3d in a libavfilter graph, the reference output
+ *
+ * The graph runs on the yuv420p format of the same depth, which hqdn3d
+ * supports at every depth we use. hqdn3d filters the luma plane the same way
+ * whatever the format, and the chroma planes are set to neutral and ignored.
+ */
+class Hqdn3dGraph {
+public:
+    Hqdn3dGraph(int width, int height, int depth) :
+        width_(width), height_(height), depth_(depth),
+        pix_fmt_(depth == 8 ? AV_PIX_FMT_YUV420P : AV_PIX_FMT_YUV420P12),
+        graph_(avfilter_graph_alloc())
+    {
+        if (!graph_) {
+            throw std::runtime_error("unable to allocate filter graph");
+        }
+        avfilter_graph_set_auto_convert(graph_.get(), AVFILTER_AUTO_CONVERT_NONE);
+
+        std::string args = "video_size=" + std::to_string(width) + "x" + std::to_string(height) +
+            ":pix_fmt=" + std::to_string(pix_fmt_) + ":time_base=1/30:pixel_aspect=1/1";
+        AVFilterContext *hqdn3d = nullptr;
+        if (avfilter_graph_create_filter(&buffersrc_ctx_, avfilter_get_by_name("buffer"), "in",
+                                         args.c_str(), NULL, graph_.get()) < 0 ||
+            avfilter_graph_create_filter(&hqdn3d, avfilter_get_by_name("hqdn3d"), "hqdn3d",
+                                         kFilterArgs, NULL, graph_.get()) < 0 ||
+            avfilter_graph_create_filter(&buffersink_ctx_, avfilter_get_by_name("buffersink"), "out",
+                                         NULL, NULL, graph_.get()) < 0) {
+            throw std::runtime_error("unable to create filters");
+        }
+        if (avfilter_link(buffersrc_ctx_, 0, hqdn3d, 0) < 0 ||
+            avfilter_link(hqdn3d, 0, buffersink_ctx_, 0) < 0 ||
+            avfilter_graph_config(graph_.get(), NULL) < 0) {
+            throw std::runtime_error("unable to configure filter graph");
+        }
+    }
+
+    /**
+     * @brief filter a frame
+     * @param src luma samples, width * bytes per sample per row
+     * @param dst filtered luma samples, same layout as src
+     */
+    void Filter(const uint8_t *src, uint8_t *dst)
+    {
+        const size_t row_bytes = static_cast<size_t>(width_) * (depth_ > 8 ? 2 : 1);
+
+        std::unique_ptr<AVFrame, AVFrameDeleter> in(av_frame_alloc());
+        if (!in) {
+            throw std::runtime_error("unable to allocate frame");
+        }
+        in->format = pix_fmt_;
+        in->width = width_;
+        in->height = height_;
+        in->pts = pts_++;
+        if (av_frame_get_buffer(in.get(), 32) < 0) {
+            throw std::runtime_error("unable to allocate frame buffer");
+        }
+
+        for (int y = 0; y < height_; y++) {
+            std::memcpy(in->data[0] + static_cast<ptrdiff_t>(y) * in->linesize[0], src + y * row_bytes, row_bytes);
+        }
+        const int chroma_width = (width_ + 1) / 2;
+        for (int plane = 1; plane < 3; plane++) {
+            for (int y = 0; y < (height_ + 1) / 2; y++) {
+                uint8_t *row = in->data[plane] + static_cast<ptrdiff_t>(y) * in->linesize[plane];
+                if (depth_ == 8) {
+                    std::memset(row, 128, chroma_width);
+                } else {
+                    uint16_t *samples = reinterpret_cast<uint16_t*>(row);
+                    for (int x = 0; x < chroma_width; x++) {
+                        samples[x] = 1 << (depth_ - 1);
+                    }
+                }
+            }
+        }
+
+        if (av_buffersrc_add_frame_flags(buffersrc_ctx_, in.get(), 0) < 0) {
+            throw std::runtime_error("unable to send frame to filter graph");
+        }
+        std::unique_ptr<AVFrame, AVFrameDeleter> out(av_frame_alloc());
+        if (!out || av_buffersink_get_frame(buffersink_ctx_, out.get()) < 0) {
+            throw std::runtime_error("no frame from filter graph");
+        }
+        for (int y = 0; y < height_; y++) {
+            std::memcpy(dst + y * row_bytes, out->data[0] + static_cast<ptrdiff_t>(y) * out->linesize[0], row_bytes);
+        }
+    }
+
+private:
+    const int width_;
+    const int height_;
+    const int depth_;
+    const AVPixelFormat pix_fmt_;
+    std::unique_ptr<AVFilterGraph, AVFilterGraphDeleter> graph_;
+    AVFilterContext *buffersrc_ctx_ = nullptr;
+    AVFilterContext *buffersink_ctx_ = nullptr;
+    int64_t pts_ = 0;
+};
+
+/// fill a frame of right aligned samples with a test pattern
+static void FillFrame(std::vector<uint8_t> &frame, int depth, Pattern pattern, int index, std::mt19937 &rng)
+{
+    const int max = (1 << depth) - 1;
+    std::uniform_int_distribution<int> full(0, max);
+    std::uniform_int_distribution<int> noise(-max / 16, max / 16);
+
+    for (int y = 0; y < kHeight; y++) {
+        for (int x = 0; x < kWidth; x++) {
+            int value;
+            if (pattern == Pattern::RANDOM) {
+                value = full(rng);
+            } else {
+                // diagonal ramp over the full range, moving a little each frame
+                value = ((x + y + index * 5) % (kWidth + kHeight)) * max / (kWidth + kHeight - 1);
+                if (pattern == Pattern::NOISY_GRADIENT) {
+                    value = std::min(max, std::max(0, value + noise(rng)));
+                }
+            }
+
+            const size_t i = static_cast<size_t>(y) * kWidth + x;
+            if (depth == 8) {
+                frame[i] = static_cast<uint8_t>(value);
+            } else {
+                reinterpret_cast<uint16_t*>(frame.data())[i] = static_cast<uint16_t>(value);
+            }
+        }
+    }
+}
+
+/**
+ * @brief run one sequence through LumaDenoiser and hqdn3d
+ * @return true if every frame matches, mismatches are reported on stderr
+ */
+static bool RunSequence(int depth, Pattern pattern, bool threaded, const std::string &name)
+{
+    const int bytes = depth > 8 ? 2 : 1;
+    const size_t frame_bytes = static_cast<size_t>(kWidth) * kHeight * bytes;
+    std::vector<uint8_t> input(frame_bytes);
+    std::vector<uint8_t> expected(frame_bytes);
+    std::vector<uint8_t> actual(frame_bytes);
+    std::mt19937 rng(depth * 3 + static_cast<int>(pattern));
+
+    Hqdn3dGraph reference(kWidth, kHeight, depth);
+    LumaDenoiser denoiser(kWidth, kHeight, depth, kSpatial, kTemporal, threaded);
+
+    for (int frame = 0; frame < kFrames; frame++) {
+        FillFrame(input, depth, pattern, frame, rng);
+        reference.Filter(input.data(), expected.data());
+        denoiser.Process(input.data(), kWidth * bytes, actual.data(), kWidth * bytes);
+
+        if (std::memcmp(expected.data(), actual.data(), frame_bytes) != 0) {
+            for (size_t i = 0; i < frame_bytes / bytes; i++) {
+                int e = depth == 8 ? expected[i] : reinterpret_cast<const uint16_t*>(expected.data())[i];
+                int a = depth == 8 ? actual[i] : reinterpret_cast<const uint16_t*>(actual.data())[i];
+                if (e != a) {
+                    std::cerr << name << ": frame " << frame << " differs at x=" << i % kWidth
+                              << " y=" << i / kWidth << ": hqdn3d " << e << ", LumaDenoiser " << a << std::endl;
+                    break;
+                }
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    const struct {
+        Pattern pattern;
+        const char *name;
+    } patterns[] = {
+        {Pattern::RANDOM, "random"},
+        {Pattern::GRADIENT, "gradient"},
+        {Pattern::NOISY_GRADIENT, "noisy gradient"},
+    };
+
+    int failures = 0;
+    for (int depth : {8, 12}) {
+        for (const auto &p : patterns) {
+            for (bool threaded : {false, true}) {
+                std::string name = std::to_string(depth) + " bit " + p.name + (threaded ? ", threaded" : "");
+                bool ok;
+                try {
+                    ok = RunSequence(depth, p.pattern, threaded, name);
+                } catch (const std::exception &e) {
+                    std::cerr << name << ": " << e.what() << std::endl;
+                    ok = false;
+                }
+                std::cout << (ok ? "ok     " : "FAILED ") << name << std::endl;
+                failures += ok ? 0 : 1;
+            }
+        }
+    }
+
+    std::cout << argv[0] << ": " << (failures ? std::to_string(failures) + " failed" : "all passed") << std::endl;
+    return failures ? 1 : 0;
+}
@@ -22,36 +22,94 @@
 #include <getopt.h>
 #include <iomanip>
 #include <iostream>
+#include <memory>
+#include <sstream>
 #include <string>
 #include <thread>
+#include <vector>
 
 #include <systemd/sd-daemon.h>
 
 #include "external/inih/INIReader.h"
+#include "camera_group.h"
+#include "command_channel.h"
+#include "command_queue.h"
 #include "status_update.h"
 #include "system_info.h"
 #include "ltm_exceptions.h"
 #include "pylon_camera.h"
 #include "server_command.h"
+#include "thread_tuning.h"
 
 struct AppConfig
 {
     std::string output_dir;  ///< path to video capture directory
     std::string api_uri;     ///< URI for webservice API
+    std::string command_channel; ///< WebSocket URI for commands pushed by the server, empty to only poll
     std::string rtmp_uri;    ///< URI for rtmp publishing endpoint
     std::string location;    ///< device location string
+    std::string timestamp_format; ///< per-frame timestamp file format
+    bool direct_io;          ///< write video files with O_DIRECT
+    bool filter_thread;      ///< run the denoise filter on its own thread
+    bool warm_encoder;       ///< keep an encoder open between sessions
+    bool adaptive_pacing;    ///< encode fewer frames while the encoder can't keep up
+    bool preallocate;        ///< preallocate video files
+    uint64_t min_free_mb;    ///< free space to leave on the video capture filesystem
+    bool disk_throttle;      ///< degrade sessions that won't fit on the disk
+    unsigned int pre_trigger; ///< default seconds of video an armed session keeps
+    unsigned int pre_trigger_mb; ///< memory limit on the video an armed session keeps, per camera
+    long proxy_scale;        ///< default proxy downscale factor, 0 for no proxy
+    long proxy_crf;          ///< default proxy crf
+    std::string container;   ///< default video file container
+    std::string preview_name; ///< shared memory object name for the preview ring
+    double preview_fps;       ///< preview frame rate, 0 to disable the preview
+    std::vector<std::string> cameras; ///< camera serial numbers, empty for the first camera found
+    thread_tuning::ThreadPolicy grab_policy;   ///< scheduling for the camera grab threads
+    thread_tuning::ThreadPolicy encode_policy; ///< scheduling for the encode threads
+    thread_tuning::ThreadPolicy status_policy; ///< scheduling for the heartbeat and http threads
     int frame_width;         ///< frame width
     int frame_height;        ///< frame height
     std::chrono::seconds sleep_time; ///< time to wait between status update calls to API, in seconds
+    std::chrono::seconds update_timeout; ///< time to wait for the API to respond to a status update
+    std::chrono::seconds push_sleep_time; ///< time between status updates while the command channel is connected
+    std::chrono::seconds sample_interval; ///< time between system information samples
 };
 
 // default update interval (in seconds) if it isn't specified in the config file
 const unsigned int kDefaultSleep = 30;
 
+// default time (in seconds) to wait for the server to respond to a status update
+const unsigned int kDefaultUpdateTimeout = 10;
+
+// default free space (in megabytes) to leave on the video capture filesystem
+const long kDefaultMinFreeMb = 1024;
+
+// default pre-trigger video length (in seconds) and memory limit (in megabytes)
+const unsigned int kDefaultPreTrigger = 10;
+const unsigned int kDefaultPreTriggerMb = 64;
+
+// default constant rate factor of proxy videos
+const long kDefaultProxyCrf = 28;
+
+// default time (in seconds) between system information samples
+const unsigned int kDefaultSampleInterval = 5;
+
+// time to the next status update while the server is working through commands
+const std::chrono::seconds kShortSleep(1);
+
 // default frame dimensions
 const int kDefaultFrameWidth = 800;
 const int kDefaultFrameHeight = 800;
 
+// highest SCHED_FIFO priority accepted for the grab thread
+const int kMaxFifoPriority = 99;
+
+// shared memory object used for the preview ring if [preview] name isn't set
+const std::string kDefaultPreviewName = "/mba-preview";
+
+// [video] cameras value that selects every camera attached to the host
+const std::string kAllCameras = "all";
+
 // used to notify the program that a HUP signal was received
 std::atomic_bool hup_received = { false };
 
@@ -65,6 +123,27 @@ void signalHandler( int signum ) {
     }
 }
 
+/* split a comma separated list, trimming whitespace and dropping empty items
+ *
+ * @param list string to split
+ *
+ * @return list items
+ */
+std::vector<std::string> splitList(const std::string &list)
+{
+    std::vector<std::string> items;
+    std::stringstream ss(list);
+    std::string item;
+
+    while (std::getline(ss, item, ',')) {
+        size_t first = item.find_first_not_of(" \t");
+        if (first != std::string::npos) {
+            items.push_back(item.substr(first, item.find_last_not_of(" \t") - first + 1));
+        }
+    }
+    return items;
+}
+
 /* read a configuration file and set configuration variables
  *
  * @param config_path string containing the path to the configuration file
@@ -81,16 +160,77 @@ AppConfig readConfig(std::string config_path)
     }
     
     config.sleep_time = std::chrono::seconds(ini_reader.GetInteger("app", "update_interval", kDefaultSleep));
+    config.update_timeout = std::chrono::seconds(ini_reader.GetInteger("app", "update_timeout", kDefaultUpdateTimeout));
+    if (config.update_timeout.count() <= 0) {
+        throw std::runtime_error("[app] update_timeout must be positive");
+    }
+    config.sample_interval = std::chrono::seconds(ini_reader.GetInteger("app", "sample_interval", kDefaultSampleInterval));
+    if (config.sample_interval.count() <= 0) {
+        throw std::runtime_error("[app] sample_interval must be positive");
+    }
     config.output_dir = ini_reader.Get("disk", "video_capture_dir", "/tmp");
+    config.timestamp_format = ini_reader.Get("disk", "timestamp_format", timestamp_formats::TEXT);
+    config.direct_io = ini_reader.GetBoolean("disk", "direct_io", false);
+    config.preallocate = ini_reader.GetBoolean("disk", "preallocate", true);
+    long min_free_mb = ini_reader.GetInteger("disk", "min_free_mb", kDefaultMinFreeMb);
+    if (min_free_mb < 0) {
+        throw std::runtime_error("[disk] min_free_mb must not be negative");
+    }
+    config.min_free_mb = min_free_mb;
+    config.disk_throttle = ini_reader.GetBoolean("disk", "throttle", true);
+    config.container = ini_reader.Get("disk", "container", containers::AVI);
+    long pre_trigger = ini_reader.GetInteger("pre_trigger", "seconds", kDefaultPreTrigger);
+    long pre_trigger_mb = ini_reader.GetInteger("pre_trigger", "max_mb", kDefaultPreTriggerMb);
+    if (pre_trigger <= 0 || pre_trigger_mb <= 0) {
+        throw std::runtime_error("[pre_trigger] seconds and max_mb must be positive");
+    }
+    config.pre_trigger = pre_trigger;
+    config.pre_trigger_mb = pre_trigger_mb;
+    config.proxy_scale = ini_reader.GetInteger("proxy", "scale", 0);
+    config.proxy_crf = ini_reader.GetInteger("proxy", "crf", kDefaultProxyCrf);
     config.api_uri = ini_reader.Get("app", "api", "");
+    config.command_channel = ini_reader.Get("app", "command_channel", "");
+    // commands don't wait for the next update while the channel is up, so
+    // updates can be less frequent
+    config.push_sleep_time = std::chrono::seconds(
+        ini_reader.GetInteger("app", "push_update_interval", config.sleep_time.count()));
     config.rtmp_uri = ini_reader.Get("streaming", "rtmp", "");
+    config.preview_name = ini_reader.Get("preview", "name", kDefaultPreviewName);
+    config.preview_fps = ini_reader.GetReal("preview", "fps", 0);
+    if (config.preview_fps < 0) {
+        throw std::runtime_error("[preview] fps must not be negative");
+    }
+    if (config.preview_name.empty() || config.preview_name[0] != '/' ||
+        config.preview_name.find('/', 1) != std::string::npos) {
+        throw std::runtime_error("[preview] name must start with '/' and contain no other '/'");
+    }
 
     // TODO: consider making these required config parameters and remove defaults
     config.frame_width = ini_reader.GetInteger("video", "frame_width", kDefaultFrameWidth);
     config.frame_height = ini_reader.GetInteger("video", "frame_height", kDefaultFrameHeight);
 
+    // serial numbers of the cameras to record from, or "all"
+    config.cameras = splitList(ini_reader.Get("video", "cameras", ""));
+
     config.location = ini_reader.Get("app", "location", "");
 
+    // thread placement and scheduling, everything defaults to unrestricted
+    try {
+        config.grab_policy.cpus = thread_tuning::ParseCpuList(ini_reader.Get("performance", "grab_cpus", ""));
+        config.encode_policy.cpus = thread_tuning::ParseCpuList(ini_reader.Get("performance", "encode_cpus", ""));
+        config.status_policy.cpus = thread_tuning::ParseCpuList(ini_reader.Get("performance", "status_cpus", ""));
+    } catch (const std::invalid_argument &e) {
+        throw std::runtime_error("[performance] " + std::string(e.what()));
+    }
+    config.filter_thread = ini_reader.GetBoolean("performance", "filter_thread", false);
+    config.warm_encoder = ini_reader.GetBoolean("performance", "warm_encoder", true);
+    config.adaptive_pacing = ini_reader.GetBoolean("performance", "adaptive_pacing", true);
+    config.grab_policy.fifo_priority = ini_reader.GetInteger("performance", "grab_priority", 0);
+    if (config.grab_policy.fifo_priority < 0 || config.grab_policy.fifo_priority > kMaxFifoPriority) {
+        throw std::runtime_error("[performance] grab_priority must be between 0 and " +
+                                 std::to_string(kMaxFifoPriority));
+    }
+
     return config;
 }
 
@@ -131,6 +271,215 @@ std::string addStreamName(std::string rtmp_uri, std::string hostname)
     return uri;
 }
 
+/**
+ * @brief apply the configured thread policies to the cameras and log them
+ *
+ * if no cpus are configured for the recording threads and there is more than
+ * one camera, each camera gets its own share of the cpus
+ *
+ * @param cameras cameras to configure
+ * @param config app configuration
+ */
+void applyThreadPolicies(CameraGroup &cameras, const AppConfig &config)
+{
+    cameras.SetThreadPolicies(config.grab_policy, config.encode_policy);
+    if (config.grab_policy.cpus.empty() && config.encode_policy.cpus.empty()) {
+        cameras.PartitionCpus();
+    }
+
+    for (size_t i = 0; i < cameras.size(); i++) {
+        std::string name = cameras.name(i).empty() ? "camera" : "camera " + cameras.name(i);
+        std::clog << SD_INFO << name << " grab thread: "
+                  << thread_tuning::Describe(cameras.camera(i).grab_policy())
+                  << ", encode threads: " << thread_tuning::Describe(cameras.camera(i).encode_policy())
+                  << std::endl;
+    }
+}
+
+/**
+ * @brief apply the configured policy to the calling (heartbeat) thread and log it
+ *
+ * cpprestsdk starts its thread pool on the first request, so its threads
+ * inherit this policy as long as it is applied before the first status update
+ *
+ * @param config app configuration
+ */
+void applyStatusPolicy(const AppConfig &config)
+{
+    std::string error;
+    if (thread_tuning::Apply(config.status_policy, error)) {
+        std::clog << SD_INFO << "status thread: " << thread_tuning::Describe(config.status_policy) << std::endl;
+    } else {
+        std::clog << SD_WARNING << "status thread: " << error << std::endl;
+    }
+}
+
+/**
+ * @brief create a controller for each configured camera
+ *
+ * @param config app configuration
+ * @param nv_room_string output subdirectory name
+ * @param hostname host name, used for the rtmp stream name
+ *
+ * @return cameras to record from
+ */
+std::unique_ptr<CameraGroup> makeCameraGroup(const AppConfig &config,
+                                             const std::string &nv_room_string,
+                                             const std::string &hostname)
+{
+    std::unique_ptr<CameraGroup> cameras(new CameraGroup());
+    std::vector<std::string> serial_numbers = config.cameras;
+
+    if (serial_numbers.size() == 1 && serial_numbers[0] == kAllCameras) {
+        serial_numbers = PylonCameraController::EnumerateSerialNumbers();
+        if (serial_numbers.empty()) {
+            std::clog << SD_WARNING << "no cameras found, using the first camera to be attached" << std::endl;
+        }
+    }
+
+    if (serial_numbers.empty()) {
+        // no cameras configured, record from whichever camera pylon finds first
+        serial_numbers.push_back("");
+    }
+
+    for (const auto &serial_number : serial_numbers) {
+        std::clog << SD_INFO << "camera: "
+                  << (serial_number.empty() ? "first available" : serial_number) << std::endl;
+        cameras->Add(serial_number, std::unique_ptr<CameraController>(new PylonCameraController(
+            config.output_dir,
+            config.frame_width,
+            config.frame_height,
+            nv_room_string,
+            "",
+            serial_number)));
+    }
+    cameras->SetRtmpUri(addStreamName(config.rtmp_uri, hostname));
+    cameras->SetPreview(config.preview_name, config.preview_fps);
+    cameras->SetWarmEncoder(config.warm_encoder);
+    applyThreadPolicies(*cameras, config);
+
+    return cameras;
+}
+
+/**
+ * @brief create the command channel if one is configured
+ *
+ * @param config app configuration
+ * @param hostname device name sent to the server
+ * @param commands queue for the commands received
+ *
+ * @return command channel, null if it isn't configured or the URI is invalid
+ */
+std::unique_ptr<CommandChannel> makeCommandChannel(const AppConfig &config,
+                                                   const std::string &hostname,
+                                                   CommandQueue &commands)
+{
+    if (config.command_channel.empty()) {
+        return nullptr;
+    }
+    try {
+        return std::unique_ptr<CommandChannel>(
+            new CommandChannel(config.command_channel, hostname, config.location, commands));
+    } catch (const std::exception &e) {
+        // heartbeats still deliver commands, carry on without the channel
+        std::clog << SD_ERR << "invalid command_channel " << config.command_channel << ": "
+                  << e.what() << std::endl;
+        return nullptr;
+    }
+}
+
+/**
+ * @brief build the session configuration for a START or ARM command
+ *
+ * parameters the server sent that aren't valid are logged and left at their
+ * defaults. throws std::invalid_argument if a START has no valid duration,
+ * which has no default
+ *
+ * @param params parameters sent with the command
+ * @param app_config app configuration
+ * @param hostname file prefix used if the server didn't send one
+ * @param command command name, for log messages
+ *
+ * @return session configuration
+ */
+CameraController::RecordingSessionConfig makeSessionConfig(const RecordingParameters &params,
+                                                           const AppConfig &app_config,
+                                                           const std::string &hostname,
+                                                           const std::string &command)
+{
+    CameraController::RecordingSessionConfig config;
+    if (!params.file_prefix.empty()) {
+        config.set_file_prefix(params.file_prefix);
+    } else {
+        config.set_file_prefix(hostname);
+    }
+    // ARM may leave out the duration and session ID, an armed session takes
+    // them from the START that triggers it, see RecordingSessionConfig::MergeSession()
+    const bool arm = command == "ARM";
+    if (!arm || params.duration > 0) {
+        config.set_duration(std::chrono::seconds(params.duration));
+    }
+    config.set_fragment_by_hour(params.fragment_hourly);
+    if (!arm || params.session_id >= 0) {
+        config.set_session_id(params.session_id);
+    }
+    config.set_target_fps(params.target_fps);
+    config.set_apply_filter(params.apply_filter);
+    config.set_direct_io(app_config.direct_io);
+    config.set_filter_thread(app_config.filter_thread);
+    config.set_preallocate(app_config.preallocate);
+    config.set_min_free_mb(app_config.min_free_mb);
+    config.set_disk_throttle(app_config.disk_throttle);
+    config.set_adaptive_pacing(app_config.adaptive_pacing);
+    try {
+        if (!params.pixel_format.empty()) {
+            config.set_pixel_format(params.pixel_format);
+        }
+        if (!params.codec.empty()) {
+            config.set_codec(params.codec);
+        }
+        if (params.gop_size > 0) {
+            config.set_gop_size(params.gop_size);
+        }
+        if (params.max_b_frames >= 0) {
+            config.set_max_b_frames(params.max_b_frames);
+        }
+        if (params.encoder_threads >= 0) {
+            config.set_encoder_threads(params.encoder_threads);
+        }
+        config.set_sliced_threads(params.sliced_threads);
+        config.set_tune(params.tune);
+        config.set_rc_lookahead(params.rc_lookahead);
+        config.set_roi(std::max(params.roi_width, 0), std::max(params.roi_height, 0),
+                       params.roi_offset_x, params.roi_offset_y);
+        if (params.binning > 0) {
+            config.set_binning(params.binning);
+        }
+        if (params.decimation > 0) {
+            config.set_decimation(params.decimation);
+        }
+    } catch (const std::invalid_argument &e) {
+        std::clog << SD_ERR << "ignoring " << command << " parameter: " << e.what() << std::endl;
+    }
+    try {
+        config.set_proxy_scale(params.proxy_scale >= 0 ? params.proxy_scale : app_config.proxy_scale);
+        config.set_proxy_crf(params.proxy_crf >= 0 ? params.proxy_crf : app_config.proxy_crf);
+    } catch (const std::invalid_argument &e) {
+        std::clog << SD_ERR << "ignoring proxy setting: " << e.what() << std::endl;
+    }
+    try {
+        config.set_timestamp_format(app_config.timestamp_format);
+    } catch (const std::invalid_argument &e) {
+        std::clog << SD_ERR << "ignoring timestamp_format setting: " << e.what() << std::endl;
+    }
+    try {
+        config.set_container(params.container.empty() ? app_config.container : params.container);
+    } catch (const std::invalid_argument &e) {
+        std::clog << SD_ERR << "ignoring container setting: " << e.what() << std::endl;
+    }
+    return config;
+}
+
 /**
  * @brief program main
  *
@@ -147,7 +496,9 @@ int main(int argc, char **argv)
     std::string config_path; ///< path to configuration file, will be passed as a program argument
 
     SysInfo system_info;     ///< information about the host system (memory, disk, load)
-    bool short_sleep;        ///< indicates that we don't want to sleep full amount before next iteration
+    CommandQueue commands;   ///< commands from the server, declared first so it outlives their sources
+    std::unique_ptr<StatusUpdater> status_updater; ///< sends heartbeats and receives commands
+    std::unique_ptr<CommandChannel> command_channel; ///< receives commands pushed by the server, if configured
 
     std::string nv_room_string;
 
@@ -185,7 +536,7 @@ int main(int argc, char **argv)
     try {
         appConfig = readConfig(config_path);
     } catch (const std::runtime_error& error) {
-        std::clog << SD_ERR << "Unable to read config file\n";
+        std::clog << SD_ERR << "Unable to read config file: " << error.what() << "\n";
         if (errno > 0) {
             std::clog <<  std::strerror(errno) << std::endl;
         }
@@ -214,31 +565,35 @@ int main(int argc, char **argv)
 
     nv_room_string = getNvBoardString(system_info.hostname(), appConfig.location);
 
-    PylonCameraController camera_controller(
-        appConfig.output_dir,
-        appConfig.frame_width,
-        appConfig.frame_height,
-        nv_room_string,
-        addStreamName(appConfig.rtmp_uri, system_info.hostname())
-    );
+    applyStatusPolicy(appConfig);
+    // the sampler inherits the status policy's cpus
+    system_info.Start(appConfig.sample_interval);
+    std::unique_ptr<CameraGroup> cameras = makeCameraGroup(appConfig, nv_room_string, system_info.hostname());
+    status_updater = std::unique_ptr<StatusUpdater>(
+        new StatusUpdater(appConfig.api_uri, appConfig.location, appConfig.update_timeout, commands));
+    command_channel = makeCommandChannel(appConfig, system_info.hostname(), commands);
     
     // notify systemd that we're done initializing
     sd_notify(0, "READY=1");
+
+    // time to send the next status update
+    auto next_update = std::chrono::steady_clock::now();
     
-    // main loop
+    // main loop. status updates go out on their own schedule, and commands
+    // are handled as soon as the server's response arrives
     while (1) {
-        short_sleep = false;
     
         // if we've received a HUP signal, and we aren't busy recording then
         // reload the configuration file. If we are recording, we won't reload
         // the config until we've stopped.
-        if (hup_received && !camera_controller.recording()) {
+        if (hup_received && !cameras->recording()) {
+            std::vector<std::string> previous_cameras = appConfig.cameras;
             system_info.ClearMounts();
             try {
                 appConfig = readConfig(config_path);
                 nv_room_string = getNvBoardString(system_info.hostname(), appConfig.location);
             } catch (const std::runtime_error& error) {
-                std::clog << SD_ERR << "Unable to read config file during reload\n";
+                std::clog << SD_ERR << "Unable to read config file during reload: " << error.what() << "\n";
                 if (errno > 0) {
                     std::clog <<  std::strerror(errno) << std::endl;
                 }
@@ -252,82 +607,131 @@ int main(int argc, char **argv)
                 std::clog << SD_ERR << e.what() << std::endl;
                 return 1;
             }
-            camera_controller.SetDirectory(appConfig.output_dir);
-            camera_controller.SetFrameHeight(appConfig.frame_height);
-            camera_controller.SetFrameWidth(appConfig.frame_width);
-            camera_controller.SetNvRoomString(nv_room_string);
-            camera_controller.SetRtmpUri(addStreamName(appConfig.rtmp_uri, system_info.hostname()));
+            if (appConfig.cameras != previous_cameras) {
+                // the set of cameras changed, replace the controllers. this
+                // discards the state of the last session, which is fine
+                // since the server has to start a new session anyway
+                cameras = makeCameraGroup(appConfig, nv_room_string, system_info.hostname());
+            } else {
+                cameras->SetDirectory(appConfig.output_dir);
+                cameras->SetFrameHeight(appConfig.frame_height);
+                cameras->SetFrameWidth(appConfig.frame_width);
+                cameras->SetNvRoomString(nv_room_string);
+                cameras->SetRtmpUri(addStreamName(appConfig.rtmp_uri, system_info.hostname()));
+                cameras->SetPreview(appConfig.preview_name, appConfig.preview_fps);
+                cameras->SetWarmEncoder(appConfig.warm_encoder);
+                applyThreadPolicies(*cameras, appConfig);
+            }
+            applyStatusPolicy(appConfig);
+            // pick up the new interval and cpus, and sample the new mount
+            system_info.Sample();
+            system_info.Start(appConfig.sample_interval);
+            if (appConfig.api_uri != status_updater->api_uri() ||
+                appConfig.location != status_updater->location()) {
+                status_updater = std::unique_ptr<StatusUpdater>(
+                    new StatusUpdater(appConfig.api_uri, appConfig.location, appConfig.update_timeout, commands));
+                command_channel.reset();
+            }
+            if (!command_channel || command_channel->uri() != appConfig.command_channel) {
+                command_channel = makeCommandChannel(appConfig, system_info.hostname(), commands);
+            }
 
             hup_received = false;
         }
-    
-        // gather updated system information
-        system_info.Sample(); 
-        
-        // send updated status to the server
-        ServerCommand* svr_command = send_status_update(system_info, camera_controller, appConfig.api_uri, appConfig.location);
-
-        switch (svr_command->command()) {
-            case CommandTypes::NOOP:
-                std::clog << SD_DEBUG << "NOOP" << std::endl;
-                if (camera_controller.live_streaming()) {
-                    camera_controller.SetStreaming(false);
+
+        if (std::chrono::steady_clock::now() >= next_update) {
+            // send updated status to the server
+            if (!status_updater->Send(system_info, *cameras)) {
+                std::clog << SD_WARNING << "previous status update still in progress, skipping" << std::endl;
+            }
+
+            // (re)connect a dropped command channel along with the update.
+            // while it is down, commands only arrive with status updates
+            if (command_channel) {
+                command_channel->Connect();
+            }
+            next_update = std::chrono::steady_clock::now() +
+                          (command_channel && command_channel->connected() ? appConfig.push_sleep_time
+                                                                           : appConfig.sleep_time);
+        }
+
+        // wait for a command, from a status update response or the command
+        // channel, or until it is time for the next update
+        std::unique_ptr<ServerCommand> svr_command = commands.WaitForCommand(next_update);
+        if (!svr_command) {
+            continue;
+        }
+        bool short_sleep = false;   // send the next update soon, the server is working through commands
+
+        // a command the server sent with invalid parameters is logged and
+        // ignored, it must not take down the client
+        try {
+            switch (svr_command->command()) {
+                case CommandTypes::NOOP:
+                    std::clog << SD_DEBUG << "NOOP" << std::endl;
+                    if (cameras->live_streaming()) {
+                        cameras->SetStreaming(false);
+                    }
+                    break;
+                case CommandTypes::START_RECORDING:
+                {
+                    std::clog << SD_DEBUG << "START_RECORDING" << std::endl;
+
+                    // cast the svr_command pointer to a RecordCommand* so we can
+                    // access the parameters() method.
+                    RecordingParameters recording_parameters = static_cast<RecordCommand*>(svr_command.get())->parameters();
+
+                    CameraController::RecordingSessionConfig config = makeSessionConfig(
+                        recording_parameters, appConfig, system_info.hostname(), "START");
+                    cameras->StartRecording(config);
+                    short_sleep = true;
+                    break;
                 }
-                break;
-            case CommandTypes::START_RECORDING:
-            {
-                std::clog << SD_DEBUG << "START_RECORDING" << std::endl;
-
-                // cast the svr_command pointer to a RecordCommand* so we can
-                // access the parameters() method.
-                RecordingParameters recording_parameters = static_cast<RecordCommand*>(svr_command)->parameters();
-
-                // setup recording session configuration
-                PylonCameraController::RecordingSessionConfig config;
-                if (!recording_parameters.file_prefix.empty()) {
-                    config.set_file_prefix(recording_parameters.file_prefix);
-                } else {
-                    config.set_file_prefix(system_info.hostname());
+                case CommandTypes::ARM_RECORDING:
+                {
+                    std::clog << SD_DEBUG << "ARM_RECORDING" << std::endl;
+
+                    // the next START triggers the armed session, see CameraController::Arm()
+                    RecordingParameters recording_parameters = static_cast<RecordCommand*>(svr_command.get())->parameters();
+                    CameraController::RecordingSessionConfig config = makeSessionConfig(
+                        recording_parameters, appConfig, system_info.hostname(), "ARM");
+                    config.set_pre_trigger(recording_parameters.pre_trigger > 0 ?
+                                           recording_parameters.pre_trigger : appConfig.pre_trigger);
+                    config.set_pre_trigger_mb(appConfig.pre_trigger_mb);
+
+                    if (!cameras->Arm(config)) {
+                        std::clog << SD_WARNING << "unable to arm, already recording" << std::endl;
+                    }
+                    short_sleep = true;
+                    break;
                 }
-                config.set_duration(std::chrono::seconds(recording_parameters.duration));
-                config.set_fragment_by_hour(recording_parameters.fragment_hourly);
-                config.set_session_id(recording_parameters.session_id);
-                config.set_target_fps(recording_parameters.target_fps);
-                config.set_apply_filter(recording_parameters.apply_filter);
-
-                camera_controller.StartRecording(config);
-                short_sleep = true;
-                break;
+                case CommandTypes::STOP_RECORDING:
+                    std::clog << SD_DEBUG << "STOP_RECORDING" << std::endl;
+                    cameras->StopRecording();
+                    short_sleep = true;
+                    break;
+                case CommandTypes::COMPLETE:
+                    std::clog << SD_DEBUG << "COMPLETE" << std::endl;
+                    cameras->ClearSession();
+                    short_sleep = true;
+                    break;
+                case CommandTypes::STREAM:
+                    std::clog << SD_DEBUG << "STREAM" << std::endl;
+                    if (!cameras->live_streaming()) {
+                        cameras->SetStreaming(true);
+                    }
+                    break;
+                case CommandTypes::UNKNOWN:
+                    std::clog << SD_ERR << "Server responded with unknown command" << std::endl;
+                    break;
             }
-            case CommandTypes::STOP_RECORDING:
-                std::clog << SD_DEBUG << "STOP_RECORDING" << std::endl;
-                camera_controller.StopRecording();
-                short_sleep = true;
-                break;
-            case CommandTypes::COMPLETE:
-                std::clog << SD_DEBUG << "COMPLETE" << std::endl;
-                camera_controller.ClearSession();
-                short_sleep = true;
-                break;
-            case CommandTypes::STREAM:
-                std::clog << SD_DEBUG << "STREAM" << std::endl;
-                if (!camera_controller.live_streaming()) {
-                    camera_controller.SetStreaming(true);
-                }
-                break;
-            case CommandTypes::UNKNOWN:
-                std::clog << SD_ERR << "Server responded with unknown command" << std::endl;
-                break;
+        } catch (const std::invalid_argument &e) {
+            std::clog << SD_ERR << "ignoring invalid server command: " << e.what() << std::endl;
         }
 
-        free(svr_command);
-
-        // sleep until next iteration. if we are actively working commands,
-        // don't sleep very long
+        // if we are actively working commands, don't wait very long for the next one
         if (short_sleep) {
-            std::this_thread::sleep_for(std::chrono::seconds(1));
-        } else {
-            std::this_thread::sleep_for(std::chrono::seconds(appConfig.sleep_time));
+            next_update = std::min(next_update, std::chrono::steady_clock::now() + kShortSleep);
         }
     }
     return 0;
@@ -0,0 +1,60 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#include <cmath>
+
+#include "packet_ring.h"
+
+PacketRing::PacketRing(AVRational time_base, double seconds, size_t max_bytes) :
+    span_(std::llround(seconds / av_q2d(time_base))),
+    max_bytes_(max_bytes)
+{
+}
+
+void PacketRing::Send(const AVPacket *pkt)
+{
+    const bool keyframe = pkt->flags & AV_PKT_FLAG_KEY;
+    if (packets_.empty() && !keyframe) {
+        return;
+    }
+
+    av_pointer::packet packet(av_packet_alloc());
+    if (!packet || av_packet_ref(packet.get(), pkt) < 0) {
+        return;
+    }
+    if (keyframe) {
+        keyframe_pts_.push_back(packet->pts);
+    }
+    bytes_ += packet->size;
+    const int64_t newest_pts = packet->pts;
+    packets_.push_back(std::move(packet));
+
+    // the groups of pictures after the first already cover the span
+    while (keyframe_pts_.size() > 1 && newest_pts - keyframe_pts_[1] >= span_) {
+        DropGop();
+    }
+    // over the memory limit, keep the newest and drop the rest. A single
+    // group of pictures that doesn't fit is dropped as well, the ring
+    // starts again at the next keyframe
+    while (bytes_ > max_bytes_ && !packets_.empty()) {
+        DropGop();
+    }
+}
+
+void PacketRing::DropGop()
+{
+    do {
+        bytes_ -= packets_.front()->size;
+        packets_.pop_front();
+    } while (!packets_.empty() && !(packets_.front()->flags & AV_PKT_FLAG_KEY));
+    keyframe_pts_.pop_front();
+}
+
+void PacketRing::Drain(PacketSink &sink)
+{
+    for (const av_pointer::packet &packet : packets_) {
+        sink.Send(packet.get());
+    }
+    packets_.clear();
+    keyframe_pts_.clear();
+    bytes_ = 0;
+}
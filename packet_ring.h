@@ -0,0 +1,77 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#ifndef PACKET_RING_H
+#define PACKET_RING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+#include "packet_sink.h"
+#include "video_writer.h"
+
+/**
+ * @brief PacketSink that keeps the most recent encoded packets
+ *
+ * Used by an armed recording session to hold the video from before the
+ * session was triggered. The ring always starts at a keyframe so it can be
+ * written to a file as is. Whole groups of pictures are dropped from the
+ * front once the rest still cover the pre-trigger duration, or once the
+ * packets take up more than the memory limit.
+ *
+ * Packets are held by reference, sharing their payload with the other sinks.
+ */
+class PacketRing : public PacketSink {
+public:
+    /**
+     * @param time_base time base of the packets' timestamps
+     * @param seconds video to keep, in seconds
+     * @param max_bytes limit on the payload held, the ring can be shorter
+     * than seconds if the video doesn't fit
+     */
+    PacketRing(AVRational time_base, double seconds, size_t max_bytes);
+    ~PacketRing() = default;
+
+    PacketRing(const PacketRing&) = delete;
+    PacketRing& operator=(const PacketRing&) = delete;
+
+    /**
+     * @brief add a packet
+     *
+     * packets before the first keyframe are discarded
+     *
+     * @param pkt packet, timestamps in the encoder time base
+     */
+    void Send(const AVPacket *pkt);
+
+    /**
+     * @brief send every packet to another sink, oldest first, and empty the ring
+     * @param sink sink to receive the packets
+     */
+    void Drain(PacketSink &sink);
+
+    /// pts of the oldest packet (a keyframe), AV_NOPTS_VALUE if empty
+    int64_t start_pts() const {return packets_.empty() ? AV_NOPTS_VALUE : packets_.front()->pts;}
+
+    /// payload bytes held
+    size_t bytes() const {return bytes_;}
+
+    /// number of packets held
+    size_t size() const {return packets_.size();}
+
+private:
+    /// drop the oldest group of pictures, up to the next keyframe
+    void DropGop();
+
+    int64_t span_;      ///< pts span to keep
+    size_t max_bytes_;
+    size_t bytes_ = 0;
+    std::deque<av_pointer::packet> packets_;
+    std::deque<int64_t> keyframe_pts_;  ///< pts of each keyframe in packets_
+};
+
+#endif
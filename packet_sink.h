@@ -0,0 +1,31 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#ifndef PACKET_SINK_H
+#define PACKET_SINK_H
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+/**
+ * @brief destination for encoded packets
+ *
+ * VideoWriter encodes each frame once and hands every packet to each of its
+ * sinks (the video file, the live stream, ...). Packets are passed as const:
+ * a sink that needs to keep a packet, or change its timestamps, takes its own
+ * reference with av_packet_ref() so the payload is shared between sinks
+ * rather than copied. Each sink converts timestamps from the encoder time
+ * base to whatever its output needs.
+ */
+class PacketSink {
+public:
+    virtual ~PacketSink() {}
+
+    /**
+     * @brief deliver an encoded packet
+     * @param pkt packet, timestamps in the encoder time base
+     */
+    virtual void Send(const AVPacket *pkt) = 0;
+};
+
+#endif
@@ -0,0 +1,103 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#include <algorithm>
+#include <cmath>
+
+#include "pipeline_stats.h"
+
+const size_t LatencyHistogram::kNumBuckets;
+
+void LatencyHistogram::Record(uint64_t nanoseconds)
+{
+    buckets_[BucketIndex(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+
+    uint64_t current = max_.load(std::memory_order_relaxed);
+    while (nanoseconds > current &&
+           !max_.compare_exchange_weak(current, nanoseconds, std::memory_order_relaxed)) {
+    }
+}
+
+uint64_t LatencyHistogram::Percentile(double fraction) const
+{
+    // take a snapshot of the counts so the total matches the buckets we walk
+    std::array<uint64_t, kNumBuckets> counts;
+    uint64_t total = 0;
+    for (size_t i = 0; i < kNumBuckets; i++) {
+        counts[i] = buckets_[i].load(std::memory_order_relaxed);
+        total += counts[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    uint64_t rank = static_cast<uint64_t>(std::ceil(std::min(std::max(fraction, 0.0), 1.0) * total));
+    rank = std::max<uint64_t>(rank, 1);
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kNumBuckets; i++) {
+        seen += counts[i];
+        if (seen >= rank) {
+            // the bucket's upper bound may overshoot the largest value seen
+            return std::min(BucketUpperBound(i), max());
+        }
+    }
+    return max();
+}
+
+void LatencyHistogram::Reset()
+{
+    for (auto &bucket : buckets_) {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+    count_.store(0, std::memory_order_relaxed);
+    max_.store(0, std::memory_order_relaxed);
+}
+
+size_t LatencyHistogram::BucketIndex(uint64_t value)
+{
+    if (value < 4) {
+        return value;
+    }
+    // exponent of the highest set bit (>= 2) and the next two bits below it
+    const int exponent = 63 - __builtin_clzll(value);
+    const size_t sub_bucket = (value >> (exponent - 2)) & 3;
+    return 4 + (exponent - 2) * 4 + sub_bucket;
+}
+
+uint64_t LatencyHistogram::BucketUpperBound(size_t index)
+{
+    if (index < 4) {
+        return index;
+    }
+    const int exponent = (index - 4) / 4 + 2;
+    const uint64_t sub_bucket = (index - 4) % 4;
+    // bucket covers [(4 + sub) << (exponent - 2), (5 + sub) << (exponent - 2))
+    return ((5 + sub_bucket) << (exponent - 2)) - 1;
+}
+
+const char* PipelineStats::StageName(Stage stage)
+{
+    switch (stage) {
+        case GRAB_WAIT: return "grab_wait";
+        case ENCODE_FRAME: return "encode_frame";
+        case COPY: return "copy";
+        case FILTER: return "filter";
+        case SEND_FRAME: return "send_frame";
+        case RECEIVE_PACKET: return "receive_packet";
+        case BITSTREAM_FILTER: return "bitstream_filter";
+        case FILE_WRITE: return "file_write";
+        case DISK_WRITE: return "disk_write";
+        case RTMP_WRITE: return "rtmp_write";
+        case PROXY_SCALE: return "proxy_scale";
+        case PROXY_ENCODE: return "proxy_encode";
+        default: return "unknown";
+    }
+}
+
+void PipelineStats::Reset()
+{
+    for (auto &histogram : histograms_) {
+        histogram.Reset();
+    }
+}
@@ -0,0 +1,132 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#ifndef PIPELINE_STATS_H
+#define PIPELINE_STATS_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief lock-free histogram of durations
+ *
+ * Durations are recorded in nanoseconds into log-linear buckets: each power
+ * of two is split into four buckets, so a reported percentile is within 25%
+ * of the true value. Recording is a couple of relaxed atomic operations, any
+ * number of threads may record and read concurrently.
+ */
+class LatencyHistogram {
+public:
+    LatencyHistogram() {Reset();}
+    LatencyHistogram(const LatencyHistogram&) = delete;
+    LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+    /// record one duration, in nanoseconds
+    void Record(uint64_t nanoseconds);
+
+    /**
+     * @brief estimate a percentile
+     * @param fraction percentile as a fraction, e.g. 0.99
+     * @return duration in nanoseconds, 0 if nothing has been recorded
+     */
+    uint64_t Percentile(double fraction) const;
+
+    /// longest duration recorded, in nanoseconds
+    uint64_t max() const {return max_.load(std::memory_order_relaxed);}
+
+    /// number of durations recorded
+    uint64_t count() const {return count_.load(std::memory_order_relaxed);}
+
+    /// clear the histogram. not atomic with respect to concurrent Record() calls
+    void Reset();
+
+private:
+    /// buckets: 4 exact buckets for 0-3ns then 4 per power of two up to 2^64
+    static const size_t kNumBuckets = 4 + 62 * 4;
+
+    static size_t BucketIndex(uint64_t value);
+    static uint64_t BucketUpperBound(size_t index);
+
+    std::array<std::atomic<uint64_t>, kNumBuckets> buckets_;
+    std::atomic<uint64_t> count_;
+    std::atomic<uint64_t> max_;
+};
+
+/**
+ * @brief latency histograms for each stage of the recording pipeline
+ *
+ * owned by the CameraController and shared with the VideoWriter and
+ * RtmpPublisher of the active session, so the heartbeat can show whether a
+ * device is waiting on the camera, the encoder or the disk.
+ */
+class PipelineStats {
+public:
+    /// instrumented pipeline stages
+    enum Stage {
+        GRAB_WAIT,          ///< waiting for the camera to deliver a frame
+        ENCODE_FRAME,       ///< everything the encoder thread does for one frame
+        COPY,               ///< copying (or unpacking) camera data into an encoder frame
+        FILTER,             ///< filter graph
+        SEND_FRAME,         ///< avcodec_send_frame
+        RECEIVE_PACKET,     ///< avcodec_receive_packet
+        BITSTREAM_FILTER,   ///< dump_extra bitstream filter
+        FILE_WRITE,         ///< writing packets to the video file
+        DISK_WRITE,         ///< writing buffered file data to disk (write-behind thread)
+        RTMP_WRITE,         ///< writing packets to the live stream (publisher thread)
+        PROXY_SCALE,        ///< downscaling a frame for the proxy video
+        PROXY_ENCODE,       ///< encoding and writing a proxy frame (proxy thread)
+        NUM_STAGES
+    };
+
+    /// name used for a stage in the heartbeat
+    static const char* StageName(Stage stage);
+
+    /// histogram for a stage
+    LatencyHistogram& histogram(Stage stage) {return histograms_[stage];}
+    const LatencyHistogram& histogram(Stage stage) const {return histograms_[stage];}
+
+    /// clear all histograms, call between recording sessions
+    void Reset();
+
+private:
+    std::array<LatencyHistogram, NUM_STAGES> histograms_;
+};
+
+/**
+ * @brief records the lifetime of the timer into a pipeline stage histogram
+ *
+ * does nothing, not even read the clock, if stats is null
+ */
+class StageTimer {
+public:
+    StageTimer(PipelineStats *stats, PipelineStats::Stage stage) :
+        histogram_(stats ? &stats->histogram(stage) : nullptr)
+    {
+        if (histogram_) {
+            start_ = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~StageTimer() {Stop();}
+
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+
+    /// record the elapsed time now instead of when the timer is destroyed
+    void Stop()
+    {
+        if (histogram_) {
+            histogram_->Record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start_).count());
+            histogram_ = nullptr;
+        }
+    }
+
+private:
+    LatencyHistogram *histogram_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+#endif
@@ -4,6 +4,12 @@
 #include <string>
 #include <vector>
 
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
 #include "pixel_types.h"
 
 namespace pixel_types {
@@ -11,4 +17,57 @@ bool Validate(std::string type_name)
 {
     return std::find(type_names.begin(), type_names.end(), type_name) != type_names.end();
 }
+
+void UnpackMono12Packed(const uint8_t *src, uint16_t *dst, size_t pixels)
+{
+    size_t i = 0;
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    // 32 pixels per iteration: vld3 de-interleaves 16 byte triplets so each
+    // register holds the same byte of every pixel pair
+    const uint8x16_t low_nibble = vdupq_n_u8(0x0F);
+    for (; i + 32 <= pixels; i += 32) {
+        uint8x16x3_t in = vld3q_u8(src);
+        uint8x16_t mid_lo = vandq_u8(in.val[1], low_nibble);
+        uint8x16_t mid_hi = vshrq_n_u8(in.val[1], 4);
+
+        uint16x8x2_t out;
+        out.val[0] = vorrq_u16(vshll_n_u8(vget_low_u8(in.val[0]), 4), vmovl_u8(vget_low_u8(mid_lo)));
+        out.val[1] = vorrq_u16(vshll_n_u8(vget_low_u8(in.val[2]), 4), vmovl_u8(vget_low_u8(mid_hi)));
+        vst2q_u16(dst, out);
+
+        out.val[0] = vorrq_u16(vshll_n_u8(vget_high_u8(in.val[0]), 4), vmovl_u8(vget_high_u8(mid_lo)));
+        out.val[1] = vorrq_u16(vshll_n_u8(vget_high_u8(in.val[2]), 4), vmovl_u8(vget_high_u8(mid_hi)));
+        vst2q_u16(dst + 16, out);
+
+        src += 48;
+        dst += 32;
+    }
+#elif defined(__SSSE3__)
+    // 8 pixels (12 bytes) per iteration. each output word is first assembled
+    // from the two bytes that hold its bits ((b0 << 8) | b1 for even pixels,
+    // (b2 << 8) | b1 for odd pixels) and then shifted/masked into place.
+    // we load 16 bytes per iteration so stop while 16 input bytes remain
+    const __m128i shuffle = _mm_setr_epi8(1, 0, 1, 2, 4, 3, 4, 5, 7, 6, 7, 8, 10, 9, 10, 11);
+    const __m128i shifted_mask = _mm_setr_epi16(0x0FF0, 0x0FFF, 0x0FF0, 0x0FFF, 0x0FF0, 0x0FFF, 0x0FF0, 0x0FFF);
+    const __m128i nibble_mask = _mm_setr_epi16(0x000F, 0, 0x000F, 0, 0x000F, 0, 0x000F, 0);
+    for (; i * 3 / 2 + 16 <= pixels * 3 / 2; i += 8) {
+        __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+        __m128i words = _mm_shuffle_epi8(in, shuffle);
+        __m128i out = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(words, 4), shifted_mask),
+                                   _mm_and_si128(words, nibble_mask));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), out);
+        src += 12;
+        dst += 8;
+    }
+#endif
+
+    // scalar tail (or the whole frame without SIMD support)
+    for (; i + 2 <= pixels; i += 2) {
+        dst[0] = (uint16_t(src[0]) << 4) | (src[1] & 0x0F);
+        dst[1] = (uint16_t(src[2]) << 4) | (src[1] >> 4);
+        src += 3;
+        dst += 2;
+    }
+}
 } //namespace pixel_types
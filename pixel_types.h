@@ -3,14 +3,17 @@
 #ifndef PIXEL_TYPES_H
 #define PIXEL_TYPES_H
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
 #include <vector>
 
 namespace pixel_types {
-static const std::vector<std::string> type_names({"Mono8", "Mono12", "YUV420P"});
+static const std::vector<std::string> type_names({"Mono8", "Mono12", "Mono12Packed", "YUV420P"});
 static const std::string YUV420P = "YUV420P";
 static const std::string MONO8 = "Mono8";
 static const std::string MONO12 = "Mono12";
+static const std::string MONO12PACKED = "Mono12Packed";
 
 /**
  * @brief validate that a given string is a valid pixel format
@@ -18,5 +21,23 @@ static const std::string MONO12 = "Mono12";
  * @return true if teh string is a known pixel type, false otherwise
  */
 bool Validate(std::string type_name);
+
+/**
+ * @brief unpack Mono12Packed pixels to 16 bit samples
+ *
+ * Mono12Packed stores two 12 bit pixels in three bytes:
+ * byte 0 holds bits 11..4 of the first pixel, the low nibble of byte 1 holds
+ * bits 3..0 of the first pixel, the high nibble of byte 1 holds bits 3..0 of
+ * the second pixel and byte 2 holds bits 11..4 of the second pixel. The
+ * output samples are right aligned (values in the range [0, 4095]), which is
+ * the layout of Mono12 and of ffmpeg's GRAY12 format.
+ *
+ * Uses NEON or SSSE3 when available.
+ *
+ * @param src packed input, must hold at least 3 * pixels / 2 bytes
+ * @param dst unpacked output, must hold at least pixels samples
+ * @param pixels number of pixels to unpack, must be even
+ */
+void UnpackMono12Packed(const uint8_t *src, uint16_t *dst, size_t pixels);
 } //namespace pixel_types
 #endif
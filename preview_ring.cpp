@@ -0,0 +1,204 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <new>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pixel_types.h"
+#include "preview_ring.h"
+
+using preview_layout::PreviewRingHeader;
+using preview_layout::PreviewSlotHeader;
+
+// slots start on cache line boundaries
+static const size_t kSlotAlignment = 64;
+
+// number of times ReadLatest() retries a slot the writer is filling
+static const int kReadAttempts = 4;
+
+const unsigned int PreviewRing::kDefaultSlotCount;
+
+static size_t SlotStride(int width, int height)
+{
+    size_t bytes = sizeof(PreviewSlotHeader) + static_cast<size_t>(width) * height;
+    return (bytes + kSlotAlignment - 1) / kSlotAlignment * kSlotAlignment;
+}
+
+static size_t HeaderSize()
+{
+    return (sizeof(PreviewRingHeader) + kSlotAlignment - 1) / kSlotAlignment * kSlotAlignment;
+}
+
+PreviewRing::PreviewRing(const std::string &name, int width, int height, double fps,
+                         uint64_t tick_rate, unsigned int slot_count) :
+    name_(name),
+    width_(width),
+    height_(height),
+    fps_(fps),
+    min_interval_(fps > 0 ? static_cast<uint64_t>(tick_rate / fps) : 0)
+{
+    if (width <= 0 || height <= 0 || slot_count == 0) {
+        throw std::runtime_error("invalid preview ring dimensions");
+    }
+    const size_t stride = SlotStride(width, height);
+    size_ = HeaderSize() + stride * slot_count;
+
+    // start from a fresh segment so a reader of a previous ring with other
+    // dimensions doesn't see this one half initialized
+    shm_unlink(name_.c_str());
+    int fd = shm_open(name_.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("unable to create shared memory " + name_ + ": " + std::strerror(errno));
+    }
+    if (ftruncate(fd, size_) != 0) {
+        int error = errno;
+        close(fd);
+        shm_unlink(name_.c_str());
+        throw std::runtime_error("unable to size shared memory " + name_ + ": " + std::strerror(error));
+    }
+    void *p = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        shm_unlink(name_.c_str());
+        throw std::runtime_error("unable to map shared memory " + name_ + ": " + std::strerror(errno));
+    }
+    base_ = static_cast<uint8_t*>(p);
+
+    // the segment is zero filled, construct the atomics in place then publish
+    // the header by setting magic last
+    header_ = new (base_) PreviewRingHeader();
+    header_->version = preview_layout::kVersion;
+    header_->width = width;
+    header_->height = height;
+    header_->slot_count = slot_count;
+    header_->slot_stride = stride;
+    header_->tick_rate = tick_rate;
+    header_->frames_written.store(0, std::memory_order_relaxed);
+    for (unsigned int i = 0; i < slot_count; i++) {
+        PreviewSlotHeader *slot = new (base_ + HeaderSize() + stride * i) PreviewSlotHeader();
+        slot->sequence.store(0, std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    header_->magic = preview_layout::kMagic;
+}
+
+PreviewRing::~PreviewRing()
+{
+    munmap(base_, size_);
+    shm_unlink(name_.c_str());
+}
+
+bool PreviewRing::Write(const uint8_t *data, const std::string &pixel_format,
+                        uint64_t frame_number, uint64_t timestamp)
+{
+    if (written_ && timestamp - last_timestamp_ < min_interval_) {
+        return false;
+    }
+    written_ = true;
+    last_timestamp_ = timestamp;
+
+    const uint64_t n = header_->frames_written.load(std::memory_order_relaxed);
+    uint8_t *slot_start = base_ + HeaderSize() + static_cast<size_t>(header_->slot_stride) * (n % header_->slot_count);
+    PreviewSlotHeader *slot = reinterpret_cast<PreviewSlotHeader*>(slot_start);
+    uint8_t *pixels = slot_start + sizeof(PreviewSlotHeader);
+    const size_t count = static_cast<size_t>(width_) * height_;
+
+    // mark the slot as being written
+    const uint64_t sequence = slot->sequence.load(std::memory_order_relaxed);
+    slot->sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot->frame_number = frame_number;
+    slot->timestamp = timestamp;
+    if (pixel_format == pixel_types::MONO12) {
+        // right aligned 16 bit little endian samples, keep the top 8 of 12 bits
+        const uint16_t *samples = reinterpret_cast<const uint16_t*>(data);
+        for (size_t i = 0; i < count; i++) {
+            pixels[i] = static_cast<uint8_t>(samples[i] >> 4);
+        }
+    } else if (pixel_format == pixel_types::MONO12PACKED) {
+        // bytes 0 and 2 of each group hold bits 11..4 of the two pixels, see
+        // pixel_types::UnpackMono12Packed()
+        for (size_t i = 0; i + 1 < count; i += 2) {
+            pixels[i] = data[0];
+            pixels[i + 1] = data[2];
+            data += 3;
+        }
+    } else {
+        // Mono8, which is also what the camera delivers for YUV420P sessions
+        std::memcpy(pixels, data, count);
+    }
+
+    // slot is complete, then advertise it
+    slot->sequence.store(sequence + 2, std::memory_order_release);
+    header_->frames_written.store(n + 1, std::memory_order_release);
+    return true;
+}
+
+PreviewReader::PreviewReader(const std::string &name)
+{
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+        throw std::runtime_error("unable to open shared memory " + name + ": " + std::strerror(errno));
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) != 0 || static_cast<size_t>(sb.st_size) < HeaderSize()) {
+        close(fd);
+        throw std::runtime_error(name + " is not a preview ring");
+    }
+    size_ = sb.st_size;
+    void *p = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        throw std::runtime_error("unable to map shared memory " + name + ": " + std::strerror(errno));
+    }
+    base_ = static_cast<const uint8_t*>(p);
+    header_ = reinterpret_cast<const PreviewRingHeader*>(base_);
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (header_->magic != preview_layout::kMagic || header_->version != preview_layout::kVersion ||
+        HeaderSize() + static_cast<size_t>(header_->slot_stride) * header_->slot_count > size_) {
+        munmap(const_cast<uint8_t*>(base_), size_);
+        throw std::runtime_error(name + " is not a preview ring");
+    }
+}
+
+PreviewReader::~PreviewReader()
+{
+    munmap(const_cast<uint8_t*>(base_), size_);
+}
+
+bool PreviewReader::ReadLatest(uint8_t *pixels, uint64_t &frame_number, uint64_t &timestamp)
+{
+    const size_t count = static_cast<size_t>(header_->width) * header_->height;
+
+    for (int attempt = 0; attempt < kReadAttempts; attempt++) {
+        const uint64_t n = header_->frames_written.load(std::memory_order_acquire);
+        if (n == frames_read_) {
+            return false;
+        }
+        const uint8_t *slot_start = base_ + HeaderSize() +
+                                    static_cast<size_t>(header_->slot_stride) * ((n - 1) % header_->slot_count);
+        const PreviewSlotHeader *slot = reinterpret_cast<const PreviewSlotHeader*>(slot_start);
+
+        const uint64_t before = slot->sequence.load(std::memory_order_acquire);
+        if (before & 1) {
+            continue;
+        }
+        frame_number = slot->frame_number;
+        timestamp = slot->timestamp;
+        std::memcpy(pixels, slot_start + sizeof(PreviewSlotHeader), count);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot->sequence.load(std::memory_order_relaxed) == before) {
+            frames_read_ = n;
+            return true;
+        }
+        // the writer lapped us while copying, try the newest frame again
+    }
+    return false;
+}
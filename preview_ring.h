@@ -0,0 +1,166 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#ifndef PREVIEW_RING_H
+#define PREVIEW_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * shared memory layout of a preview ring
+ *
+ * The segment starts with a PreviewRingHeader, followed by slot_count slots.
+ * Each slot is a PreviewSlotHeader followed by width * height bytes of Mono8
+ * pixels, padded so every slot starts on a slot_stride boundary. Slots are
+ * filled in turn; frames_written counts every frame ever written, so the
+ * latest frame is in slot (frames_written - 1) % slot_count.
+ *
+ * Each slot is protected by a sequence lock: sequence is odd while the
+ * writer is filling the slot. A reader copies the slot and then checks that
+ * sequence was even and unchanged before and after the copy, retrying (or
+ * moving on to a newer frame) if not. Readers never block the writer.
+ */
+namespace preview_layout {
+static const uint32_t kMagic = 0x4d425056;   // "VPBM"
+static const uint32_t kVersion = 1;
+
+struct PreviewRingHeader {
+    uint32_t magic;                         ///< kMagic once the segment is initialized
+    uint32_t version;                       ///< kVersion
+    uint32_t width;                         ///< frame width in pixels
+    uint32_t height;                        ///< frame height in pixels
+    uint32_t slot_count;                    ///< number of slots
+    uint32_t slot_stride;                   ///< bytes from the start of one slot to the next
+    uint64_t tick_rate;                     ///< camera timestamp ticks per second
+    std::atomic<uint64_t> frames_written;   ///< frames written since the ring was created
+};
+
+struct PreviewSlotHeader {
+    std::atomic<uint64_t> sequence;         ///< odd while the slot is being written
+    uint64_t frame_number;                  ///< frame number within the recording session
+    uint64_t timestamp;                     ///< camera timestamp, in ticks
+};
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "preview ring needs lock free 64 bit atomics");
+} // namespace preview_layout
+
+/**
+ * @brief publishes a decimated copy of the camera frames to POSIX shared memory
+ *
+ * Lets local tools (focus and alignment helpers, on-device QC) watch the
+ * camera with low latency without going through the encoder or the rtmp
+ * server. Frames are converted to Mono8 and written to a small ring of slots
+ * in a shared memory segment, see preview_layout for the format. A
+ * PreviewReader can be used to read it from another process.
+ *
+ * Only frames at least 1 / fps apart (by camera timestamp) are written, so
+ * the cost to the grab thread is one Mono8 copy a few times a second.
+ * Write() must only be called from one thread.
+ */
+class PreviewRing {
+public:
+    /// default number of slots, enough that a reader is rarely lapped
+    static const unsigned int kDefaultSlotCount = 4;
+
+    /**
+     * @brief create (or replace) the shared memory segment
+     *
+     * throws std::runtime_error if the segment can't be created
+     *
+     * @param name shared memory object name, e.g. "/mba-preview"
+     * @param width frame width in pixels
+     * @param height frame height in pixels
+     * @param fps maximum rate of frames written to the ring
+     * @param tick_rate camera timestamp ticks per second
+     * @param slot_count number of slots in the ring
+     */
+    PreviewRing(const std::string &name, int width, int height, double fps,
+                uint64_t tick_rate, unsigned int slot_count = kDefaultSlotCount);
+
+    /// unmap and remove the shared memory segment
+    ~PreviewRing();
+
+    PreviewRing(const PreviewRing&) = delete;
+    PreviewRing& operator=(const PreviewRing&) = delete;
+
+    /**
+     * @brief write a frame if enough time has passed since the last one
+     *
+     * @param data camera frame, width * height pixels
+     * @param pixel_format camera pixel format (Mono8, Mono12 or Mono12Packed).
+     * 12 bit pixels are reduced to their 8 most significant bits
+     * @param frame_number frame number within the recording session
+     * @param timestamp camera timestamp of the frame, in ticks
+     * @return true if the frame was written
+     */
+    bool Write(const uint8_t *data, const std::string &pixel_format,
+               uint64_t frame_number, uint64_t timestamp);
+
+    /// shared memory object name
+    const std::string& name() const {return name_;}
+    int width() const {return width_;}
+    int height() const {return height_;}
+
+    /// maximum rate of frames written to the ring
+    double fps() const {return fps_;}
+
+private:
+    std::string name_;
+    int width_;
+    int height_;
+    double fps_;
+    uint64_t min_interval_;         ///< minimum ticks between written frames
+    uint64_t last_timestamp_ = 0;   ///< timestamp of the last frame written
+    bool written_ = false;          ///< a frame has been written since construction
+    size_t size_;                   ///< size of the mapping
+    uint8_t *base_;                 ///< start of the mapping
+    preview_layout::PreviewRingHeader *header_;
+};
+
+/**
+ * @brief reads frames from a PreviewRing in another process
+ */
+class PreviewReader {
+public:
+    /**
+     * @brief map an existing preview ring read only
+     *
+     * throws std::runtime_error if the segment doesn't exist or isn't a
+     * preview ring
+     *
+     * @param name shared memory object name
+     */
+    explicit PreviewReader(const std::string &name);
+
+    ~PreviewReader();
+
+    PreviewReader(const PreviewReader&) = delete;
+    PreviewReader& operator=(const PreviewReader&) = delete;
+
+    /**
+     * @brief copy the newest frame if it hasn't been read yet
+     *
+     * @param pixels destination for width() * height() Mono8 pixels
+     * @param frame_number set to the frame number of the frame
+     * @param timestamp set to the camera timestamp of the frame, in ticks
+     * @return true if a new frame was copied, false if there is no frame
+     * newer than the last one returned
+     */
+    bool ReadLatest(uint8_t *pixels, uint64_t &frame_number, uint64_t &timestamp);
+
+    int width() const {return header_->width;}
+    int height() const {return header_->height;}
+
+    /// camera timestamp ticks per second
+    uint64_t tick_rate() const {return header_->tick_rate;}
+
+private:
+    size_t size_;                   ///< size of the mapping
+    const uint8_t *base_;           ///< start of the mapping
+    const preview_layout::PreviewRingHeader *header_;
+    uint64_t frames_read_ = 0;      ///< frames_written at the last successful read
+};
+
+#endif
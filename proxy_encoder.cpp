@@ -0,0 +1,290 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#include <iostream>
+#include <stdexcept>
+
+#include "file_sink.h"
+#include "proxy_encoder.h"
+#include "thread_tuning.h"
+
+// frames waiting for the proxy encoder before new ones are left out
+static const size_t kProxyQueueCapacity = 8;
+
+// the proxy encoder runs on the proxy thread only, x264's own threads
+// would compete with the main encoder
+static const int kProxyEncoderThreads = 1;
+
+/*
+ * average factor x factor blocks of 8 bit samples. The factor 2 case is the
+ * common one and is written so the compiler can vectorize it
+ */
+static void BoxFilter8(const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride,
+                       int width, int height, int factor)
+{
+    if (factor == 2) {
+        for (int y = 0; y < height; y++) {
+            const uint8_t *row0 = src + 2 * y * src_stride;
+            const uint8_t *row1 = row0 + src_stride;
+            uint8_t *out = dst + y * dst_stride;
+            for (int x = 0; x < width; x++) {
+                out[x] = (row0[2 * x] + row0[2 * x + 1] + row1[2 * x] + row1[2 * x + 1] + 2) >> 2;
+            }
+        }
+        return;
+    }
+
+    const unsigned int area = factor * factor;
+    for (int y = 0; y < height; y++) {
+        uint8_t *out = dst + y * dst_stride;
+        for (int x = 0; x < width; x++) {
+            unsigned int sum = 0;
+            for (int dy = 0; dy < factor; dy++) {
+                const uint8_t *row = src + (y * factor + dy) * src_stride + x * factor;
+                for (int dx = 0; dx < factor; dx++) {
+                    sum += row[dx];
+                }
+            }
+            out[x] = (sum + area / 2) / area;
+        }
+    }
+}
+
+// average factor x factor blocks of 16 bit samples with depth significant
+// bits, reducing them to 8 bits
+static void BoxFilter16(const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride,
+                        int width, int height, int factor, int depth)
+{
+    const unsigned int divisor = (factor * factor) << (depth - 8);
+    for (int y = 0; y < height; y++) {
+        uint8_t *out = dst + y * dst_stride;
+        for (int x = 0; x < width; x++) {
+            unsigned int sum = 0;
+            for (int dy = 0; dy < factor; dy++) {
+                const uint16_t *row = reinterpret_cast<const uint16_t*>(src + (y * factor + dy) * src_stride) +
+                                      x * factor;
+                for (int dx = 0; dx < factor; dx++) {
+                    sum += row[dx];
+                }
+            }
+            out[x] = (sum + divisor / 2) / divisor;
+        }
+    }
+}
+
+ProxyEncoder::ProxyEncoder(const std::string &filename, int source_width, int source_height,
+                           enum AVPixelFormat source_format,
+                           const CameraController::RecordingSessionConfig &config, PipelineStats *stats) :
+    filename_(filename),
+    scale_(config.proxy_scale()),
+    source_depth_(source_format == AV_PIX_FMT_GRAY12 ? 12 : 8),
+    stats_(stats),
+    packet_(av_packet_alloc())
+{
+    if (scale_ < 2) {
+        throw std::invalid_argument("proxy scale must be at least 2");
+    }
+    if (!packet_) {
+        throw std::runtime_error("unable to allocate proxy packet");
+    }
+
+    // YUV420P needs an even frame size
+    const int width = (source_width / scale_) & ~1;
+    const int height = (source_height / scale_) & ~1;
+    if (width <= 0 || height <= 0) {
+        throw std::invalid_argument("frame is too small for a proxy");
+    }
+
+    CameraController::RecordingSessionConfig proxy_config = config;
+    proxy_config.set_crf(config.proxy_crf());
+    // the preallocation estimate is for full quality video, the proxy
+    // file is much smaller
+    proxy_config.set_preallocate(false);
+
+    OpenEncoder(proxy_config, width, height);
+
+    // neutral chroma, filled once per pooled buffer
+    frame_pool_ = std::unique_ptr<FramePool>(new FramePool(AV_PIX_FMT_YUV420P, width, height, 128));
+    // rebased so the proxy starts at 0 however far into the session it is opened
+    file_sink_ = std::unique_ptr<FileSink>(new FileSink(filename_, codec_context_.get(), proxy_config,
+                                                        nullptr, true));
+
+    // everything the thread uses is initialized, start it
+    thread_ = std::thread(&ProxyEncoder::Run, this);
+}
+
+ProxyEncoder::~ProxyEncoder()
+{
+    try {
+        Close();
+    } catch (const std::exception &e) {
+        std::cerr << "error closing proxy file: " << e.what() << std::endl;
+    }
+}
+
+void ProxyEncoder::OpenEncoder(const CameraController::RecordingSessionConfig &config, int width, int height)
+{
+    const AVCodec *codec = avcodec_find_encoder_by_name(codecs::LIBX264.c_str());
+    if (!codec) {
+        throw std::runtime_error("proxy encoder " + codecs::LIBX264 + " is not available");
+    }
+    codec_context_ = av_pointer::codec_context(avcodec_alloc_context3(codec));
+    if (!codec_context_) {
+        throw std::runtime_error("unable to initialize proxy AVCodecContext");
+    }
+
+    codec_context_->width = width;
+    codec_context_->height = height;
+    // same timeline as the main video, so frame numbers match between them
+    codec_context_->time_base = (AVRational){1, config.target_fps()};
+    codec_context_->framerate = (AVRational){config.target_fps(), 1};
+    codec_context_->pix_fmt = AV_PIX_FMT_YUV420P;
+    codec_context_->bits_per_raw_sample = 8;
+    codec_context_->gop_size = config.gop_size();
+    codec_context_->max_b_frames = config.max_b_frames();
+    codec_context_->thread_count = kProxyEncoderThreads;
+    av_opt_set(codec_context_->priv_data, "preset", config.compression_target().c_str(), 0);
+    av_opt_set(codec_context_->priv_data, "crf", std::to_string(config.crf()).c_str(), 0);
+
+    // see VideoWriter::OpenEncoder(), FileSink takes care of AVI
+    codec_context_->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    if (avcodec_open2(codec_context_.get(), codec, NULL) < 0) {
+        throw std::runtime_error("unable to open proxy encoder " + codecs::LIBX264);
+    }
+}
+
+void ProxyEncoder::Send(const AVFrame *frame)
+{
+    if (failed_ || stop_) {
+        return;
+    }
+
+    // reuse a frame struct from the free list, only allocating until the
+    // queue has been full once. leave the frame out if the proxy is behind
+    av_pointer::frame proxy_frame;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (queue_.size() >= kProxyQueueCapacity) {
+            frames_dropped_++;
+            return;
+        }
+        if (!free_frames_.empty()) {
+            proxy_frame = std::move(free_frames_.back());
+            free_frames_.pop_back();
+        }
+    }
+    if (!proxy_frame) {
+        proxy_frame = av_pointer::frame(av_frame_alloc());
+        if (!proxy_frame) {
+            frames_dropped_++;
+            return;
+        }
+    }
+
+    StageTimer timer(stats_.load(), PipelineStats::PROXY_SCALE);
+    frame_pool_->Get(proxy_frame.get());
+    if (source_depth_ > 8) {
+        BoxFilter16(frame->data[0], frame->linesize[0], proxy_frame->data[0], proxy_frame->linesize[0],
+                    codec_context_->width, codec_context_->height, scale_, source_depth_);
+    } else {
+        BoxFilter8(frame->data[0], frame->linesize[0], proxy_frame->data[0], proxy_frame->linesize[0],
+                   codec_context_->width, codec_context_->height, scale_);
+    }
+    proxy_frame->pts = frame->pts;
+    timer.Stop();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.push_back(std::move(proxy_frame));
+    }
+    cv_.notify_one();
+}
+
+void ProxyEncoder::Run()
+{
+    thread_tuning::SetName("mba-proxy");
+
+    while (1) {
+        av_pointer::frame frame;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this] {return stop_ || !queue_.empty();});
+            if (queue_.empty()) {
+                // stopped and everything queued has been encoded
+                break;
+            }
+            frame = std::move(queue_.front());
+            queue_.pop_front();
+        }
+
+        try {
+            Encode(frame.get());
+        } catch (const std::exception &e) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            error_ = e.what();
+            failed_ = true;
+            queue_.clear();
+            return;
+        }
+
+        // return the buffers to the pool and the struct to the free list
+        av_frame_unref(frame.get());
+        std::lock_guard<std::mutex> lock(mutex_);
+        free_frames_.push_back(std::move(frame));
+    }
+
+    try {
+        Encode(nullptr);
+    } catch (const std::exception &e) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        error_ = e.what();
+        failed_ = true;
+    }
+}
+
+void ProxyEncoder::Encode(AVFrame *frame)
+{
+    StageTimer timer(stats_.load(), PipelineStats::PROXY_ENCODE);
+    int rval = avcodec_send_frame(codec_context_.get(), frame);
+    if (rval < 0) {
+        throw std::runtime_error("error sending frame for proxy encoding");
+    }
+
+    AVPacket *pkt = packet_.get();
+    while (rval >= 0) {
+        rval = avcodec_receive_packet(codec_context_.get(), pkt);
+        if (rval == AVERROR(EAGAIN) || rval == AVERROR_EOF) {
+            return;
+        } else if (rval < 0) {
+            throw std::runtime_error("error during proxy encoding");
+        }
+        file_sink_->Send(pkt);
+        bytes_written_ += pkt->size;
+        av_packet_unref(pkt);
+    }
+}
+
+void ProxyEncoder::Close()
+{
+    if (!thread_.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+
+    if (frames_dropped_) {
+        std::clog << "proxy " << filename_ << " left out " << frames_dropped_ << " frames" << std::endl;
+    }
+
+    // FileSink::Close() throws if anything failed to reach the disk
+    std::unique_ptr<FileSink> file_sink = std::move(file_sink_);
+    codec_context_.reset();
+    file_sink->Close();
+    if (failed_) {
+        throw std::runtime_error("proxy stopped early: " + error_);
+    }
+}
@@ -0,0 +1,137 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#ifndef PROXY_ENCODER_H
+#define PROXY_ENCODER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "camera_controller.h"
+#include "frame_pool.h"
+#include "pipeline_stats.h"
+#include "video_writer.h"
+
+class FileSink;
+
+/**
+ * @brief encodes a downscaled, low bitrate copy of a video from its own thread
+ *
+ * VideoWriter hands each frame it encodes to Send(), which box filters the
+ * luma plane down by an integer factor into a pooled YUV420P frame (neutral
+ * chroma) and queues it. Encoding with libx264 at the proxy crf and writing
+ * the side file happen on the proxy thread, so the proxy costs the
+ * recording one extra pass over the luma plane. AVFrame structs are
+ * recycled, so steady state operation doesn't allocate.
+ *
+ * If the proxy thread falls behind, frames that don't fit in the queue are
+ * left out of the proxy. An error on the proxy thread stops the proxy, the
+ * recording carries on without it.
+ */
+class ProxyEncoder {
+public:
+    /**
+     * @brief open the proxy encoder and file, and start the proxy thread
+     *
+     * throws std::runtime_error if the encoder or file can't be set up
+     *
+     * @param filename full path of the proxy file, including extension
+     * @param source_width width of the frames passed to Send()
+     * @param source_height height of the frames passed to Send()
+     * @param source_format pixel format of the frames passed to Send(), only
+     * the luma plane is used
+     * @param config session configuration, proxy_scale() must be set
+     * @param stats histograms to record downscale and encode latency into, may be null
+     */
+    ProxyEncoder(const std::string &filename, int source_width, int source_height,
+                 enum AVPixelFormat source_format, const CameraController::RecordingSessionConfig &config,
+                 PipelineStats *stats = nullptr);
+
+    /// stop the proxy thread and close the file, errors are logged
+    ~ProxyEncoder();
+
+    ProxyEncoder(const ProxyEncoder&) = delete;
+    ProxyEncoder& operator=(const ProxyEncoder&) = delete;
+
+    /**
+     * @brief downscale a frame and queue it for the proxy
+     *
+     * never blocks on the proxy encoder. frame isn't modified or referenced
+     * after Send() returns
+     *
+     * @param frame frame sent to the main encoder
+     */
+    void Send(const AVFrame *frame);
+
+    /**
+     * @brief encode the queued frames, flush the encoder and close the file
+     *
+     * throws std::runtime_error if the proxy failed. Calling Close() again
+     * does nothing.
+     */
+    void Close();
+
+    /// full path of the proxy file
+    const std::string& filename() const {return filename_;}
+
+    /// encoded bytes sent to the proxy file so far, safe to call from any thread
+    uint64_t bytes_written() const {return bytes_written_;}
+
+    /// frames left out of the proxy because its queue was full
+    uint64_t frames_dropped() const {return frames_dropped_;}
+
+    /**
+     * @brief record downscale and encode latencies
+     * @param stats histograms to record into, or nullptr to disable
+     */
+    void set_pipeline_stats(PipelineStats *stats) {stats_ = stats;}
+
+private:
+    /// proxy thread main loop
+    void Run();
+
+    /**
+     * @brief encode a frame (or flush with nullptr) and write the packets
+     * @param frame downscaled frame
+     */
+    void Encode(AVFrame *frame);
+
+    /**
+     * @brief configure and open libx264 for the downscaled frames
+     * @param config proxy configuration, crf() is the proxy crf
+     * @param width proxy frame width in pixels
+     * @param height proxy frame height in pixels
+     */
+    void OpenEncoder(const CameraController::RecordingSessionConfig &config, int width, int height);
+
+    std::string filename_;
+    int scale_;                 ///< downscale factor along each axis
+    int source_depth_;          ///< bits per luma sample of the source frames
+    std::atomic<PipelineStats*> stats_; ///< latency histograms, not owned. may be null
+
+    av_pointer::codec_context codec_context_;
+    std::unique_ptr<FramePool> frame_pool_;
+    std::unique_ptr<FileSink> file_sink_;
+    av_pointer::packet packet_; ///< packet received from the encoder, proxy thread only
+
+    std::deque<av_pointer::frame> queue_;             ///< frames waiting to be encoded, guarded by mutex_
+    std::vector<av_pointer::frame> free_frames_;      ///< unused frames for Send(), guarded by mutex_
+    std::string error_;                               ///< why the proxy stopped, guarded by mutex_
+    std::mutex mutex_;
+    std::condition_variable cv_;
+
+    std::atomic_bool stop_ {false};     ///< finish the queue and flush
+    std::atomic_bool failed_ {false};   ///< the proxy thread hit an error and stopped
+    std::atomic<uint64_t> bytes_written_ {0};
+    std::atomic<uint64_t> frames_dropped_ {0};
+
+    std::thread thread_;                ///< proxy thread, started last
+};
+
+#endif
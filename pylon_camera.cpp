@@ -1,13 +1,19 @@
 // Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
 
+#include <algorithm>
 #include <chrono>
+#include <cstdio>
 #include <ctime>
+#include <deque>
 #include <exception>
 #include <fstream>
-#include <iomanip>
+#include <future>
 #include <iostream>
+#include <memory>
 #include <thread>
 
+#include "disk_space_monitor.h"
+#include "encoder_governor.h"
 #include "pylon_camera.h"
 #include "video_writer.h"
 
@@ -15,258 +21,1065 @@ namespace chrono = std::chrono;
 using namespace Pylon;
 using namespace GenApi;
 
+// maximum number of grabbed frames that can be waiting for the encoder
+const size_t kGrabQueueCapacity = 64;
 
-void PylonCameraController::RecordVideo(const RecordingSessionConfig &config)
+// pylon buffers available for grabbing on top of those held in the grab queue
+const size_t kPylonBufferHeadroom = 15;
+
+// how long the encoder thread sleeps when it finds the grab queue empty
+const chrono::microseconds kGrabQueuePollInterval(500);
+
+// how far ahead of the hour boundary the next hour's VideoWriter is opened
+const chrono::seconds kRolloverLeadTime(30);
+
+// camera timestamps are measured in ticks of a 125MHz clock
+const uint64_t kCameraTickRate = 125000000;
+
+// GigE Vision block IDs are 16 bits, after 65535 they start again at 1
+const uint64_t kGigEMaxBlockId = 65535;
+
+// how often the stream grabber statistics are read during a session
+const chrono::seconds kStreamStatisticsInterval(1);
+
+// how often free disk space is checked during a session
+const chrono::seconds kDiskCheckInterval(5);
+
+// frame timestamps an armed session holds while its pre-trigger video has no
+// keyframe yet
+const size_t kMaxPendingTimestamps = 65536;
+
+// close a file that has been rotated out. runs on its own thread so the
+// encoder thread doesn't wait for the trailer to be written
+static void RetireFile(std::unique_ptr<VideoWriter::OutputFile> file)
 {
-    // reset the CameraController err_state_
-    // this is set to let the controlling thread know that we encountered an error
-    err_state_ = 0;
+    try {
+        file->Close();
+    } catch (const std::exception &e) {
+        std::cerr << "error closing video file: " << e.what() << std::endl;
+    }
+}
+
+// free callback for buffers created by WrapGrabResult(). opaque is the heap
+// allocated CGrabResultPtr keeping the pylon buffer alive
+static void ReleaseGrabResult(void *opaque, uint8_t *data)
+{
+    CGrabResultPtr *ptrGrabResult = static_cast<CGrabResultPtr*>(opaque);
+    ptrGrabResult->Release();
+    delete ptrGrabResult;
+}
+
+/*
+ * wrap the image buffer of a grab result in a read only AVBufferRef so the
+ * encoder can reference it without copying. The grab result (and so the
+ * pylon buffer) is held until ffmpeg drops its last reference.
+ * returns nullptr if the buffer could not be created.
+ */
+static AVBufferRef* WrapGrabResult(const CGrabResultPtr &ptrGrabResult)
+{
+    CGrabResultPtr *ref = new CGrabResultPtr(ptrGrabResult);
+    AVBufferRef *buffer = av_buffer_create(static_cast<uint8_t*>(ptrGrabResult->GetBuffer()),
+                                           ptrGrabResult->GetPayloadSize(),
+                                           ReleaseGrabResult, ref, AV_BUFFER_FLAG_READONLY);
+    if (!buffer) {
+        delete ref;
+    }
+    return buffer;
+}
+
+// round value down to a multiple of the node's increment (and of alignment)
+// and clamp it to the node's range
+static int64_t AlignedValue(const CIntegerPtr &node, int64_t value, int64_t alignment = 1)
+{
+    const int64_t increment = std::max(node->GetInc(), alignment);
+    value -= value % increment;
+    return std::min(std::max(value, node->GetMin()), node->GetMax());
+}
+
+/*
+ * set a binning or decimation node to factor. A factor of 1 is fine on
+ * cameras without the node, anything else throws
+ */
+static void SetSubsampling(INodeMap &control, const char *name, int64_t factor)
+{
+    const CIntegerPtr node = control.GetNode(name);
+    if (IsWritable(node)) {
+        node->SetValue(factor);
+    } else if (factor != 1) {
+        throw RUNTIME_EXCEPTION("camera doesn't support %s", name);
+    }
+}
+
+// stream grabber counters
+struct StreamCounters {
+    uint64_t buffer_underruns = 0;
+    uint64_t failed_packets = 0;
+    uint64_t failed_buffers = 0;
+};
+
+// read a stream grabber statistic, 0 if the stream grabber doesn't have it
+static uint64_t StreamStatistic(INodeMap &stream, const char *name)
+{
+    const CIntegerPtr node = stream.GetNode(name);
+    return IsReadable(node) ? node->GetValue() : 0;
+}
 
-    std::string filename;   // output video filename
-    std::string output_dir; // output directory
+// counts since baseline, or since the counter was last reset if that was after the baseline
+static uint64_t CountSince(uint64_t count, uint64_t baseline)
+{
+    return count >= baseline ? count - baseline : count;
+}
 
-    // if config.fragment_by_hour is true, current hour == next_hour triggers
-    // rolling over to a new file
-    int next_hour = 0;
+/*
+ * read the stream grabber counters, zero if they can't be read. The camera
+ * stays open between sessions, so a session counts from the values read
+ * when it starts grabbing
+ */
+static StreamCounters ReadStreamCounters(CInstantCamera &camera)
+{
+    StreamCounters counters;
+    try {
+        INodeMap &stream = camera.GetStreamGrabberNodeMap();
+        counters.buffer_underruns = StreamStatistic(stream, "Statistic_Buffer_Underrun_Count");
+        counters.failed_packets = StreamStatistic(stream, "Statistic_Failed_Packet_Count");
+        counters.failed_buffers = StreamStatistic(stream, "Statistic_Failed_Buffer_Count");
+    } catch (const GenericException &e) {
+        return StreamCounters();
+    }
+    return counters;
+}
+
+/*
+ * publish the stream grabber statistics counted since baseline and log any
+ * buffer underruns or failed packets since the last update. frame is the
+ * number of frames grabbed so far
+ */
+static void UpdateStreamStatistics(CInstantCamera &camera, const StreamCounters &baseline,
+                                   FrameDropStats &stats, DropLog *drop_log, uint64_t frame)
+{
+    uint64_t buffer_underruns;
+    uint64_t failed_packets;
+    uint64_t failed_buffers;
+    try {
+        INodeMap &stream = camera.GetStreamGrabberNodeMap();
+        buffer_underruns = CountSince(StreamStatistic(stream, "Statistic_Buffer_Underrun_Count"),
+                                      baseline.buffer_underruns);
+        failed_packets = CountSince(StreamStatistic(stream, "Statistic_Failed_Packet_Count"),
+                                    baseline.failed_packets);
+        failed_buffers = CountSince(StreamStatistic(stream, "Statistic_Failed_Buffer_Count"),
+                                    baseline.failed_buffers);
+    } catch (const GenericException &e) {
+        return;
+    }
+
+    if (drop_log && buffer_underruns > stats.buffer_underruns()) {
+        drop_log->Record(frame, 0, 0, DropLog::BUFFER_UNDERRUN, buffer_underruns - stats.buffer_underruns());
+    }
+    if (drop_log && failed_packets > stats.failed_packets()) {
+        drop_log->Record(frame, 0, 0, DropLog::FAILED_PACKET, failed_packets - stats.failed_packets());
+    }
+    stats.SetStreamStatistics(buffer_underruns, failed_packets, failed_buffers);
+}
 
-    //TODO move current_frame into VideoWriter
-    size_t current_frame = 0;   // frame number in the current file
-    size_t frames_captured = 0; // total number of frames captured in session
-    uint64_t first_click = 0;   // timestamp of first frame captured
-    uint64_t last_click = 0;    // timestamp of last frame captured
-    double current_fps;         // current acquisition framerate
+
+PylonCameraController::~PylonCameraController()
+{
+    StopRecording();
+
+    // a session that ended on its own may not have been joined yet, it
+    // could still be using the camera
+    if (recording_thread_.joinable()) {
+        recording_thread_.join();
+    }
+    CloseCamera();
+}
+
+std::vector<std::string> PylonCameraController::EnumerateSerialNumbers()
+{
+    PylonAutoInitTerm autoInitTerm;
+    DeviceInfoList_t devices;
+    std::vector<std::string> serial_numbers;
+
+    try {
+        CTlFactory::GetInstance().EnumerateDevices(devices);
+    } catch (const GenericException &e) {
+        std::cerr << "unable to enumerate cameras: " << e.what() << std::endl;
+        return serial_numbers;
+    }
+    for (const auto &device : devices) {
+        serial_numbers.push_back(std::string(device.GetSerialNumber().c_str()));
+    }
+    return serial_numbers;
+}
+
+bool PylonCameraController::OpenSessionOutput(const RecordingSessionConfig &config, SessionOutput &output,
+                                              std::unique_ptr<DropLog> &drop_log, std::string &drop_log_filename)
+{
+    output.config = config;
+    output.start_time = chrono::system_clock::now();
 
     // setup the output directory
     try {
-        output_dir = MakeOutputDir(chrono::system_clock::now());
+        output.output_dir = MakeOutputDir(output.start_time);
     } catch (const std::runtime_error &e) {
         // couldn't setup the file path. set error string and return
-        recording_ = false;
         err_msg_ = "unable to setup output dir: " + std::string(e.what());
         err_state_ = 1;
-        return;
+        return false;
     }
 
     // setup filenames for timestamp files
     // file for storing timestamp of each frame
-    std::string timestamp_filename = output_dir + config.file_prefix() + "timestamps.txt";
+    std::string timestamp_filename = output.output_dir + config.file_prefix() +
+        (config.timestamp_format() == timestamp_formats::BINARY ? "timestamps.bin" : "timestamps.txt");
     // file for storing timestamp of recording session start
-    std::string timestamp_start_filename = output_dir + config.file_prefix() + "start_timestamp.txt";
+    std::string timestamp_start_filename = output.output_dir + config.file_prefix() + "start_timestamp.txt";
+    // file for logging frames lost before they were encoded
+    drop_log_filename = output.output_dir + config.file_prefix() + "drops.txt";
 
     // open files
-    std::ofstream timestamp_file (timestamp_filename, std::ofstream::out);
+    try {
+        output.timestamp_log = std::unique_ptr<TimestampLog>(
+            new TimestampLog(timestamp_filename, config.timestamp_format(), kCameraTickRate));
+    } catch (const std::exception &e) {
+        std::cerr << "unable to open timestamp log: " << e.what() << std::endl;
+    }
     std::ofstream timestamp_start_file (timestamp_start_filename, std::ofstream::out);
 
     // terminate recording session if we were unable to open either file
-    if (!timestamp_file || ! timestamp_start_file) {
+    if (!output.timestamp_log || ! timestamp_start_file) {
         err_state_ = 1;
         err_msg_ = "error opening timestamp files";
-        recording_ = false;
+        return false;
+    }
+
+    // save the start time of the recording session
+    std::time_t t = chrono::system_clock::to_time_t(output.start_time);
+    timestamp_start_file << "Recording started at Local Time: " << std::ctime(&t);
+
+    // the drop log is diagnostic, record without it if it can't be opened
+    try {
+        drop_log = std::unique_ptr<DropLog>(new DropLog(drop_log_filename));
+    } catch (const std::exception &e) {
+        std::cerr << "unable to open drop log: " << e.what() << std::endl;
+    }
+    // the encoder thread logs pacing changes to it
+    output.drop_log = drop_log.get();
+    return true;
+}
+
+CBaslerGigEInstantCamera& PylonCameraController::OpenCamera(const RecordingSessionConfig &config)
+{
+    const CameraSettings settings(config, frame_width_, frame_height_);
+
+    // attaching and opening the camera takes seconds, reuse the camera from
+    // the last session if it is still there and only change what differs
+    if (camera_ && camera_->IsOpen() && !camera_->IsCameraDeviceRemoved()) {
+        try {
+            if (!settings.SameImageFormat(camera_settings_)) {
+                CameraConfiguration::ApplyImageFormat(*camera_, settings);
+            }
+            if (settings.target_fps != camera_settings_.target_fps) {
+                CameraConfiguration::ApplyFrameRate(*camera_, settings.target_fps);
+            }
+            // auto gain adjusts once per session, as it does when the camera is opened
+            camera_->GainAuto.SetValue(Basler_GigECameraParams::GainAuto_Once);
+            camera_settings_ = settings;
+            return *camera_;
+        } catch (const GenericException &e) {
+            std::cerr << "camera " << serial_number_ << ": unable to reconfigure, reopening: "
+                      << e.what() << std::endl;
+        }
+    }
+
+    CloseCamera();
+    camera_ = std::unique_ptr<CBaslerGigEInstantCamera>(new CBaslerGigEInstantCamera());
+    try {
+        if (serial_number_.empty()) {
+            camera_->Attach(CTlFactory::GetInstance().CreateFirstDevice());
+        } else {
+            CDeviceInfo device_info;
+            device_info.SetSerialNumber(serial_number_.c_str());
+            camera_->Attach(CTlFactory::GetInstance().CreateFirstDevice(device_info));
+        }
+        // customConfig will be managed by the Basler API so we are not using a smart pointer
+        CameraConfiguration *customConfig = new CameraConfiguration(settings, false);
+        camera_->RegisterConfiguration(customConfig, RegistrationMode_ReplaceAll, Cleanup_Delete);
+        camera_->Open();
+    } catch (const GenericException &e) {
+        CloseCamera();
+        throw;
+    }
+    camera_settings_ = settings;
+    return *camera_;
+}
+
+void PylonCameraController::CloseCamera()
+{
+    if (!camera_) {
         return;
     }
+    try {
+        if (camera_->IsGrabbing()) {
+            camera_->StopGrabbing();
+        }
+        camera_->Close();
+        camera_->DestroyDevice();
+    } catch (const GenericException &e) {
+        std::cerr << "camera " << serial_number_ << ": error closing camera: " << e.what() << std::endl;
+    }
+    camera_.reset();
+}
 
-    // set format for floating point output to the timestamp file
-    timestamp_file << std::fixed << std::setprecision(6);
+void PylonCameraController::OpenStandbyWriter(const RecordingSessionConfig &config)
+{
+    RecordingSessionConfig standby_config = config;
+    standby_config.set_pre_trigger(0);
+    const std::string rtmp_uri = rtmp_uri_;
+    const int width = image_width_;
+    const int height = image_height_;
+    PipelineStats *stats = &pipeline_stats_;
+    const thread_tuning::ThreadPolicy policy = encode_policy_;
+    standby_writer_ = std::async(std::launch::async, [policy, rtmp_uri, width, height, stats, standby_config]() {
+        std::string error;
+        thread_tuning::SetName("mba-encode");
+        if (!thread_tuning::Apply(policy, error)) {
+            std::cerr << "standby encoder: " << error << std::endl;
+        }
+        std::unique_ptr<VideoWriter> writer(new VideoWriter("", rtmp_uri, width, height, standby_config));
+        writer->set_pipeline_stats(stats);
+        return writer;
+    });
+}
 
-    // attach and configure the camera
-    PylonAutoInitTerm autoInitTerm;
-    CImageFormatConverter img_converter;
+std::unique_ptr<VideoWriter> PylonCameraController::TakeStandbyWriter(const RecordingSessionConfig &config)
+{
+    if (!standby_writer_.valid()) {
+        return nullptr;
+    }
+    std::unique_ptr<VideoWriter> writer;
+    try {
+        writer = standby_writer_.get();
+    } catch (const std::exception &e) {
+        std::cerr << "standby encoder: " << e.what() << std::endl;
+        return nullptr;
+    }
+    // a standby that doesn't match is closed, it has no frames to flush
+    if (!writer->CanEncode(image_width_, image_height_, rtmp_uri_, config)) {
+        return nullptr;
+    }
+    return writer;
+}
+
+std::string PylonCameraController::SessionFilename(const SessionOutput &output)
+{
+    if (output.config.fragment_by_hour()) {
+        return output.output_dir + output.config.file_prefix() + timestamp(output.start_time);
+    }
+    return output.output_dir + output.config.file_prefix();
+}
+
+void PylonCameraController::RecordVideo(const RecordingSessionConfig &config)
+{
+    // reset the CameraController err_state_
+    // this is set to let the controlling thread know that we encountered an error
+    err_state_ = 0;
+
+    // an armed session only creates its files once it is triggered, until
+    // then the encoder keeps the pre-trigger video in memory
+    const bool armed = config.pre_trigger() > 0;
+
+    // attach and configure the camera, or reconfigure the one kept open
+    // since the last session
     CGrabResultPtr ptrGrabResult;
-    CBaslerGigEInstantCamera camera;
 
+    // frames waiting in the grab queue hold on to their pylon buffer, so
+    // pylon needs enough buffers to fill the queue and still have some left
+    // over for the camera to grab into
+    GrabQueue grab_queue(kGrabQueueCapacity);
+
+    CBaslerGigEInstantCamera *camera_ptr;
     try {
-        camera.Attach(CTlFactory::GetInstance().CreateFirstDevice());
-        // customConfig will be managed by the Basler API so we are not using a smart pointer
-        CameraConfiguration *customConfig = new CameraConfiguration(frame_width_, frame_height_,
-                                                                    config.target_fps(), config.pixel_format(), false);
-        camera.RegisterConfiguration(customConfig, RegistrationMode_ReplaceAll, Cleanup_Delete);
-        camera.MaxNumBuffer = 15;
-        camera.Open();
+        camera_ptr = &OpenCamera(config);
+        camera_ptr->MaxNumBuffer = grab_queue.capacity() + kPylonBufferHeadroom;
+
+        // size of the frames the camera delivers, after the region of
+        // interest has been fitted to the sensor and binned or decimated
+        image_width_ = static_cast<int>(CIntegerPtr(camera_ptr->GetNodeMap().GetNode("Width"))->GetValue());
+        image_height_ = static_cast<int>(CIntegerPtr(camera_ptr->GetNodeMap().GetNode("Height"))->GetValue());
     } catch (const GenericException &e) {
         // couldn't attach to or configure the camera. set error string and return
+        CloseCamera();
         recording_ = false;
         err_msg_ = "unable to configure camera: " + std::string(e.what());
         err_state_ = 1;
         return;
     }
     // done configuring camera
-
-    // save the start time of the recording session
-    auto start_time = chrono::system_clock::now();
-    std::time_t t = chrono::system_clock::to_time_t(start_time);
-    session_start_.store(start_time.time_since_epoch());
-    timestamp_start_file << "Recording started at Local Time: " << std::ctime(&t);
-    timestamp_start_file.close();
-
-    if (config.fragment_by_hour()) {
-        next_hour = (GetCurrentHour(start_time) + 1) % 24;
-        filename = output_dir + config.file_prefix() + timestamp(start_time);
+    CBaslerGigEInstantCamera &camera = *camera_ptr;
+
+    // frames for local preview tools, published from the grab loop
+    UpdatePreviewRing();
+    const std::string &camera_pixel_format = config.pixel_format() == pixel_types::YUV420P ?
+                                             pixel_types::MONO8 : config.pixel_format();
+    uint64_t frames_grabbed = 0;
+
+    // session files. They are handed to the encoder thread through
+    // session_output, right away or, for an armed session, on the trigger
+    RecordingSessionConfig session_config = config;
+    SessionOutput output;
+    std::promise<SessionOutput> output_promise;
+    std::future<SessionOutput> session_output = output_promise.get_future();
+    bool session_started = false;
+    std::unique_ptr<DropLog> drop_log;
+    std::string drop_log_filename;
+    std::string output_dir;
+    std::string filename;   // first video file, empty while armed
+
+    if (!armed) {
+        if (!OpenSessionOutput(config, output, drop_log, drop_log_filename)) {
+            recording_ = false;
+            return;
+        }
+        output_dir = output.output_dir;
+        filename = SessionFilename(output);
+        session_start_.store(output.start_time.time_since_epoch());
     } else {
-        filename = output_dir + config.file_prefix();
+        // the session starts again at the trigger
+        session_start_.store(chrono::system_clock::now().time_since_epoch());
     }
 
-    VideoWriter video_writer(filename, rtmp_uri_, frame_width_, frame_height_, config);
+    // the encoder opened after the last session saves opening one now, if
+    // it has this session's settings. its file starts at the first keyframe
+    std::unique_ptr<VideoWriter> video_writer;
+    try {
+        video_writer = TakeStandbyWriter(config);
+        if (video_writer) {
+            video_writer->OpenFile(filename, config);
+        } else {
+            video_writer = std::unique_ptr<VideoWriter>(
+                new VideoWriter(filename, rtmp_uri_, image_width_, image_height_, config));
+        }
+    } catch (const std::exception &e) {
+        // no usable encoder or the video file couldn't be opened. set error
+        // string and return
+        recording_ = false;
+        err_msg_ = "unable to open video writer: " + std::string(e.what());
+        err_state_ = 1;
+        return;
+    }
+    video_writer->set_pipeline_stats(&pipeline_stats_);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        encoder_name_ = video_writer->encoder_name();
+    }
+
+    // moving average over one second worth of frames
+    frame_rate_stats_.Reset(config.target_fps(), kCameraTickRate, config.target_fps());
+    frame_drop_stats_.Reset(kGigEMaxBlockId);
+    auto next_statistics_update = chrono::steady_clock::now() + kStreamStatisticsInterval;
+
+    // the encoder thread applies the throttle level, see EncodeFrames().
+    // there is nothing to check until the session has files
+    std::unique_ptr<DiskSpaceMonitor> disk_monitor;
+    const unsigned int max_throttle_level =
+        DiskSpaceMonitor::MaxThrottleLevel(video_writer->encoder_name() == codecs::LIBX264);
+    auto next_disk_check = chrono::steady_clock::now() + kDiskCheckInterval;
+
+    if (!armed) {
+        disk_monitor = std::unique_ptr<DiskSpaceMonitor>(
+            new DiskSpaceMonitor(output_dir, config.min_free_mb() * 1024 * 1024));
+        output_promise.set_value(std::move(output));
+        session_started = true;
+    }
 
     // camera is configured and we're ready to start capturing video
     // start grabbing frames
-    camera.StartGrabbing(GrabStrategy_OneByOne);
+    try {
+        camera.StartGrabbing(GrabStrategy_OneByOne);
+    } catch (const GenericException &e) {
+        // a camera kept open since the last session may have been unplugged
+        // or power cycled. the next session opens it again
+        CloseCamera();
+        recording_ = false;
+        err_msg_ = "unable to start grabbing: " + std::string(e.what());
+        err_state_ = 1;
+        return;
+    }
     capturing_ = true;
+    const StreamCounters stream_baseline = ReadStreamCounters(camera);
+    bool camera_failed = false;
+
+    // start the encoder thread, it will drain grab_queue until grabbing is
+    // set to false and there are no frames left
+    std::atomic_bool grabbing {true};
+    std::atomic_bool encoder_aborted {false};
+    std::string encoder_error;
+    std::thread encoder_thread(&PylonCameraController::EncodeFrames, this,
+                               std::cref(config), std::ref(grab_queue),
+                               std::ref(video_writer), std::ref(session_output),
+                               std::cref(grabbing), std::ref(encoder_aborted),
+                               std::ref(encoder_error));
+
+    // everything else in the session has been started with the encode
+    // policy, only this thread runs with the grab policy
+    {
+        std::string policy_error;
+        thread_tuning::SetName("mba-grab");
+        if (!thread_tuning::Apply(grab_policy_, policy_error)) {
+            std::cerr << "grab thread: " << policy_error << std::endl;
+        }
+    }
 
     // main recording loop
     while(1) {
+        // an armed session has been triggered, create its files and hand
+        // them to the encoder, which starts the video file with the
+        // pre-trigger video
+        if (!session_started && triggered_) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                session_config = trigger_config_;
+            }
+            if (!OpenSessionOutput(session_config, output, drop_log, drop_log_filename)) {
+                break;
+            }
+            output_dir = output.output_dir;
+            session_start_.store(output.start_time.time_since_epoch());
+            disk_monitor = std::unique_ptr<DiskSpaceMonitor>(
+                new DiskSpaceMonitor(output_dir, session_config.min_free_mb() * 1024 * 1024));
+            next_disk_check = chrono::steady_clock::now() + kDiskCheckInterval;
+            output_promise.set_value(std::move(output));
+            session_started = true;
+        }
+
         auto elapsed = chrono::duration_cast<chrono::seconds>(
             chrono::system_clock::now().time_since_epoch() - session_start_.load());
 
         // check to see if we've completed the specified duration or we've been told
-        // to terminate early
-        if (this->stop_recording_ || elapsed >= config.duration()) {
+        // to terminate early. an armed session runs until it is stopped
+        if (this->stop_recording_ || encoder_aborted || (session_started && elapsed >= session_config.duration())) {
             break;
         }
 
         // Wait for an image and then retrieve it. A timeout of 5000 ms is used.
         try {
+            StageTimer timer(&pipeline_stats_, PipelineStats::GRAB_WAIT);
             camera.RetrieveResult(5000, ptrGrabResult, TimeoutHandling_ThrowException);
         } catch (const GenericException &e) {
             // bailing out -- should we retry?
             err_msg_ = "Timeout retrieving frame: " + std::string(e.what());
             err_state_ = 1;
+            camera_failed = true;
             break;
         }
 
+        // frame number the next successfully grabbed frame will have
+        const uint64_t frame_number = frames_grabbed;
+
+        const auto now = chrono::steady_clock::now();
+        if (now >= next_statistics_update) {
+            UpdateStreamStatistics(camera, stream_baseline, frame_drop_stats_, drop_log.get(), frame_number);
+            if (drop_log) {
+                drop_log->Flush(frame_number);
+            }
+            next_statistics_update = now + kStreamStatisticsInterval;
+        }
+
+        // stop before the disk fills up rather than have writes start
+        // failing part way through a file
+        if (disk_monitor && now >= next_disk_check) {
+            const bool can_degrade = session_config.disk_throttle() && disk_throttle_level_ < max_throttle_level;
+            DiskSpaceMonitor::Action action = disk_monitor->Check(bytes_written_, session_config.duration() - elapsed,
+                                                                  can_degrade);
+            if (action == DiskSpaceMonitor::STOP) {
+                err_msg_ = "stopped recording: " + std::to_string(disk_monitor->free_bytes() / (1024 * 1024)) +
+                           " MB free on " + output_dir + ", minimum is " +
+                           std::to_string(session_config.min_free_mb()) + " MB";
+                err_state_ = 1;
+                std::clog << "camera " << serial_number_ << ": " << err_msg_ << std::endl;
+                ptrGrabResult.Release();
+                break;
+            } else if (action == DiskSpaceMonitor::DEGRADE) {
+                disk_throttle_level_++;
+                std::clog << "camera " << serial_number_ << ": disk expected to fill in "
+                          << static_cast<int64_t>(disk_monitor->seconds_to_full()) << "s at "
+                          << static_cast<int64_t>(disk_monitor->write_rate()) << " B/s, throttling to level "
+                          << disk_throttle_level_ << std::endl;
+            }
+            next_disk_check = now + kDiskCheckInterval;
+        }
+
+        // failed grabs still carry a block ID, so a gap in the IDs means
+        // frames the camera sent that never arrived at all
+        const uint64_t block_id = ptrGrabResult->GetBlockID();
+        const uint64_t missing_blocks = frame_drop_stats_.AddBlockId(block_id);
+        const uint64_t frame_timestamp = ptrGrabResult->GrabSucceeded() ? ptrGrabResult->GetTimeStamp() : 0;
+        if (missing_blocks && drop_log) {
+            drop_log->Record(frame_number, frame_timestamp, block_id, DropLog::MISSING_BLOCK, missing_blocks);
+        }
+
         if (!ptrGrabResult->GrabSucceeded()) {
             std::cerr << "Error: " << ptrGrabResult->GetErrorCode()
                       << " " << ptrGrabResult->GetErrorDescription() << std::endl;
+            frame_drop_stats_.AddGrabFailure();
+            if (drop_log) {
+                drop_log->Record(frame_number, 0, block_id, DropLog::GRAB_FAILED, 1);
+            }
             continue;
         }
 
         // got a frame from the camera
-        // get a pointer to the image buffer and
-        auto pImageBuffer = (uint8_t *)ptrGrabResult->GetBuffer();
-        // get the timestamp of the frame
-        auto frame_timestamp = ptrGrabResult->GetTimeStamp();
-
-        // record timestamp of first frame
-        if (frames_captured == 0) {
-            first_click = frame_timestamp;
+        // update the frame rate moving average and interval statistics. A
+        // gap in the timestamps also catches drops the block IDs can't show
+        // (e.g. the camera itself skipping frames), it is only logged when
+        // the block IDs don't already account for it
+        const uint64_t tick_gap = frame_rate_stats_.AddFrame(frame_timestamp);
+        if (tick_gap && !missing_blocks && drop_log) {
+            drop_log->Record(frame_number, frame_timestamp, block_id, DropLog::TICK_GAP, tick_gap);
         }
 
-        // calculate current framerate and add to the vector used for computing
-        // the moving average
-        current_fps = 1.0/((frame_timestamp - last_click)/125000000.0);
-        {
-            std::lock_guard<std::mutex> lock(mutex_);
-            if (moving_avg_.size() == moving_avg_.capacity())
-                moving_avg_.pop_back();
-            moving_avg_.insert(moving_avg_.begin(), current_fps);
-            last_click = frame_timestamp;
+        // copy a decimated Mono8 version of the frame for local viewers
+        if (preview_ring_ && ptrGrabResult->GetWidth() == static_cast<uint32_t>(preview_ring_->width()) &&
+            ptrGrabResult->GetHeight() == static_cast<uint32_t>(preview_ring_->height())) {
+            preview_ring_->Write(static_cast<const uint8_t*>(ptrGrabResult->GetBuffer()),
+                                 camera_pixel_format, frame_number, frame_timestamp);
         }
-
-        // record timestamp of current frame, as an offset from the first timestamp
-        // NOTE: Camera tick is measured at 125MHz, so divide by 125,000,000 to get the value in seconds
-        timestamp_file << (frame_timestamp - first_click) / 125000000.0 << std::endl;
-
-        // send frame to the encoder
-        video_writer.EncodeFrame(pImageBuffer, current_frame, live_stream_);
-
-        current_frame++;
-        frames_captured++;
-
-        // check to see if we need to roll over to a new file
-        if (config.fragment_by_hour() && GetCurrentHour() == next_hour) {
-            start_time = chrono::system_clock::now();
-            filename = output_dir + config.file_prefix() + timestamp(start_time);
-
-            // setup a VideoWriter to the new filename:
-            video_writer = VideoWriter(filename, rtmp_uri_, frame_width_, frame_height_, config);
-
-            next_hour = (GetCurrentHour(start_time) + 1) % 24;
-            current_frame = 0;
+        frames_grabbed++;
+
+        // hand the frame off to the encoder thread. If the encoder has
+        // fallen so far behind that the queue is full we drop this frame
+        // rather than stall the camera
+        if (!grab_queue.TryPush(std::move(ptrGrabResult))) {
+            frames_overflowed_++;
+            ptrGrabResult.Release();
+            if (drop_log) {
+                drop_log->Record(frame_number, frame_timestamp, block_id, DropLog::QUEUE_OVERFLOW, 1);
+            }
         }
 
-        ptrGrabResult.Release();
+        size_t depth = grab_queue.size();
+        frame_queue_depth_ = depth;
+        if (depth > frame_queue_high_water_) {
+            frame_queue_high_water_ = depth;
+        }
     }
     elapsed_time_ = chrono::duration_cast<chrono::seconds>(
         chrono::system_clock::now().time_since_epoch() - session_start_.load());
 
-    // out of acquisition loop, stop grabbing frames and shutdown the camera
-    camera.StopGrabbing();
-    camera.Close();
+    // tell the encoder thread we are done and wait for it to drain the queue
+    grabbing = false;
+    encoder_thread.join();
+    frame_queue_depth_ = 0;
+
+    if (encoder_aborted) {
+        err_msg_ = encoder_error;
+        err_state_ = 1;
+    }
+
+    // pick up any stream grabber drops since the last update
+    UpdateStreamStatistics(camera, stream_baseline, frame_drop_stats_, drop_log.get(), frames_grabbed);
+    if (drop_log && drop_log->events()) {
+        std::clog << "camera " << serial_number_ << ": " << drop_log->events() << " drop events, "
+                  << frame_drop_stats_.missing_blocks() << " missing blocks, "
+                  << frame_drop_stats_.grab_failures() << " failed grabs, "
+                  << frames_overflowed_ << " queue overflows, see " << drop_log_filename << std::endl;
+    }
+    drop_log.reset();
+
+    // out of acquisition loop, stop grabbing frames. The camera stays open
+    // for the next session unless it stopped delivering frames
+    try {
+        camera.StopGrabbing();
+    } catch (const GenericException &e) {
+        camera_failed = true;
+    }
+    if (camera_failed) {
+        CloseCamera();
+    }
     capturing_ = false;
+
+    // get an encoder ready for the next session while the camera is idle
+    if (warm_encoder_ && !camera_failed && !encoder_aborted) {
+        OpenStandbyWriter(session_config);
+    }
     recording_ = false;
 }
 
-PylonCameraController::CameraConfiguration::CameraConfiguration(
-    int frame_width, int frame_height, int target_fps,
-    const std::string& pixel_format, bool enable_pgi)
+void PylonCameraController::EncodeFrames(
+    const RecordingSessionConfig &config, GrabQueue &queue,
+    std::unique_ptr<VideoWriter> &video_writer, std::future<SessionOutput> &session_output,
+    const std::atomic_bool &grabbing, std::atomic_bool &aborted,
+    std::string &error)
 {
-    frame_width_ = frame_width;
-    frame_height_ = frame_height;
-    target_fps_ = target_fps;
+    size_t current_frame = 0;   // frame number in the session, the encoder keeps running across files
+    CGrabResultPtr ptrGrabResult;
 
-    // for YUV420P we get Mono8 off the camera
-    if (pixel_format == pixel_types::YUV420P) {
-        pixel_format_ = pixel_types::MONO8;
-    } else {
-        // pixel_format should have been validated by the time we get here
-        pixel_format_ = pixel_format;
+    // session files, from RecordVideo() once they exist
+    SessionOutput output;
+    bool session_started = false;
+
+    // if output.config.fragment_by_hour() is true, the first frame encoded at
+    // or after next_file_start triggers rolling over to a new file
+    chrono::system_clock::time_point next_file_start;
+
+    // timestamps of frames that may still end up in the video. An armed
+    // session doesn't know which will until its file has its first frame
+    std::deque<std::pair<size_t, uint64_t>> pending_timestamps;
+    bool timestamps_started = false;
+
+    // throttle level requested by the grab loop and the level applied to
+    // video_writer. The encoder is kept across files, so a throttled crf
+    // carries over to the next file
+    const bool adjust_crf = video_writer->encoder_name() == codecs::LIBX264;
+    unsigned int throttle_level = 0;
+    DiskSpaceMonitor::Throttle throttle = DiskSpaceMonitor::ThrottleSettings(0, config.crf(), adjust_crf);
+
+    // leaves frames out, the same way the disk throttle does, while the
+    // encoder can't keep up with the camera. null if the session isn't paced
+    std::unique_ptr<EncoderGovernor> governor;
+    unsigned int pacing_interval = 1;
+    if (config.adaptive_pacing()) {
+        governor = std::unique_ptr<EncoderGovernor>(new EncoderGovernor(config.target_fps(), queue.capacity()));
     }
 
-    enable_pgi_ = enable_pgi;
-}
+    // the next hour's file, opened in the background shortly before it is
+    // needed. The encoder stays open and switches to it at a keyframe
+    std::future<std::unique_ptr<VideoWriter::OutputFile>> next_file;
+    // previous hour's file being closed in the background
+    std::future<void> retired_file;
 
-void PylonCameraController::CameraConfiguration::OnOpened(CInstantCamera &camera)
-{
     try {
-        // Get the camera control object.
-        INodeMap &control = camera.GetNodeMap();
-
-        if (!camera.IsGigE()) {
-            throw RUNTIME_EXCEPTION("Could not apply configuration: Only GigE cameras are currently supported.");
+        while (1) {
+            if (!queue.TryPop(ptrGrabResult)) {
+                // queue is empty. we are done once the grab loop has
+                // stopped, otherwise wait for the next frame
+                if (!grabbing) {
+                    break;
+                }
+                std::this_thread::sleep_for(kGrabQueuePollInterval);
+                continue;
+            }
+            frame_queue_depth_ = queue.size();
+
+            // the session has its files. An armed session has been
+            // triggered, its video file starts with the pre-trigger video
+            if (!session_started && session_output.wait_for(chrono::seconds::zero()) == std::future_status::ready) {
+                output = session_output.get();
+                if (config.pre_trigger() > 0) {
+                    video_writer->OpenFile(SessionFilename(output), output.config);
+                }
+                if (output.config.fragment_by_hour()) {
+                    next_file_start = NextHour(output.start_time);
+                }
+                session_started = true;
+            }
+
+            // get a pointer to the image buffer and
+            auto pImageBuffer = (uint8_t *)ptrGrabResult->GetBuffer();
+            // get the timestamp of the frame
+            auto frame_timestamp = ptrGrabResult->GetTimeStamp();
+
+            // record timestamp of current frame. buffered, the log is only
+            // written out periodically
+            if (timestamps_started) {
+                output.timestamp_log->Append(frame_timestamp);
+            } else {
+                pending_timestamps.emplace_back(current_frame, frame_timestamp);
+            }
+
+            if (disk_throttle_level_ != throttle_level) {
+                throttle_level = disk_throttle_level_;
+                throttle = DiskSpaceMonitor::ThrottleSettings(throttle_level, config.crf(), adjust_crf);
+                if (throttle.crf != config.crf()) {
+                    video_writer->SetCrf(throttle.crf);
+                }
+            }
+
+            // a pacing change takes effect from this frame
+            if (governor && governor->frame_interval() != pacing_interval) {
+                pacing_interval = governor->frame_interval();
+                pacing_level_ = governor->level();
+                std::clog << "camera " << serial_number_ << ": encoder load " << governor->load()
+                          << ", encoding one of every " << pacing_interval << " frames" << std::endl;
+                const int64_t start_frame = video_writer->start_frame();
+                if (timestamps_started && output.drop_log && start_frame >= 0) {
+                    output.drop_log->Record(current_frame - start_frame, frame_timestamp, 0,
+                                            DropLog::PACING, pacing_interval);
+                }
+            }
+
+            // a throttled or paced session leaves frames out but keeps their
+            // slot in the timeline, so the file plays at the right speed and
+            // frame numbers still match the timestamp log
+            const unsigned int frame_interval = std::max(throttle.frame_interval, pacing_interval);
+            chrono::nanoseconds encode_time(0);
+            if (current_frame % frame_interval == 0) {
+                const auto encode_start = chrono::steady_clock::now();
+                // send frame to the encoder. if we can wrap the pylon buffer the
+                // encoder will reference it directly rather than copying it
+                StageTimer encode_timer(&pipeline_stats_, PipelineStats::ENCODE_FRAME);
+                AVBufferRef *frame_ref = WrapGrabResult(ptrGrabResult);
+                if (frame_ref) {
+                    video_writer->EncodeFrame(frame_ref, current_frame, live_stream_);
+                } else {
+                    video_writer->EncodeFrame(pImageBuffer, current_frame, live_stream_);
+                }
+                encode_timer.Stop();
+                encode_time = chrono::steady_clock::now() - encode_start;
+                frame_pool_hits_ = video_writer->frame_pool_hits();
+                frame_pool_misses_ = video_writer->frame_pool_misses();
+                bytes_written_ = video_writer->bytes_written();
+            } else {
+                frames_throttled_++;
+            }
+            if (governor) {
+                governor->AddFrame(queue.size(), encode_time);
+            }
+
+            // the keyframe starting the next file has been encoded
+            std::unique_ptr<VideoWriter::OutputFile> switched_out = video_writer->TakeRetiredFile();
+            if (switched_out) {
+                // the previous rollover's close has had an hour to finish
+                if (retired_file.valid()) {
+                    retired_file.wait();
+                }
+                retired_file = std::async(std::launch::async, RetireFile, std::move(switched_out));
+            }
+
+            // the log starts with the first frame in the video file. While
+            // armed only the frames still in the pre-trigger video are kept
+            if (!timestamps_started) {
+                const int64_t start_frame = video_writer->start_frame();
+                if (start_frame >= 0) {
+                    while (!pending_timestamps.empty() &&
+                           pending_timestamps.front().first < static_cast<size_t>(start_frame)) {
+                        pending_timestamps.pop_front();
+                    }
+                } else if (pending_timestamps.size() > kMaxPendingTimestamps) {
+                    pending_timestamps.pop_front();
+                }
+                if (session_started && start_frame >= 0) {
+                    for (const auto &pending : pending_timestamps) {
+                        output.timestamp_log->Append(pending.second);
+                    }
+                    pending_timestamps.clear();
+                    timestamps_started = true;
+                }
+            }
+
+            current_frame++;
+
+            if (timestamps_started && output.config.fragment_by_hour()) {
+                auto now = chrono::system_clock::now();
+
+                // start opening the next file ahead of time so rolling over
+                // doesn't stall the encoder while the file is created.
+                // PrepareFile() leaves the VideoWriter alone, it is only
+                // reset after this thread has waited for next_file
+                if (!next_file.valid() && now >= next_file_start - kRolloverLeadTime) {
+                    std::string filename = output.output_dir + output.config.file_prefix() + timestamp(next_file_start);
+                    const VideoWriter *writer = video_writer.get();
+                    RecordingSessionConfig file_config = output.config;
+                    next_file = std::async(std::launch::async, [writer, filename, file_config]() {
+                        return writer->PrepareFile(filename, file_config);
+                    });
+                }
+
+                // check to see if we need to roll over to a new file. the
+                // next frame encoded is a keyframe and starts the new file
+                if (now >= next_file_start) {
+                    // only blocks if the next file isn't ready yet. rethrows
+                    // any exception thrown while opening it
+                    video_writer->SwitchFile(next_file.get());
+                    output.timestamp_log->Flush();
+                    next_file_start = NextHour(next_file_start);
+                }
+            }
+
+            ptrGrabResult.Release();
         }
+    } catch (const std::exception &e) {
+        error = "error encoding video: " + std::string(e.what());
+        aborted = true;
+        ptrGrabResult.Release();
 
-        CBaslerGigEInstantCamera *gige_camera = dynamic_cast<CBaslerGigEInstantCamera *>(&camera);
-
+        // the grab loop stops pushing once it sees aborted, drain whatever is
+        // left so the pylon buffers are returned
+        while (grabbing || !queue.empty()) {
+            if (!queue.TryPop(ptrGrabResult)) {
+                std::this_thread::sleep_for(kGrabQueuePollInterval);
+            }
+        }
+    }
 
-        // Get the parameters for setting the image area of interest (Image AOI).
-        const CIntegerPtr width = control.GetNode("Width");
-        const CIntegerPtr height = control.GetNode("Height");
-        const CIntegerPtr offset_x = control.GetNode("OffsetX");
-        const CIntegerPtr offset_y = control.GetNode("OffsetY");
-        const CIntegerPtr auto_roi_width = control.GetNode("AutoFunctionAOIWidth");
-        const CIntegerPtr auto_roi_height = control.GetNode("AutoFunctionAOIHeight");
-        const CIntegerPtr auto_roi_offset_x = control.GetNode("AutoFunctionAOIOffsetX");
-        const CIntegerPtr auto_roi_offset_y = control.GetNode("AutoFunctionAOIOffsetY");
+    // triggered just as the session stopped. the pre-trigger video is still
+    // written out, along with the timestamps of its frames
+    if (!aborted && !timestamps_started) {
+        try {
+            if (!session_started && session_output.wait_for(chrono::seconds::zero()) == std::future_status::ready) {
+                output = session_output.get();
+                video_writer->OpenFile(SessionFilename(output), output.config);
+                session_started = true;
+            }
+            const int64_t start_frame = video_writer->start_frame();
+            if (session_started && start_frame >= 0) {
+                for (const auto &pending : pending_timestamps) {
+                    if (pending.first >= static_cast<size_t>(start_frame)) {
+                        output.timestamp_log->Append(pending.second);
+                    }
+                }
+            }
+        } catch (const std::exception &e) {
+            error = "error encoding video: " + std::string(e.what());
+            aborted = true;
+        }
+    }
 
-        // Set the AOI.
-        if (IsWritable(offset_x)) {
-            offset_x->SetValue(offset_x->GetMin());
+    // write out the last timestamps, so a failed write is reported with
+    // the session rather than only logged when the log is closed
+    if (session_started) {
+        try {
+            output.timestamp_log->Flush();
+        } catch (const std::exception &e) {
+            if (!aborted) {
+                error = e.what();
+                aborted = true;
+            }
         }
+    }
 
-        if (IsWritable(offset_y)) {
-            offset_y->SetValue(offset_y->GetMin());
+    // session ended before the next hour's file was used. wait for it to
+    // finish opening and then discard it so we don't leave an empty file
+    if (next_file.valid()) {
+        try {
+            next_file.get()->Remove();
+        } catch (const std::exception &e) {
+            std::cerr << "error opening video file: " << e.what() << std::endl;
         }
+    }
 
-        // Assign frame width/height
-        width->SetValue(frame_width_);
-        height->SetValue(frame_height_);
+    if (retired_file.valid()) {
+        retired_file.wait();
+    }
+}
 
-        // Re-center, the GetMax is already shifted given the width/height
-        if (IsWritable(offset_x)) {
-            offset_x->SetValue(int(offset_x->GetMax() / 2));
-        }
-        if (IsWritable(offset_y)) {
-            offset_y->SetValue(int(offset_y->GetMax() / 2));
-        }
+void PylonCameraController::UpdatePreviewRing()
+{
+    if (preview_fps_ <= 0 || preview_name_.empty()) {
+        preview_ring_.reset();
+        return;
+    }
+    if (preview_ring_ && preview_ring_->name() == preview_name_ && preview_ring_->fps() == preview_fps_ &&
+        preview_ring_->width() == image_width_ && preview_ring_->height() == image_height_) {
+        return;
+    }
 
-        // Set the pixel data format.
-        CEnumerationPtr(control.GetNode("PixelFormat"))->FromString(pixel_format_.c_str());
+    // the old segment has to go before one with the same name is created
+    preview_ring_.reset();
+    try {
+        preview_ring_ = std::unique_ptr<PreviewRing>(
+            new PreviewRing(preview_name_, image_width_, image_height_, preview_fps_, kCameraTickRate));
+    } catch (const std::runtime_error &e) {
+        // recording doesn't depend on the preview, carry on without it
+        std::cerr << "preview disabled: " << e.what() << std::endl;
+    }
+}
 
-        CEnumerationPtr(control.GetNode("ShutterMode"))->FromString("Global");
+PylonCameraController::CameraSettings::CameraSettings(
+    const RecordingSessionConfig &config, int frame_width, int frame_height)
+{
+    roi_width = config.roi_width() ? config.roi_width() : frame_width;
+    roi_height = config.roi_height() ? config.roi_height() : frame_height;
+    roi_offset_x = config.roi_offset_x();
+    roi_offset_y = config.roi_offset_y();
+    binning = config.binning();
+    decimation = config.decimation();
+    target_fps = config.target_fps();
+
+    // for YUV420P we get Mono8 off the camera
+    if (config.pixel_format() == pixel_types::YUV420P) {
+        pixel_format = pixel_types::MONO8;
+    } else {
+        // pixel_format should have been validated by the time we get here
+        pixel_format = config.pixel_format();
+    }
+}
+
+bool PylonCameraController::CameraSettings::SameImageFormat(const CameraSettings &other) const
+{
+    return roi_width == other.roi_width && roi_height == other.roi_height &&
+           roi_offset_x == other.roi_offset_x && roi_offset_y == other.roi_offset_y &&
+           binning == other.binning && decimation == other.decimation &&
+           pixel_format == other.pixel_format;
+}
 
-        gige_camera->AutoFunctionAOISelector.SetValue(Basler_GigECameraParams::AutoFunctionAOISelector_AOI1);
+PylonCameraController::CameraConfiguration::CameraConfiguration(
+    const CameraSettings &settings, bool enable_pgi) :
+    settings_(settings),
+    enable_pgi_(enable_pgi) {}
+
+void PylonCameraController::CameraConfiguration::ApplyImageFormat(
+    CBaslerGigEInstantCamera &camera, const CameraSettings &settings)
+{
+    // Get the camera control object.
+    INodeMap &control = camera.GetNodeMap();
+
+    // Get the parameters for setting the image area of interest (Image AOI).
+    const CIntegerPtr width = control.GetNode("Width");
+    const CIntegerPtr height = control.GetNode("Height");
+    const CIntegerPtr offset_x = control.GetNode("OffsetX");
+    const CIntegerPtr offset_y = control.GetNode("OffsetY");
+    const CIntegerPtr auto_roi_width = control.GetNode("AutoFunctionAOIWidth");
+    const CIntegerPtr auto_roi_height = control.GetNode("AutoFunctionAOIHeight");
+    const CIntegerPtr auto_roi_offset_x = control.GetNode("AutoFunctionAOIOffsetX");
+    const CIntegerPtr auto_roi_offset_y = control.GetNode("AutoFunctionAOIOffsetY");
+
+    // Set the pixel data format. first, the binning modes and AOI
+    // increments available can depend on it
+    CEnumerationPtr(control.GetNode("PixelFormat"))->FromString(settings.pixel_format.c_str());
+
+    // binning and decimation change the range of the AOI nodes, which
+    // are in binned/decimated pixels from here on
+    SetSubsampling(control, "BinningHorizontal", settings.binning);
+    SetSubsampling(control, "BinningVertical", settings.binning);
+    SetSubsampling(control, "DecimationHorizontal", settings.decimation);
+    SetSubsampling(control, "DecimationVertical", settings.decimation);
+    const int64_t subsampling = settings.binning * settings.decimation;
+
+    // Set the AOI.
+    if (IsWritable(offset_x)) {
+        offset_x->SetValue(offset_x->GetMin());
+    }
+
+    if (IsWritable(offset_y)) {
+        offset_y->SetValue(offset_y->GetMin());
+    }
+
+    // Assign frame width/height. Even, the encoder subsamples chroma
+    width->SetValue(AlignedValue(width, settings.roi_width / subsampling, 2));
+    height->SetValue(AlignedValue(height, settings.roi_height / subsampling, 2));
+
+    // Position the AOI, the GetMax is already shifted given the
+    // width/height. Centered unless an offset was given
+    if (IsWritable(offset_x)) {
+        offset_x->SetValue(AlignedValue(offset_x, settings.roi_offset_x < 0 ? offset_x->GetMax() / 2
+                                                                            : settings.roi_offset_x / subsampling));
+    }
+    if (IsWritable(offset_y)) {
+        offset_y->SetValue(AlignedValue(offset_y, settings.roi_offset_y < 0 ? offset_y->GetMax() / 2
+                                                                            : settings.roi_offset_y / subsampling));
+    }
+
+    // Assign the auto-gain to only look at the image AOI, AOI1 is used
+    // for exposure balancing and AOI2 for white balancing
+    const Basler_GigECameraParams::AutoFunctionAOISelectorEnums auto_rois[] = {
+        Basler_GigECameraParams::AutoFunctionAOISelector_AOI1,
+        Basler_GigECameraParams::AutoFunctionAOISelector_AOI2
+    };
+    for (auto auto_roi : auto_rois) {
+        camera.AutoFunctionAOISelector.SetValue(auto_roi);
 
-        // Assign the auto-gain to only look at the RoI assigned for exposure balancing
-        //camera.AutoFunctionAOISelector.SetValue(AutoFunctionAOISelector_AOI1);
         if (IsWritable(auto_roi_offset_x)) {
             auto_roi_offset_x->SetValue(auto_roi_offset_x->GetMin());
         }
@@ -274,42 +1087,42 @@ void PylonCameraController::CameraConfiguration::OnOpened(CInstantCamera &camera
             auto_roi_offset_y->SetValue(auto_roi_offset_y->GetMin());
         }
 
-        // Assign frame width/height
-        auto_roi_width->SetValue(frame_width_);
-        auto_roi_height->SetValue(frame_height_);
+        auto_roi_width->SetValue(AlignedValue(auto_roi_width, width->GetValue()));
+        auto_roi_height->SetValue(AlignedValue(auto_roi_height, height->GetValue()));
 
-        // Re-center, the GetMax is already shifted given the width/height
-        if (IsWritable(auto_roi_offset_x)) {
-            auto_roi_offset_x->SetValue(int(auto_roi_offset_x->GetMax() / 2));
+        // same position as the image AOI
+        if (IsWritable(auto_roi_offset_x) && IsReadable(offset_x)) {
+            auto_roi_offset_x->SetValue(AlignedValue(auto_roi_offset_x, offset_x->GetValue()));
         }
-
-        if (IsWritable(auto_roi_offset_y)) {
-            auto_roi_offset_y->SetValue(int(auto_roi_offset_y->GetMax() / 2));
+        if (IsWritable(auto_roi_offset_y) && IsReadable(offset_y)) {
+            auto_roi_offset_y->SetValue(AlignedValue(auto_roi_offset_y, offset_y->GetValue()));
         }
+    }
+}
 
-        gige_camera->AutoFunctionAOISelector.SetValue(Basler_GigECameraParams::AutoFunctionAOISelector_AOI2);
+void PylonCameraController::CameraConfiguration::ApplyFrameRate(CBaslerGigEInstantCamera &camera, int target_fps)
+{
+    INodeMap &control = camera.GetNodeMap();
+    CBooleanPtr(control.GetNode("AcquisitionFrameRateEnable"))->SetValue(true);
+    CFloatPtr(control.GetNode("AcquisitionFrameRateAbs"))->SetValue(target_fps);
+}
 
-        // Assign the auto-gain to only look at the RoI assigned for white balancing
-        if (IsWritable(auto_roi_offset_x)) {
-            auto_roi_offset_x->SetValue(auto_roi_offset_x->GetMin());
-        }
+void PylonCameraController::CameraConfiguration::OnOpened(CInstantCamera &camera)
+{
+    try {
+        // Get the camera control object.
+        INodeMap &control = camera.GetNodeMap();
 
-        if (IsWritable(auto_roi_offset_y)) {
-            auto_roi_offset_y->SetValue(auto_roi_offset_y->GetMin());
+        if (!camera.IsGigE()) {
+            throw RUNTIME_EXCEPTION("Could not apply configuration: Only GigE cameras are currently supported.");
         }
 
-        // Assign frame width/height
-        auto_roi_width->SetValue(frame_width_);
-        auto_roi_height->SetValue(frame_height_);
+        CBaslerGigEInstantCamera *gige_camera = dynamic_cast<CBaslerGigEInstantCamera *>(&camera);
 
-        // Re-center, the GetMax is already shifted given the width/height
-        if (IsWritable(auto_roi_offset_x)) {
-            auto_roi_offset_x->SetValue(int(auto_roi_offset_x->GetMax() / 2));
-        }
+        // pixel format and AOI, these can change between sessions
+        ApplyImageFormat(*gige_camera, settings_);
 
-        if (IsWritable(auto_roi_offset_y)) {
-            auto_roi_offset_y->SetValue(int(auto_roi_offset_y->GetMax() / 2));
-        }
+        CEnumerationPtr(control.GetNode("ShutterMode"))->FromString("Global");
 
         // Enforce a 15ms exposure time manually
         gige_camera->ExposureTimeRaw.SetValue(15000);
@@ -334,8 +1147,7 @@ void PylonCameraController::CameraConfiguration::OnOpened(CInstantCamera &camera
         }
 
         // Framerate items
-        CBooleanPtr(control.GetNode("AcquisitionFrameRateEnable"))->SetValue(true);
-        CFloatPtr(control.GetNode("AcquisitionFrameRateAbs"))->SetValue(target_fps_);
+        ApplyFrameRate(*gige_camera, settings_.target_fps);
     }
     catch (const GenericException &e) {
         throw RUNTIME_EXCEPTION(
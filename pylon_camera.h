@@ -3,52 +3,264 @@
 #ifndef PYLON_CAMERA_H
 #define PYLON_CAMERA_H
 
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <future>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include <pylon/PylonIncludes.h>
 #include <pylon/gige/BaslerGigEInstantCamera.h>
 #include <pylon/VideoWriter.h>
 
 #include "camera_controller.h"
+#include "frame_ring.h"
+#include "preview_ring.h"
+
+class VideoWriter;
 
 /**
  * @brief CameraController for a Basler camera using pylon
  */
 class PylonCameraController : public CameraController {
 public:
+    /**
+     * @param directory base video capture directory
+     * @param frame_width frame width in pixels
+     * @param frame_height frame height in pixels
+     * @param nv_room_string output subdirectory name
+     * @param rtmp_uri rtmp URI for live streaming
+     * @param serial_number serial number of the camera to record from, empty
+     * to use the first camera found
+     */
     PylonCameraController(
         const std::string &directory, int frame_width, int frame_height,
-        const std::string &nv_room_string, const std::string &rtmp_uri
-    ) : CameraController(directory, frame_width, frame_height, nv_room_string, rtmp_uri) {}
+        const std::string &nv_room_string, const std::string &rtmp_uri,
+        const std::string &serial_number = ""
+    ) : CameraController(directory, frame_width, frame_height, nv_room_string, rtmp_uri),
+        serial_number_(serial_number) {}
+
+    /// stop any active recording before the camera and the members it uses are destroyed
+    ~PylonCameraController();
+
+    /// serial number of the camera, empty if using the first camera found
+    const std::string& serial_number() const {return serial_number_;}
+
+    /**
+     * @brief list the cameras attached to this host
+     * @return serial numbers of all cameras pylon can see, empty if none
+     * were found or enumeration failed
+     */
+    static std::vector<std::string> EnumerateSerialNumbers();
+
+    /// the encoder can hold pre-trigger video, see Arm()
+    bool can_arm() const {return true;}
 
 private:
 
+    /// camera settings that can change from one session to the next
+    struct CameraSettings {
+        CameraSettings() = default;
+
+        /**
+         * @param config session settings: frame rate, pixel format, region
+         * of interest, binning and decimation
+         * @param frame_width region of interest width if config doesn't set one
+         * @param frame_height region of interest height if config doesn't set one
+         */
+        CameraSettings(const RecordingSessionConfig& config, int frame_width, int frame_height);
+
+        /// true if other reads out the same pixels in the same format
+        bool SameImageFormat(const CameraSettings& other) const;
+
+        int roi_width = 0;          ///< region of interest width in sensor pixels
+        int roi_height = 0;         ///< region of interest height in sensor pixels
+        int roi_offset_x = -1;      ///< region of interest left edge in sensor pixels, negative to center
+        int roi_offset_y = -1;      ///< region of interest top edge in sensor pixels, negative to center
+        int binning = 1;            ///< binning factor
+        int decimation = 1;         ///< decimation factor
+        int target_fps = 0;         ///< target frames per second
+        std::string pixel_format;   ///< camera pixel format
+    };
+
     /**
      * private inner class used to extend Pylon::CConfigurationEventHandler to
      * apply our custom camera configuration
      */
     class CameraConfiguration : public Pylon::CConfigurationEventHandler {
     public:
-        CameraConfiguration(int frame_width, int frame_height, int target_fps,
-                            const std::string& pixel_format, bool enablePGI);
+        /**
+         * @param settings settings of the first session on the camera
+         * @param enablePGI enable Basler PGI image enhancement
+         */
+        CameraConfiguration(const CameraSettings& settings, bool enablePGI);
         void OnOpened(Pylon::CInstantCamera &camera);
 
+        /**
+         * @brief set the pixel format, binning, decimation and area of
+         * interest of an open camera that isn't grabbing
+         *
+         * throws GenICam exceptions
+         */
+        static void ApplyImageFormat(Pylon::CBaslerGigEInstantCamera &camera, const CameraSettings& settings);
+
+        /**
+         * @brief set the frame rate of an open camera
+         *
+         * throws GenICam exceptions
+         */
+        static void ApplyFrameRate(Pylon::CBaslerGigEInstantCamera &camera, int target_fps);
+
     private:
-        int frame_width_;           ///< frame width in pixels
-        int frame_height_;          ///< frame height in pixels
-        int target_fps_;            ///< target frames per second
-        std::string pixel_format_;  ///< pixel format
+        CameraSettings settings_;   ///< session settings
         bool enable_pgi_;           ///< enable pgi flag
     };
 
+    /// queue used to hand grabbed frames from the grab loop to the encoder thread
+    using GrabQueue = FrameRing<Pylon::CGrabResultPtr>;
+
+    /// files of a recording session, created by the grab thread and handed to the encoder thread
+    struct SessionOutput {
+        RecordingSessionConfig config;                  ///< session and file settings
+        std::string output_dir;                         ///< output directory, with trailing slash
+        std::unique_ptr<TimestampLog> timestamp_log;    ///< per-frame timestamp output
+        std::chrono::system_clock::time_point start_time;  ///< start of the session
+        DropLog *drop_log = nullptr;                    ///< drop log owned by the grab thread, may be null
+    };
+
     // private methods
 
+    /**
+     * @brief get the camera ready for a session
+     *
+     * the camera stays open between sessions. If it is still open only the
+     * settings that differ from the last session are applied, otherwise (or
+     * if that fails) the camera is attached and opened again. Only called
+     * from the recording thread
+     *
+     * throws GenICam exceptions if the camera can't be opened or configured
+     *
+     * @param config session settings
+     * @return the open camera, not grabbing
+     */
+    Pylon::CBaslerGigEInstantCamera& OpenCamera(const RecordingSessionConfig& config);
+
+    /// close and detach the camera, the next session opens it again
+    void CloseCamera();
+
+    /**
+     * @brief open an encoder for the next session in the background
+     *
+     * see SetWarmEncoder(). The encoder is opened with the encode thread
+     * policy so the threads it starts inherit it
+     *
+     * @param config settings of the session that just ended
+     */
+    void OpenStandbyWriter(const RecordingSessionConfig& config);
+
+    /**
+     * @brief take the encoder opened after the last session
+     *
+     * waits for it if it is still opening
+     *
+     * @param config settings of the new session
+     * @return the VideoWriter, waiting for OpenFile(). null if there is none
+     * or it was opened with settings the session can't use
+     */
+    std::unique_ptr<VideoWriter> TakeStandbyWriter(const RecordingSessionConfig& config);
+
     /**
      * @brief implements the recording thread for a Basler camera using pylon
      *
+     * The recording thread only retrieves frames from the camera and pushes
+     * them onto a GrabQueue. Encoding, timestamp output and file rollover
+     * happen in a separate thread running EncodeFrames() so a slow encoder or
+     * disk can't hold up the camera's buffers. Once the encoder thread has
+     * been started this thread switches to the grab thread policy.
+     *
+     * An armed session (config.pre_trigger() > 0) creates its files once
+     * it is triggered, the encoder keeps the most recent video in memory until
+     * then.
+     *
      * @param config RecordingSessionConfig
      */
     void RecordVideo(const RecordingSessionConfig& config);
 
+    /**
+     * @brief create the output directory and timestamp files of a session
+     *
+     * sets err_msg_ and err_state_ on failure
+     *
+     * @param config session settings
+     * @param output filled in with the session's files and start time
+     * @param drop_log opened drop log, left null if it can't be opened
+     * @param drop_log_filename path of the drop log
+     * @return true if the session can go ahead
+     */
+    bool OpenSessionOutput(const RecordingSessionConfig& config, SessionOutput& output,
+                           std::unique_ptr<DropLog>& drop_log, std::string& drop_log_filename);
+
+    /**
+     * @brief filename of the first video file of a session, without extension
+     * @param output session files
+     */
+    std::string SessionFilename(const SessionOutput& output);
+
+    /**
+     * @brief encoder thread for a recording session
+     *
+     * pops frames off of the queue until grabbing has finished and the queue
+     * has been drained.
+     *
+     * The VideoWriter for each hour's file is opened on a background thread
+     * shortly before the hour starts and the previous one is closed on a
+     * background thread, so rolling over to a new file is just a pointer swap.
+     *
+     * Frames are encoded from the start, the session's files may only arrive
+     * later through session_output. An armed session's video file starts with
+     * the pre-trigger video and its timestamp log with the first frame in that
+     * file.
+     *
+     * @param config RecordingSessionConfig, the encoder settings of the session
+     * @param queue queue of frames filled by RecordVideo()
+     * @param video_writer VideoWriter for the first output file, without a
+     * file while armed. replaced at each rollover
+     * @param session_output session files, set by RecordVideo()
+     * @param grabbing set to false by RecordVideo() once it stops pushing frames
+     * @param aborted set by this thread if it terminates early due to an error
+     * @param error error message, set if aborted is set
+     */
+    void EncodeFrames(const RecordingSessionConfig& config, GrabQueue& queue,
+                      std::unique_ptr<VideoWriter>& video_writer,
+                      std::future<SessionOutput>& session_output,
+                      const std::atomic_bool& grabbing, std::atomic_bool& aborted,
+                      std::string& error);
+
+    /**
+     * @brief create, replace or remove the preview ring for a new session
+     *
+     * the ring is kept between sessions so readers stay attached, it is only
+     * recreated if the preview settings or frame size changed
+     */
+    void UpdatePreviewRing();
+
+    std::string serial_number_; ///< camera to open, empty for the first camera found
+
+    /// keeps pylon initialized while the camera is open, declared before camera_
+    Pylon::PylonAutoInitTerm auto_init_term_;
+
+    /// camera kept open between sessions, only used by the recording thread. null if closed
+    std::unique_ptr<Pylon::CBaslerGigEInstantCamera> camera_;
+
+    /// settings applied to camera_
+    CameraSettings camera_settings_;
+
+    /// encoder opened after the last session for the next one, see OpenStandbyWriter()
+    std::future<std::unique_ptr<VideoWriter>> standby_writer_;
+
+    /// shared memory preview, only used by the recording thread. null if disabled
+    std::unique_ptr<PreviewRing> preview_ring_;
 };
 #endif
\ No newline at end of file
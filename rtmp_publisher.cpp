@@ -0,0 +1,247 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+#include "rtmp_publisher.h"
+
+namespace chrono = std::chrono;
+
+// delay before retrying after the first failed connection attempt, doubled
+// after each consecutive failure up to kMaxReconnectBackoff
+const chrono::seconds kInitialReconnectBackoff(1);
+const chrono::seconds kMaxReconnectBackoff(60);
+
+const size_t RtmpPublisher::kDefaultQueueCapacity;
+
+RtmpPublisher::RtmpPublisher(const std::string &uri, const AVCodecContext *codec_context,
+                             PipelineStats *stats, size_t queue_capacity) :
+    uri_(uri),
+    codec_time_base_(codec_context->time_base),
+    codec_parameters_(avcodec_parameters_alloc()),
+    stats_(stats),
+    queue_capacity_(std::max<size_t>(queue_capacity, 1)),
+    backoff_(kInitialReconnectBackoff)
+{
+    if (!codec_parameters_ ||
+        avcodec_parameters_from_context(codec_parameters_.get(), codec_context) < 0) {
+        throw std::runtime_error("unable to copy codec parameters for rtmp stream");
+    }
+
+    // everything the thread uses is initialized, start it
+    thread_ = std::thread(&RtmpPublisher::Run, this);
+}
+
+RtmpPublisher::~RtmpPublisher()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+
+    if (packets_dropped_) {
+        std::clog << "rtmp stream dropped " << packets_dropped_ << " of "
+                  << packets_sent_ + packets_dropped_ << " packets" << std::endl;
+    }
+}
+
+void RtmpPublisher::Send(const AVPacket *pkt)
+{
+    // reuse a packet struct from the free list, only allocating until the
+    // queue has been full once
+    av_pointer::packet ref;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!free_packets_.empty()) {
+            ref = std::move(free_packets_.back());
+            free_packets_.pop_back();
+        }
+    }
+    if (!ref) {
+        ref = av_pointer::packet(av_packet_alloc());
+    }
+
+    // reference the packet so the payload is shared with the file output
+    // rather than copied
+    if (!ref || av_packet_ref(ref.get(), pkt) < 0) {
+        packets_dropped_++;
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (queue_.size() >= queue_capacity_) {
+            // publisher has fallen behind. drop the oldest packet, the
+            // stream can't be decoded again until the next keyframe
+            Recycle(std::move(queue_.front()));
+            queue_.pop_front();
+            packets_dropped_++;
+            resync_ = true;
+        }
+        queue_.push_back(std::move(ref));
+    }
+    cv_.notify_one();
+}
+
+void RtmpPublisher::Recycle(av_pointer::packet pkt)
+{
+    av_packet_unref(pkt.get());
+    free_packets_.push_back(std::move(pkt));
+}
+
+void RtmpPublisher::Run()
+{
+    auto next_attempt = chrono::steady_clock::now();
+
+    while (!stop_) {
+        if (!format_context_) {
+            if (chrono::steady_clock::now() >= next_attempt) {
+                if (Connect()) {
+                    backoff_ = kInitialReconnectBackoff;
+                } else {
+                    next_attempt = chrono::steady_clock::now() + backoff_;
+                    backoff_ = std::min(backoff_ * 2, kMaxReconnectBackoff);
+                }
+            }
+
+            if (!format_context_) {
+                // Send() keeps the queue bounded while we wait, and
+                // Connect() discards anything stale once we are back
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait_until(lock, next_attempt, [this] {return stop_.load();});
+                continue;
+            }
+        }
+
+        av_pointer::packet pkt;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this] {return stop_ || !queue_.empty();});
+            if (stop_) {
+                break;
+            }
+            pkt = std::move(queue_.front());
+            queue_.pop_front();
+
+            if (resync_) {
+                if (!(pkt->flags & AV_PKT_FLAG_KEY)) {
+                    Recycle(std::move(pkt));
+                    packets_dropped_++;
+                    continue;
+                }
+                resync_ = false;
+            }
+        }
+
+        // rescale output packet timestamp values from codec to stream timebase
+        av_packet_rescale_ts(pkt.get(), codec_time_base_, stream_->time_base);
+        StageTimer timer(stats_, PipelineStats::RTMP_WRITE);
+        int rval = av_interleaved_write_frame(format_context_.get(), pkt.get());
+        timer.Stop();
+        if (rval < 0) {
+            packets_dropped_++;
+            if (stop_) {
+                break;
+            }
+            std::clog << "error writing frame to rtmp stream: " << av_err2str(rval) << std::endl;
+
+            // if the streaming server closes the connection unexpectedly
+            // (ECONNRESET) or we lose the connection (EPIPE) then reconnect.
+            // the first attempt is immediate, repeated failures back off
+            if (rval == AVERROR(EPIPE) || rval == AVERROR(ECONNRESET)) {
+                Disconnect();
+                next_attempt = chrono::steady_clock::now();
+            }
+        } else {
+            packets_sent_++;
+        }
+
+        // the muxer took the packet contents, keep the struct for Send()
+        std::lock_guard<std::mutex> lock(mutex_);
+        Recycle(std::move(pkt));
+    }
+
+    Disconnect();
+}
+
+/*
+ * setup the rtmp stream.
+ * if we encounter any errors we log them and return false, Run() will try
+ * again once the backoff has expired
+ * TODO -- eventually we may want to relay the streaming error to the server in order to inform the client
+ */
+bool RtmpPublisher::Connect()
+{
+    // allocate output format context
+    AVFormatContext *tmp_f_context = nullptr;
+    avformat_alloc_output_context2(&tmp_f_context, NULL, "flv", uri_.c_str());
+    if (!tmp_f_context) {
+        std::cerr << "unable to allocate rtmp output format context\n";
+        return false;
+    }
+
+    // transfer management of the allocated format context to a smart pointer
+    av_pointer::format_context context(tmp_f_context);
+
+    // let the destructor abort connecting or writing
+    context->interrupt_callback.callback = &RtmpPublisher::Interrupt;
+    context->interrupt_callback.opaque = this;
+
+    // add stream to output context
+    AVStream *stream = avformat_new_stream(context.get(), NULL);
+    if (!stream || avcodec_parameters_copy(stream->codecpar, codec_parameters_.get()) < 0) {
+        std::cerr << "unable to add stream to rtmp output\n";
+        return false;
+    }
+    stream->time_base = codec_time_base_;
+
+    // open rtmp stream
+    if (!(context->oformat->flags & AVFMT_NOFILE)) {
+        int r = avio_open2(&context->pb, uri_.c_str(), AVIO_FLAG_WRITE,
+                           &context->interrupt_callback, NULL);
+        if (r < 0) {
+            std::cerr << "unable to open rtmp stream: " << av_err2str(r) << std::endl;
+            return false;
+        }
+    }
+
+    // write header to stream
+    if (avformat_write_header(context.get(), NULL) < 0) {
+        std::cerr << "unable to write header to rtmp stream\n";
+        // close without writing a trailer, there is no header to go with it
+        avio_closep(&context->pb);
+        return false;
+    }
+
+    // anything queued while we were disconnected is stale, start the new
+    // connection with the next keyframe
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        packets_dropped_ += queue_.size();
+        while (!queue_.empty()) {
+            Recycle(std::move(queue_.front()));
+            queue_.pop_front();
+        }
+        resync_ = true;
+    }
+
+    format_context_ = std::move(context);
+    stream_ = stream;
+    connected_ = true;
+    return true;
+}
+
+void RtmpPublisher::Disconnect()
+{
+    connected_ = false;
+    stream_ = nullptr;
+    format_context_.reset();
+}
+
+int RtmpPublisher::Interrupt(void *opaque)
+{
+    return static_cast<RtmpPublisher*>(opaque)->stop_ ? 1 : 0;
+}
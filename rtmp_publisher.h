@@ -0,0 +1,135 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#ifndef RTMP_PUBLISHER_H
+#define RTMP_PUBLISHER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "packet_sink.h"
+#include "pipeline_stats.h"
+#include "video_writer.h"
+
+/**
+ * @brief publishes encoded packets to an rtmp server from its own thread
+ *
+ * The encoder thread hands packets to Send(), which only takes a new
+ * reference to the packet data and appends it to a bounded queue. The
+ * AVPacket structs holding those references are recycled, so steady state
+ * streaming doesn't allocate. Connecting
+ * to the server, writing the flv header and sending packets all happen on
+ * the publisher thread, so a slow or unreachable streaming server can never
+ * hold up recording.
+ *
+ * If the queue is full the oldest packet is dropped. Since the stream can't
+ * be decoded again until the next keyframe, after a drop (or a reconnect)
+ * packets are discarded until a keyframe is seen. Failed connections are
+ * retried with exponential backoff.
+ */
+class RtmpPublisher : public PacketSink {
+public:
+    /**
+     * @brief create a publisher and start its thread
+     *
+     * The connection is made in the background, the constructor doesn't
+     * block on the network.
+     *
+     * @param uri rtmp uri to publish to
+     * @param codec_context opened encoder context producing the packets
+     * @param stats histograms to record write latency into, may be null
+     * @param queue_capacity maximum number of packets waiting to be sent
+     */
+    RtmpPublisher(const std::string& uri, const AVCodecContext *codec_context,
+                  PipelineStats *stats = nullptr,
+                  size_t queue_capacity = kDefaultQueueCapacity);
+
+    /**
+     * @brief stop the publisher thread and close the connection
+     *
+     * any packets still queued are discarded. A connection attempt in
+     * progress is interrupted rather than waited for.
+     */
+    ~RtmpPublisher();
+
+    RtmpPublisher(const RtmpPublisher&) = delete;
+    RtmpPublisher& operator=(const RtmpPublisher&) = delete;
+
+    /**
+     * @brief queue a packet for publishing
+     *
+     * never blocks on the network. The packet isn't modified, the queue holds
+     * its own reference to the packet data.
+     *
+     * @param pkt encoded packet, timestamps in the codec time base
+     */
+    void Send(const AVPacket *pkt);
+
+    /// true if the publisher currently has an open connection
+    bool connected() const {return connected_;}
+
+    /// number of packets sent to the server
+    uint64_t packets_sent() const {return packets_sent_;}
+
+    /// number of packets discarded because of a full queue or lost connection
+    uint64_t packets_dropped() const {return packets_dropped_;}
+
+    /// default queue capacity, a few seconds of video at typical frame rates
+    static const size_t kDefaultQueueCapacity = 256;
+
+private:
+    /// publisher thread main loop
+    void Run();
+
+    /**
+     * @brief open the rtmp connection and write the flv header
+     * @return true if the stream is ready for packets
+     */
+    bool Connect();
+
+    /// close the connection, if open
+    void Disconnect();
+
+    /**
+     * @brief return a packet to the free list
+     *
+     * drops the packet's data reference. must be called with mutex_ held
+     *
+     * @param pkt packet no longer in use
+     */
+    void Recycle(av_pointer::packet pkt);
+
+    /// ffmpeg interrupt callback, aborts blocking io once stop_ is set
+    static int Interrupt(void *opaque);
+
+    std::string uri_;                               ///< rtmp uri
+    AVRational codec_time_base_;                    ///< time base of queued packets
+    av_pointer::codec_parameters codec_parameters_; ///< copy of the encoder parameters
+    av_pointer::format_context format_context_;     ///< flv output, null when not connected
+    AVStream *stream_ = nullptr;                    ///< stream in format_context_
+    PipelineStats *stats_;                          ///< latency histograms, not owned. may be null
+
+    const size_t queue_capacity_;       ///< maximum number of queued packets
+    std::deque<av_pointer::packet> queue_; ///< packets waiting to be sent, guarded by mutex_
+    std::vector<av_pointer::packet> free_packets_; ///< unused packets for Send(), guarded by mutex_
+    bool resync_ = true;                ///< discard packets until a keyframe, guarded by mutex_
+    std::mutex mutex_;
+    std::condition_variable cv_;
+
+    std::atomic_bool stop_ {false};
+    std::atomic_bool connected_ {false};
+    std::atomic<uint64_t> packets_sent_ {0};
+    std::atomic<uint64_t> packets_dropped_ {0};
+
+    std::chrono::seconds backoff_;      ///< delay before the next connection attempt
+
+    std::thread thread_;                ///< publisher thread, started last
+};
+
+#endif
@@ -1,11 +1,14 @@
 #include "server_command.h"
 
+#include <algorithm>
+
 #include <cpprest/json.h>
 
 using namespace web;
 using namespace CommandTypes;
 
 #define START_CMD "START"
+#define ARM_CMD "ARM"
 #define STOP_CMD  "STOP"
 #define COMPLETE_CMD "COMPLETE"
 #define STREAM_CMD "STREAM"
@@ -14,6 +17,8 @@ CommandTypes::CommandTypes getCommand(json::value payload)
 {
     if (payload["command_name"].as_string() == START_CMD) {
         return CommandTypes::START_RECORDING;
+    } else if (payload["command_name"].as_string() == ARM_CMD) {
+        return CommandTypes::ARM_RECORDING;
     } else if (payload["command_name"].as_string() == STOP_CMD) {
         return CommandTypes::STOP_RECORDING;
     } else if (payload["command_name"].as_string() == COMPLETE_CMD) {
@@ -24,9 +29,19 @@ CommandTypes::CommandTypes getCommand(json::value payload)
     return CommandTypes::UNKNOWN;
 }
 
+// get an optional integer parameter, returning default_value if it is missing or null
+static int OptionalInt(json::value &parameters, const std::string &name, int default_value)
+{
+    if (parameters.has_field(name) && !parameters[name].is_null()) {
+        return parameters[name].as_number().to_int32();
+    }
+    return default_value;
+}
+
 RecordingParameters RecordCommand::parseRecordingParameters(web::json::value payload)
 {
-    assert(getCommand(payload) == START_RECORDING);
+    const CommandTypes::CommandTypes command = getCommand(payload);
+    assert(command == START_RECORDING || command == ARM_RECORDING);
 
     utility::stringstream_t ss;
     ss << payload["parameters"].as_string();
@@ -38,11 +53,56 @@ RecordingParameters RecordCommand::parseRecordingParameters(web::json::value pay
     } else {
         params.file_prefix = "";
     }
-    params.fragment_hourly = parameters["fragment_hourly"].as_bool();
+    if (parameters.has_field("pixel_format") && !parameters["pixel_format"].is_null()) {
+        params.pixel_format = parameters["pixel_format"].as_string();
+    }
+    if (parameters.has_field("codec") && !parameters["codec"].is_null()) {
+        params.codec = parameters["codec"].as_string();
+    }
+    if (parameters.has_field("container") && !parameters["container"].is_null()) {
+        params.container = parameters["container"].as_string();
+    }
+
+    // encoder tuning, all optional
+    params.gop_size = OptionalInt(parameters, "gop_size", 0);
+    params.max_b_frames = OptionalInt(parameters, "max_b_frames", -1);
+    params.encoder_threads = OptionalInt(parameters, "encoder_threads", -1);
+    params.rc_lookahead = OptionalInt(parameters, "rc_lookahead", -1);
+    params.sliced_threads = parameters.has_field("sliced_threads") && !parameters["sliced_threads"].is_null() &&
+                            parameters["sliced_threads"].as_bool();
+    if (parameters.has_field("tune") && !parameters["tune"].is_null()) {
+        params.tune = parameters["tune"].as_string();
+    }
+
+    // sensor readout, all optional
+    params.roi_width = OptionalInt(parameters, "roi_width", 0);
+    params.roi_height = OptionalInt(parameters, "roi_height", 0);
+    params.roi_offset_x = OptionalInt(parameters, "roi_offset_x", -1);
+    params.roi_offset_y = OptionalInt(parameters, "roi_offset_y", -1);
+    params.binning = OptionalInt(parameters, "binning", 0);
+    params.decimation = OptionalInt(parameters, "decimation", 0);
+
+    // proxy video, optional
+    params.proxy_scale = OptionalInt(parameters, "proxy_scale", -1);
+    params.proxy_crf = OptionalInt(parameters, "proxy_crf", -1);
+
     params.apply_filter = parameters["apply_filter"].as_bool();
-    params.duration = parameters["duration"].as_number().to_uint64();
-    params.session_id = parameters["session_id"].as_number().to_int32();
     params.target_fps = parameters["target_fps"].as_number().to_int32();
+    params.pre_trigger = OptionalInt(parameters, "pre_trigger", 0);
+
+    // the session itself is only described by the START that triggers an
+    // armed recording
+    if (command == ARM_RECORDING) {
+        params.fragment_hourly = parameters.has_field("fragment_hourly") &&
+                                 !parameters["fragment_hourly"].is_null() &&
+                                 parameters["fragment_hourly"].as_bool();
+        params.duration = std::max(OptionalInt(parameters, "duration", 0), 0);
+        params.session_id = OptionalInt(parameters, "session_id", -1);
+    } else {
+        params.fragment_hourly = parameters["fragment_hourly"].as_bool();
+        params.duration = parameters["duration"].as_number().to_uint64();
+        params.session_id = parameters["session_id"].as_number().to_int32();
+    }
 
     return params;
 
@@ -60,4 +120,13 @@ ServerCommand::ServerCommand(web::json::value command_payload)
 RecordCommand::RecordCommand(web::json::value command_payload) : ServerCommand(command_payload)
 {
     parameters_ = parseRecordingParameters(command_payload);
-}
\ No newline at end of file
+}
+
+std::unique_ptr<ServerCommand> makeCommand(web::json::value payload)
+{
+    CommandTypes::CommandTypes command = getCommand(payload);
+    if (command == CommandTypes::START_RECORDING || command == CommandTypes::ARM_RECORDING) {
+        return std::unique_ptr<ServerCommand>(new RecordCommand(payload));
+    }
+    return std::unique_ptr<ServerCommand>(new ServerCommand(command));
+}
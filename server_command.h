@@ -1,6 +1,7 @@
 #ifndef SERVER_COMMAND_H
 #define SERVER_COMMAND_H
 
+#include <memory>
 #include <string>
 
 #include <cpprest/json.h>
@@ -10,6 +11,7 @@ namespace CommandTypes
 enum CommandTypes {
     NOOP,
     START_RECORDING,
+    ARM_RECORDING,
     STOP_RECORDING,
     COMPLETE,
     STREAM,
@@ -18,7 +20,10 @@ enum CommandTypes {
 }
 
 /**
- * @brief parameters for a "START_RECORDING" command
+ * @brief parameters for a "START_RECORDING" or "ARM_RECORDING" command
+ *
+ * an ARM_RECORDING command doesn't need session_id, duration or
+ * fragment_hourly, those come from the START_RECORDING that triggers it
  */
 struct RecordingParameters {
     int session_id;          ///< session ID of recording session device is joining
@@ -27,6 +32,24 @@ struct RecordingParameters {
     bool fragment_hourly;    ///< fragment video files at the top of the hour
     bool apply_filter;       ///< apply filtering when encoding video
     std::string file_prefix; ///< user specified filename prefix
+    std::string pixel_format; ///< optional pixel format, empty to use the default
+    std::string codec;        ///< optional codec name, empty to use the default
+    std::string container;    ///< optional video file container, empty to use the configured default
+    int gop_size;             ///< optional frames between keyframes, <= 0 to use the default
+    int max_b_frames;         ///< optional max consecutive B-frames, < 0 to use the default
+    int encoder_threads;      ///< optional encoder thread count, < 0 to use the default
+    bool sliced_threads;      ///< use slice based encoder threading
+    std::string tune;         ///< optional x264 tune, empty for none
+    int rc_lookahead;         ///< optional rate control lookahead, < 0 to use the default
+    int pre_trigger;          ///< optional seconds of pre-trigger video for ARM_RECORDING, <= 0 to use the default
+    int roi_width;            ///< optional region of interest width in sensor pixels, <= 0 for the configured width
+    int roi_height;           ///< optional region of interest height in sensor pixels, <= 0 for the configured height
+    int roi_offset_x;         ///< optional region of interest left edge in sensor pixels, < 0 to center
+    int roi_offset_y;         ///< optional region of interest top edge in sensor pixels, < 0 to center
+    int binning;              ///< optional sensor binning factor, <= 0 for none
+    int decimation;           ///< optional sensor decimation factor, <= 0 for none
+    int proxy_scale;          ///< optional proxy downscale factor, 0 for no proxy, < 0 to use the configured default
+    int proxy_crf;            ///< optional proxy crf, < 0 to use the configured default
 };
 
 /**
@@ -67,7 +90,7 @@ private:
 };
 
 /**
- * @brief special case command for a START_RECORDING command since it also
+ * @brief special case command for START_RECORDING and ARM_RECORDING commands since they also
  * includes parameters
  */
 class RecordCommand: public ServerCommand {
@@ -102,4 +125,15 @@ private:
  */
 CommandTypes::CommandTypes getCommand(web::json::value payload);
 
+/**
+ * @brief create the command described by a JSON payload
+ *
+ * used for both status update responses and commands pushed by the server.
+ * throws web::json::json_exception if the payload is malformed
+ *
+ * @param payload JSON command from the server
+ * @return RecordCommand for START_RECORDING and ARM_RECORDING, ServerCommand otherwise
+ */
+std::unique_ptr<ServerCommand> makeCommand(web::json::value payload);
+
 #endif //SERVER_COMMAND_H
@@ -22,20 +22,87 @@ using namespace concurrency::streams;
 const std::string kStatusUpdateEndpoint = "/device/heartbeat";
 
 
-ServerCommand* send_status_update(
-    SysInfo system_info,
-    CameraController& camera_controller,
-    const std::string api_uri,
-    const std::string location)
+/**
+ * @brief build the sensor_status entry for one camera
+ * @param camera_controller camera to report on
+ * @return json object with the camera's recording state and statistics
+ */
+static web::json::value camera_status(CameraController& camera_controller)
+{
+    web::json::value camera = web::json::value::object();
+
+    if (camera_controller.recording()) {
+        camera["recording"] = web::json::value::boolean(true);
+        camera["armed"] = web::json::value::boolean(camera_controller.armed());
+        camera["duration"] = web::json::value::number(camera_controller.elapsed_time().count());
+        camera["fps"] = web::json::value::number(camera_controller.avg_fps());
+        camera["frame_interval"]["min"] = web::json::value::number(camera_controller.min_frame_interval());
+        camera["frame_interval"]["max"] = web::json::value::number(camera_controller.max_frame_interval());
+        camera["dropped_estimate"] = web::json::value::number(camera_controller.frames_dropped_estimate());
+        camera["encoder"] = web::json::value::string(camera_controller.encoder_name());
+        camera["frame_size"]["width"] = web::json::value::number(camera_controller.image_width());
+        camera["frame_size"]["height"] = web::json::value::number(camera_controller.image_height());
+        camera["queue_depth"] = web::json::value::number((uint64_t)camera_controller.frame_queue_depth());
+        camera["queue_high_water"] = web::json::value::number((uint64_t)camera_controller.frame_queue_high_water());
+        camera["overflow_drops"] = web::json::value::number(camera_controller.frames_overflowed());
+        camera["bytes_written"] = web::json::value::number(camera_controller.bytes_written());
+        camera["disk_throttle"]["level"] = web::json::value::number(camera_controller.disk_throttle_level());
+        camera["disk_throttle"]["skipped_frames"] = web::json::value::number(camera_controller.frames_throttled());
+        camera["pacing_level"] = web::json::value::number(camera_controller.pacing_level());
+        const FrameDropStats &drops = camera_controller.frame_drop_stats();
+        camera["drops"]["missing_blocks"] = web::json::value::number(drops.missing_blocks());
+        camera["drops"]["grab_failures"] = web::json::value::number(drops.grab_failures());
+        camera["drops"]["buffer_underruns"] = web::json::value::number(drops.buffer_underruns());
+        camera["drops"]["failed_packets"] = web::json::value::number(drops.failed_packets());
+        camera["drops"]["failed_buffers"] = web::json::value::number(drops.failed_buffers());
+        camera["frame_pool"]["hits"] = web::json::value::number(camera_controller.frame_pool_hits());
+        camera["frame_pool"]["misses"] = web::json::value::number(camera_controller.frame_pool_misses());
+
+        // per-stage latency, in microseconds
+        const PipelineStats &pipeline_stats = camera_controller.pipeline_stats();
+        for (int i = 0; i < PipelineStats::NUM_STAGES; i++) {
+            auto stage = static_cast<PipelineStats::Stage>(i);
+            const LatencyHistogram &histogram = pipeline_stats.histogram(stage);
+            web::json::value &latency = camera["latency"][PipelineStats::StageName(stage)];
+            latency["count"] = web::json::value::number(histogram.count());
+            latency["p50"] = web::json::value::number(histogram.Percentile(0.50) / 1000.0);
+            latency["p99"] = web::json::value::number(histogram.Percentile(0.99) / 1000.0);
+            latency["max"] = web::json::value::number(histogram.max() / 1000.0);
+        }
+    } else {
+        camera["recording"] = web::json::value::boolean(false);
+
+        // camera is done recording -- send final elapsed_time value for the session
+        if (camera_controller.elapsed_time().count() != 0) {
+            camera["duration"] = web::json::value::number(camera_controller.elapsed_time().count());
+        }
+        if (camera_controller.session_id() != -1 && camera_controller.recording_error()) {
+            camera["err_msg"] = web::json::value::string(camera_controller.error_string());
+        }
+    }
+    return camera;
+}
+
+static http_client_config ClientConfig(std::chrono::seconds timeout)
+{
+    http_client_config config;
+    config.set_timeout(timeout);
+    return config;
+}
+
+/**
+ * @brief build the status update payload
+ * @param system_info current system information
+ * @param cameras cameras to report the status of
+ * @param location device location string
+ * @param timestamp time of the update, ISO 8601
+ * @return json payload for the heartbeat endpoint
+ */
+static json::value status_payload(const SysInfo &system_info, CameraGroup &cameras,
+                                  const std::string &location, const std::string &timestamp)
 {
-    static web::http::client::http_client client(api_uri);
-    
     json::value payload;
-    ServerCommand *command = nullptr;
 
-    std::string timestamp = datetime::utc_now().to_string(datetime::date_format::ISO_8601);    
-    std::clog << SD_INFO << "Sending status update @ " << timestamp << std::endl;
-    
     payload["name"] = web::json::value(system_info.hostname());
     if (location.length() > 0) {
         payload["location"] = web::json::value(location);
@@ -43,126 +110,192 @@ ServerCommand* send_status_update(
 
     payload["timestamp"] = web::json::value::string(timestamp);
 
-    if (camera_controller.session_id() != -1) {
+    if (cameras.session_id() != -1) {
         payload["state"] = web::json::value("BUSY");
     } else {
         payload["state"] = web::json::value("IDLE");
     }
+    // armed cameras are waiting for a START, there is no session until then
+    payload["armed"] = web::json::value::boolean(cameras.armed());
 
-    if (camera_controller.recording()) {
-        payload["sensor_status"]["camera"]["recording"] = web::json::value::boolean(true);
-        payload["sensor_status"]["camera"]["duration"] = web::json::value::number(camera_controller.elapsed_time().count());
-        payload["sensor_status"]["camera"]["fps"] = web::json::value::number(camera_controller.avg_fps());
-        payload["session_id"] = web::json::value::number(camera_controller.session_id());
-    } else {
-        payload["sensor_status"]["camera"]["recording"] = web::json::value::boolean(false);
+    // "camera" reports the first camera so single camera servers keep working,
+    // "cameras" has an entry for every camera on this host
+    if (cameras.size() > 0) {
+        payload["sensor_status"]["camera"] = camera_status(cameras.camera(0));
+    }
+    web::json::value camera_list = web::json::value::array(cameras.size());
+    for (size_t i = 0; i < cameras.size(); i++) {
+        web::json::value status = camera_status(cameras.camera(i));
+        if (!cameras.name(i).empty()) {
+            status["serial"] = web::json::value::string(cameras.name(i));
+        }
+        camera_list[i] = status;
+    }
+    payload["sensor_status"]["cameras"] = camera_list;
 
-        // camera is done recording -- send final elapsed_time value for the session
-        if (camera_controller.session_id() != -1) {
-            payload["session_id"] = web::json::value::number(camera_controller.session_id());
+    if (cameras.session_id() != -1) {
+        payload["session_id"] = web::json::value::number(cameras.session_id());
 
-            if (camera_controller.recording_error()) {
-                payload["err_msg"] = web::json::value::string(camera_controller.error_string());
-            }
-        }
-        if (camera_controller.elapsed_time().count() != 0) {
-            payload["sensor_status"]["camera"]["duration"] = web::json::value::number(camera_controller.elapsed_time().count());
+        // camera is done recording -- report any errors from the session
+        if (!cameras.recording() && cameras.recording_error()) {
+            payload["err_msg"] = web::json::value::string(cameras.error_string());
         }
     }
     
+    // the latest sample from the background sampler, taking it doesn't block
+    std::shared_ptr<const SystemSnapshot> snapshot = system_info.snapshot();
+
     payload["system_info"]["release"] = web::json::value::string(system_info.release());
-    payload["system_info"]["uptime"] = web::json::value::number(system_info.uptime());
-    payload["system_info"]["load"] = web::json::value::number(system_info.load());
-    payload["system_info"]["free_ram"] = web::json::value::number(system_info.mem_available());
-    payload["system_info"]["total_ram"] = web::json::value::number(system_info.mem_total());
+    payload["system_info"]["uptime"] = web::json::value::number(snapshot->uptime);
+    payload["system_info"]["load"] = web::json::value::number(snapshot->load);
+    payload["system_info"]["free_ram"] = web::json::value::number(snapshot->mem_available);
+    payload["system_info"]["total_ram"] = web::json::value::number(snapshot->mem_total);
     
     //TODO we might change the API to take a list of mount points that are being monitored
     //right now we only support monitoring a single drive, so there will only be one
-    //registered mount in the vector returned by system_info.get_registered_mounts()
-    std::vector<std::string> mounts = system_info.registered_mounts();
-    DiskInfo di = system_info.disk_info(mounts[0]);
+    //registered mount in the snapshot
+    DiskInfo di = {0, 0, 0};
+    if (!snapshot->disks.empty()) {
+        di = snapshot->disks.begin()->second;
+    }
     payload["system_info"]["free_disk"] = web::json::value::number(di.available);
     payload["system_info"]["total_disk"] = web::json::value::number(di.capacity);
+    payload["system_info"]["disk_write_rate"] = web::json::value::number(di.write_rate);
+
+    payload["system_info"]["cpu_busy"] = web::json::value::number(snapshot->cpu_busy);
+    web::json::value cores = web::json::value::array(snapshot->core_busy.size());
+    for (size_t i = 0; i < snapshot->core_busy.size(); i++) {
+        cores[i]["busy"] = web::json::value::number(snapshot->core_busy[i]);
+        if (i < snapshot->core_khz.size()) {
+            cores[i]["khz"] = web::json::value::number(static_cast<uint64_t>(snapshot->core_khz[i]));
+        }
+    }
+    payload["system_info"]["cores"] = cores;
+
+    web::json::value temperatures = web::json::value::object();
+    for (const auto &zone : snapshot->temperatures) {
+        temperatures[zone.first] = web::json::value::number(zone.second);
+    }
+    payload["system_info"]["temperatures"] = temperatures;
 
-    // send update to the server
-    pplx::task<void> requestTask = client.request(web::http::methods::POST, kStatusUpdateEndpoint, payload)
-    .then([&command](const web::http::http_response& response) {
-        status_code status = response.status_code();
+    web::json::value clocks = web::json::value::object();
+    for (const auto &device : snapshot->device_hz) {
+        clocks[device.first] = web::json::value::number(static_cast<uint64_t>(device.second));
+    }
+    payload["system_info"]["clocks"] = clocks;
+
+    web::json::value thread_cpus = web::json::value::object();
+    for (const auto &thread : snapshot->thread_cpus) {
+        thread_cpus[thread.first] = web::json::value::number(thread.second);
+    }
+    payload["system_info"]["thread_cpu"] = thread_cpus;
+
+    return payload;
+}
+
+/**
+ * @brief get the command from the server's response to a status update
+ * @param response server response
+ * @return command, null if the server didn't send one
+ */
+static std::unique_ptr<ServerCommand> parse_response(const http_response &response)
+{
+    std::unique_ptr<ServerCommand> command;
+    status_code status = response.status_code();
+    
+    if (status >= http::status_codes::BadRequest) {
+        json::value response_body = response.extract_json().get();
         
-        if (status >= http::status_codes::BadRequest) {
-            json::value response_body = response.extract_json().get();
-            
-            // for systemd logging purposes, each line is handled as a new logging event
-            // therefore we combine all the information related to this error into a 
-            // single line
-            std::string err_msg;
-            
-            if (response_body.has_field("message")) {
-                err_msg = response_body["message"].as_string();
-            } else {
-                err_msg = "Status update request failed with http status code " + status;
+        // for systemd logging purposes, each line is handled as a new logging event
+        // therefore we combine all the information related to this error into a 
+        // single line
+        std::string err_msg;
+        
+        if (response_body.has_field("message")) {
+            err_msg = response_body["message"].as_string();
+        } else {
+            err_msg = "Status update request failed with http status code " + std::to_string(status);
+        }
+        
+        // The webservice includes a field 'errors' for payload verification failures.
+        // This is a JSON object where the keys are the names of invalid parameters
+        // and the value is an error message.
+        if (response_body.has_field("errors")) {
+            if (!err_msg.empty()) {
+                err_msg += ":  ";
             }
             
-            // The webservice includes a field 'errors' for payload verification failures.
-            // This is a JSON object where the keys are the names of invalid parameters
-            // and the value is an error message.
-            if (response_body.has_field("errors")) {
-                if (!err_msg.empty()) {
-                    err_msg += ":  ";
-                }
-                
-                json::object err_obj = response_body["errors"].as_object();
-                for (auto iter = err_obj.cbegin(); iter != err_obj.cend(); ++iter)
-                {
-                    const utility::string_t &key = iter->first;
-                    const json::value &val = iter->second;
-                    if (iter != err_obj.cbegin()) {
-                        err_msg += ", ";
-                    }
-                    err_msg += key + ":" + val.as_string();
+            json::object err_obj = response_body["errors"].as_object();
+            for (auto iter = err_obj.cbegin(); iter != err_obj.cend(); ++iter)
+            {
+                const utility::string_t &key = iter->first;
+                const json::value &val = iter->second;
+                if (iter != err_obj.cbegin()) {
+                    err_msg += ", ";
                 }
+                err_msg += key + ":" + val.as_string();
             }
-            
-            std::clog << SD_ERR << err_msg << std::endl;
-            
-        } else if (status == http::status_codes::NoContent) {
-            std::clog << SD_INFO << "Server responded with no content" << std::endl;
-        } else if (status == http::status_codes::OK) {
-            json::value response_body = response.extract_json().get();
-            switch (getCommand(response_body)) {
-                case CommandTypes::START_RECORDING:
-                    command = new RecordCommand(response_body);
-                    break;
-                case CommandTypes::STOP_RECORDING:
-                    command = new ServerCommand(response_body);
-                    break;
-                case CommandTypes::NOOP:
-                    command = new ServerCommand();
-                    break;
-                case CommandTypes::COMPLETE:
-                    command = new ServerCommand(CommandTypes::COMPLETE);
-                    break;
-                case CommandTypes::STREAM:
-                    command = new ServerCommand(CommandTypes::STREAM);
-                    break;
-                case CommandTypes::UNKNOWN:
-                    command = new ServerCommand(CommandTypes::UNKNOWN);
-                    break;
-            }
-        }      
-    });
-    
-    try {
-        requestTask.wait();
+        }
+        
+        std::clog << SD_ERR << err_msg << std::endl;
+        
+    } else if (status == http::status_codes::NoContent) {
+        std::clog << SD_INFO << "Server responded with no content" << std::endl;
+    } else if (status == http::status_codes::OK) {
+        command = makeCommand(response.extract_json().get());
     }
-    catch (http_exception &e)
-    {
-        std::clog << SD_ERR << "HTTP Exception: " << e.what() << std::endl;
+    return command;
+}
+
+StatusUpdater::StatusUpdater(const std::string &api_uri, const std::string &location,
+                             std::chrono::seconds timeout, CommandQueue &commands) :
+    api_uri_(api_uri),
+    location_(location),
+    client_(api_uri, ClientConfig(timeout)),
+    commands_(commands)
+{
+}
+
+StatusUpdater::~StatusUpdater()
+{
+    // the continuation uses this object, so it has to finish first. it
+    // can't take longer than the client timeout
+    if (request_sent_) {
+        request_.wait();
     }
+}
 
-    if (!command) {
-        command = new ServerCommand();
+bool StatusUpdater::Send(const SysInfo &system_info, CameraGroup &cameras)
+{
+    if (in_flight_) {
+        return false;
     }
 
-    return command;
-}
\ No newline at end of file
+    std::string timestamp = datetime::utc_now().to_string(datetime::date_format::ISO_8601);    
+    std::clog << SD_INFO << "Sending status update @ " << timestamp << std::endl;
+    json::value payload = status_payload(system_info, cameras, location_, timestamp);
+
+    // send update to the server. the continuation takes the task rather than
+    // the response so request failures are handled here instead of being
+    // rethrown at whoever waits on request_
+    in_flight_ = true;
+    request_sent_ = true;
+    request_ = client_.request(web::http::methods::POST, kStatusUpdateEndpoint, payload)
+    .then([this](pplx::task<http_response> response_task) {
+        std::unique_ptr<ServerCommand> command;
+        try {
+            command = parse_response(response_task.get());
+        } catch (const http_exception &e) {
+            std::clog << SD_ERR << "HTTP Exception: " << e.what() << std::endl;
+        } catch (const std::exception &e) {
+            std::clog << SD_ERR << "Unable to read status update response: " << e.what() << std::endl;
+        }
+
+        if (!command) {
+            command.reset(new ServerCommand());
+        }
+        commands_.Push(std::move(command));
+        in_flight_ = false;
+    });
+    return true;
+}
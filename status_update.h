@@ -3,21 +3,71 @@
 #ifndef STATUS_UPDATE_H
 #define STATUS_UPDATE_H
 
+#include <atomic>
+#include <chrono>
+#include <string>
+
+#include <cpprest/http_client.h>
+
 #include "system_info.h"
-#include "server_command.h"
-#include "camera_controller.h"
+#include "command_queue.h"
+#include "camera_group.h"
 
 /**
- * @brief send a status update message to the server
+ * @brief sends status updates to the server without blocking the control loop
  *
- * @param system_info current system information
- * @param api_uri root URI of web service
+ * Send() builds the status payload on the calling thread and posts it
+ * asynchronously through an http_client that lives as long as the
+ * StatusUpdater, so the connection is kept alive between updates. The
+ * command in the response is parsed on a cpprestsdk thread and pushed onto
+ * a CommandQueue for the control loop. A slow or unreachable server delays
+ * the next command, never the loop itself.
  *
- * @return void
+ * Only one update is in flight at a time, and a request that takes longer
+ * than the timeout is abandoned. An update that fails for any reason
+ * queues a NOOP command, the same as the server not asking for anything.
+ *
+ * Send() must only be called from one thread.
  */
-ServerCommand* send_status_update(SysInfo system_info,
-    CameraController& camera_controller,
-    const std::string api_url,
-    const std::string location);
+class StatusUpdater {
+public:
+    /**
+     * @param api_uri root URI of web service
+     * @param location device location string
+     * @param timeout how long to wait for the server to respond to an update
+     * @param commands queue for the commands in the server's responses, must
+     * outlive the StatusUpdater
+     */
+    StatusUpdater(const std::string &api_uri, const std::string &location,
+                  std::chrono::seconds timeout, CommandQueue &commands);
+
+    /// waits for an update in flight to complete or time out
+    ~StatusUpdater();
+
+    StatusUpdater(const StatusUpdater&) = delete;
+    StatusUpdater& operator=(const StatusUpdater&) = delete;
+
+    /**
+     * @brief start sending a status update to the server
+     *
+     * @param system_info current system information
+     * @param cameras cameras to report the status of
+     * @return true if the update was sent, false if the previous update is
+     * still in flight
+     */
+    bool Send(const SysInfo &system_info, CameraGroup &cameras);
+
+    const std::string& api_uri() const {return api_uri_;}
+    const std::string& location() const {return location_;}
+
+private:
+    std::string api_uri_;
+    std::string location_;
+    web::http::client::http_client client_;
+    std::atomic_bool in_flight_ {false};    ///< an update has been sent and not completed
+    pplx::task<void> request_;              ///< the latest update, valid if request_sent_
+    bool request_sent_ = false;             ///< an update has been sent since construction
+    CommandQueue &commands_;
+};
 
-#endif
\ No newline at end of file
+#endif
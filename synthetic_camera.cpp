@@ -0,0 +1,392 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <libswscale/swscale.h>
+}
+
+#include "synthetic_camera.h"
+#include "video_writer.h"
+
+namespace chrono = std::chrono;
+
+// synthetic frame timestamps are in nanoseconds of the steady clock
+const uint64_t kSyntheticTickRate = 1000000000;
+
+// give up on a replay file if this many packets in a row don't produce a frame
+const int kMaxPacketsPerFrame = 1000;
+
+namespace {
+
+// true if the session pixel format stores one byte per pixel
+bool IsEightBit(const std::string &pixel_format)
+{
+    return pixel_format == pixel_types::MONO8 || pixel_format == pixel_types::YUV420P;
+}
+
+/*
+ * convert 8 bit gray pixels to the session's camera pixel format. 12 bit
+ * formats get the 8 bit value in their top bits
+ */
+void FromGray8(const uint8_t *gray, size_t pixels, const std::string &pixel_format, uint8_t *dst)
+{
+    if (IsEightBit(pixel_format)) {
+        std::memcpy(dst, gray, pixels);
+    } else if (pixel_format == pixel_types::MONO12) {
+        uint16_t *out = reinterpret_cast<uint16_t*>(dst);
+        for (size_t i = 0; i < pixels; i++) {
+            out[i] = gray[i] << 4;
+        }
+    } else if (pixel_format == pixel_types::MONO12PACKED) {
+        // low nibbles are zero, so the middle byte of each pair is zero too
+        for (size_t i = 0; i + 1 < pixels; i += 2) {
+            *dst++ = gray[i];
+            *dst++ = 0;
+            *dst++ = gray[i + 1];
+        }
+    } else {
+        throw std::logic_error("synthetic frames not implemented for pixel format " + pixel_format);
+    }
+}
+
+/*
+ * generated test pattern: a diagonal gradient and a bright square that both
+ * move every frame, plus a little pixel noise so the encoder has sensor-like
+ * detail to deal with rather than perfectly flat areas
+ */
+class PatternSource : public FrameSource {
+public:
+    PatternSource(int frame_width, int frame_height, const std::string &pixel_format) :
+        width_(frame_width), height_(frame_height), pixel_format_(pixel_format),
+        gray_(static_cast<size_t>(frame_width) * frame_height) {}
+
+    void NextFrame(uint8_t *buffer)
+    {
+        const int square = height_ / 8;
+        const int square_x = (frame_ * 4) % std::max(width_ - square, 1);
+        const int square_y = (frame_ * 2) % std::max(height_ - square, 1);
+
+        for (int y = 0; y < height_; y++) {
+            uint8_t *row = &gray_[static_cast<size_t>(y) * width_];
+            const bool in_square_rows = y >= square_y && y < square_y + square;
+            for (int x = 0; x < width_; x++) {
+                // xorshift, cheap enough not to dominate the benchmark
+                noise_ ^= noise_ << 13;
+                noise_ ^= noise_ >> 17;
+                noise_ ^= noise_ << 5;
+                int value = ((x + y + frame_ * 2) & 0xFF) / 2 + 32 + (noise_ & 7);
+                if (in_square_rows && x >= square_x && x < square_x + square) {
+                    value = 224 + (noise_ & 7);
+                }
+                row[x] = static_cast<uint8_t>(value);
+            }
+        }
+        FromGray8(gray_.data(), gray_.size(), pixel_format_, buffer);
+        frame_++;
+    }
+
+private:
+    int width_;
+    int height_;
+    std::string pixel_format_;
+    std::vector<uint8_t> gray_;
+    int frame_ = 0;
+    uint32_t noise_ = 2463534242u;
+};
+
+/*
+ * replay a raw dump of camera frames (e.g. written from pylon grab buffers).
+ * the file must already be in the session's pixel format and frame size
+ */
+class RawFileSource : public FrameSource {
+public:
+    RawFileSource(const std::string &filename, size_t frame_bytes) :
+        filename_(filename), file_(filename, std::ifstream::in | std::ifstream::binary),
+        frame_bytes_(frame_bytes)
+    {
+        if (!file_) {
+            throw std::runtime_error("unable to open " + filename);
+        }
+    }
+
+    void NextFrame(uint8_t *buffer)
+    {
+        file_.read(reinterpret_cast<char*>(buffer), frame_bytes_);
+        if (static_cast<size_t>(file_.gcount()) != frame_bytes_) {
+            // loop back to the first frame, dropping any partial frame
+            file_.clear();
+            file_.seekg(0);
+            file_.read(reinterpret_cast<char*>(buffer), frame_bytes_);
+            if (static_cast<size_t>(file_.gcount()) != frame_bytes_) {
+                throw std::runtime_error(filename_ + " doesn't hold a complete frame");
+            }
+        }
+    }
+
+private:
+    std::string filename_;
+    std::ifstream file_;
+    size_t frame_bytes_;
+};
+
+struct InputContextDeleter {
+    void operator()(AVFormatContext *context) {
+        avformat_close_input(&context);
+    }
+};
+
+struct SwsContextDeleter {
+    void operator()(SwsContext *context) {
+        sws_freeContext(context);
+    }
+};
+
+/*
+ * replay a video file (e.g. an existing recording). frames are decoded and
+ * scaled to the session's frame size as 8 bit gray
+ */
+class VideoFileSource : public FrameSource {
+public:
+    VideoFileSource(const std::string &filename, int frame_width, int frame_height,
+                    const std::string &pixel_format) :
+        filename_(filename), width_(frame_width), height_(frame_height),
+        pixel_format_(pixel_format), gray_(static_cast<size_t>(frame_width) * frame_height)
+    {
+        AVFormatContext *tmp_context = nullptr;
+        if (avformat_open_input(&tmp_context, filename.c_str(), NULL, NULL) < 0) {
+            throw std::runtime_error("unable to open " + filename);
+        }
+        format_context_.reset(tmp_context);
+
+        if (avformat_find_stream_info(format_context_.get(), NULL) < 0) {
+            throw std::runtime_error("unable to read stream info from " + filename);
+        }
+
+        AVCodec *decoder = nullptr;
+        stream_index_ = av_find_best_stream(format_context_.get(), AVMEDIA_TYPE_VIDEO, -1, -1, &decoder, 0);
+        if (stream_index_ < 0 || !decoder) {
+            throw std::runtime_error("no decodable video stream in " + filename);
+        }
+
+        codec_context_ = av_pointer::codec_context(avcodec_alloc_context3(decoder));
+        if (!codec_context_ ||
+            avcodec_parameters_to_context(codec_context_.get(),
+                                          format_context_->streams[stream_index_]->codecpar) < 0 ||
+            avcodec_open2(codec_context_.get(), decoder, NULL) < 0) {
+            throw std::runtime_error("unable to open decoder for " + filename);
+        }
+
+        frame_ = av_pointer::frame(av_frame_alloc());
+        packet_ = av_pointer::packet(av_packet_alloc());
+        if (!frame_ || !packet_) {
+            throw std::runtime_error("unable to allocate decoder frame");
+        }
+    }
+
+    void NextFrame(uint8_t *buffer)
+    {
+        Decode();
+
+        sws_context_.reset(sws_getCachedContext(sws_context_.release(),
+                                                frame_->width, frame_->height,
+                                                static_cast<AVPixelFormat>(frame_->format),
+                                                width_, height_, AV_PIX_FMT_GRAY8,
+                                                SWS_BILINEAR, NULL, NULL, NULL));
+        if (!sws_context_) {
+            throw std::runtime_error("unable to convert frames from " + filename_);
+        }
+
+        uint8_t *dst[4] = {gray_.data(), nullptr, nullptr, nullptr};
+        int dst_linesize[4] = {width_, 0, 0, 0};
+        sws_scale(sws_context_.get(), frame_->data, frame_->linesize, 0, frame_->height, dst, dst_linesize);
+        av_frame_unref(frame_.get());
+
+        FromGray8(gray_.data(), gray_.size(), pixel_format_, buffer);
+    }
+
+private:
+    // decode the next frame into frame_, looping back to the start of the
+    // file when the decoder runs out of frames
+    void Decode()
+    {
+        for (int packets = 0; packets < kMaxPacketsPerFrame; packets++) {
+            int rval = avcodec_receive_frame(codec_context_.get(), frame_.get());
+            if (rval == 0) {
+                return;
+            }
+            if (rval == AVERROR_EOF) {
+                // decoder is drained, start over
+                avcodec_flush_buffers(codec_context_.get());
+                av_seek_frame(format_context_.get(), stream_index_, 0, AVSEEK_FLAG_BACKWARD);
+                draining_ = false;
+                continue;
+            }
+            if (rval != AVERROR(EAGAIN)) {
+                throw std::runtime_error("error decoding " + filename_);
+            }
+
+            if (draining_) {
+                continue;
+            }
+            rval = av_read_frame(format_context_.get(), packet_.get());
+            if (rval < 0) {
+                // end of file, flush the frames the decoder is holding
+                avcodec_send_packet(codec_context_.get(), NULL);
+                draining_ = true;
+                continue;
+            }
+            if (packet_->stream_index == stream_index_) {
+                avcodec_send_packet(codec_context_.get(), packet_.get());
+            }
+            av_packet_unref(packet_.get());
+        }
+        throw std::runtime_error("unable to decode a frame from " + filename_);
+    }
+
+    std::string filename_;
+    int width_;
+    int height_;
+    std::string pixel_format_;
+    std::vector<uint8_t> gray_;
+    std::unique_ptr<AVFormatContext, InputContextDeleter> format_context_;
+    std::unique_ptr<SwsContext, SwsContextDeleter> sws_context_;
+    av_pointer::codec_context codec_context_;
+    av_pointer::frame frame_;
+    av_pointer::packet packet_;
+    int stream_index_ = -1;
+    bool draining_ = false;
+};
+
+} // namespace
+
+size_t FrameSource::FrameBytes(int frame_width, int frame_height, const std::string &pixel_format)
+{
+    size_t pixels = static_cast<size_t>(frame_width) * frame_height;
+    if (pixel_format == pixel_types::MONO12) {
+        return pixels * 2;
+    } else if (pixel_format == pixel_types::MONO12PACKED) {
+        return pixels * 3 / 2;
+    }
+    return pixels;
+}
+
+std::unique_ptr<FrameSource> FrameSource::Create(const std::string &replay_file,
+                                                 int frame_width, int frame_height,
+                                                 const std::string &pixel_format)
+{
+    const std::string raw_extension = ".raw";
+    if (replay_file.empty()) {
+        return std::unique_ptr<FrameSource>(new PatternSource(frame_width, frame_height, pixel_format));
+    } else if (replay_file.size() > raw_extension.size() &&
+               replay_file.compare(replay_file.size() - raw_extension.size(), raw_extension.size(), raw_extension) == 0) {
+        return std::unique_ptr<FrameSource>(
+            new RawFileSource(replay_file, FrameBytes(frame_width, frame_height, pixel_format)));
+    }
+    return std::unique_ptr<FrameSource>(
+        new VideoFileSource(replay_file, frame_width, frame_height, pixel_format));
+}
+
+void SyntheticCameraController::RecordVideo(const RecordingSessionConfig &config)
+{
+    err_state_ = 0;
+    frames_encoded_ = 0;
+    encode_seconds_ = 0.0;
+
+    std::string output_dir;
+    std::unique_ptr<FrameSource> source;
+    std::unique_ptr<TimestampLog> timestamp_log;
+    std::unique_ptr<VideoWriter> video_writer;
+
+    // there is no sensor, the region of interest and binning are ignored
+    image_width_ = frame_width_;
+    image_height_ = frame_height_;
+
+    auto start_time = chrono::system_clock::now();
+    try {
+        output_dir = MakeOutputDir(start_time);
+        source = FrameSource::Create(replay_file_, frame_width_, frame_height_, config.pixel_format());
+        std::string timestamp_filename = output_dir + config.file_prefix() +
+            (config.timestamp_format() == timestamp_formats::BINARY ? "timestamps.bin" : "timestamps.txt");
+        timestamp_log = std::unique_ptr<TimestampLog>(
+            new TimestampLog(timestamp_filename, config.timestamp_format(), kSyntheticTickRate));
+        video_writer = std::unique_ptr<VideoWriter>(
+            new VideoWriter(output_dir + config.file_prefix() + timestamp(start_time),
+                            rtmp_uri_, frame_width_, frame_height_, config));
+        video_writer->set_pipeline_stats(&pipeline_stats_);
+    } catch (const std::exception &e) {
+        err_msg_ = "unable to setup synthetic recording: " + std::string(e.what());
+        err_state_ = 1;
+        recording_ = false;
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        encoder_name_ = video_writer->encoder_name();
+    }
+
+    std::vector<uint8_t> buffer(FrameSource::FrameBytes(frame_width_, frame_height_, config.pixel_format()));
+    const auto frame_interval = chrono::duration_cast<chrono::steady_clock::duration>(
+        chrono::duration<double>(1.0 / config.target_fps()));
+
+    frame_rate_stats_.Reset(config.target_fps(), kSyntheticTickRate, config.target_fps());
+    session_start_.store(start_time.time_since_epoch());
+    capturing_ = true;
+
+    const auto loop_start = chrono::steady_clock::now();
+    auto next_frame = loop_start;
+    size_t current_frame = 0;
+
+    try {
+        while (!stop_recording_ && (frame_limit_ == 0 || current_frame < frame_limit_)) {
+            auto elapsed = chrono::duration_cast<chrono::seconds>(
+                chrono::system_clock::now().time_since_epoch() - session_start_.load());
+            if (elapsed >= config.duration()) {
+                break;
+            }
+
+            if (realtime_) {
+                std::this_thread::sleep_until(next_frame);
+                next_frame += frame_interval;
+            }
+
+            {
+                StageTimer timer(&pipeline_stats_, PipelineStats::GRAB_WAIT);
+                source->NextFrame(buffer.data());
+            }
+            uint64_t ticks = chrono::duration_cast<chrono::nanoseconds>(
+                chrono::steady_clock::now() - loop_start).count();
+            frame_rate_stats_.AddFrame(ticks);
+            timestamp_log->Append(ticks);
+
+            StageTimer encode_timer(&pipeline_stats_, PipelineStats::ENCODE_FRAME);
+            video_writer->EncodeFrame(buffer.data(), current_frame, live_stream_);
+            encode_timer.Stop();
+
+            frame_pool_hits_ = video_writer->frame_pool_hits();
+            frame_pool_misses_ = video_writer->frame_pool_misses();
+            current_frame++;
+            frames_encoded_ = current_frame;
+        }
+
+        // include flushing the encoder in the time spent
+        video_writer->Close();
+    } catch (const std::exception &e) {
+        err_msg_ = "error encoding video: " + std::string(e.what());
+        err_state_ = 1;
+    }
+    encode_seconds_ = chrono::duration<double>(chrono::steady_clock::now() - loop_start).count();
+
+    elapsed_time_ = chrono::duration_cast<chrono::seconds>(
+        chrono::system_clock::now().time_since_epoch() - session_start_.load());
+    capturing_ = false;
+    recording_ = false;
+}
@@ -0,0 +1,110 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#ifndef SYNTHETIC_CAMERA_H
+#define SYNTHETIC_CAMERA_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "camera_controller.h"
+
+/**
+ * @brief source of frames for a SyntheticCameraController
+ *
+ * frames are delivered in the camera pixel format of the recording session
+ * (Mono8, Mono12 or Mono12Packed; YUV420P sessions use Mono8 frames just like
+ * the Basler camera)
+ */
+class FrameSource {
+public:
+    virtual ~FrameSource() {}
+
+    /**
+     * @brief produce the next frame
+     * @param buffer destination, must hold FrameBytes() bytes
+     */
+    virtual void NextFrame(uint8_t *buffer) = 0;
+
+    /**
+     * @brief create a frame source
+     *
+     * throws std::runtime_error if the replay file can't be opened
+     *
+     * @param replay_file empty for a generated test pattern. A path ending in
+     * ".raw" is replayed as a raw dump of camera frames, anything else is
+     * decoded with ffmpeg and converted to the session's pixel format. Replay
+     * files loop when they reach the end.
+     * @param frame_width frame width in pixels
+     * @param frame_height frame height in pixels
+     * @param pixel_format recording session pixel format
+     * @return new frame source
+     */
+    static std::unique_ptr<FrameSource> Create(const std::string& replay_file,
+                                               int frame_width, int frame_height,
+                                               const std::string& pixel_format);
+
+    /**
+     * @brief size of one camera frame
+     * @param frame_width frame width in pixels
+     * @param frame_height frame height in pixels
+     * @param pixel_format recording session pixel format
+     * @return bytes per frame
+     */
+    static size_t FrameBytes(int frame_width, int frame_height, const std::string& pixel_format);
+};
+
+/**
+ * @brief CameraController that generates or replays frames instead of
+ * grabbing them from a camera
+ *
+ * Used to measure VideoWriter throughput without camera hardware. Frames go
+ * through the same VideoWriter, timestamp log and statistics as a real
+ * recording session, producing the same output files. Hourly fragmentation
+ * is not supported, each session writes a single video file.
+ */
+class SyntheticCameraController : public CameraController {
+public:
+    /**
+     * @param directory output directory
+     * @param frame_width frame width in pixels
+     * @param frame_height frame height in pixels
+     * @param nv_room_string output subdirectory name
+     * @param replay_file frames to replay, see FrameSource::Create()
+     * @param realtime if true deliver frames at the session's target fps,
+     * otherwise as fast as the encoder accepts them
+     */
+    SyntheticCameraController(const std::string &directory, int frame_width, int frame_height,
+                              const std::string &nv_room_string, const std::string &replay_file,
+                              bool realtime) :
+        CameraController(directory, frame_width, frame_height, nv_room_string, ""),
+        replay_file_(replay_file), realtime_(realtime) {}
+
+    /**
+     * @brief stop the session after a number of frames
+     * @param frames frame limit, 0 for no limit (the session duration still applies)
+     */
+    void set_frame_limit(uint64_t frames) {frame_limit_ = frames;}
+
+    /// number of frames encoded in the current (or last) session
+    uint64_t frames_encoded() const {return frames_encoded_;}
+
+    /// time spent in the frame loop of the current (or last) session, in seconds
+    double encode_seconds() const {return encode_seconds_;}
+
+private:
+    /**
+     * @brief implements the recording thread, see CameraController::RecordVideo()
+     * @param config RecordingSessionConfig
+     */
+    void RecordVideo(const RecordingSessionConfig& config);
+
+    std::string replay_file_;   ///< frames to replay, empty for a generated pattern
+    bool realtime_;             ///< pace frames at the target fps
+    uint64_t frame_limit_ = 0;  ///< stop after this many frames, 0 for no limit
+    std::atomic<uint64_t> frames_encoded_ {0};
+    std::atomic<double> encode_seconds_ {0.0};
+};
+
+#endif
@@ -1,31 +1,129 @@
 // Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
 
 #include <string>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <limits>
 
-#include <sys/sysinfo.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/statvfs.h>
-#include <unistd.h>
-#include <assert.h>
-#include <stdlib.h>
+#include <sys/syscall.h>
+#include <sys/sysinfo.h>
+#include <sys/sysmacros.h>
 #include <sys/utsname.h>
+#include <unistd.h>
 
 #include "system_info.h"
+#include "thread_tuning.h"
+
+// present on NVIDIA Tegra (Jetson) boards
+static const char *kTegraReleaseFile = "/etc/nv_tegra_release";
+
+// nice value of the background sampler thread
+static const int kSamplerNice = 10;
+
+// /proc/diskstats reports sectors of 512 bytes regardless of the device
+static const uint64_t kDiskStatsSectorSize = 512;
+
+SysInfo::StatFile::StatFile(const std::string &path, size_t buffer_size) :
+    fd_(open(path.c_str(), O_RDONLY | O_CLOEXEC)),
+    buffer_(buffer_size)
+{
+}
+
+SysInfo::StatFile::~StatFile()
+{
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+}
+
+const char* SysInfo::StatFile::Read()
+{
+    if (fd_ < 0) {
+        return nullptr;
+    }
+    while (true) {
+        // procfs and sysfs regenerate the contents for a read from offset 0
+        ssize_t n = pread(fd_, buffer_.data(), buffer_.size() - 1, 0);
+        if (n < 0) {
+            return nullptr;
+        }
+        if (static_cast<size_t>(n) < buffer_.size() - 1) {
+            buffer_[n] = '\0';
+            return buffer_.data();
+        }
+        // might not have read all of it
+        buffer_.resize(buffer_.size() * 2);
+    }
+}
+
+// glob a pattern, returning the matching paths
+static std::vector<std::string> Glob(const char *pattern)
+{
+    std::vector<std::string> paths;
+    glob_t matches;
+    if (glob(pattern, 0, nullptr, &matches) == 0) {
+        for (size_t i = 0; i < matches.gl_pathc; i++) {
+            paths.push_back(matches.gl_pathv[i]);
+        }
+    }
+    globfree(&matches);
+    return paths;
+}
+
+// directory part of a path
+static std::string Dirname(const std::string &path)
+{
+    return path.substr(0, path.find_last_of('/'));
+}
+
+// parse the busy and total jiffies from the numbers following a cpu label in /proc/stat
+static bool ParseCpuTimes(const char *p, uint64_t &busy, uint64_t &total)
+{
+    // user nice system idle iowait irq softirq steal. guest time is already
+    // counted in user
+    uint64_t fields[8] = {0};
+    char *end;
+    for (int i = 0; i < 8; i++) {
+        fields[i] = std::strtoull(p, &end, 10);
+        if (end == p) {
+            if (i < 4) {
+                return false;
+            }
+            break;
+        }
+        p = end;
+    }
+    total = 0;
+    for (uint64_t field : fields) {
+        total += field;
+    }
+    busy = total - fields[3] - fields[4];
+    return true;
+}
 
 SysInfo::SysInfo(void)
 {
-    Sample();
     char buffer[1024];
     gethostname(buffer, sizeof(buffer));
     hostname_ = std::string(buffer);
 
     // get the amount of physical RAM -- this won't change so we don't need to update
+    struct sysinfo system_info;
+    sysinfo(&system_info);
     mem_total_ = system_info.totalram * system_info.mem_unit / 1024;
 
     // get the release. We use the first line of /etc/nv_tegra_release if it is available
     // and accessible, otherwise we fall back to using the Linux Kernel release string
-    std::ifstream release_file("/etc/nv_tegra_release");
+    std::ifstream release_file(kTegraReleaseFile);
     if (release_file) {
         std::getline(release_file, this->release_);
     } else {
@@ -38,6 +136,47 @@ SysInfo::SysInfo(void)
             this->release_ = std::string(buf.release);
         }
     }
+
+    meminfo_.reset(new StatFile("/proc/meminfo"));
+    stat_.reset(new StatFile("/proc/stat", 16384));
+    diskstats_.reset(new StatFile("/proc/diskstats", 16384));
+
+    const long cores = sysconf(_SC_NPROCESSORS_CONF);
+    for (long i = 0; i < cores; i++) {
+        std::unique_ptr<StatFile> freq(new StatFile(
+            "/sys/devices/system/cpu/cpu" + std::to_string(i) + "/cpufreq/scaling_cur_freq", 64));
+        if (!freq->is_open()) {
+            // no cpufreq, or not for every core. don't report a partial list
+            core_freq_.clear();
+            break;
+        }
+        core_freq_.push_back(std::move(freq));
+    }
+
+    // thermal zones and devfreq devices (on Tegra the GPU and memory
+    // controller) found at startup. their names don't change
+    for (const std::string &path : Glob("/sys/class/thermal/thermal_zone*/temp")) {
+        std::string type;
+        std::ifstream type_file(Dirname(path) + "/type");
+        std::unique_ptr<StatFile> temp(new StatFile(path, 64));
+        if (std::getline(type_file, type) && temp->is_open()) {
+            thermal_zones_.emplace_back(type, std::move(temp));
+        }
+    }
+    for (const std::string &path : Glob("/sys/class/devfreq/*/cur_freq")) {
+        std::string dir = Dirname(path);
+        std::unique_ptr<StatFile> freq(new StatFile(path, 64));
+        if (freq->is_open()) {
+            devfreq_.emplace_back(dir.substr(dir.find_last_of('/') + 1), std::move(freq));
+        }
+    }
+
+    Sample();
+}
+
+SysInfo::~SysInfo()
+{
+    Stop();
 }
 
 /*
@@ -46,19 +185,115 @@ SysInfo::SysInfo(void)
  */
 void SysInfo::Sample(void)
 {
-    sysinfo(&system_info);
-    UpdateMemInfo();
+    std::lock_guard<std::mutex> lock(sample_mutex_);
+
+    auto now = std::chrono::steady_clock::now();
+    double seconds = 0;
+    if (last_sample_ != std::chrono::steady_clock::time_point()) {
+        seconds = std::chrono::duration<double>(now - last_sample_).count();
+    }
+    last_sample_ = now;
+
+    std::shared_ptr<SystemSnapshot> snapshot = std::make_shared<SystemSnapshot>();
 
+    struct sysinfo system_info;
+    sysinfo(&system_info);
+    snapshot->uptime = system_info.uptime;
     // convert the integer value sysinfo gives us to the floating point number we expect
-    load_ = system_info.loads[0] / (float)(1 << SI_LOAD_SHIFT);
+    snapshot->load = system_info.loads[0] / (float)(1 << SI_LOAD_SHIFT);
+    snapshot->mem_total = mem_total_;
+
+    SampleMemory(*snapshot);
+    SampleCpus(*snapshot);
+    SampleDisks(*snapshot, seconds);
+    SampleDevices(*snapshot);
+    SampleThreads(*snapshot, seconds);
+
+    std::atomic_store(&snapshot_, std::shared_ptr<const SystemSnapshot>(std::move(snapshot)));
+}
+
+/*
+ * This method uses /proc/meminfo to get an updated view of memory usage. This is more
+ * accurate than using the information returned by sysinfo, because Linux will use
+ * free memory for disk caching. To sysinfo this appears to be used, but the kernel will
+ * free it as soon as it is needed by another program so it should be included in the
+ * reported available memory.
+ */
+void SysInfo::SampleMemory(SystemSnapshot &snapshot)
+{
+    const char *meminfo = meminfo_->Read();
+    const char *line = meminfo ? std::strstr(meminfo, "MemAvailable:") : nullptr;
+    if (line) {
+        snapshot.mem_available = std::strtoul(line + std::strlen("MemAvailable:"), nullptr, 10);
+    }
+}
+
+/*
+ * cpu utilization since the previous sample, from the jiffy counters in
+ * /proc/stat. The first line is the total over all cpus, followed by a
+ * line per online cpu
+ */
+void SysInfo::SampleCpus(SystemSnapshot &snapshot)
+{
+    const char *stat = stat_->Read();
+    if (!stat) {
+        return;
+    }
+
+    auto busy_fraction = [](const CpuTimes &previous, const CpuTimes &current) {
+        uint64_t total = current.total - previous.total;
+        return total && current.total > previous.total ? (current.busy - previous.busy) / double(total) : 0.0;
+    };
+
+    for (const char *line = stat; std::strncmp(line, "cpu", 3) == 0; ) {
+        const char *p = line + 3;
+        CpuTimes times;
+        if (*p == ' ') {
+            if (ParseCpuTimes(p, times.busy, times.total)) {
+                snapshot.cpu_busy = busy_fraction(cpu_times_, times);
+                cpu_times_ = times;
+            }
+        } else {
+            char *end;
+            unsigned long core = std::strtoul(p, &end, 10);
+            if (end != p && ParseCpuTimes(end, times.busy, times.total)) {
+                if (core >= core_times_.size()) {
+                    core_times_.resize(core + 1);
+                }
+                if (core >= snapshot.core_busy.size()) {
+                    snapshot.core_busy.resize(core + 1);
+                }
+                snapshot.core_busy[core] = busy_fraction(core_times_[core], times);
+                core_times_[core] = times;
+            }
+        }
+
+        line = std::strchr(line, '\n');
+        if (!line) {
+            break;
+        }
+        line++;
+    }
 
+    for (const auto &freq : core_freq_) {
+        const char *value = freq->Read();
+        snapshot.core_khz.push_back(value ? std::strtoul(value, nullptr, 10) : 0);
+    }
+}
 
-    // update disk information
-    for(auto m : mount_points) {
+/*
+ * free space of each registered mount, and the rate its device is written
+ * at from the sectors written counter in /proc/diskstats
+ */
+void SysInfo::SampleDisks(SystemSnapshot &snapshot, double seconds)
+{
+    const char *diskstats = mount_points.empty() ? nullptr : diskstats_->Read();
+
+    for (auto &m : mount_points) {
         struct statvfs buf;
         DiskInfo di;
 
-        if (statvfs(m.c_str(), &buf) == 0) {
+        if (statvfs(m.first.c_str(), &buf) == 0) {
             di.capacity = BlocksToMb(buf.f_blocks, buf.f_frsize);
             di.available = BlocksToMb(buf.f_bavail, buf.f_bsize);
         } else {
@@ -66,67 +301,187 @@ void SysInfo::Sample(void)
             di.capacity = 0;
             di.available = 0;
         }
-        disk_information[m] = di;
+        di.write_rate = 0;
+
+        // lines are "major minor name" followed by the counters, sectors
+        // written is the 7th counter
+        for (const char *line = diskstats; line && *line; ) {
+            unsigned int major_number, minor_number;
+            int offset = 0;
+            if (std::sscanf(line, "%u %u %*s%n", &major_number, &minor_number, &offset) == 2 &&
+                makedev(major_number, minor_number) == m.second.device) {
+                const char *p = line + offset;
+                char *end;
+                uint64_t counter = 0;
+                for (int i = 0; i < 7; i++) {
+                    counter = std::strtoull(p, &end, 10);
+                    p = end;
+                }
+                if (seconds > 0 && m.second.sectors_written && counter >= m.second.sectors_written) {
+                    di.write_rate = (counter - m.second.sectors_written) * kDiskStatsSectorSize / seconds;
+                }
+                m.second.sectors_written = counter;
+                break;
+            }
+            line = std::strchr(line, '\n');
+            if (line) {
+                line++;
+            }
+        }
+
+        snapshot.disks[m.first] = di;
+    }
+}
+
+void SysInfo::SampleDevices(SystemSnapshot &snapshot)
+{
+    for (const auto &zone : thermal_zones_) {
+        // some zones fail to read while their sensor is off, leave them out
+        const char *value = zone.second->Read();
+        if (value) {
+            snapshot.temperatures.emplace_back(zone.first, std::strtol(value, nullptr, 10) / 1000.0);
+        }
+    }
+    for (const auto &device : devfreq_) {
+        const char *value = device.second->Read();
+        if (value) {
+            snapshot.device_hz.emplace_back(device.first, std::strtoul(value, nullptr, 10));
+        }
     }
 }
 
 /*
- * This method uses /proc/meminfo to get an updated view of memory usage. This is more
- * accurate than using the information returned by sysinfo, because Linux will use
- * free memory for disk caching. To sysinfo this appears to be used, but the kernel will
- * free it as soon as it is needed by another program so it should be included in the
- * reported available memory.
+ * cpu used by each thread of this process since the previous sample, added
+ * up by thread name. Threads come and go (encoder workers, file rollover),
+ * so these files are opened each sample; only threads seen in both samples
+ * are counted
  */
-void SysInfo::UpdateMemInfo()
+void SysInfo::SampleThreads(SystemSnapshot &snapshot, double seconds)
 {
-    std::string token;
-    std::ifstream file("/proc/meminfo");
+    static const long ticks_per_second = sysconf(_SC_CLK_TCK);
+    std::map<pid_t, std::pair<std::string, uint64_t>> thread_ticks;
+    char buffer[512];
 
-    mem_available_ = 0;
+    DIR *tasks = opendir("/proc/self/task");
+    if (!tasks) {
+        return;
+    }
+    while (struct dirent *entry = readdir(tasks)) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        std::string path = std::string("/proc/self/task/") + entry->d_name + "/stat";
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        ssize_t n = read(fd, buffer, sizeof(buffer) - 1);
+        close(fd);
+        if (n <= 0) {
+            continue;
+        }
+        buffer[n] = '\0';
 
-    while(file >> token) {
-        if(token == "MemAvailable:") {
-            unsigned long mem;
-            if(file >> mem) {
-                mem_available_ = mem;
+        // "tid (name) state ..." where the name may contain spaces or
+        // parentheses, utime and stime are the 12th and 13th fields after it
+        const char *name_start = std::strchr(buffer, '(');
+        const char *name_end = std::strrchr(buffer, ')');
+        if (!name_start || !name_end || name_end < name_start) {
+            continue;
+        }
+        const char *p = name_end + 2;
+        for (int field = 0; field < 11 && p; field++) {
+            p = std::strchr(p, ' ');
+            if (p) {
+                p++;
             }
         }
-        // ignore rest of the line
-        file.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        if (!p) {
+            continue;
+        }
+        char *end;
+        uint64_t ticks = std::strtoull(p, &end, 10);
+        ticks += std::strtoull(end, nullptr, 10);
+
+        pid_t tid = std::atoi(entry->d_name);
+        std::string name(name_start + 1, name_end);
+        auto previous = thread_ticks_.find(tid);
+        if (seconds > 0 && previous != thread_ticks_.end() && ticks >= previous->second.second) {
+            snapshot.thread_cpus[name] += (ticks - previous->second.second) / (seconds * ticks_per_second);
+        } else if (!snapshot.thread_cpus.count(name)) {
+            snapshot.thread_cpus[name] = 0;
+        }
+        thread_ticks[tid] = std::make_pair(std::move(name), ticks);
+    }
+    closedir(tasks);
+    thread_ticks_ = std::move(thread_ticks);
+}
+
+void SysInfo::Start(std::chrono::seconds interval)
+{
+    Stop();
+    stop_sampler_ = false;
+    sampler_ = std::thread(&SysInfo::RunSampler, this, interval);
+}
+
+void SysInfo::Stop()
+{
+    if (!sampler_.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(sampler_mutex_);
+        stop_sampler_ = true;
+    }
+    sampler_cv_.notify_all();
+    sampler_.join();
+}
+
+void SysInfo::RunSampler(std::chrono::seconds interval)
+{
+    // stay out of the way of the recording threads on a busy system.
+    // setpriority() with a thread ID only changes this thread
+    thread_tuning::SetName("mba-sysinfo");
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), kSamplerNice);
+
+    std::unique_lock<std::mutex> lock(sampler_mutex_);
+    while (!sampler_cv_.wait_for(lock, interval, [this] {return stop_sampler_;})) {
+        lock.unlock();
+        Sample();
+        lock.lock();
     }
 }
 
 void SysInfo::AddMount(std::string mount)
 {
-    // TODO check that mount point exists before registering, otherwise throw exception
-    mount_points.insert(mount);
+    struct stat sb;
+    if (stat(mount.c_str(), &sb) != 0) {
+        throw DiskRegistrationException("unable to register " + mount + ": " + std::strerror(errno));
+    }
+    std::lock_guard<std::mutex> lock(sample_mutex_);
+    mount_points[mount] = Mount {sb.st_dev, 0};
 }
 
 void SysInfo::ClearMounts()
 {
+    std::lock_guard<std::mutex> lock(sample_mutex_);
     mount_points.clear();
-    disk_information.clear();
 }
 
-std::vector<std::string> SysInfo::registered_mounts()
+std::vector<std::string> SysInfo::registered_mounts() const
 {
-    // return a vector instead of the set we're using internally
-    std::vector<std::string> v(mount_points.begin(), mount_points.end());
+    // return a vector instead of the map we're using internally
+    std::lock_guard<std::mutex> lock(sample_mutex_);
+    std::vector<std::string> v;
+    for (const auto &m : mount_points) {
+        v.push_back(m.first);
+    }
     return v;
 }
 
-DiskInfo SysInfo::disk_info(const std::string mount)
+bool SysInfo::IsTegra()
 {
-
-    DiskInfo di;
-
-    auto it = disk_information.find(mount);
-    assert(it != disk_information.end());
-
-    di.capacity = it->second.capacity;
-    di.available = it->second.available;
-
-    return di;
+    return access(kTegraReleaseFile, F_OK) == 0;
 }
 
 unsigned long SysInfo::BlocksToMb(fsblkcnt_t blocks, unsigned long bsize)
@@ -134,4 +489,3 @@ unsigned long SysInfo::BlocksToMb(fsblkcnt_t blocks, unsigned long bsize)
     // convert number of filesystem blocks into a size in mB
     return blocks * bsize / (1048576);
 }
-
@@ -3,10 +3,16 @@
 #ifndef SYSTEM_INFO_H
 #define SYSTEM_INFO_H
 
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
 #include <exception>
 #include <map>
-#include <set>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include <sys/sysinfo.h>
@@ -19,6 +25,7 @@
 struct DiskInfo {
     unsigned long capacity;  ///capacity of mount in megabytes
     unsigned long available; ///available disk space of mount in megabytes
+    double write_rate;       ///bytes per second written to the mount's device since the previous sample
 };
 
 /**
@@ -38,26 +45,116 @@ public:
     }
 };
 
+/**
+ * @brief one sample of the system state, see SysInfo
+ *
+ * rates and utilizations are averages over the time since the previous
+ * sample, they are zero in the first sample
+ */
+struct SystemSnapshot {
+    unsigned long uptime = 0;           ///< seconds since boot
+    float load = 0;                     ///< 1 minute load average
+    unsigned long mem_total = 0;        ///< physical memory in kB
+    unsigned long mem_available = 0;    ///< memory available in kB
+    double cpu_busy = 0;                ///< fraction of all cpu time that was busy
+    std::vector<double> core_busy;      ///< fraction of each core's time that was busy
+    std::vector<unsigned long> core_khz; ///< current frequency of each core, empty if not available
+    std::map<std::string, DiskInfo> disks; ///< registered mount points
+    /// thermal zone name and temperature in degrees C (on Tegra e.g. "CPU-therm", "GPU-therm")
+    std::vector<std::pair<std::string, double>> temperatures;
+    /// devfreq device name and current frequency in Hz (on Tegra the GPU and memory clocks)
+    std::vector<std::pair<std::string, unsigned long>> device_hz;
+    /// cpus used by the threads of this process, by thread name. Recording
+    /// threads are named by role, see thread_tuning::SetName()
+    std::map<std::string, double> thread_cpus;
+};
+
 /**
  * @brief system information
  *
- * this class gathers system information such as total physical memory, memory available, 
- * available disk space, load average. This uses functionality only available on Linux 
- * and is non-portable.
+ * this class gathers system information such as total physical memory, memory available,
+ * available disk space, load average, cpu and disk utilization, temperatures and clocks.
+ * This uses functionality only available on Linux and is non-portable.
+ *
+ * Sampling is meant to be cheap enough to share cores with the encoder: the
+ * /proc and /sys files are opened once and re-read with pread() into fixed
+ * buffers. Start() samples on a low priority background thread, and each
+ * sample is published as an immutable SystemSnapshot, so readers never wait
+ * for a sample to be taken.
  */
 class SysInfo {
 
 private:
-    float load_;
-    unsigned long mem_available_;
-    unsigned long mem_total_;
-    struct sysinfo system_info;
+    /// a /proc or /sys file that is kept open and re-read from the start
+    class StatFile {
+    public:
+        explicit StatFile(const std::string &path, size_t buffer_size = 4096);
+        ~StatFile();
+        StatFile(const StatFile&) = delete;
+        StatFile& operator=(const StatFile&) = delete;
+
+        /// false if the file couldn't be opened
+        bool is_open() const {return fd_ >= 0;}
+
+        /**
+         * @brief read the whole file
+         * @return nul terminated contents, or null on error. The buffer
+         * grows if the file doesn't fit and is reused by the next Read()
+         */
+        const char* Read();
+
+    private:
+        int fd_;
+        std::vector<char> buffer_;
+    };
+
+    /// a registered mount point
+    struct Mount {
+        dev_t device;               ///< device the mount's filesystem is on
+        uint64_t sectors_written;   ///< at the previous sample
+    };
+
+    /// cpu time counters for one line of /proc/stat
+    struct CpuTimes {
+        uint64_t busy = 0;
+        uint64_t total = 0;
+    };
+
     std::string hostname_;
     std::string release_;
-    std::set <std::string> mount_points;
-    std::map <std::string, DiskInfo> disk_information;
+    unsigned long mem_total_;
 
-    void UpdateMemInfo();
+    std::unique_ptr<StatFile> meminfo_;
+    std::unique_ptr<StatFile> stat_;
+    std::unique_ptr<StatFile> diskstats_;
+    std::vector<std::unique_ptr<StatFile>> core_freq_;
+    std::vector<std::pair<std::string, std::unique_ptr<StatFile>>> thermal_zones_;
+    std::vector<std::pair<std::string, std::unique_ptr<StatFile>>> devfreq_;
+
+    // state kept between samples, guarded by sample_mutex_
+    mutable std::mutex sample_mutex_;
+    std::map<std::string, Mount> mount_points;
+    CpuTimes cpu_times_;
+    std::vector<CpuTimes> core_times_;
+    std::map<pid_t, std::pair<std::string, uint64_t>> thread_ticks_; ///< thread name and cpu ticks
+    std::chrono::steady_clock::time_point last_sample_;
+
+    /// latest sample, only accessed through std::atomic_load/atomic_store
+    std::shared_ptr<const SystemSnapshot> snapshot_;
+
+    // background sampling
+    std::thread sampler_;
+    std::mutex sampler_mutex_;
+    std::condition_variable sampler_cv_;
+    bool stop_sampler_ = false;
+
+    void SampleMemory(SystemSnapshot &snapshot);
+    void SampleCpus(SystemSnapshot &snapshot);
+    void SampleDisks(SystemSnapshot &snapshot, double seconds);
+    void SampleDevices(SystemSnapshot &snapshot);
+    void SampleThreads(SystemSnapshot &snapshot, double seconds);
+
+    void RunSampler(std::chrono::seconds interval);
 
     unsigned long BlocksToMb(fsblkcnt_t blocks, unsigned long bsize);
 
@@ -72,58 +169,67 @@ public:
      */
     SysInfo();
 
+    /// stops the background sampler
+    ~SysInfo();
+
+    SysInfo(const SysInfo&) = delete;
+    SysInfo& operator=(const SysInfo&) = delete;
+
     /**
      * @brief sample system information
      *
      * refreshes the view of the system by getting updated memory usage, load,
-     * disk usage, etc
+     * disk usage, etc and publishes a new snapshot
      *
      * @return void
      */
     void Sample();
 
-    std::string hostname() { return hostname_; }
-
     /**
-     * @brief get amount of physical memory in kB
+     * @brief sample periodically on a background thread
      *
-     * @return amount of RAM
-     */
-    unsigned long mem_total() { return mem_total_; }
-
-    /**
-     * @brief get memory available in kB
+     * the thread runs at a lower priority than the rest of the process and
+     * inherits the cpu affinity of the calling thread. Restarts the thread
+     * if it is already running, e.g. to pick up a new interval or affinity
      *
-     * @return memory available
+     * @param interval time between samples
      */
-    unsigned long mem_available() { return mem_available_; }
+    void Start(std::chrono::seconds interval);
+
+    /// stop the background sampler, if running
+    void Stop();
 
     /**
-     * @brief get 1 minute load average
+     * @brief get the latest sample
      *
-     * @return floating point load average
+     * never blocks on sampling, may be called from any thread
+     *
+     * @return the most recently published snapshot
      */
-    float load() { return load_; }
+    std::shared_ptr<const SystemSnapshot> snapshot() const {return std::atomic_load(&snapshot_);}
+
+    const std::string& hostname() const { return hostname_; }
 
     /**
-     * @brief get uptime in seconds
+     * @brief get release string
      *
-     * @return number of seconds since boot
+     * @return release (NVidia Tegra release string or Kernel Release)
      */
-    unsigned long uptime() { return system_info.uptime; }
+    const std::string& release() const { return release_; }
 
     /**
-     * @brief get release string
+     * @brief check if we are running on an NVIDIA Tegra (Jetson) board
      *
-     * @return release (NVidia Tegra release string or Kernel Release)
+     * @return true if /etc/nv_tegra_release exists
      */
-    std::string release() { return release_; }
+    static bool IsTegra();
 
     /**
      * @brief register mount point
      *
      * register a mount point so that we will gather information about it (capacity,
-     * available space)
+     * available space, write rate). It is included in the snapshot from the next
+     * sample on
      *
      * @param path string containing path to mount
      */
@@ -140,18 +246,6 @@ public:
      *
      * @return a vector of strings listing all registered mounts
      */
-    std::vector <std::string> registered_mounts();
-
-    /**
-     * @brief returns information about capacity and available disk space
-     *
-     * this method looks up a mount point, specified as a string, and returns the
-     * capacity and available disk space in a struct. This mount point must have been
-     * registered prior to the last call to sample(), otherwise reported capacity and
-     * available space will be zero
-     *
-     * @return a struct containing disk capacity and available space
-     */
-    DiskInfo disk_info(const std::string mount);
+    std::vector <std::string> registered_mounts() const;
 };
-#endif
\ No newline at end of file
+#endif
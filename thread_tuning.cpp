@@ -0,0 +1,166 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#include <cstring>
+#include <pthread.h>
+#include <sched.h>
+#include <stdexcept>
+#include <thread>
+
+#include "thread_tuning.h"
+
+namespace thread_tuning {
+
+bool SetAffinity(const std::vector<int> &cpus)
+{
+    if (cpus.empty()) {
+        return true;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        if (cpu < 0 || cpu >= CPU_SETSIZE) {
+            return false;
+        }
+        CPU_SET(cpu, &set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+bool Apply(const ThreadPolicy &policy, std::string &error)
+{
+    bool ok = true;
+    error.clear();
+
+    std::vector<int> cpus = policy.cpus;
+    if (cpus.empty()) {
+        // allow every cpu, in case we inherited a narrower set
+        unsigned int num_cpus = std::thread::hardware_concurrency();
+        for (unsigned int i = 0; i < num_cpus; i++) {
+            cpus.push_back(i);
+        }
+    }
+    if (!SetAffinity(cpus)) {
+        error = "unable to set affinity to cpus " + CpuListString(policy.cpus);
+        ok = false;
+    }
+
+    struct sched_param param;
+    std::memset(&param, 0, sizeof(param));
+    int sched_policy = SCHED_OTHER;
+    if (policy.fifo_priority > 0) {
+        sched_policy = SCHED_FIFO;
+        param.sched_priority = policy.fifo_priority;
+    }
+    int rval = pthread_setschedparam(pthread_self(), sched_policy, &param);
+    if (rval != 0) {
+        if (!error.empty()) {
+            error += ", ";
+        }
+        error += "unable to set " + std::string(sched_policy == SCHED_FIFO ? "SCHED_FIFO" : "SCHED_OTHER") +
+                 ": " + std::strerror(rval);
+        ok = false;
+    }
+    return ok;
+}
+
+bool SetName(const std::string &name)
+{
+    return pthread_setname_np(pthread_self(), name.substr(0, 15).c_str()) == 0;
+}
+
+std::vector<int> ParseCpuList(const std::string &list)
+{
+    std::vector<int> cpus;
+    size_t start = 0;
+
+    while (start < list.size()) {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+        std::string item = list.substr(start, end - start);
+        start = end + 1;
+
+        // trim whitespace, skip empty items
+        size_t first = item.find_first_not_of(" \t");
+        if (first == std::string::npos) {
+            continue;
+        }
+        item = item.substr(first, item.find_last_not_of(" \t") - first + 1);
+
+        // each item is either N or N-M
+        int low, high;
+        try {
+            size_t consumed;
+            low = std::stoi(item, &consumed);
+            high = low;
+            if (consumed < item.size()) {
+                if (item[consumed] != '-') {
+                    throw std::invalid_argument(item);
+                }
+                std::string rest = item.substr(consumed + 1);
+                high = std::stoi(rest, &consumed);
+                if (consumed != rest.size()) {
+                    throw std::invalid_argument(item);
+                }
+            }
+        } catch (const std::logic_error &e) {
+            throw std::invalid_argument("invalid cpu list: " + list);
+        }
+        if (low < 0 || high < low || high >= CPU_SETSIZE) {
+            throw std::invalid_argument("invalid cpu list: " + list);
+        }
+        for (int cpu = low; cpu <= high; cpu++) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+std::string CpuListString(const std::vector<int> &cpus)
+{
+    if (cpus.empty()) {
+        return "any";
+    }
+
+    std::string s;
+    for (size_t i = 0; i < cpus.size(); i++) {
+        if (i) {
+            s += ",";
+        }
+        s += std::to_string(cpus[i]);
+    }
+    return s;
+}
+
+std::string Describe(const ThreadPolicy &policy)
+{
+    std::string s = "cpus " + CpuListString(policy.cpus);
+    if (policy.fifo_priority > 0) {
+        s += " SCHED_FIFO priority " + std::to_string(policy.fifo_priority);
+    } else {
+        s += " SCHED_OTHER";
+    }
+    return s;
+}
+
+std::vector<std::vector<int>> PartitionCpus(size_t pipelines)
+{
+    std::vector<std::vector<int>> partitions(pipelines);
+    unsigned int num_cpus = std::thread::hardware_concurrency();
+
+    if (pipelines == 0 || num_cpus < pipelines) {
+        return partitions;
+    }
+
+    unsigned int per_pipeline = num_cpus / pipelines;
+    for (size_t i = 0; i < pipelines; i++) {
+        for (unsigned int j = 0; j < per_pipeline; j++) {
+            partitions[i].push_back(i * per_pipeline + j);
+        }
+    }
+    return partitions;
+}
+
+} // namespace thread_tuning
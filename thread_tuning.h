@@ -0,0 +1,99 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#ifndef THREAD_TUNING_H
+#define THREAD_TUNING_H
+
+#include <string>
+#include <vector>
+
+/**
+ * @brief helpers for controlling where and how recording threads run
+ *
+ * CPU affinity and scheduling policy set on a thread are inherited by every
+ * thread it creates, so setting the policy of a recording thread also covers
+ * its encoder thread, the encoder's own worker threads and the background
+ * threads that open and close files.
+ */
+namespace thread_tuning {
+
+/**
+ * @brief where and how a thread should be scheduled
+ */
+struct ThreadPolicy {
+    /// cpus the thread may run on, empty for any cpu
+    std::vector<int> cpus;
+
+    /// SCHED_FIFO priority (1-99), 0 for the default time sharing scheduler
+    int fifo_priority = 0;
+};
+
+/**
+ * @brief restrict the calling thread to a set of cpus
+ * @param cpus cpu numbers, an empty list is a no-op
+ * @return true on success, false if the affinity couldn't be set
+ */
+bool SetAffinity(const std::vector<int> &cpus);
+
+/**
+ * @brief apply a policy to the calling thread
+ *
+ * unlike SetAffinity() an empty cpu list allows every cpu, and a zero
+ * priority switches back to the default scheduler, so the thread doesn't
+ * keep a policy it inherited from the thread that created it. SCHED_FIFO
+ * needs CAP_SYS_NICE or a suitable RLIMIT_RTPRIO.
+ *
+ * @param policy policy to apply
+ * @param error set to a description of the problem on failure
+ * @return true on success, false if any part of the policy couldn't be applied
+ */
+bool Apply(const ThreadPolicy &policy, std::string &error);
+
+/**
+ * @brief name the calling thread
+ *
+ * the name shows up in top -H and /proc, and is inherited by threads the
+ * named thread creates. Linux truncates it to 15 characters
+ *
+ * @param name thread name
+ * @return true on success
+ */
+bool SetName(const std::string &name);
+
+/**
+ * @brief parse a cpu list such as "0-2,5"
+ *
+ * throws std::invalid_argument if the list is malformed
+ *
+ * @param list comma separated cpu numbers and ranges, may be empty
+ * @return cpu numbers in the order given
+ */
+std::vector<int> ParseCpuList(const std::string &list);
+
+/**
+ * @brief format a set of cpus for logging
+ * @param cpus cpu numbers
+ * @return comma separated cpu numbers, "any" for an empty list
+ */
+std::string CpuListString(const std::vector<int> &cpus);
+
+/**
+ * @brief describe a policy for logging
+ * @param policy policy to describe
+ * @return e.g. "cpus 0,1 SCHED_FIFO priority 50"
+ */
+std::string Describe(const ThreadPolicy &policy);
+
+/**
+ * @brief split the online cpus evenly between a number of pipelines
+ *
+ * pipeline i gets a contiguous block of cpus. If there are fewer cpus than
+ * pipelines every list is empty and the threads are left unpinned.
+ *
+ * @param pipelines number of pipelines
+ * @return one cpu list per pipeline
+ */
+std::vector<std::vector<int>> PartitionCpus(size_t pipelines);
+
+} // namespace thread_tuning
+
+#endif
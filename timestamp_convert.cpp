@@ -0,0 +1,92 @@
+/**
+ * @brief convert a binary timestamp file to the text timestamp format
+ *
+ * Reads a timestamps.bin file written by a recording session using the
+ * binary timestamp format and writes the equivalent timestamps.txt content:
+ * one line per frame with the time since the first frame in seconds.
+ *
+ * usage: mba-timestamp-convert <INPUT.bin> [OUTPUT.txt]
+ *
+ * output goes to stdout if no output file is given
+ */
+
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "timestamp_log.h"
+
+// number of ticks read from the input file at a time
+const size_t kReadChunk = 8192;
+
+int main(int argc, char **argv)
+{
+    if (argc < 2 || argc > 3) {
+        std::cerr << "usage: " << argv[0] << " <INPUT.bin> [OUTPUT.txt]\n";
+        return 1;
+    }
+
+    std::ifstream input(argv[1], std::ifstream::in | std::ifstream::binary);
+    if (!input) {
+        std::cerr << "unable to open " << argv[1] << std::endl;
+        return 1;
+    }
+
+    TimestampFileHeader header;
+    if (!input.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+        std::memcmp(header.magic, kTimestampFileMagic, sizeof(header.magic)) != 0) {
+        std::cerr << argv[1] << " is not a binary timestamp file\n";
+        return 1;
+    }
+    if (header.version != kTimestampFileVersion || header.header_size < sizeof(header) ||
+        header.tick_rate == 0) {
+        std::cerr << "unsupported timestamp file version " << header.version << std::endl;
+        return 1;
+    }
+    // skip any header fields added after this version
+    input.seekg(header.header_size);
+
+    std::ofstream output_file;
+    if (argc == 3) {
+        output_file.open(argv[2], std::ofstream::out);
+        if (!output_file) {
+            std::cerr << "unable to open " << argv[2] << std::endl;
+            return 1;
+        }
+    }
+    std::ostream &output = argc == 3 ? output_file : std::cout;
+
+    std::vector<uint64_t> ticks(kReadChunk);
+    std::string text;
+    uint64_t first_tick = 0;
+    bool have_first = false;
+
+    while (input) {
+        input.read(reinterpret_cast<char*>(ticks.data()), ticks.size() * sizeof(uint64_t));
+        size_t count = input.gcount() / sizeof(uint64_t);
+        if (count == 0) {
+            break;
+        }
+        if (!have_first) {
+            first_tick = ticks[0];
+            have_first = true;
+        }
+
+        text.clear();
+        for (size_t i = 0; i < count; i++) {
+            TimestampLog::AppendText(text, ticks[i] - first_tick, header.tick_rate);
+        }
+        output.write(text.data(), text.size());
+    }
+
+    output.flush();
+    if (!output) {
+        std::cerr << "error writing timestamps\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,98 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include "timestamp_log.h"
+
+// buffered timestamps are written once the buffer reaches this size...
+const size_t kFlushBytes = 64 * 1024;
+
+// ...or once this much time has passed since the last write
+const std::chrono::seconds kFlushInterval(1);
+
+TimestampLog::TimestampLog(const std::string &filename, const std::string &format, uint64_t tick_rate) :
+    filename_(filename), binary_(format == timestamp_formats::BINARY), tick_rate_(tick_rate)
+{
+    if (std::find(timestamp_formats::format_names.begin(), timestamp_formats::format_names.end(), format)
+        == timestamp_formats::format_names.end()) {
+        throw std::invalid_argument("invalid timestamp format: " + format);
+    }
+
+    std::ios_base::openmode mode = std::ofstream::out;
+    if (binary_) {
+        mode |= std::ofstream::binary;
+    }
+    file_.open(filename, mode);
+    if (!file_) {
+        throw std::runtime_error("unable to open " + filename);
+    }
+
+    buffer_.reserve(kFlushBytes + 64);
+
+    if (binary_) {
+        TimestampFileHeader header;
+        std::memcpy(header.magic, kTimestampFileMagic, sizeof(header.magic));
+        header.version = kTimestampFileVersion;
+        header.header_size = sizeof(TimestampFileHeader);
+        header.tick_rate = tick_rate_;
+        buffer_.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    }
+    last_flush_ = std::chrono::steady_clock::now();
+}
+
+TimestampLog::~TimestampLog()
+{
+    try {
+        Flush();
+    } catch (const std::runtime_error &e) {
+        std::cerr << e.what() << std::endl;
+    }
+}
+
+void TimestampLog::Append(uint64_t ticks)
+{
+    if (binary_) {
+        buffer_.append(reinterpret_cast<const char*>(&ticks), sizeof(ticks));
+    } else {
+        // record timestamp of current frame, as an offset from the first timestamp
+        if (!have_first_) {
+            first_tick_ = ticks;
+            have_first_ = true;
+        }
+        AppendText(buffer_, ticks - first_tick_, tick_rate_);
+    }
+
+    if (buffer_.size() >= kFlushBytes ||
+        std::chrono::steady_clock::now() - last_flush_ >= kFlushInterval) {
+        Flush();
+    }
+}
+
+void TimestampLog::Flush()
+{
+    if (!buffer_.empty()) {
+        file_.write(buffer_.data(), buffer_.size());
+        buffer_.clear();
+    }
+    file_.flush();
+    last_flush_ = std::chrono::steady_clock::now();
+    if (!file_) {
+        // a full disk would otherwise truncate the log while the video goes on
+        throw std::runtime_error("error writing timestamps to " + filename_);
+    }
+}
+
+void TimestampLog::AppendText(std::string &buffer, uint64_t offset_ticks, uint64_t tick_rate)
+{
+    // seconds with microsecond precision, same as std::fixed with
+    // std::setprecision(6)
+    char line[32];
+    int n = std::snprintf(line, sizeof(line), "%.6f\n", offset_ticks / static_cast<double>(tick_rate));
+    if (n > 0) {
+        buffer.append(line, std::min<size_t>(n, sizeof(line) - 1));
+    }
+}
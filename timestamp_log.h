@@ -0,0 +1,107 @@
+// Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
+
+#ifndef TIMESTAMP_LOG_H
+#define TIMESTAMP_LOG_H
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+/**
+ * @brief supported timestamp log formats
+ */
+namespace timestamp_formats {
+    /// one line per frame, seconds since the first frame with microsecond precision
+    const std::string TEXT = "text";
+    /// TimestampFileHeader followed by the raw 64-bit camera tick of each frame
+    const std::string BINARY = "binary";
+
+    /// vector of all valid format names
+    const std::vector<std::string> format_names = {TEXT, BINARY};
+}
+
+/**
+ * @brief header at the start of a binary timestamp file
+ *
+ * followed by one uint64_t camera tick per frame. All fields and ticks are
+ * stored in host (little endian) byte order. The header is a multiple of 8
+ * bytes so the ticks are naturally aligned when the file is mmapped.
+ */
+struct TimestampFileHeader {
+    char magic[8];          ///< kTimestampFileMagic
+    uint32_t version;       ///< kTimestampFileVersion
+    uint32_t header_size;   ///< sizeof(TimestampFileHeader), offset of the first tick
+    uint64_t tick_rate;     ///< camera ticks per second
+};
+
+/// identifies a binary timestamp file
+const char kTimestampFileMagic[8] = {'J', 'A', 'B', 'S', 'T', 'S', '\0', '\0'};
+
+/// current binary timestamp file version
+const uint32_t kTimestampFileVersion = 1;
+
+/**
+ * @brief per-frame timestamp output for a recording session
+ *
+ * Timestamps are collected in memory and only written out once the buffer
+ * fills, when the flush interval has elapsed, or when Flush() is called (e.g.
+ * at file rollover), rather than flushing the stream for every frame.
+ */
+class TimestampLog {
+public:
+    /**
+     * @brief open a timestamp log
+     *
+     * throws std::runtime_error if the file can't be opened
+     *
+     * @param filename path of the file to create
+     * @param format one of timestamp_formats::format_names
+     * @param tick_rate camera ticks per second
+     */
+    TimestampLog(const std::string& filename, const std::string& format, uint64_t tick_rate);
+
+    /// flushes any buffered timestamps, errors are logged
+    ~TimestampLog();
+
+    TimestampLog(const TimestampLog&) = delete;
+    TimestampLog& operator=(const TimestampLog&) = delete;
+
+    /**
+     * @brief record the timestamp of a frame
+     *
+     * throws std::runtime_error if buffered timestamps are written out and
+     * the write fails
+     *
+     * @param ticks camera timestamp of the frame
+     */
+    void Append(uint64_t ticks);
+
+    /// write buffered timestamps to the file. throws std::runtime_error if the write fails
+    void Flush();
+
+    /**
+     * @brief format one frame in the text timestamp format
+     *
+     * shared with the binary to text converter so both produce identical
+     * output
+     *
+     * @param buffer string to append the line to
+     * @param offset_ticks ticks since the first frame of the session
+     * @param tick_rate camera ticks per second
+     */
+    static void AppendText(std::string& buffer, uint64_t offset_ticks, uint64_t tick_rate);
+
+private:
+    std::string filename_;      ///< path of file_, for error messages
+    std::ofstream file_;        ///< output file
+    bool binary_;               ///< write raw ticks rather than text
+    uint64_t tick_rate_;        ///< camera ticks per second
+    bool have_first_ = false;   ///< first_tick_ has been set
+    uint64_t first_tick_ = 0;   ///< tick of the first frame, text offsets are relative to it
+    std::string buffer_;        ///< timestamps not yet written to file_
+    std::chrono::steady_clock::time_point last_flush_; ///< time of the last Flush()
+};
+
+#endif
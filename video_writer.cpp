@@ -1,11 +1,18 @@
 // Copyright 2019, The Jackson Laboratory, Bar Harbor, Maine - all rights reserved
 
+#include <algorithm>
+#include <cstdio>
 #include <cstring>
 #include <stdexcept>
 #include <iostream>
 
+#include "file_sink.h"
+#include "luma_denoiser.h"
+#include "packet_ring.h"
 #include "pixel_types.h"
+#include "proxy_encoder.h"
 #include "video_writer.h"
+#include "rtmp_publisher.h"
 #include "camera_controller.h"
 
 // replace the av_err2str macro with something that works for C++
@@ -13,42 +20,123 @@
 #undef av_err2str
 #define av_err2str(errnum) av_make_error_string((char*)__builtin_alloca(AV_ERROR_MAX_STRING_SIZE), AV_ERROR_MAX_STRING_SIZE, errnum)
 
+// target bits per pixel per frame for encoders that need an explicit bitrate
+static const double kHardwareBitsPerPixel = 0.1;
+
+// denoise strengths, the same as the hqdn3d=luma_spatial=10 filter we used
+// to run (hqdn3d defaults the temporal strength to 1.5 times the spatial)
+static const double kDenoiseSpatial = 10;
+static const double kDenoiseTemporal = 15;
+
+// camera buffers are only referenced directly by the encoder if they start on
+// an address aligned to this many bytes
+static const uintptr_t kZeroCopyAlignment = 16;
+
+VideoWriter::OutputFile::OutputFile() = default;
+
+VideoWriter::OutputFile::~OutputFile()
+{
+    try {
+        Close();
+    } catch (const std::exception &e) {
+        std::cerr << "error closing video file: " << e.what() << std::endl;
+    }
+}
+
+void VideoWriter::OutputFile::Close()
+{
+    // a failed proxy doesn't fail the video file
+    if (proxy) {
+        try {
+            proxy->Close();
+        } catch (const std::exception &e) {
+            std::cerr << "error closing proxy file: " << e.what() << std::endl;
+        }
+        proxy.reset();
+    }
+    if (file_sink) {
+        std::unique_ptr<FileSink> sink = std::move(file_sink);
+        sink->Close();
+    }
+}
+
+void VideoWriter::OutputFile::Remove()
+{
+    const std::string proxy_filename = proxy ? proxy->filename() : "";
+    try {
+        Close();
+    } catch (const std::exception &e) {
+        // being deleted anyway
+    }
+    std::remove(filename.c_str());
+    if (!proxy_filename.empty()) {
+        std::remove(proxy_filename.c_str());
+    }
+}
+
 // move assignment operator
 VideoWriter & VideoWriter::operator=(VideoWriter &&o)
 {
     if (this != &o)
     {
-        // close rtmp output if it was open
-        // don't try to copy it -- it will get reopened on demand
-        rtmp_format_context_.reset();
+        // flush and close our current file, this also stops the rtmp
+        // publisher if it was running
+        Close();
 
         // the rest of the members can be copied or moved
+        filename_ = o.filename_;
         rtmp_uri_ = o.rtmp_uri_;
         ffcodec_ = o.ffcodec_;
-        apply_filter_ = o.apply_filter_;
         selected_pixel_format_ = o.selected_pixel_format_;
-        stream_ = o.stream_;
-        buffersink_ctx_ = std::move(o.buffersink_ctx_);
-        buffersrc_ctx_ = std::move(o.buffersrc_ctx_);
         codec_context_ = std::move(o.codec_context_);
-        format_context_ = std::move(o.format_context_);
-        filter_graph_ = std::move(o.filter_graph_);
-        bsfc_ = std::move(o.bsfc_);
+        denoiser_ = std::move(o.denoiser_);
+        filter_thread_ = o.filter_thread_;
+        frame_pool_ = std::move(o.frame_pool_);
+        frame_ = std::move(o.frame_);
+        pending_frame_ = std::move(o.pending_frame_);
+        packet_ = std::move(o.packet_);
+        file_sink_ = std::move(o.file_sink_);
+        packet_ring_ = std::move(o.packet_ring_);
+        proxy_ = std::move(o.proxy_);
+        rtmp_publisher_ = std::move(o.rtmp_publisher_);
+        sinks_ = std::move(o.sinks_);
+        luma_row_bytes_ = o.luma_row_bytes_;
+        zero_copy_frames_ = o.zero_copy_frames_;
+        bytes_written_ = o.bytes_written_;
+        next_file_ = std::move(o.next_file_);
+        switch_pts_ = o.switch_pts_;
+        retired_file_ = std::move(o.retired_file_);
+        encoder_config_ = o.encoder_config_;
+        unpack_mono12_ = o.unpack_mono12_;
+        stats_ = o.stats_;
     }
     return *this;
 }
 
 // move constructor
-VideoWriter::VideoWriter(VideoWriter &&o) : rtmp_uri_(o.rtmp_uri_), ffcodec_(o.ffcodec_),
-                                            apply_filter_(o.apply_filter_),
+VideoWriter::VideoWriter(VideoWriter &&o) : filename_(o.filename_), rtmp_uri_(o.rtmp_uri_), ffcodec_(o.ffcodec_),
                                             selected_pixel_format_(o.selected_pixel_format_),
-                                            stream_(o.stream_),
-                                            buffersink_ctx_(std::move(o.buffersink_ctx_)),
-                                            buffersrc_ctx_(std::move(o.buffersrc_ctx_)),
                                             codec_context_(std::move(o.codec_context_)),
-                                            format_context_(std::move(o.format_context_)),
-                                            filter_graph_(std::move(o.filter_graph_)),
-                                            bsfc_(std::move(o.bsfc_)) {}
+                                            denoiser_(std::move(o.denoiser_)),
+                                            filter_thread_(o.filter_thread_),
+                                            frame_pool_(std::move(o.frame_pool_)),
+                                            frame_(std::move(o.frame_)),
+                                            pending_frame_(std::move(o.pending_frame_)),
+                                            packet_(std::move(o.packet_)),
+                                            file_sink_(std::move(o.file_sink_)),
+                                            packet_ring_(std::move(o.packet_ring_)),
+                                            proxy_(std::move(o.proxy_)),
+                                            rtmp_publisher_(std::move(o.rtmp_publisher_)),
+                                            sinks_(std::move(o.sinks_)),
+                                            luma_row_bytes_(o.luma_row_bytes_),
+                                            zero_copy_frames_(o.zero_copy_frames_),
+                                            bytes_written_(o.bytes_written_),
+                                            next_file_(std::move(o.next_file_)),
+                                            switch_pts_(o.switch_pts_),
+                                            retired_file_(std::move(o.retired_file_)),
+                                            encoder_config_(o.encoder_config_),
+                                            unpack_mono12_(o.unpack_mono12_),
+                                            stats_(o.stats_) {}
 
 
 // parameter constructor for creating configured VideoWriters
@@ -59,415 +147,623 @@ VideoWriter::VideoWriter(
     int frame_width, int frame_height,
     const CameraController::RecordingSessionConfig& config)
 {
-    int r;
+    rtmp_uri_ = rtmp_uri;
 
-    // make sure that config.codec is something we support
-    // for now we are only supporting LIBX264
-    if (config.codec() != codecs::LIBX264) {
-        throw std::invalid_argument("currently only libx264 codec is supported");
+    // Mono8 and Mono12 camera data can be used as the luma plane of the
+    // encoder's frames as is. Mono12Packed is unpacked to Mono12 first
+    unpack_mono12_ = false;
+    if (config.pixel_format() == pixel_types::MONO8) {
+        selected_pixel_format_ = AV_PIX_FMT_GRAY8;
+    } else if (config.pixel_format() == pixel_types::MONO12) {
+        selected_pixel_format_ = AV_PIX_FMT_GRAY12;
+    } else if (config.pixel_format() == pixel_types::MONO12PACKED) {
+        selected_pixel_format_ = AV_PIX_FMT_GRAY12;
+        unpack_mono12_ = true;
+        if (frame_width % 2) {
+            throw std::invalid_argument("Mono12Packed requires an even frame width");
+        }
+    } else {
+        selected_pixel_format_ = AV_PIX_FMT_YUV420P;
     }
 
-    std::string full_filename = filename;
-    full_filename.append(".avi");
+    // pick and open the encoder, falling back to libx264 if a requested
+    // hardware encoder isn't available
+    OpenEncoder(config, frame_width, frame_height);
+    encoder_config_ = config;
+
+    // open the output file and write the container header. An armed
+    // session keeps its video in memory until it is triggered
+    if (filename.empty()) {
+        if (config.pre_trigger() > 0) {
+            packet_ring_ = std::unique_ptr<PacketRing>(new PacketRing(
+                codec_context_->time_base, config.pre_trigger(), size_t(config.pre_trigger_mb()) * 1024 * 1024));
+        }
+    } else {
+        filename_ = filename + "." + config.container();
+        file_sink_ = std::unique_ptr<FileSink>(new FileSink(filename_, codec_context_.get(), config, stats_));
+        proxy_ = OpenProxy(filename, config);
+    }
+    UpdateSinks();
 
-    rtmp_uri_ = rtmp_uri;
+    InitReusableObjects();
 
-    // lookup specified codec
-    ffcodec_ = avcodec_find_encoder_by_name(config.codec().c_str());
-    if (!ffcodec_) {
-        throw std::invalid_argument("unable to get codec " + config.codec());
+    // luma denoiser, run either inline or pipelined with the encoder
+    if (config.apply_filter()) {
+        int depth = selected_pixel_format_ == AV_PIX_FMT_GRAY12 ? 12 : 8;
+        filter_thread_ = config.filter_thread();
+        denoiser_ = std::unique_ptr<LumaDenoiser>(new LumaDenoiser(
+            codec_context_->width, codec_context_->height, depth,
+            kDenoiseSpatial, kDenoiseTemporal, filter_thread_));
     }
+}
 
-    apply_filter_ = config.apply_filter();
-    codec_context_ = av_pointer::codec_context(avcodec_alloc_context3(ffcodec_));
+VideoWriter::~VideoWriter()
+{
+    try {
+        Close();
+    } catch (const std::exception &e) {
+        std::cerr << "error closing video file: " << e.what() << std::endl;
+    }
+}
 
-    if (!codec_context_) {
-        throw std::runtime_error("unable to initialize AVCodecContext");
+void VideoWriter::Close()
+{
+    // need to make sure this doesn't get called on an object that's been moved
+    // or already closed
+    if (!codec_context_.get()) {
+        return;
     }
 
-    // setup codec_context_
-    codec_context_->width = frame_width;
-    codec_context_->height = frame_height;
-    codec_context_->time_base = (AVRational){1, config.target_fps()};
-    codec_context_->framerate = (AVRational){config.target_fps(), 1};
-    codec_context_->global_quality = 0;
-    codec_context_->compression_level = 0;
+    try {
+        // encode the last frame filtered on the denoiser thread, then flush
+        if (pending_frame_ && pending_frame_->buf[0]) {
+            Encode(pending_frame_.get());
+            av_frame_unref(pending_frame_.get());
+        }
+        Encode((AVFrame*)NULL);
+    } catch (...) {
+        // don't try to flush again from the destructor
+        codec_context_.reset();
+        throw;
+    }
+    codec_context_.reset();
+
+    // a switch requested just before closing happens during the flush. The
+    // files are closed here if the caller didn't take them
+    std::unique_ptr<OutputFile> retired_file = std::move(retired_file_);
+    if (retired_file) {
+        try {
+            retired_file->Close();
+        } catch (const std::exception &e) {
+            std::cerr << "error closing video file: " << e.what() << std::endl;
+        }
+    }
+    if (next_file_) {
+        next_file_->Remove();
+        next_file_.reset();
+    }
 
-    if (config.pixel_format() == pixel_types::MONO12) {
-        codec_context_->bits_per_raw_sample = 12;
-    } else {
-        codec_context_->bits_per_raw_sample = 8;
+    // the proxy has had every frame, let it finish. it is optional, a
+    // failed proxy doesn't fail the video file
+    if (proxy_) {
+        try {
+            proxy_->Close();
+        } catch (const std::exception &e) {
+            std::cerr << "error closing proxy file: " << e.what() << std::endl;
+        }
+        proxy_.reset();
     }
 
-    // x264 only settings
-    if (config.codec() == codecs::LIBX264) {
-        av_opt_set(codec_context_->priv_data, "preset", config.compression_target().c_str(), 0);
-        av_opt_set(codec_context_->priv_data, "crf", std::to_string(config.crf()).c_str(), 0);
+    // stop the live stream, then write the trailer and close the file.
+    // FileSink::Close() throws if anything failed to reach the disk
+    std::unique_ptr<FileSink> file_sink = std::move(file_sink_);
+    rtmp_publisher_.reset();
+    packet_ring_.reset();
+    UpdateSinks();
+    if (file_sink) {
+        file_sink->Close();
     }
+}
 
-    codec_context_->gop_size = 1;
-    codec_context_->max_b_frames = 1;
+void VideoWriter::set_pipeline_stats(PipelineStats *stats)
+{
+    stats_ = stats;
+    if (file_sink_) {
+        file_sink_->set_pipeline_stats(stats);
+    }
+    if (proxy_) {
+        proxy_->set_pipeline_stats(stats);
+    }
+}
 
-    if (config.pixel_format() == pixel_types::MONO8) {
-        selected_pixel_format_ = AV_PIX_FMT_GRAY8;
-    } else if (config.pixel_format() == pixel_types::MONO12) {
-        selected_pixel_format_ = AV_PIX_FMT_GRAY12;
-    } else {
-        selected_pixel_format_ = AV_PIX_FMT_YUV420P;
+void VideoWriter::OpenFile(const std::string& filename, const CameraController::RecordingSessionConfig& config)
+{
+    if (file_sink_ || !codec_context_) {
+        throw std::runtime_error("video file already open");
     }
-    codec_context_->pix_fmt = selected_pixel_format_;
+    std::string full_filename = filename + "." + config.container();
+    file_sink_ = std::unique_ptr<FileSink>(new FileSink(full_filename, codec_context_.get(), config, stats_, true));
+    filename_ = full_filename;
+
+    // the proxy starts with the frames encoded from now on
+    proxy_ = OpenProxy(filename, config);
+
+    // the pre-trigger packets go out ahead of anything encoded from now on
+    if (packet_ring_) {
+        bytes_written_ += packet_ring_->bytes();
+        packet_ring_->Drain(*file_sink_);
+        packet_ring_.reset();
+    }
+    UpdateSinks();
+}
 
-    // This flag is required for streaming with rtmp so we have to set it for
-    // the codec. The avi format context does not want this set, so we will use
-    // a bitstream filter on the AVI output to correct for this
-    codec_context_->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+int64_t VideoWriter::start_frame() const
+{
+    int64_t pts = AV_NOPTS_VALUE;
+    if (file_sink_) {
+        pts = file_sink_->pts_offset();
+    } else if (packet_ring_) {
+        pts = packet_ring_->start_pts();
+    }
+    return pts == AV_NOPTS_VALUE ? -1 : pts;
+}
 
-    // setup above mentioned bitstream filter
-    // we are more or less doing what the example shows with the ffmpeg
-    // command line: https://ffmpeg.org/ffmpeg-bitstream-filters.html#dump_005fextra
-    AVBSFContext *tmp;
-    r = av_bsf_alloc(av_bsf_get_by_name("dump_extra"), &tmp);
-    if (r < 0) {
-        throw std::runtime_error("unable to allocate bitstream filter context: " + std::string(av_err2str(r)));
-    }
-    // use smart pointer to manage bitstream filter context
-    bsfc_ = av_pointer::bsf_context(tmp);
-
-    // Open up the codec
-    if (avcodec_open2(codec_context_.get(), ffcodec_, NULL) < 0) {
-        throw std::runtime_error("unable to open ffmpeg codec");
-    }
-
-    // setup the avi output stream
-    AVFormatContext *tmp_f_context;
-    avformat_alloc_output_context2(&tmp_f_context, NULL, NULL, full_filename.c_str());
-    format_context_ = av_pointer::format_context(tmp_f_context);
-    stream_ = avformat_new_stream(format_context_.get(), ffcodec_);
-    avcodec_parameters_from_context(stream_->codecpar, codec_context_.get());
-    stream_->time_base = codec_context_->time_base;
-    stream_->r_frame_rate = codec_context_->framerate;
-
-    // finish setting up the bitstream filter
-    // first copy the codec parameters and time base
-    avcodec_parameters_copy(bsfc_->par_in, stream_->codecpar);
-    bsfc_->time_base_in = stream_->time_base;
-    // initialize teh bsf, abort if not
-    r = av_bsf_init(bsfc_.get());
-    if (r < 0) {
-        throw std::runtime_error("unable to initialize bitstream filter " + std::string(av_err2str(r)));
+uint64_t VideoWriter::bytes_written() const
+{
+    return bytes_written_ + (proxy_ ? proxy_->bytes_written() : 0);
+}
+
+std::unique_ptr<VideoWriter::OutputFile> VideoWriter::PrepareFile(
+    const std::string& filename, const CameraController::RecordingSessionConfig& config) const
+{
+    if (!codec_context_) {
+        throw std::runtime_error("video writer is closed");
     }
+    // read only access to the open encoder's parameters, safe while the
+    // encoder thread is using it
+    std::unique_ptr<OutputFile> file(new OutputFile());
+    file->filename = filename + "." + config.container();
+    file->file_sink = std::unique_ptr<FileSink>(
+        new FileSink(file->filename, codec_context_.get(), config, stats_, true));
+    file->proxy = OpenProxy(filename, config);
+    return file;
+}
 
-    // open the output file
-    r = avio_open(&format_context_->pb, full_filename.c_str(), AVIO_FLAG_WRITE);
-    if (r < 0) {
-        throw std::runtime_error("unable to open " + full_filename + " : " + std::string(av_err2str(r)));
+void VideoWriter::SwitchFile(std::unique_ptr<OutputFile> file)
+{
+    if (!file_sink_ || !codec_context_) {
+        throw std::logic_error("no video file to switch from");
     }
+    if (next_file_ || retired_file_) {
+        throw std::logic_error("previous file switch has not finished");
+    }
+    next_file_ = std::move(file);
+    switch_pts_ = AV_NOPTS_VALUE;
+}
+
+void VideoWriter::SwitchSinks()
+{
+    std::unique_ptr<OutputFile> retired(new OutputFile());
+    retired->filename = filename_;
+    retired->file_sink = std::move(file_sink_);
+    // Encode() already swapped the proxies
+    retired->proxy = std::move(next_file_->proxy);
+
+    filename_ = next_file_->filename;
+    file_sink_ = std::move(next_file_->file_sink);
+    next_file_.reset();
+    switch_pts_ = AV_NOPTS_VALUE;
+    retired_file_ = std::move(retired);
+    UpdateSinks();
+}
+
+bool VideoWriter::CanEncode(int frame_width, int frame_height, const std::string& rtmp_uri,
+                            const CameraController::RecordingSessionConfig& config) const
+{
+    const CameraController::RecordingSessionConfig &c = encoder_config_;
+    return codec_context_ && !file_sink_ && !packet_ring_ && config.pre_trigger() == 0 &&
+           frame_width == codec_context_->width && frame_height == codec_context_->height &&
+           rtmp_uri == rtmp_uri_ &&
+           config.pixel_format() == c.pixel_format() && config.codec() == c.codec() &&
+           config.target_fps() == c.target_fps() && config.compression_target() == c.compression_target() &&
+           config.crf() == c.crf() && config.tune() == c.tune() && config.rc_lookahead() == c.rc_lookahead() &&
+           config.gop_size() == c.gop_size() && config.max_b_frames() == c.max_b_frames() &&
+           config.encoder_threads() == c.encoder_threads() && config.sliced_threads() == c.sliced_threads() &&
+           config.apply_filter() == c.apply_filter() && config.filter_thread() == c.filter_thread();
+}
 
-    if (avformat_write_header(format_context_.get(), NULL) < 0) {
-        throw std::runtime_error("unable to write header");
+std::unique_ptr<ProxyEncoder> VideoWriter::OpenProxy(
+    const std::string& filename, const CameraController::RecordingSessionConfig& config) const
+{
+    if (!config.proxy_scale()) {
+        return nullptr;
     }
+    try {
+        return std::unique_ptr<ProxyEncoder>(new ProxyEncoder(
+            filename + "_proxy." + config.container(), codec_context_->width, codec_context_->height,
+            selected_pixel_format_, config, stats_));
+    } catch (const std::exception &e) {
+        std::cerr << "proxy disabled: " << e.what() << std::endl;
+    }
+    return nullptr;
+}
 
-    // initialize filter
-    if (apply_filter_) {
-        InitFilters();
+void VideoWriter::UpdateSinks()
+{
+    sinks_.clear();
+    if (file_sink_) {
+        sinks_.push_back(file_sink_.get());
+    }
+    if (packet_ring_) {
+        sinks_.push_back(packet_ring_.get());
+    }
+    if (rtmp_publisher_) {
+        sinks_.push_back(rtmp_publisher_.get());
     }
 }
 
-VideoWriter::~VideoWriter()
+void VideoWriter::OpenEncoder(const CameraController::RecordingSessionConfig& config,
+                              int frame_width, int frame_height)
 {
-    // need to make sure this doesn't get called on an object that's been moved
-    if (codec_context_.get()) {
-        // flush buffers
-        if (apply_filter_) {
-            int rval = av_buffersrc_write_frame(buffersrc_ctx_, NULL);
-            if (rval < 0) {
-                std::cerr << "av_bufferserc_write_frame() returned " << rval << std::endl;
+    std::vector<std::string> candidates = codecs::EncoderCandidates(config.codec());
+    std::string errors;
+
+    for (const std::string &name : candidates) {
+        try {
+            OpenEncoder(name, config, frame_width, frame_height);
+            if (name != candidates.front()) {
+                std::cerr << "using encoder " << name << " (" << errors << ")" << std::endl;
             }
+            return;
+        } catch (const std::exception &e) {
+            codec_context_.reset();
+            if (!errors.empty()) {
+                errors += "; ";
+            }
+            errors += e.what();
         }
-        apply_filter_ = false;
-        Encode((AVFrame*)NULL);
     }
+    throw std::runtime_error("unable to open an encoder: " + errors);
 }
 
-void VideoWriter::InitFilters()
+void VideoWriter::OpenEncoder(const std::string& name,
+                              const CameraController::RecordingSessionConfig& config,
+                              int frame_width, int frame_height)
 {
-    const AVFilter *buffersrc  = avfilter_get_by_name("buffer");
-    const AVFilter *buffersink = avfilter_get_by_name("buffersink");
-    enum AVPixelFormat pix_fmts[] = {selected_pixel_format_, AV_PIX_FMT_NONE};
-    const char *filter_descr = "hqdn3d=luma_spatial=10";
+    // lookup specified codec
+    ffcodec_ = avcodec_find_encoder_by_name(name.c_str());
+    if (!ffcodec_) {
+        throw std::invalid_argument("unable to get codec " + name);
+    }
 
-    // use smart pointers for these so they get cleaned up if we throw any
-    // exceptions during initialization
-    av_pointer::in_out outputs(avfilter_inout_alloc());
-    av_pointer::in_out inputs(avfilter_inout_alloc());
+    // make sure the encoder accepts the pixel format (libx264 is normally
+    // built for 8 bit samples only, so 12 bit formats need a codec like ffv1,
+    // and hardware encoders generally don't take gray input)
+    if (ffcodec_->pix_fmts) {
+        const enum AVPixelFormat *f = ffcodec_->pix_fmts;
+        while (*f != AV_PIX_FMT_NONE && *f != selected_pixel_format_) {
+            f++;
+        }
+        if (*f == AV_PIX_FMT_NONE) {
+            throw std::invalid_argument("codec " + name + " does not support pixel format " +
+                                        config.pixel_format());
+        }
+    }
 
-    // allocate filter graph
-    filter_graph_ = av_pointer::filter_graph(avfilter_graph_alloc());
+    codec_context_ = av_pointer::codec_context(avcodec_alloc_context3(ffcodec_));
 
-    // make sure everything has been initialized properly
-    if (!outputs || !inputs || !filter_graph_) {
-        throw std::runtime_error("unable to initialize filters");
+    if (!codec_context_) {
+        throw std::runtime_error("unable to initialize AVCodecContext");
     }
 
-    avfilter_graph_set_auto_convert(filter_graph_.get(), AVFILTER_AUTO_CONVERT_NONE);
-
-    std::string args =
-        "video_size=" + std::to_string(codec_context_->width) + "x" + std::to_string(codec_context_->height) +
-        ":pix_fmt=" + std::to_string(codec_context_->pix_fmt) + ":time_base=" +
-        std::to_string(codec_context_->time_base.num) + "/" + std::to_string(codec_context_->time_base.den);
+    // setup codec_context_
+    codec_context_->width = frame_width;
+    codec_context_->height = frame_height;
+    codec_context_->time_base = (AVRational){1, config.target_fps()};
+    codec_context_->framerate = (AVRational){config.target_fps(), 1};
+    codec_context_->global_quality = 0;
+    codec_context_->compression_level = 0;
+    codec_context_->pix_fmt = selected_pixel_format_;
 
-    if (avfilter_graph_create_filter(&buffersrc_ctx_, buffersrc, "in", args.c_str(), NULL, filter_graph_.get()) < 0) {
-        throw std::runtime_error("unable to create buffer source");
+    if (config.pixel_format() == pixel_types::MONO12 || config.pixel_format() == pixel_types::MONO12PACKED) {
+        codec_context_->bits_per_raw_sample = 12;
+    } else {
+        codec_context_->bits_per_raw_sample = 8;
     }
 
-    /* buffer video sink: to terminate the filter chain. */
-    if (avfilter_graph_create_filter(&buffersink_ctx_, buffersink, "out", NULL, NULL, filter_graph_.get()) < 0) {
-        throw std::runtime_error("unable to create buffer sink");
+    if (name == codecs::LIBX264) {
+        // x264 only settings. A keyframe forced by SwitchFile() has to be
+        // an IDR frame for the new file to start with it
+        av_opt_set(codec_context_->priv_data, "preset", config.compression_target().c_str(), 0);
+        av_opt_set_int(codec_context_->priv_data, "forced-idr", 1, 0);
+        av_opt_set(codec_context_->priv_data, "crf", std::to_string(config.crf()).c_str(), 0);
+        if (!config.tune().empty()) {
+            av_opt_set(codec_context_->priv_data, "tune", config.tune().c_str(), 0);
+        }
+        if (config.rc_lookahead() >= 0) {
+            av_opt_set_int(codec_context_->priv_data, "rc-lookahead", config.rc_lookahead(), 0);
+        }
+    } else if (name == codecs::H264_NVENC) {
+        // nvenc's constant quality mode is the closest match to x264's crf
+        av_opt_set(codec_context_->priv_data, "rc", "vbr", 0);
+        av_opt_set(codec_context_->priv_data, "cq", std::to_string(config.crf()).c_str(), 0);
+    } else if (codecs::IsHardware(name)) {
+        // the Jetson encoders only do bitrate based rate control
+        codec_context_->bit_rate = (int64_t)(frame_width * frame_height * config.target_fps() * kHardwareBitsPerPixel);
     }
 
-    if (av_opt_set_int_list(buffersink_ctx_, "pix_fmts", pix_fmts, AV_PIX_FMT_NONE, AV_OPT_SEARCH_CHILDREN) < 0) {
-        throw std::runtime_error("unable to set ouptut pixel format");
-    }
+    codec_context_->gop_size = config.gop_size();
+    codec_context_->max_b_frames = config.max_b_frames();
 
-    /*
-	 * Set the endpoints for the filter graph. The filter_graph will
-	 * be linked to the graph described by filters_descr.
-	 *
-     * The buffer source output must be connected to the input pad of
-     * the first filter described by filters_descr; since the first
-     * filter input label is not specified, it is set to "in" by
-     * default.
-     */
+    // threading. libx264 switches to sliced threads when thread_type is
+    // FF_THREAD_SLICE
+    codec_context_->thread_count = config.encoder_threads();
+    if (config.sliced_threads()) {
+        codec_context_->thread_type = FF_THREAD_SLICE;
+    }
 
-    outputs->name       = av_strdup("in");
-    outputs->filter_ctx = buffersrc_ctx_;
-    outputs->pad_idx    = 0;
-    outputs->next       = NULL;
+    // This flag is required for streaming with rtmp (and is what MP4 and
+    // Matroska expect) so we have to set it for the codec. The avi format
+    // context does not want this set, so we will use a bitstream filter on the
+    // AVI output to correct for this
+    codec_context_->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
-    /*
-	 * The buffer sink input must be connected to the output pad of
-	 * the last filter described by filters_descr; since the last
-	 * filter output label is not specified, it is set to "out" by
-	 * default.
-	 */
-    inputs->name       = av_strdup("out");
-    inputs->filter_ctx = buffersink_ctx_;
-    inputs->pad_idx    = 0;
-    inputs->next       = NULL;
+    // Open up the codec. hardware encoders are fed frames in system memory,
+    // which all of the supported encoders upload themselves
+    int r = avcodec_open2(codec_context_.get(), ffcodec_, NULL);
+    if (r < 0) {
+        throw std::runtime_error("unable to open ffmpeg codec " + name + ": " + std::string(av_err2str(r)));
+    }
+}
 
-    // need to manage inputs & outputs manually now so we can pass pointer references
-    AVFilterInOut *ins = inputs.release();
-    AVFilterInOut *outs = outputs.release();
+void VideoWriter::InitReusableObjects()
+{
+    // monochrome data is encoded as YUV420P with neutral chroma
+    int chroma_fill = codec_context_->pix_fmt == AV_PIX_FMT_YUV420P ? 128 : -1;
+    frame_pool_ = std::unique_ptr<FramePool>(
+        new FramePool(codec_context_->pix_fmt, codec_context_->width, codec_context_->height, chroma_fill));
+    luma_row_bytes_ = av_image_get_linesize(codec_context_->pix_fmt, codec_context_->width, 0);
 
-    int rval = avfilter_graph_parse_ptr(filter_graph_.get(), filter_descr, &ins, &outs, NULL);
+    frame_ = av_pointer::frame(av_frame_alloc());
+    pending_frame_ = av_pointer::frame(av_frame_alloc());
+    packet_ = av_pointer::packet(av_packet_alloc());
 
-    // free the released pointers
-    avfilter_inout_free(&ins);
-    avfilter_inout_free(&outs);
+    if (!frame_ || !pending_frame_) {
+        throw std::runtime_error("unable to allocate frame");
+    }
+    if (!packet_) {
+        throw std::runtime_error("unable to allocate packet");
+    }
+}
 
-    if (rval < 0) {
-        throw std::runtime_error("unable to link filter description to filter graph");
+// reset the reusable frame and attach fresh buffers from the pool
+AVFrame* VideoWriter::InitFrame(AVBufferRef *luma) {
+    // drop our references to the previous frame's buffers, this returns them
+    // to the pool once the encoder is done with them too
+    av_frame_unref(frame_.get());
+
+    // reference the caller's buffer directly as the luma plane if it is big
+    // enough and suitably aligned, otherwise fall back to a pooled plane
+    if (luma && luma->size >= luma_row_bytes_ * codec_context_->height &&
+        reinterpret_cast<uintptr_t>(luma->data) % kZeroCopyAlignment == 0) {
+        frame_pool_->Get(frame_.get(), false);
+        frame_->buf[0] = luma;
+        frame_->data[0] = luma->data;
+        frame_->linesize[0] = luma_row_bytes_;
+        zero_copy_frames_++;
+        return frame_.get();
     }
 
-    if (avfilter_graph_config(filter_graph_.get(), NULL) < 0) {
-        throw std::runtime_error("unable to configure filter graph");
+    frame_pool_->Get(frame_.get());
+    if (luma) {
+        // pooled planes may be padded, so copy row by row
+        av_image_copy_plane(frame_->data[0], frame_->linesize[0], luma->data, luma_row_bytes_,
+                            luma_row_bytes_, codec_context_->height);
+        av_buffer_unref(&luma);
     }
+    return frame_.get();
 }
 
-/*
- * setup the rtmp_stream.
- * if we encounter any errors, we will return and continue with the recording
- * session without streaming
- * TODO -- eventually we may want to relay the streaming error to the server in order to inform the client
- * TODO -- if we fail to open the rtmp stream, set a timer so we don't try again for a certain amount of time
- */
-void VideoWriter::OpenRtmpStream()
+// encode a raw frame from the camera, copying it into a pooled frame
+void VideoWriter::EncodeFrame(uint8_t buffer[], size_t current_frame,  bool stream)
 {
-    // allocate output format context
-    AVFormatContext *tmp_f_context;
-    avformat_alloc_output_context2(&tmp_f_context, NULL, "flv", rtmp_uri_.c_str());
-    if (!tmp_f_context) {
-        std::cerr << "unable to allocate rtmp output format context\n";
-        return;
-    }
-
-    // transfer management of the allocated format context to a smart pointer
-    rtmp_format_context_ = av_pointer::format_context(tmp_f_context);
+    EncodeImage(buffer, nullptr, current_frame, stream);
+}
 
-    // add stream to output context
-    rtmp_stream_ = avformat_new_stream(rtmp_format_context_.get(), ffcodec_);
-    avcodec_parameters_from_context(rtmp_stream_->codecpar, codec_context_.get());
+// encode a raw frame from the camera, referencing its buffer if possible
+void VideoWriter::EncodeFrame(AVBufferRef *buffer, size_t current_frame, bool stream)
+{
+    EncodeImage(buffer->data, buffer, current_frame, stream);
+}
 
-    // open rtmp stream
-    if (!(rtmp_format_context_->flags & AVFMT_NOFILE)) {
-        int r = avio_open(&rtmp_format_context_->pb, rtmp_uri_.c_str(), AVIO_FLAG_WRITE);
-        if (r < 0) {
-            std::cerr << "unable to open rtmp stream: " + std::string(av_err2str(r));
-            rtmp_format_context_.reset();
-            return;
-        }
+void VideoWriter::EncodeImage(const uint8_t *data, AVBufferRef *ref, size_t current_frame, bool stream)
+{
+    // the publisher connects on its own thread, creating it doesn't block
+    if (stream && !rtmp_publisher_) {
+        rtmp_publisher_ = std::unique_ptr<RtmpPublisher>(
+            new RtmpPublisher(rtmp_uri_, codec_context_.get(), stats_));
+        UpdateSinks();
+    } else if (!stream && rtmp_publisher_) {
+        // close rtmp stream
+        rtmp_publisher_.reset();
+        UpdateSinks();
     }
 
-    // write header to stream
-    if (avformat_write_header(rtmp_format_context_.get(), NULL) < 0) {
-        std::cerr << "unable to write header to rtmp stream\n";
-        rtmp_format_context_.reset();
+    if (unpack_mono12_) {
+        EncodeMono12Packed(data, ref, current_frame);
+    } else if (selected_pixel_format_ == AV_PIX_FMT_YUV420P ||
+               selected_pixel_format_ == AV_PIX_FMT_GRAY8 ||
+               selected_pixel_format_ == AV_PIX_FMT_GRAY12) {
+        EncodeMonochrome(data, ref, current_frame);
+    } else {
+        av_buffer_unref(&ref);
+        // unknown pixel format, we shouldn't get this far with an unknown pixel format
+        // this will let us know we haven't implemented the encoder yet
+        throw std::logic_error("encoder not implemented for pixel format");
     }
 }
 
-// initialize a frame and return a pointer to it
-av_pointer::frame VideoWriter::InitFrame() {
-
-    // temporary smart pointer, can be returned from function and moved without
-    // using std::move to transfer ownership
-    av_pointer::frame frame(av_frame_alloc());
-
-    if (!frame) {
-        throw std::runtime_error("unable to allocate frame");
+// encode monochrome camera data using the Yuv420p, Gray8 or Gray12 pixel format
+void VideoWriter::EncodeMonochrome(const uint8_t *buffer, AVBufferRef *ref, size_t current_frame)
+{
+    if (denoiser_) {
+        // filter straight from the camera buffer into a pooled plane, so the
+        // filter pass doubles as the copy
+        AVFrame *frame = InitFrame();
+        frame->pts = current_frame;
+        FilterAndEncode(buffer, luma_row_bytes_, frame, ref);
+        return;
     }
 
-    // initialize newly allocated frame
-    frame->format = codec_context_->pix_fmt;
-    frame->width  = codec_context_->width;
-    frame->height = codec_context_->height;
+    // get frame backed by pooled buffers, or by ref for the luma plane.
+    // For Yuv420p Cb and Cr are always grayscale: the pool fills them with
+    // 128 when it allocates a buffer and nothing writes to them afterwards
+    AVFrame *frame = InitFrame(ref);
 
-    // 0 means "system select".
-    // 8 recommended from doc tutorial?
-    if (av_frame_get_buffer(frame.get(), 8) < 0) {
-        throw std::runtime_error("unable to allocate frame buffer");
+    if (!ref) {
+        // copy data to frame. pooled planes may be padded, so copy row by row
+        StageTimer timer(stats_, PipelineStats::COPY);
+        av_image_copy_plane(frame->data[0], frame->linesize[0], buffer, luma_row_bytes_,
+                            luma_row_bytes_, codec_context_->height);
     }
+    frame->pts = current_frame;
 
-    // make writable
-    if (av_frame_make_writable(frame.get()) < 0) {
-        throw std::runtime_error("unable to make frame writable");
-    }
+    // send frame to encoder
+    Encode(frame);
 
-    return frame;
+    // the encoder holds its own reference if it still needs the data
+    av_frame_unref(frame);
 }
 
-// encode a raw frame from the camera
-void VideoWriter::EncodeFrame(uint8_t buffer[], size_t current_frame,  bool stream)
+// encode a Mono12Packed frame using the Gray12 pixel format
+void VideoWriter::EncodeMono12Packed(const uint8_t *buffer, AVBufferRef *ref, size_t current_frame)
 {
-    if (selected_pixel_format_ == AV_PIX_FMT_YUV420P) {
-        EncodeYuv420p(buffer, current_frame);
-    } else {
-        // unknown pixel format, we shouldn't get this far with an unknown pixel format
-        // this will let us know we haven't implemented the encoder yet
-        throw std::logic_error("encoder not implemented for pixel format");
+    AVFrame *frame = InitFrame();
+
+    // unpack one row at a time since the pooled plane may be padded
+    StageTimer timer(stats_, PipelineStats::COPY);
+    const int width = codec_context_->width;
+    const int packed_row_bytes = width * 3 / 2;
+    for (int y = 0; y < codec_context_->height; y++) {
+        pixel_types::UnpackMono12Packed(buffer + y * packed_row_bytes,
+                                        reinterpret_cast<uint16_t*>(frame->data[0] + y * frame->linesize[0]),
+                                        width);
     }
+    timer.Stop();
+    // done with the camera buffer
+    av_buffer_unref(&ref);
+    frame->pts = current_frame;
 
-    if (stream && !rtmp_format_context_) {
-        OpenRtmpStream();
-    } else if (!stream && rtmp_format_context_) {
-        // close rtmp stream
-        rtmp_format_context_.reset();
+    if (denoiser_) {
+        // filter the unpacked plane in place
+        FilterAndEncode(frame->data[0], frame->linesize[0], frame, nullptr);
+        return;
     }
+
+    Encode(frame);
+    av_frame_unref(frame);
 }
 
-// encode a frame using Yuv420p pixel format
-void VideoWriter::EncodeYuv420p(uint8_t buffer[], size_t current_frame)
+void VideoWriter::FilterAndEncode(const uint8_t *src, int src_stride, AVFrame *frame, AVBufferRef *ref)
 {
-    // create smart pointer to frame
-    auto frame = InitFrame();
-
-    // copy data to frame
-    std::memcpy(frame->data[0], buffer, codec_context_->width * codec_context_->height);
-    frame->pts = current_frame;
+    if (!filter_thread_) {
+        StageTimer filter_timer(stats_, PipelineStats::FILTER);
+        denoiser_->Process(src, src_stride, frame->data[0], frame->linesize[0]);
+        filter_timer.Stop();
+        av_buffer_unref(&ref);
+        Encode(frame);
+        av_frame_unref(frame);
+        return;
+    }
 
-    /* Cb and Cr always set to grayscale*/
-    for (int y = 0; y < codec_context_->height / 2; y++) {
-        auto yl1 = y * frame->linesize[1];
-        auto yl2 = y * frame->linesize[2];
-        for (int x = 0; x < codec_context_->width / 2; x++) {
-            frame->data[1][yl1 + x] = 128;
-            frame->data[2][yl2 + x] = 128;
+    // encode the previous frame while this one is being filtered. the
+    // denoiser reads src until Wait() returns, so wait even if encoding fails
+    denoiser_->Start(src, src_stride, frame->data[0], frame->linesize[0]);
+    try {
+        if (pending_frame_->buf[0]) {
+            Encode(pending_frame_.get());
+            av_frame_unref(pending_frame_.get());
         }
+    } catch (...) {
+        denoiser_->Wait();
+        av_buffer_unref(&ref);
+        throw;
     }
 
-    // send frame to encoder
-    Encode(frame.get());
+    // only the time the encoder thread waits for the filter is recorded
+    StageTimer wait_timer(stats_, PipelineStats::FILTER);
+    denoiser_->Wait();
+    wait_timer.Stop();
+    av_buffer_unref(&ref);
+
+    // frame is frame_, keep it until the next call and let InitFrame() reuse
+    // the empty one
+    std::swap(frame_, pending_frame_);
 }
 
-// send the frame to the encoder, filtering first if necessary
-void VideoWriter::Encode(AVFrame *frame)
+bool VideoWriter::SetCrf(unsigned int crf)
 {
-    int rval;
-    if (!apply_filter_) {
-        //send frame to encoder
-        rval = avcodec_send_frame(codec_context_.get(), frame);
-        if (rval < 0) {
-            throw std::runtime_error("error sending frame for encoding");
-        }
-    } else {
-        // push frame to filter
-        if (av_buffersrc_add_frame_flags(buffersrc_ctx_, frame, AV_BUFFERSRC_FLAG_KEEP_REF) < 0) {
-            throw std::runtime_error("could not send frame to filter graph");
-        }
+    if (!codec_context_ || ffcodec_->name != codecs::LIBX264) {
+        return false;
+    }
+    // libx264 compares its options against the encoder's parameters before
+    // each frame and reconfigures itself if they changed
+    return av_opt_set(codec_context_->priv_data, "crf", std::to_string(crf).c_str(), 0) == 0;
+}
 
-        // pull frame from filter
-        // frame smart pointer
-        av_pointer::frame filt_frame = av_pointer::frame(av_frame_alloc());
-        if (!filt_frame) {
-            throw std::runtime_error("unable to allocate filtered frame");
+// send the frame to the encoder and pass the packets to the sinks
+void VideoWriter::Encode(AVFrame *frame)
+{
+    // the first frame after SwitchFile() starts the next file. The proxy
+    // switches right away, the video file once the keyframe is encoded
+    if (frame && next_file_ && switch_pts_ == AV_NOPTS_VALUE) {
+        frame->pict_type = AV_PICTURE_TYPE_I;
+        switch_pts_ = frame->pts;
+        if (proxy_) {
+            bytes_written_ += proxy_->bytes_written();
         }
+        std::swap(proxy_, next_file_->proxy);
+    }
 
-        av_buffersink_get_frame(buffersink_ctx_, filt_frame.get());
+    // the proxy downscales its own copy before the encoder gets the frame
+    if (frame && proxy_) {
+        proxy_->Send(frame);
+    }
 
-        rval = avcodec_send_frame(codec_context_.get(), filt_frame.get());
-        if (rval < 0) {
-            throw std::runtime_error("Error sending a frame for encoding");
-        }
+    //send frame to encoder
+    StageTimer timer(stats_, PipelineStats::SEND_FRAME);
+    int rval = avcodec_send_frame(codec_context_.get(), frame);
+    timer.Stop();
+    if (rval < 0) {
+        throw std::runtime_error("error sending frame for encoding");
     }
 
     // get packets from encoder
+    AVPacket *pkt = packet_.get();
     while (rval >= 0) {
-        // create smart pointer to allocated packet
-        av_pointer::packet pkt(av_packet_alloc());
-        if (!pkt) {
-            throw std::runtime_error("unable to allocate packet");
-        }
-
-        rval = avcodec_receive_packet(codec_context_.get(), pkt.get());
+        StageTimer receive_timer(stats_, PipelineStats::RECEIVE_PACKET);
+        rval = avcodec_receive_packet(codec_context_.get(), pkt);
+        receive_timer.Stop();
         if (rval == AVERROR(EAGAIN) || rval == AVERROR_EOF) {
             return;
         } else if (rval < 0) {
             throw std::runtime_error("error during encoding");
         }
 
-        // if the rtmp stream is setup
-        if (rtmp_format_context_) {
-            // clone packet so we can send to the live stream
-            av_pointer::packet stream_pkt(av_packet_clone(pkt.get()));
-
-            // rescale output packet timestamp values from codec to stream timebase
-            av_packet_rescale_ts(stream_pkt.get(), codec_context_->time_base, rtmp_stream_->time_base);
-            rval = av_interleaved_write_frame(rtmp_format_context_.get(), stream_pkt.get());
-            if (rval < 0 ) {
-                std::clog << "error writing frame to rtmp stream: " << av_err2str(rval) << std::endl;
-
-                /* if the streaming server closes the connection unexpectedly (ECONNRESET)
-                   or we lose the connection (EPIPE), then reset rtmp_format_context_
-                   to force a reconnect when we handle the next frame.
-                   this frame won't get streamed
-
-                   TODO: limit reconnect attempts for ECONNRESET since that may indicate a configuration issue
-                 */
-                if (rval == AVERROR(EPIPE) || rval == AVERROR(ECONNRESET)) {
-                    rtmp_format_context_.reset();
-                }
-            }
+        // everything encoded before the forced keyframe has gone to the old file
+        if (switch_pts_ != AV_NOPTS_VALUE && (pkt->flags & AV_PKT_FLAG_KEY) && pkt->pts >= switch_pts_) {
+            SwitchSinks();
         }
 
-        // use "dump_extra" bitstream filter to add header back to keyframes
-        // this is used because we have to ste global headers to allow for streaming
-        av_pointer::packet pkt_filtered(av_packet_alloc());
-        av_bsf_send_packet(bsfc_.get(), pkt.get());
-
-        // grab all available packets from the bitstream filter (a bsf can collect
-        // multiple packets before they are ready to be received)
-        while ((rval = av_bsf_receive_packet(bsfc_.get(), pkt_filtered.get())) == 0) {
-            // write filtered packet to file
-            av_interleaved_write_frame(format_context_.get(), pkt_filtered.get());
+        // every sink takes its own reference to the packet, so the payload
+        // is shared rather than copied. the live stream only queues it and
+        // never waits on the streaming server
+        for (PacketSink *sink : sinks_) {
+            sink->Send(pkt);
+        }
+        if (file_sink_) {
+            bytes_written_ += pkt->size;
         }
+        av_packet_unref(pkt);
     }
 }
@@ -7,6 +7,7 @@
 #include <memory>
 #include <string>
 #include <iostream>
+#include <vector>
 
 extern "C" {
 #include <libavcodec/avcodec.h>
@@ -14,11 +15,11 @@ extern "C" {
 #include <libavutil/imgutils.h>
 #include <libavutil/pixfmt.h>
 #include <libavformat/avformat.h>
-#include <libavfilter/buffersink.h>
-#include <libavfilter/buffersrc.h>
 }
 
 #include "camera_controller.h"
+#include "frame_pool.h"
+#include "pipeline_stats.h"
 
 /**
  * custom deleter so that we can have a std::unique_ptr manage an
@@ -47,8 +48,16 @@ struct AVFormatContextDeleter {
             if (context->pb) {
                 // if the file has been opened, make sure to write the trailer
                 av_write_trailer(context);
-                // close the AVIO context, will flush internal buffer
-                avio_closep(&context->pb);
+                if (context->flags & AVFMT_FLAG_CUSTOM_IO) {
+                    // we own the AVIO context but not what it writes to,
+                    // flush it and free it
+                    avio_flush(context->pb);
+                    av_freep(&context->pb->buffer);
+                    avio_context_free(&context->pb);
+                } else {
+                    // close the AVIO context, will flush internal buffer
+                    avio_closep(&context->pb);
+                }
             }
 
             // free AVFormatContext memory
@@ -57,30 +66,6 @@ struct AVFormatContextDeleter {
     }
 };
 
-/**
- * custom deleter so that we can have a std::unique_ptr manage an
- * AVFilterInOut pointer
- */
-struct AVFilterInOutDeleter {
-    void operator()(AVFilterInOut* io) {
-        if (io) {
-            avfilter_inout_free(&io);
-        }
-    }
-};
-
-/**
- * custom deleter so that we can have a std::unique_ptr manage an
- * AVFilterGraph pointer
- */
-struct AVFilterGraphDeleter {
-    void operator()(AVFilterGraph* fg) {
-        if (fg) {
-            avfilter_graph_free(&fg);
-        }
-    }
-};
-
 /**
  * custom deleter so that we can have a std::unique_ptr manage an
  * AVFrame pointer
@@ -118,20 +103,81 @@ struct AVBSFContextDeleter {
     }
 };
 
+/**
+ * custom deleter so that we can have a std::unique_ptr manage an
+ * AVCodecParameters pointer
+ */
+struct AVCodecParametersDeleter {
+    void operator()(AVCodecParameters* p) {
+        if (p) {
+            avcodec_parameters_free(&p);
+        }
+    }
+};
+
 // namespace of various smart pointer types
 // this lets us use `av_pointer::frame foo;` vs `std::unique_ptr<AVFrame, AVFrameDeleter> foo;`
 namespace av_pointer {
 using frame = std::unique_ptr<AVFrame, AVFrameDeleter>;
 using codec_context = std::unique_ptr<AVCodecContext, AVCodecContextDeleter>;
 using format_context = std::unique_ptr<AVFormatContext, AVFormatContextDeleter>;
-using in_out = std::unique_ptr<AVFilterInOut, AVFilterInOutDeleter>;
-using filter_graph = std::unique_ptr<AVFilterGraph, AVFilterGraphDeleter>;
 using packet = std::unique_ptr<AVPacket, AVPacketDeleter>;
 using bsf_context = std::unique_ptr<AVBSFContext, AVBSFContextDeleter>;
+using codec_parameters = std::unique_ptr<AVCodecParameters, AVCodecParametersDeleter>;
 }
 
+class FileSink;
+class LumaDenoiser;
+class PacketRing;
+class PacketSink;
+class ProxyEncoder;
+class RtmpPublisher;
+
 class VideoWriter {
 public:
+    /**
+     * @brief a video file and its proxy, prepared ahead of a rollover
+     *
+     * see PrepareFile() and SwitchFile()
+     */
+    struct OutputFile {
+        OutputFile();
+
+        /// close the files, errors are logged
+        ~OutputFile();
+
+        /**
+         * @brief close the proxy and then the video file
+         *
+         * throws std::runtime_error if the video file failed, proxy errors
+         * are logged
+         */
+        void Close();
+
+        /// close the files and delete them, for a file that was never used
+        void Remove();
+
+        std::string filename;                   ///< full path of the video file
+        std::unique_ptr<FileSink> file_sink;    ///< video file output
+        std::unique_ptr<ProxyEncoder> proxy;    ///< proxy video, null if the session has none
+    };
+
+    /**
+     * @brief open the encoder and the output file
+     *
+     * throws if either can't be set up
+     *
+     * @param filename output path without extension. If it is empty no file
+     * is opened until OpenFile() is called; an armed session keeps
+     * config.pre_trigger() seconds of video in memory until then, otherwise
+     * the encoder is opened ahead of a session and nothing is kept. If
+     * config.proxy_scale() is set a proxy video is written next to the file,
+     * see ProxyEncoder
+     * @param rtmp_uri live stream URI
+     * @param frame_width frame width in pixels
+     * @param frame_height frame height in pixels
+     * @param config recording session configuration
+     */
     VideoWriter(
         const std::string& filename,
         const std::string& rtmp_uri,
@@ -141,9 +187,22 @@ public:
 
     /**
      * @brief destructor -- will make sure buffers are flushed
+     *
+     * errors closing the file are logged rather than thrown, call Close()
+     * first if the caller needs to know about them
      */
     ~VideoWriter();
 
+    /**
+     * @brief flush the encoder and close the output file
+     *
+     * writes any buffered frames and the container trailer. The VideoWriter
+     * can not be used to encode frames after it has been closed. Calling
+     * Close() more than once, or on a VideoWriter that has been moved from,
+     * does nothing.
+     */
+    void Close();
+
     /**
      * @brief move assignment operator
      * @param rhs temporary VideoWriter instance being moved to this VideoWriter
@@ -180,89 +239,320 @@ public:
      */
     void EncodeFrame(uint8_t buffer[], size_t current_frame, bool stream);
 
+    /**
+     * @brief encode a reference counted frame from the camera
+     *
+     * takes ownership of the reference. When the buffer is large enough and
+     * suitably aligned it is used directly as the luma plane of the encoded
+     * frame instead of being copied, and the reference is released once the
+     * encoder no longer needs it. The buffer must not be modified until then.
+     *
+     * @param buffer reference to raw frame data
+     * @param current_frame current frame number
+     * @param stream if true also send frame to rtmp stream
+     */
+    void EncodeFrame(AVBufferRef *buffer, size_t current_frame, bool stream);
+
+    /**
+     * @brief open the output file of an armed session
+     *
+     * the pre-trigger video is written to the file first, starting at its
+     * oldest keyframe, which becomes the first frame of the file. If there
+     * is no pre-trigger video yet the file starts with the next keyframe.
+     * throws std::runtime_error if the file can't be set up
+     *
+     * @param filename output path without extension
+     * @param config session configuration, for the container and disk settings
+     */
+    void OpenFile(const std::string& filename, const CameraController::RecordingSessionConfig& config);
+
+    /**
+     * @brief create the next file of the session and its proxy
+     *
+     * doesn't change the VideoWriter, so it can run on another thread while
+     * this one encodes. throws std::runtime_error if the file can't be set up
+     *
+     * @param filename output path without extension
+     * @param config session configuration, for the container and disk settings
+     * @return file to pass to SwitchFile()
+     */
+    std::unique_ptr<OutputFile> PrepareFile(const std::string& filename,
+                                            const CameraController::RecordingSessionConfig& config) const;
+
+    /**
+     * @brief roll over to a file from PrepareFile() without reopening the encoder
+     *
+     * the next frame encoded is forced to be a keyframe and starts the new
+     * file and its proxy; the current file receives everything encoded
+     * before it. Once that keyframe has come out of the encoder the old file
+     * is handed back by TakeRetiredFile(). throws std::logic_error if there
+     * is no open file or the last switch hasn't finished
+     *
+     * @param file next file
+     */
+    void SwitchFile(std::unique_ptr<OutputFile> file);
+
+    /**
+     * @brief get the file SwitchFile() rolled over from
+     *
+     * the caller closes it, see OutputFile::Close(). Files not taken are
+     * closed by Close()
+     *
+     * @return the previous file, null if the switch hasn't happened yet
+     */
+    std::unique_ptr<OutputFile> TakeRetiredFile() {return std::move(retired_file_);}
+
+    /**
+     * @brief check if a VideoWriter opened ahead of a session can record it
+     *
+     * @param frame_width frame width of the session
+     * @param frame_height frame height of the session
+     * @param rtmp_uri live stream URI of the session
+     * @param config session configuration
+     * @return true if the encoder was opened with the same settings and is
+     * waiting for OpenFile()
+     */
+    bool CanEncode(int frame_width, int frame_height, const std::string& rtmp_uri,
+                   const CameraController::RecordingSessionConfig& config) const;
+
+    /**
+     * @brief frame number of the first frame in the output
+     *
+     * frame numbers are the current_frame passed to EncodeFrame(). 0 unless
+     * the VideoWriter was armed. While armed it is the first frame of the
+     * pre-trigger video
+     *
+     * @return frame number, -1 if not known yet
+     */
+    int64_t start_frame() const;
+
+    /**
+     * @brief record per-stage encode latencies
+     * @param stats histograms to record into, or nullptr to disable
+     */
+    void set_pipeline_stats(PipelineStats *stats);
+
+    /// full path of the output file, including extension
+    const std::string& filename() const {return filename_;}
+
+    /// name of the encoder in use, may differ from the configured codec after a fallback
+    std::string encoder_name() const {return ffcodec_ ? ffcodec_->name : "";}
+
+    /// encoded bytes sent to the video and proxy files so far, not counting container overhead
+    uint64_t bytes_written() const;
+
+    /**
+     * @brief change the constant rate factor of an open encoder
+     *
+     * takes effect from the next frame. Only libx264 can change it during
+     * a session
+     *
+     * @param crf new constant rate factor
+     * @return true if the encoder accepted it, false if it can't be changed
+     */
+    bool SetCrf(unsigned int crf);
+
+    /// number of frames encoded directly from the caller's buffer
+    uint64_t zero_copy_frames() const {return zero_copy_frames_;}
+
+    /// number of frame plane buffers reused from the frame pool
+    uint64_t frame_pool_hits() const {return frame_pool_ ? frame_pool_->hits() : 0;}
+
+    /// number of frame plane buffers the frame pool had to allocate
+    uint64_t frame_pool_misses() const {return frame_pool_ ? frame_pool_->misses() : 0;}
+
 private:
 
+    /// output filename, including extension
+    std::string filename_;
+
     /// rtmp uri
     std::string rtmp_uri_;
 
     /// pointer to specified codec
     const AVCodec *ffcodec_;
 
-    /// flag to indicate if we should send frames through filter graph before encoding
-    bool apply_filter_;
-
     /// specified pixel format
     enum AVPixelFormat selected_pixel_format_;
 
-    /// file output stream. Will get freed up when format_context_ is deleted
-    AVStream *stream_;
-
-    /// rtmp output stream. Will get freed up when rtmp_format_context_ is deleted
-    AVStream *rtmp_stream_;
-
-    /// source for filter graph, will get freed when filter graph is deleted
-    AVFilterContext *buffersink_ctx_;
-
-    /// sink for filter graph, will get freed when filter graph is deleted
-    AVFilterContext *buffersrc_ctx_;
-
     // we wrap the AV pointers in std::unique_ptr with delete functions so that
     // they'll get cleaned up properly
     /// smart pointer to AVCodecContext
     av_pointer::codec_context codec_context_;
-    /// smart pointer to AVFormatContext
-    av_pointer::format_context format_context_;
-    /// smart pointer to AVFormatContext
-    av_pointer::format_context rtmp_format_context_;
-    /// smart pointer to AVFilterGraph
-    av_pointer::filter_graph filter_graph_;
-    /// smart pointer for AVBSFContext
-    av_pointer::bsf_context bsfc_;
+
+    /// luma denoiser, null unless the session applies the filter
+    std::unique_ptr<LumaDenoiser> denoiser_;
+    /// the denoiser runs on its own thread, one frame ahead of the encoder
+    bool filter_thread_ = false;
+
+    // the following are allocated once and reused for every frame so that
+    // steady state encoding doesn't allocate
+    /// pool of image buffers for frames sent to the encoder
+    std::unique_ptr<FramePool> frame_pool_;
+    /// frame sent to the encoder, populated from frame_pool_
+    av_pointer::frame frame_;
+    /// frame filtered on the denoiser thread, waiting to be encoded
+    av_pointer::frame pending_frame_;
+    /// packet received from the encoder
+    av_pointer::packet packet_;
+
+    /// video file output, null once closed or while armed
+    std::unique_ptr<FileSink> file_sink_;
+    /// pre-trigger video, only exists while armed
+    std::unique_ptr<PacketRing> packet_ring_;
+
+    /// downscaled copy of the video, null if the session has no proxy or it failed to open
+    std::unique_ptr<ProxyEncoder> proxy_;
+
+    /// live stream output, exists while streaming is requested
+    std::unique_ptr<RtmpPublisher> rtmp_publisher_;
+
+    /// every open output, each encoded packet is sent to all of them. rebuilt
+    /// by UpdateSinks() when an output is opened or closed
+    std::vector<PacketSink*> sinks_;
+
+    /// bytes per row of a tightly packed luma plane
+    int luma_row_bytes_ = 0;
+
+    /// frames whose luma plane referenced the camera buffer without a copy
+    uint64_t zero_copy_frames_ = 0;
+    /// encoded bytes sent to video files, plus those of proxies that have been switched out
+    uint64_t bytes_written_ = 0;
+
+    /// file to switch to at the next keyframe, see SwitchFile()
+    std::unique_ptr<OutputFile> next_file_;
+    /// pts of the frame forced to be a keyframe for next_file_, AV_NOPTS_VALUE until it is encoded
+    int64_t switch_pts_ = AV_NOPTS_VALUE;
+    /// file switched out and not yet taken by TakeRetiredFile()
+    std::unique_ptr<OutputFile> retired_file_;
+
+    /// settings the encoder was opened with, see CanEncode()
+    CameraController::RecordingSessionConfig encoder_config_;
+
+    /// camera delivers Mono12Packed, unpack to Gray12 before encoding
+    bool unpack_mono12_ = false;
+
+    /// latency histograms, not owned. may be null
+    PipelineStats *stats_ = nullptr;
+
+    /**
+     * @brief select, configure and open the encoder
+     *
+     * tries each encoder returned by codecs::EncoderCandidates() for the
+     * configured codec in turn, so a hardware encoder that is missing from
+     * the ffmpeg build, or fails to open, falls back to libx264.
+     * selected_pixel_format_ must be set before calling.
+     *
+     * @param config recording session configuration
+     * @param frame_width frame width in pixels
+     * @param frame_height frame height in pixels
+     */
+    void OpenEncoder(const CameraController::RecordingSessionConfig& config,
+                     int frame_width, int frame_height);
 
     /**
-     * @brief initialize filters
+     * @brief configure and open a specific encoder
      *
-     * called during constructor if apply_filter_ is set to true.
+     * sets ffcodec_ and codec_context_. throws if the encoder is unavailable,
+     * does not support selected_pixel_format_ or can't be opened.
+     *
+     * @param name ffmpeg encoder name
+     * @param config recording session configuration
+     * @param frame_width frame width in pixels
+     * @param frame_height frame height in pixels
      */
-    void InitFilters();
+    void OpenEncoder(const std::string& name,
+                     const CameraController::RecordingSessionConfig& config,
+                     int frame_width, int frame_height);
+
+    /// rebuild sinks_ from the outputs that are currently open
+    void UpdateSinks();
 
     /**
-     * @brief open rtmp stream and prepare for output
+     * @brief start the proxy video if the session has one
      *
-     * Open and configure the rtmp stream if it is not already open.
-     * After calling, rtmp_stream_ will be ready to accept frames. If the
-     * stream can't be opened for some reason rtmp_stream_ and
-     * rtmp_format_context_ will be set to nullptr
+     * the proxy is optional, errors are logged and recording carries on
+     * without it
+     *
+     * @param filename output path of the main video without extension
+     * @param config session configuration
+     * @return the proxy, null if the session has none or it failed to open
      */
-    void OpenRtmpStream();
+    std::unique_ptr<ProxyEncoder> OpenProxy(const std::string& filename,
+                                            const CameraController::RecordingSessionConfig& config) const;
+
+    /// start writing to next_file_, called when its keyframe comes out of the encoder
+    void SwitchSinks();
 
     /**
-     * @brief close rtmp stream
+     * @brief prepare the reusable frame for new image data
      *
-     * Used to close the rtmp stream if it is no longer in use.
-     * This does not have to be called unless we want to stop streaming
-     * during an active recording session.
+     * populates frame_ with buffers from frame_pool_. The buffers are
+     * returned to the pool once the encoder releases them. If luma is given
+     * InitFrame takes ownership of it and either attaches it as plane 0 or,
+     * if it can't be referenced directly, copies it into a pooled plane.
+     *
+     * @param luma optional reference to a tightly packed luma plane
+     * @return pointer to frame_
      */
-    void CloseRtmpStream();
+    AVFrame* InitFrame(AVBufferRef *luma = nullptr);
 
     /**
-     * @brief allocate an initialize a frame
-     * @return std::unique_ptr managed AVFrame pointer
+     * @brief allocate the per-frame objects reused throughout encoding
+     *
+     * called by the constructor once codec_context_ has been configured
      */
-    av_pointer::frame InitFrame();
+    void InitReusableObjects();
 
     /**
-     * @brief encodes frame and write to file
+     * @brief encode frame and send the packets to every sink
      * @param frame AVFrame pointer containing frame data
      */
     void Encode(AVFrame *frame);
 
     /**
-     * @brief encode a raw Yuv420p frame
+     * @brief denoise the luma plane of a frame and encode it
+     *
+     * without a filter thread the frame is filtered and encoded right away.
+     * With one, the previous frame is encoded while this frame is filtered,
+     * and this frame is kept in pending_frame_ until the next call (or
+     * Close()). Takes ownership of frame's buffers.
+     *
+     * @param src luma plane to filter, may be frame's own plane
+     * @param src_stride bytes between rows of src
+     * @param frame frame_, populated from the pool, receives the filtered plane
+     * @param ref optional reference keeping src alive, released once filtered
+     */
+    void FilterAndEncode(const uint8_t *src, int src_stride, AVFrame *frame, AVBufferRef *ref);
+
+    /**
+     * @brief encode a raw frame with the selected pixel format
+     * @param data raw frame data from camera
+     * @param ref optional reference to data, ownership is transferred
+     * @param current_frame frame index
+     * @param stream if true also send frame to rtmp stream
+     */
+    void EncodeImage(const uint8_t *data, AVBufferRef *ref, size_t current_frame, bool stream);
+
+    /**
+     * @brief encode a raw Mono8 or Mono12 frame
+     *
+     * the camera data is used as the luma plane for Yuv420p, Gray8 and
+     * Gray12 output
+     *
+     * @param buffer raw frame data from camera
+     * @param ref optional reference to buffer, ownership is transferred
+     * @param current_frame frame index
+     */
+    void EncodeMonochrome(const uint8_t *buffer, AVBufferRef *ref, size_t current_frame);
+
+    /**
+     * @brief encode a raw Mono12Packed frame as Gray12
      * @param buffer raw frame data from camera
+     * @param ref optional reference to buffer, ownership is transferred
      * @param current_frame frame index
      */
-    void EncodeYuv420p(uint8_t buffer[], size_t current_frame);
+    void EncodeMono12Packed(const uint8_t *buffer, AVBufferRef *ref, size_t current_frame);
 };
 
 #endif